@@ -0,0 +1,52 @@
+#!/bin/sh
+# Boots the BENCHMARKS build headless through runner.sh and keeps the JSON lines it
+# prints on COM1. Run through `make bench`, which builds the kernel first.
+#
+#   ./bench.sh                          results go to bench-results/<commit>.jsonl
+#   ./bench.sh memcpy_64,memcpy_1500    only the named benchmarks
+#   BASELINE=<file> ./bench.sh          also compares the medians against an earlier run
+#   ./bench.sh compare <old> <new>      compares two saved runs
+. ./config.sh
+
+compare() {
+    awk '
+    function median(line,   r) {
+        if (!match(line, /"median":[0-9]+/)) return -1
+        r = substr(line, RSTART, RLENGTH); sub(/.*:/, "", r); return r + 0
+    }
+    function name(line) {
+        if (!match(line, /"bench":"[^"]*"/)) return ""
+        return substr(line, RSTART + 9, RLENGTH - 10)
+    }
+    FNR == NR { n = name($0); if (n != "") base[n] = median($0); next }
+    {
+        n = name($0); if (n == "") next
+        m = median($0)
+        if (!(n in base)) { printf "%-24s %10s -> %10d cycles  new\n", n, "-", m; next }
+        delta = base[n] ? (m - base[n]) * 100.0 / base[n] : 0
+        printf "%-24s %10d -> %10d cycles  %+6.1f%%\n", n, base[n], m, delta
+    }' "$1" "$2"
+}
+
+if [ "$1" = "compare" ]; then
+    compare "$2" "$3"
+    exit 0
+fi
+
+mkdir -p bench-results
+out="bench-results/$(git rev-parse --short HEAD 2>/dev/null || echo local).jsonl"
+
+RESULTS=bench-results/last.log ./runner.sh bench "$1" >/dev/null
+status=$?
+grep '^{"bench' bench-results/last.log >"$out"
+
+if ! grep -q '"bench_run":"end"' "$out"; then
+    echo "bench: run did not finish (runner status $status), log in bench-results/last.log"
+    exit 1
+fi
+grep '"bench":' "$out"
+echo "bench: results in $out"
+
+if [ -n "$BASELINE" ]; then
+    compare "$BASELINE" "$out"
+fi
@@ -1,5 +1,5 @@
-SYSTEM_HEADER_PROJECTS="libc kernel"
-PROJECTS="libc kernel"
+SYSTEM_HEADER_PROJECTS="libc kernel user"
+PROJECTS="libc kernel user"
 
 unset HOST
 export MAKE=${MAKE:-make}
@@ -0,0 +1,186 @@
+/*
+ * Host microbenchmarks for the allocator, the log ring buffer and the
+ * formatter, built with -O2 and no sanitizers. Each benchmark loops on
+ * bench_keep_running() and the runner grows the iteration count until a run
+ * lasts BENCH_MIN_TIME_NS, the way Google Benchmark does.
+ *
+ *   ./build/bench/host-bench [filter]     runs the benchmarks whose name contains filter
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shim/shim.h"
+
+#define BENCH_MIN_TIME_NS 500000000ULL
+#define BENCH_MAX_ITERATIONS 1000000000ULL
+
+struct BenchState {
+    uint64_t iterations;
+    uint64_t remaining;
+};
+
+typedef void (*BenchFunc)(struct BenchState*);
+
+static inline bool bench_keep_running(struct BenchState* state) {
+    return state->remaining-- > 0;
+}
+
+// Keeps the compiler from dropping a result nothing reads
+static inline void do_not_optimize(const void* value) {
+    asm volatile("" : : "g"(value) : "memory");
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int format(char* buffer, size_t size, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int written = kvsnprintf(buffer, size, fmt, args);
+    va_end(args);
+    return written;
+}
+
+static void null_sink(void* ctx, const char* data, size_t len) {
+    (void)data;
+    *(size_t*)ctx += len;
+}
+
+static int stream(size_t* sunk, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int written = vcbprintf(null_sink, sunk, fmt, args);
+    va_end(args);
+    return written;
+}
+
+static void bench_malloc_free_64(struct BenchState* state) {
+    host_heap_reset(16 * 1024 * 1024);
+    while (bench_keep_running(state)) {
+        void* p = kmalloc(64);
+        do_not_optimize(p);
+        kfree(p);
+    }
+}
+
+static void bench_malloc_free_4096(struct BenchState* state) {
+    host_heap_reset(16 * 1024 * 1024);
+    while (bench_keep_running(state)) {
+        void* p = kmalloc(4096);
+        do_not_optimize(p);
+        kfree(p);
+    }
+}
+
+static void bench_vsnprintf_int(struct BenchState* state) {
+    char buf[32];
+    int i = 0;
+    while (bench_keep_running(state)) {
+        format(buf, sizeof(buf), "%d", i++ * 7919);
+        do_not_optimize(buf);
+    }
+}
+
+static void bench_vsnprintf_hex64(struct BenchState* state) {
+    char buf[32];
+    uint64_t v = 0x0123456789abcdefULL;
+    while (bench_keep_running(state)) {
+        format(buf, sizeof(buf), "%#018llx", (unsigned long long)v++);
+        do_not_optimize(buf);
+    }
+}
+
+// The message and prefix of a typical LOG() line, as the kernel's log_format benchmark
+static void bench_log_format(struct BenchState* state) {
+    char buf[100];
+    char prefix[100];
+    while (bench_keep_running(state)) {
+        format(buf, sizeof(buf), "Found device at bus: %d, slot: %d, base: 0x%x", 0, 4, 0xc000);
+        format(prefix, sizeof(prefix), "[%s] %s:%d ", "INFO", "pci.c", 42);
+        do_not_optimize(buf);
+        do_not_optimize(prefix);
+    }
+}
+
+static void bench_vcbprintf_stream(struct BenchState* state) {
+    size_t sunk = 0;
+    while (bench_keep_running(state)) {
+        stream(&sunk, "[%s] %s:%d Found device at bus: %d, slot: %d, base: 0x%x", "INFO", "pci.c",
+               42, 0, 4, 0xc000);
+    }
+    do_not_optimize(&sunk);
+}
+
+// LOG() into the ring, with the periodic dump going to a console that drops it
+static void bench_ring_buffer_log(struct BenchState* state) {
+    tail = 0;
+    host_console_discard(true);
+    int i = 0;
+    while (bench_keep_running(state))
+        write_to_buffer("Found device at bus: %d, slot: %d", LOG_LEVEL_INFO, "pci.c", 42, i++, 4);
+    dump_buffer();
+    host_console_discard(false);
+}
+
+static void bench_ring_buffer_dump(struct BenchState* state) {
+    host_console_discard(true);
+    while (bench_keep_running(state)) {
+        tail = 0;
+        for (int i = 0; i < NUM_LOG_LINES - 2; i++)
+            write_to_buffer("line %d", LOG_LEVEL_INFO, "ring.c", i, i);
+        dump_buffer();
+    }
+    host_console_discard(false);
+}
+
+struct Benchmark {
+    const char* name;
+    BenchFunc func;
+};
+
+static const struct Benchmark BENCHMARKS[] = {
+    {"malloc_free_64", bench_malloc_free_64},
+    {"malloc_free_4096", bench_malloc_free_4096},
+    {"vsnprintf_int", bench_vsnprintf_int},
+    {"vsnprintf_hex64", bench_vsnprintf_hex64},
+    {"log_format", bench_log_format},
+    {"vcbprintf_stream", bench_vcbprintf_stream},
+    {"ring_buffer_log", bench_ring_buffer_log},
+    {"ring_buffer_dump", bench_ring_buffer_dump},
+};
+
+// Doubles the iteration count (or jumps towards the target) until one run is long enough
+static void run_benchmark(const struct Benchmark* bench) {
+    struct BenchState state = {0};
+    uint64_t iterations = 1;
+    uint64_t elapsed;
+
+    for (;;) {
+        state.iterations = state.remaining = iterations;
+        uint64_t start = now_ns();
+        bench->func(&state);
+        elapsed = now_ns() - start;
+        if (elapsed >= BENCH_MIN_TIME_NS || iterations >= BENCH_MAX_ITERATIONS) break;
+
+        uint64_t next = elapsed ? (double)iterations * BENCH_MIN_TIME_NS * 1.4 / elapsed : 0;
+        iterations = next > iterations * 10 ? iterations * 10 : next;
+        if (iterations < state.iterations * 2) iterations = state.iterations * 2;
+    }
+
+    double ns = (double)elapsed / state.iterations;
+    printf("%-28s %12.1f ns %14" PRIu64 "\n", bench->name, ns, state.iterations);
+}
+
+int main(int argc, char** argv) {
+    const char* filter = argc > 1 ? argv[1] : "";
+    printf("%-28s %15s %14s\n", "Benchmark", "Time", "Iterations");
+    for (size_t i = 0; i < sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]); i++)
+        if (strstr(BENCHMARKS[i].name, filter)) run_benchmark(&BENCHMARKS[i]);
+    return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef __HOST_RENAME__
+#define __HOST_RENAME__
+
+/*
+ * Force-included into every kernel module built for the host. The kernel's
+ * malloc, free, printf and vsnprintf would otherwise replace the C library's
+ * in the test binary, so they are linked under a k prefix instead.
+ */
+#define malloc kmalloc
+#define free kfree
+#define printf kprintf
+#define vsnprintf kvsnprintf
+
+// The linker script symbols become pointers the shim sets up, "&KERNEL_END" stays valid
+#define KERNEL_START (*host_kernel_start)
+#define KERNEL_END (*host_kernel_end)
+
+#endif
@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+#include "shim.h"
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <kernel/log.h>
+
+// Read by allocator.c through shim/rename.h as &KERNEL_START and &KERNEL_END
+unsigned long* host_kernel_start;
+unsigned long* host_kernel_end;
+
+static uint8_t* memory;
+static uint32_t heap_size;
+
+static char console[1 << 20];
+static size_t console_len;
+static bool console_discard;
+
+static jmp_buf* panic_trap;
+static const char* panic_msg;
+
+// The modules' LOG() sites read these keys, there is no code patching on the host
+LOG_SUBSYSTEMS(LOG_SUBSYSTEM_DEFINE)
+
+static const char* LEVEL_NAMES[LOG_LEVEL_COUNT] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR"};
+
+/*
+ * multiboot_info_t keeps the memory map address in 32 bits, so the region
+ * (map, kernel image and heap) is mapped below 4G.
+ */
+static void map_memory() {
+    memory = mmap(NULL, HOST_MEMORY_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    if (memory == MAP_FAILED) {
+        perror("host shim: mmap below 4G");
+        exit(2);
+    }
+}
+
+void host_heap_reset(uint32_t size) {
+    if (!memory) map_memory();
+    uint32_t max_size = HOST_MEMORY_SIZE - 2 * HOST_KERNEL_SIZE;
+    if (size > max_size) size = max_size;
+
+    // First page: the memory map. Then the "kernel image", then the heap.
+    multiboot_memory_map_t* map = (multiboot_memory_map_t*)memory;
+    host_kernel_start = (unsigned long*)(memory + HOST_KERNEL_SIZE);
+    host_kernel_end = (unsigned long*)(memory + 2 * HOST_KERNEL_SIZE);
+    map->size = sizeof(multiboot_memory_map_t) - sizeof(map->size);
+    map->addr = (uintptr_t)host_kernel_start;
+    map->len = HOST_KERNEL_SIZE + size;
+    map->type = MULTIBOOT_MEMORY_AVAILABLE;
+
+    multiboot_info_t info = {0};
+    info.flags = MULTIBOOT_INFO_MEM_MAP;
+    info.mmap_addr = (uint32_t)(uintptr_t)map;
+    info.mmap_length = sizeof(multiboot_memory_map_t);
+
+    heap_size = size;
+    freeSegment = NULL;
+    initialize_free_segments(&info);
+}
+
+uintptr_t host_heap_start() {
+    return (uintptr_t)host_kernel_end;
+}
+
+uintptr_t host_heap_end() {
+    return (uintptr_t)host_kernel_start + HOST_KERNEL_SIZE + heap_size;
+}
+
+void console_write(LogLevel level, const char* data, size_t len) {
+    (void)level;
+    if (console_discard) return;
+    if (len > sizeof(console) - console_len) len = sizeof(console) - console_len;
+    memcpy(console + console_len, data, len);
+    console_len += len;
+}
+
+const char* log_level_name(LogLevel level) {
+    if (level >= LOG_LEVEL_COUNT) return "?";
+    return LEVEL_NAMES[level];
+}
+
+void host_console_reset() {
+    console_len = 0;
+}
+
+const char* host_console_output(size_t* len) {
+    *len = console_len;
+    return console;
+}
+
+void host_console_discard(bool discard) {
+    console_discard = discard;
+}
+
+void panic(const char* msg) {
+    panic_msg = msg;
+    if (panic_trap) longjmp(*panic_trap, 1);
+
+    fprintf(stderr, "panic called with error: %s\n", msg);
+    abort();
+}
+
+void assert(int cond, const char* msg) {
+    if (!cond) panic(msg);
+}
+
+bool host_expect_panic(void (*fn)(void*), void* arg) {
+    jmp_buf trap;
+    jmp_buf* outer = panic_trap;
+    panic_msg = NULL;
+    if (setjmp(trap)) {
+        panic_trap = outer;
+        return true;
+    }
+    panic_trap = &trap;
+    fn(arg);
+    panic_trap = outer;
+    return false;
+}
+
+const char* host_last_panic() {
+    return panic_msg;
+}
@@ -0,0 +1,61 @@
+#ifndef __HOST_SHIM__
+#define __HOST_SHIM__
+
+/*
+ * The kernel modules as the host test and benchmark drivers see them, plus the
+ * pieces of the kernel they normally lean on (panic, the console, the memory
+ * the linker script hands to the allocator). Included by the drivers only, the
+ * modules themselves are built against the kernel's headers and shim/rename.h.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define malloc kmalloc
+#define free kfree
+#include <kernel/allocator.h>
+#undef malloc
+#undef free
+#include <kernel/circular_buffer.h>
+
+// libc/stdio/printf.c
+typedef void (*FormatSink)(void* ctx, const char* data, size_t len);
+int kvsnprintf(char* buffer, size_t bufsz, const char* format, va_list vlist);
+int vcbprintf(FormatSink sink, void* ctx, const char* format, va_list vlist);
+
+// Module state the drivers reset between cases
+extern struct FreeSegment* freeSegment;
+extern int tail;
+
+#define HOST_MEMORY_SIZE (64 * 1024 * 1024)
+#define HOST_KERNEL_SIZE 4096  // stands in for the image between KERNEL_START and KERNEL_END
+
+// Hands the allocator a fresh heap of heap_size bytes through a fake multiboot memory map
+void host_heap_reset(uint32_t heap_size);
+uintptr_t host_heap_start();
+uintptr_t host_heap_end();
+
+// Everything console_write() received since the last reset
+void host_console_reset();
+const char* host_console_output(size_t* len);
+void host_console_discard(bool discard);  // benchmarks drop the output instead
+
+// Runs fn, returns true if it panicked. panic() outside of this aborts the process.
+bool host_expect_panic(void (*fn)(void*), void* arg);
+const char* host_last_panic();
+
+// xorshift64*, every run prints its seed so a failure can be replayed
+static inline uint64_t host_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static inline uint32_t host_random_range(uint64_t* state, uint32_t lo, uint32_t hi) {
+    return lo + (uint32_t)(host_random(state) % (hi - lo + 1));
+}
+
+#endif
@@ -0,0 +1,399 @@
+/*
+ * Host unit and property tests for the allocator, the log ring buffer and the
+ * formatter, built with ASan and UBSan. The same modules run in the kernel
+ * under -DTEST, here they run natively and against random inputs.
+ *
+ *   ./build/asan/host-tests [seed] [iterations]
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shim/shim.h"
+
+#define CHECK(cond, ...)                                                      \
+    do {                                                                      \
+        if (!(cond)) {                                                        \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed, seed 0x%" PRIx64 ": ", \
+                    __FILE__, __LINE__, #cond, seed);                         \
+            fprintf(stderr, __VA_ARGS__);                                     \
+            fprintf(stderr, "\n");                                            \
+            exit(1);                                                          \
+        }                                                                     \
+    } while (0)
+
+static uint64_t seed;
+static uint64_t rng;
+static int iterations = 200;
+
+/* Allocator */
+
+#define HEAP_SIZE (4 * 1024 * 1024)
+#define MAX_LIVE 256
+
+struct Block {
+    uint8_t* ptr;
+    uint32_t size;
+    uint8_t fill;
+};
+
+// Sorted, in bounds, not overlapping; returns the bytes the list covers, headers included
+static uint32_t check_free_list() {
+    uint32_t covered = 0;
+    uintptr_t last_end = 0;
+    for (struct FreeSegment* s = freeSegment; s; s = s->next_segment) {
+        uintptr_t start = (uintptr_t)s;
+        uintptr_t end = start + sizeof(struct FreeSegment) + s->size;
+        CHECK(start >= host_heap_start() && end <= host_heap_end(),
+              "free segment %#lx-%#lx outside the heap", start, end);
+        CHECK(start >= last_end, "free segment %#lx overlaps the one before", start);
+        last_end = end;
+        covered += end - start;
+    }
+    return covered;
+}
+
+static void check_block(const struct Block* b) {
+    for (uint32_t i = 0; i < b->size; i++)
+        CHECK(b->ptr[i] == b->fill, "block %p+%u was overwritten", (void*)b->ptr, i);
+}
+
+static void test_allocator_round_trip() {
+    host_heap_reset(HEAP_SIZE);
+    uint32_t initial = freeSegment->size;
+
+    int* ints = kmalloc(4 * sizeof(int));
+    char* str = kmalloc(11);
+    for (int i = 0; i < 4; i++) ints[i] = i;
+    memcpy(str, "helloworld", 11);
+    kfree(ints);
+    kfree(str);
+
+    CHECK(freeSegment->next_segment == NULL && freeSegment->size == initial,
+          "free list did not go back to one segment of %u", initial);
+}
+
+/*
+ * Random malloc/free sequences. Every live block is filled with its own byte
+ * and checked before it is freed, so overlapping blocks or headers written
+ * into user memory show up. Once everything is freed the heap must be one
+ * segment again.
+ */
+static void prop_allocator_random() {
+    struct Block live[MAX_LIVE];
+
+    for (int it = 0; it < iterations; it++) {
+        host_heap_reset(HEAP_SIZE);
+        uint32_t initial = check_free_list();
+        int count = 0;
+
+        for (int op = 0; op < 2000; op++) {
+            bool alloc = count == 0 || (count < MAX_LIVE && host_random(&rng) % 100 < 55);
+            if (alloc) {
+                uint32_t size = host_random(&rng) % 4 ? host_random_range(&rng, 1, 64)
+                                                      : host_random_range(&rng, 1, 8192);
+                struct Block* b = &live[count++];
+                b->ptr = kmalloc(size);
+                b->size = size;
+                b->fill = (uint8_t)host_random(&rng);
+                CHECK((uintptr_t)b->ptr % 8 == 0, "malloc(%u) returned %p", size, (void*)b->ptr);
+                CHECK((uintptr_t)b->ptr >= host_heap_start() &&
+                          (uintptr_t)b->ptr + size <= host_heap_end(),
+                      "malloc(%u) returned %p outside the heap", size, (void*)b->ptr);
+                memset(b->ptr, b->fill, size);
+            } else {
+                int i = host_random(&rng) % count;
+                check_block(&live[i]);
+                kfree(live[i].ptr);
+                live[i] = live[--count];
+            }
+            check_free_list();
+        }
+
+        while (count > 0) {
+            check_block(&live[--count]);
+            kfree(live[count].ptr);
+        }
+        CHECK(check_free_list() == initial, "freeing everything left %u of %u bytes free",
+              check_free_list(), initial);
+        CHECK(freeSegment->next_segment == NULL, "freeing everything left a fragmented list");
+    }
+}
+
+static void allocate_too_much(void* arg) {
+    kmalloc(*(uint32_t*)arg);
+}
+
+static void test_allocator_exhaustion_panics() {
+    host_heap_reset(HEAP_SIZE);
+    uint32_t size = HEAP_SIZE + 1;
+    CHECK(host_expect_panic(allocate_too_much, &size), "malloc(%u) did not panic", size);
+}
+
+/* Log ring buffer */
+
+static void expect_console(const char* expected) {
+    size_t len;
+    const char* out = host_console_output(&len);
+    CHECK(len == strlen(expected) && memcmp(out, expected, len) == 0,
+          "console got \"%.*s\", expected \"%s\"", (int)len, out, expected);
+}
+
+static void test_ring_buffer_lines() {
+    tail = 0;
+    host_console_reset();
+    write_to_buffer("bus: %d, base: 0x%x", LOG_LEVEL_INFO, "pci.c", 42, 3, 0xc000);
+    write_to_buffer_colored("Net: [OK]", "\033[32m", LOG_LEVEL_WARN, "net.c", 7);
+    dump_buffer();
+    expect_console("[INFO] pci.c:42 bus: 3, base: 0xc000\n"
+                   "\033[32m [WARN] net.c:7 Net: [OK]\033[0m\n");
+    CHECK(tail == 0, "dump_buffer() left tail at %d", tail);
+}
+
+/*
+ * Random lines through write_to_buffer(). The ring dumps itself when it fills
+ * up, so whatever the count, the console must end up with every line in order
+ * and each message cut at 99 bytes.
+ */
+static void prop_ring_buffer_order() {
+    static char expected[1 << 20];
+    char message[256];
+
+    for (int it = 0; it < iterations; it++) {
+        tail = 0;
+        host_console_reset();
+        size_t expected_len = 0;
+        int lines = host_random_range(&rng, 0, 3 * NUM_LOG_LINES);
+
+        for (int line = 0; line < lines; line++) {
+            int len = host_random_range(&rng, 0, 200);
+            for (int i = 0; i < len; i++) message[i] = (char)host_random_range(&rng, ' ', '~');
+            message[len] = '\0';
+
+            write_to_buffer("%s", LOG_LEVEL_DEBUG, "ring.c", line, message);
+            CHECK(tail >= 0 && tail < FULL_IDX, "tail is %d after %d lines", tail, line + 1);
+            expected_len += snprintf(expected + expected_len, sizeof(expected) - expected_len,
+                                     "[DEBUG] ring.c:%d %.99s\n", line, message);
+        }
+        dump_buffer();
+        expected[expected_len] = '\0';
+        expect_console(expected);
+    }
+}
+
+/* Formatter */
+
+static int format_ours(char* buffer, size_t size, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int written = kvsnprintf(buffer, size, fmt, args);
+    va_end(args);
+    return written;
+}
+
+enum ArgKind { ARG_INT, ARG_UNSIGNED, ARG_CHAR, ARG_STRING, ARG_POINTER, ARG_PERCENT };
+
+struct Conversion {
+    char format[64];
+    enum ArgKind kind;
+    const char* length;
+    int stars;  // '*' width and precision arguments in front of the value
+    int star_args[2];
+};
+
+static const char* pick(const char* const* options, int count) {
+    return options[host_random(&rng) % count];
+}
+
+// A random conversion, limited to what C defines for it so glibc is a valid reference
+static void random_conversion(struct Conversion* c) {
+    static const char CONVERSIONS[] = "diuxXcsp%";
+    static const char* const INT_LENGTHS[] = {"", "", "", "hh", "h", "l", "ll", "z"};
+    char conv = CONVERSIONS[host_random(&rng) % (sizeof(CONVERSIONS) - 1)];
+    bool integer = strchr("diuxX", conv) != NULL;
+    char* p = c->format;
+
+    c->stars = 0;
+    c->length = "";
+    *p++ = '%';
+    if (conv == '%') {
+        c->kind = ARG_PERCENT;
+        *p++ = '%';
+        *p = '\0';
+        return;
+    }
+
+    if (host_random(&rng) % 3 == 0) *p++ = '-';
+    if (integer && host_random(&rng) % 3 == 0) *p++ = '0';
+    if ((conv == 'd' || conv == 'i') && host_random(&rng) % 4 == 0) *p++ = '+';
+    if ((conv == 'd' || conv == 'i') && host_random(&rng) % 4 == 0) *p++ = ' ';
+    if ((conv == 'x' || conv == 'X') && host_random(&rng) % 3 == 0) *p++ = '#';
+
+    int width = host_random(&rng) % 3;
+    if (width == 1) {
+        p += sprintf(p, "%u", host_random_range(&rng, 1, 40));
+    } else if (width == 2) {
+        *p++ = '*';
+        c->star_args[c->stars++] = (int)host_random_range(&rng, 0, 80) - 40;
+    }
+
+    int precision = (integer || conv == 's') ? host_random(&rng) % 4 : 0;
+    if (precision == 1) {
+        p += sprintf(p, ".%u", host_random_range(&rng, 0, 30));
+    } else if (precision == 2) {
+        *p++ = '.';
+        *p++ = '*';
+        c->star_args[c->stars++] = (int)host_random_range(&rng, 0, 40) - 10;
+    }
+
+    if (integer) c->length = pick(INT_LENGTHS, sizeof(INT_LENGTHS) / sizeof(INT_LENGTHS[0]));
+    p += sprintf(p, "%s%c", c->length, conv);
+
+    if (conv == 'd' || conv == 'i')
+        c->kind = ARG_INT;
+    else if (integer)
+        c->kind = ARG_UNSIGNED;
+    else if (conv == 'c')
+        c->kind = ARG_CHAR;
+    else if (conv == 's')
+        c->kind = ARG_STRING;
+    else
+        c->kind = ARG_POINTER;
+}
+
+static uint64_t random_value() {
+    switch (host_random(&rng) % 4) {
+        case 0:
+            return host_random(&rng) % 10;
+        case 1:
+            return (uint64_t)(int64_t)(int32_t)host_random(&rng);
+        case 2:
+            return host_random(&rng) % 2 ? INT64_MIN : UINT64_MAX;
+        default:
+            return host_random(&rng);
+    }
+}
+
+// Both sides get the same arguments, with the '*' values first
+#define FORMAT_BOTH(value)                                                                  \
+    do {                                                                                    \
+        if (c.stars == 0) {                                                                 \
+            ours = format_ours(got, size, fmt, value);                                      \
+            theirs = snprintf(want, size, fmt, value);                                      \
+        } else if (c.stars == 1) {                                                          \
+            ours = format_ours(got, size, fmt, c.star_args[0], value);                      \
+            theirs = snprintf(want, size, fmt, c.star_args[0], value);                      \
+        } else {                                                                            \
+            ours = format_ours(got, size, fmt, c.star_args[0], c.star_args[1], value);      \
+            theirs = snprintf(want, size, fmt, c.star_args[0], c.star_args[1], value);      \
+        }                                                                                   \
+    } while (0)
+
+#define FORMAT_INTEGER(type) FORMAT_BOTH((type)value)
+
+/*
+ * Random conversions with random literal text around them, formatted by
+ * vsnprintf() and by the C library into buffers of random size. Return value,
+ * truncated output and terminator must all match.
+ */
+static void prop_printf_matches_libc() {
+    static const char* const STRINGS[] = {"", "a", "hello", "pci 0000:00:04.0", "(null)"};
+    char fmt[128];
+    char got[160];
+    char want[160];
+
+    for (int it = 0; it < iterations * 50; it++) {
+        struct Conversion c;
+        random_conversion(&c);
+        snprintf(fmt, sizeof(fmt), "%s%s%s", pick(STRINGS, 4), c.format, pick(STRINGS, 4));
+
+        size_t size = host_random_range(&rng, 0, sizeof(got));
+        uint64_t value = random_value();
+        const char* string = pick(STRINGS, 5);
+        int character = host_random_range(&rng, ' ', '~');
+        int ours = 0, theirs = 0;
+        memset(got, 0x55, sizeof(got));
+        memset(want, 0x55, sizeof(want));
+
+        // fmt is built at run time, the checker cannot follow it
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+        switch (c.kind) {
+            case ARG_INT:
+                if (!strcmp(c.length, "hh"))
+                    FORMAT_INTEGER(signed char);
+                else if (!strcmp(c.length, "h"))
+                    FORMAT_INTEGER(short);
+                else if (!strcmp(c.length, "l"))
+                    FORMAT_INTEGER(long);
+                else if (!strcmp(c.length, "ll"))
+                    FORMAT_INTEGER(long long);
+                else if (!strcmp(c.length, "z"))
+                    FORMAT_INTEGER(ssize_t);
+                else
+                    FORMAT_INTEGER(int);
+                break;
+            case ARG_UNSIGNED:
+                if (!strcmp(c.length, "hh"))
+                    FORMAT_INTEGER(unsigned char);
+                else if (!strcmp(c.length, "h"))
+                    FORMAT_INTEGER(unsigned short);
+                else if (!strcmp(c.length, "l"))
+                    FORMAT_INTEGER(unsigned long);
+                else if (!strcmp(c.length, "ll"))
+                    FORMAT_INTEGER(unsigned long long);
+                else if (!strcmp(c.length, "z"))
+                    FORMAT_INTEGER(size_t);
+                else
+                    FORMAT_INTEGER(unsigned int);
+                break;
+            case ARG_CHAR:
+                FORMAT_BOTH(character);
+                break;
+            case ARG_STRING:
+                FORMAT_BOTH(string);
+                break;
+            case ARG_POINTER:
+                FORMAT_BOTH((void*)(uintptr_t)(value | 1));  // glibc prints NULL as "(nil)"
+                break;
+            case ARG_PERCENT:
+                ours = format_ours(got, size, fmt);
+                theirs = snprintf(want, size, fmt);
+                break;
+        }
+#pragma GCC diagnostic pop
+
+        CHECK(ours == theirs, "\"%s\" returned %d, libc %d", fmt, ours, theirs);
+        CHECK(memcmp(got, want, sizeof(got)) == 0, "\"%s\" size %zu gave \"%.*s\", libc \"%.*s\"",
+              fmt, size, (int)size, got, (int)size, want);
+    }
+}
+
+struct Test {
+    const char* name;
+    void (*run)();
+};
+
+static const struct Test TESTS[] = {
+    {"allocator_round_trip", test_allocator_round_trip},
+    {"allocator_random", prop_allocator_random},
+    {"allocator_exhaustion_panics", test_allocator_exhaustion_panics},
+    {"ring_buffer_lines", test_ring_buffer_lines},
+    {"ring_buffer_order", prop_ring_buffer_order},
+    {"printf_matches_libc", prop_printf_matches_libc},
+};
+
+int main(int argc, char** argv) {
+    seed = argc > 1 ? strtoull(argv[1], NULL, 0) : 0x5eed;
+    if (argc > 2) iterations = atoi(argv[2]);
+    printf("host tests: seed 0x%" PRIx64 ", %d iterations\n", seed, iterations);
+
+    for (size_t i = 0; i < sizeof(TESTS) / sizeof(TESTS[0]); i++) {
+        rng = seed ? seed : 1;
+        TESTS[i].run();
+        printf("%s: [OK]\n", TESTS[i].name);
+    }
+    return 0;
+}
@@ -7,11 +7,13 @@ mkdir -p isodir/boot
 mkdir -p isodir/boot/grub
 
 cp sysroot/boot/myos.kernel isodir/boot/myos.kernel
+cp sysroot/boot/init.elf isodir/boot/init.elf
 cat > isodir/boot/grub/grub.cfg << EOF
 set timeout=0
 set default=0
 menuentry "myos" {
 	multiboot /boot/myos.kernel
+	module /boot/init.elf init
 }
 EOF
 grub-mkrescue -o myos.iso isodir
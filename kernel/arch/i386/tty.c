@@ -1,32 +1,121 @@
-#include <kernel/io/uart.h>
+#include <kernel/console.h>
 #include <kernel/tty.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <utils.h>
 
 #include "vga.h"
 
-static const size_t VGA_WIDTH = 80;
-static const size_t VGA_HEIGHT = 25;
+#define VGA_WIDTH 80
+#define VGA_HEIGHT 25
+#define ALL_ROWS_DIRTY ((1u << VGA_HEIGHT) - 1)
+
+#define VGA_CRTC_INDEX 0x3D4
+#define VGA_CRTC_DATA 0x3D5
+#define VGA_CURSOR_START_REG 0x0A
+#define VGA_CURSOR_END_REG 0x0B
+#define VGA_CURSOR_HIGH_REG 0x0E
+#define VGA_CURSOR_LOW_REG 0x0F
+
 static uint16_t* const VGA_MEMORY = (uint16_t*)0xB8000;
 
 static size_t terminal_row;
 static size_t terminal_column;
 static uint8_t terminal_color;
-static uint16_t* terminal_buffer;
+
+// Everything is drawn here first and copied to VGA_MEMORY by terminal_flush().
+// One bit per row in dirty_rows, VGA_HEIGHT has to stay <= 32.
+static uint16_t shadow_buffer[VGA_HEIGHT * VGA_WIDTH];
+static uint32_t dirty_rows;
+static uint16_t cursor_position;
+
+static void fill_row(size_t row, uint16_t entry) {
+    uint16_t* cell = &shadow_buffer[row * VGA_WIDTH];
+    for (size_t x = 0; x < VGA_WIDTH; x++) cell[x] = entry;
+}
+
+static void update_cursor(uint16_t position) {
+    if (position == cursor_position) return;
+    outb(VGA_CRTC_INDEX, VGA_CURSOR_LOW_REG);
+    outb(VGA_CRTC_DATA, position & 0xFF);
+    outb(VGA_CRTC_INDEX, VGA_CURSOR_HIGH_REG);
+    outb(VGA_CRTC_DATA, position >> 8);
+    cursor_position = position;
+}
+
+static void enable_cursor() {
+    // Underline cursor on scanlines 14-15
+    outb(VGA_CRTC_INDEX, VGA_CURSOR_START_REG);
+    outb(VGA_CRTC_DATA, (inb(VGA_CRTC_DATA) & 0xC0) | 14);
+    outb(VGA_CRTC_INDEX, VGA_CURSOR_END_REG);
+    outb(VGA_CRTC_DATA, (inb(VGA_CRTC_DATA) & 0xE0) | 15);
+}
+
+static void scroll() {
+    memmove(shadow_buffer, shadow_buffer + VGA_WIDTH,
+            (VGA_HEIGHT - 1) * VGA_WIDTH * sizeof(uint16_t));
+    fill_row(VGA_HEIGHT - 1, vga_entry(' ', terminal_color));
+    terminal_row = VGA_HEIGHT - 1;
+    dirty_rows = ALL_ROWS_DIRTY;
+}
+
+static void newline() {
+    terminal_column = 0;
+    if (++terminal_row == VGA_HEIGHT) scroll();
+}
+
+static void put_char(char c) {
+    if (c == '\n') {
+        newline();
+        return;
+    }
+    const size_t index = terminal_row * VGA_WIDTH + terminal_column;
+    shadow_buffer[index] = vga_entry((unsigned char)c, terminal_color);
+    dirty_rows |= 1u << terminal_row;
+    if (++terminal_column == VGA_WIDTH) newline();
+}
+
+/*
+ * Copies dirty rows to VGA memory, merging adjacent rows into one copy, and
+ * moves the hardware cursor once.
+ */
+static void terminal_flush() {
+    size_t row = 0;
+    while (dirty_rows) {
+        if (!(dirty_rows & (1u << row))) {
+            row++;
+            continue;
+        }
+        size_t first = row;
+        while (row < VGA_HEIGHT && (dirty_rows & (1u << row))) {
+            dirty_rows &= ~(1u << row);
+            row++;
+        }
+
+        memcpy(VGA_MEMORY + first * VGA_WIDTH, shadow_buffer + first * VGA_WIDTH,
+               (row - first) * VGA_WIDTH * sizeof(uint16_t));
+    }
+    update_cursor(terminal_row * VGA_WIDTH + terminal_column);
+}
+
+// Shadow buffer writes never stall, so the vga sink always takes the whole span
+static size_t vga_sink_write(const char* data, size_t len) {
+    terminal_write(data, len);
+    return len;
+}
 
 void terminal_initialize(void) {
     terminal_row = 0;
     terminal_column = 0;
     terminal_color = vga_entry_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK);
-    terminal_buffer = VGA_MEMORY;
-    for (size_t y = 0; y < VGA_HEIGHT; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            const size_t index = y * VGA_WIDTH + x;
-            terminal_buffer[index] = vga_entry(' ', terminal_color);
-        }
-    }
+    for (size_t y = 0; y < VGA_HEIGHT; y++) fill_row(y, vga_entry(' ', terminal_color));
+    dirty_rows = ALL_ROWS_DIRTY;
+    cursor_position = 0xFFFF;  // force the first cursor update
+    enable_cursor();
+    terminal_flush();
+    console_register_sink("vga", vga_sink_write, DRAIN_SYNC, LOG_LEVEL_TRACE);
 }
 
 void terminal_setcolor(uint8_t color) {
@@ -35,33 +124,21 @@ void terminal_setcolor(uint8_t color) {
 
 void terminal_putentryat(unsigned char c, uint8_t color, size_t x, size_t y) {
     const size_t index = y * VGA_WIDTH + x;
-    terminal_buffer[index] = vga_entry(c, color);
+    shadow_buffer[index] = vga_entry(c, color);
+    dirty_rows |= 1u << y;
+    terminal_flush();
 }
 
 void terminal_putchar(char c) {
-    unsigned char uc = c;
-    if (c == '\n') {
-        terminal_row++;
-        terminal_column = 0;
-        return;
-    }
-    terminal_putentryat(uc, terminal_color, terminal_column, terminal_row);
-    if (++terminal_column == VGA_WIDTH) {
-        terminal_column = 0;
-        if (++terminal_row == VGA_HEIGHT) terminal_row = 0;
-    }
+    put_char(c);
+    terminal_flush();
 }
 
 void terminal_write(const char* data, size_t size) {
-    for (size_t i = 0; i < size; i++) {
-        terminal_putchar(data[i]);
-        serial_putchar(data[i]);
-    }
+    for (size_t i = 0; i < size; i++) put_char(data[i]);
+    terminal_flush();
 }
 
-#if 0
 void terminal_writestring(const char* data) {
     terminal_write(data, strlen(data));
-    serial_write(data, strlen(data));
 }
-#endif
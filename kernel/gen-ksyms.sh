@@ -0,0 +1,13 @@
+#!/bin/sh
+# Turns `nm -n myos.kernel` on stdin into the C symbol table for ksyms.c.
+# Empty input gives an empty table, for the first of the two links.
+echo "/* Generated by gen-ksyms.sh from the first link of myos.kernel, do not edit */"
+echo "#include <kernel/ksyms.h>"
+echo
+echo "const KernelSymbol kernel_symbols[] = {"
+awk '$2 ~ /^[Tt]$/ && $3 !~ /^\./ && $1 != last {
+    printf "    {0x%s, \"%s\"},\n", $1, $3
+    last = $1
+}'
+echo "};"
+echo "const int kernel_symbol_count = sizeof(kernel_symbols) / sizeof(kernel_symbols[0]);"
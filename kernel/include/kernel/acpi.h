@@ -0,0 +1,80 @@
+#ifndef __ACPI__
+#define __ACPI__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct AcpiRsdp {
+    char signature[8];  // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;  // 0 for ACPI 1.0, 2 and above have the extended fields
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct AcpiSdtHeader {
+    char signature[4];
+    uint32_t length;  // including this header
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+// One ECAM window of the MCFG table
+struct AcpiMcfgEntry {
+    uint64_t base_address;
+    uint16_t segment_group;
+    uint8_t start_bus;
+    uint8_t end_bus;
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct AcpiMcfg {
+    struct AcpiSdtHeader header;
+    uint64_t reserved;
+    struct AcpiMcfgEntry entries[];
+} __attribute__((packed));
+
+// Where a register lives, address_space_id 0 is memory and 1 is I/O ports
+struct AcpiGenericAddress {
+    uint8_t address_space_id;
+    uint8_t register_bit_width;
+    uint8_t register_bit_offset;
+    uint8_t access_size;
+    uint64_t address;
+} __attribute__((packed));
+
+#define ACPI_ADDRESS_SPACE_MEMORY 0
+
+struct AcpiHpet {
+    struct AcpiSdtHeader header;
+    uint32_t event_timer_block_id;  // a copy of the low half of the capabilities register
+    struct AcpiGenericAddress address;
+    uint8_t hpet_number;
+    uint16_t minimum_tick;  // smallest periodic interval without lost interrupts, in counter ticks
+    uint8_t page_protection;
+} __attribute__((packed));
+
+typedef struct AcpiRsdp AcpiRsdp;
+typedef struct AcpiSdtHeader AcpiSdtHeader;
+typedef struct AcpiMcfgEntry AcpiMcfgEntry;
+typedef struct AcpiMcfg AcpiMcfg;
+typedef struct AcpiGenericAddress AcpiGenericAddress;
+typedef struct AcpiHpet AcpiHpet;
+
+bool acpi_init();
+const AcpiSdtHeader* acpi_find_table(const char signature[4]);
+
+#ifdef TEST
+void run_acpi_tests();
+#endif
+
+#endif
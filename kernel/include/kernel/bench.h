@@ -0,0 +1,47 @@
+#ifndef __BENCH__
+#define __BENCH__
+
+#include <stdint.h>
+
+#define BENCH_WARMUP 32
+#define BENCH_SAMPLES 256
+
+typedef void (*BenchFunc)();
+
+struct Bench {
+    const char* name;
+    BenchFunc func;
+    uint32_t batch;  // calls per sample, for operations close to the timer overhead
+    uint32_t ops;    // operations per call, for bodies that loop themselves
+};
+
+typedef struct Bench Bench;
+
+/*
+ * Defines a benchmark body and registers it in the .bench section, which
+ * run_benchmarks() walks. Only built with -DBENCHMARKS (make bench), so
+ * uses belong under #ifdef BENCHMARKS next to the code they measure:
+ *
+ *     BENCH(malloc_free_64) {
+ *         free(malloc(64));
+ *     }
+ */
+#define BENCH_ENTRY(bench_name, calls, operations)               \
+    static void bench_##bench_name();                            \
+    static const Bench bench_entry_##bench_name                  \
+        __attribute__((used, section(".bench"), aligned(4))) = { \
+            #bench_name, bench_##bench_name, calls, operations}; \
+    static void bench_##bench_name()
+
+#define BENCH(bench_name) BENCH_ENTRY(bench_name, 1, 1)
+#define BENCH_BATCH(bench_name, calls) BENCH_ENTRY(bench_name, calls, 1)
+// The body does the operation ops times, e.g. around a setup that would swamp a single one
+#define BENCH_OPS(bench_name, ops) BENCH_ENTRY(bench_name, 1, ops)
+
+uint64_t bench_start();
+uint64_t bench_stop();
+// Takes cycles a body spends waiting on purpose out of its sample
+void bench_exclude(uint64_t cycles);
+void run_benchmarks();
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef __BOOT_TRACE__
+#define __BOOT_TRACE__
+
+#include <stdint.h>
+
+#define BOOT_TRACE_MAX_PHASES 24
+#define BOOT_TRACE_BAR_WIDTH 40
+
+/*
+ * Boot waterfall. boot.S stamps the TSC in _start, boot_trace(phase) stamps
+ * the end of each phase of kernel_main, and boot_trace_report() prints when
+ * every phase started and how long it took once the kernel is ready for work.
+ */
+extern uint64_t boot_tsc_start;
+
+void boot_trace(const char* phase);
+void boot_trace_report();
+
+#ifdef TEST
+void run_boot_trace_tests();
+#endif
+
+#endif
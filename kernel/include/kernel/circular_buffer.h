@@ -1,6 +1,8 @@
 #ifndef CIRCULAR_BUFFER
 #define CIRCULAR_BUFFER
 
+#include <kernel/console.h>
+
 #define NUM_LOG_LINES 50
 #define LINE_SIZE 900
 
@@ -9,9 +11,8 @@
 #define BUFFER_FULL -1
 #define LOG_SIZE_OVERFLOW -2
 
-int write_to_buffer(const char* fmt, const char* level, const char* file_name, int line_number,
-                    ...);
-int write_to_buffer_colored(const char* fmt, const char* color, const char* level,
+int write_to_buffer(const char* fmt, LogLevel level, const char* file_name, int line_number, ...);
+int write_to_buffer_colored(const char* fmt, const char* color, LogLevel level,
                             const char* file_name, int line_number, ...);
 void dump_buffer();
 int read_from_buffer(char* msg, int size);
@@ -0,0 +1,26 @@
+#ifndef __CMDLINE__
+#define __CMDLINE__
+
+#include <kernel/multiboot.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CMDLINE_MAX 256
+
+/*
+ * The multiboot command line, e.g. "/boot/myos.kernel test=pci,rtl8139".
+ * Only key=value words are looked at, the loader puts the kernel path first.
+ */
+void cmdline_init(multiboot_info_t* mbd);
+const char* cmdline_get();
+bool cmdline_has(const char* key);
+bool cmdline_selects(const char* key, const char* name);
+int cmdline_count(const char* key);
+int cmdline_int(const char* key, int fallback);
+const char* cmdline_value(const char* key, size_t* len);
+
+#ifdef TEST
+void run_cmdline_tests();
+#endif
+
+#endif
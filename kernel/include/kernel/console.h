@@ -0,0 +1,67 @@
+#ifndef __CONSOLE__
+#define __CONSOLE__
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONSOLE_MAX_SINKS 4
+#define CONSOLE_SINK_BUFFER_SIZE 4096  // power of two
+#define CONSOLE_MEMORY_RING_SIZE 8192  // power of two
+
+enum LogLevel {
+    LOG_LEVEL_TRACE = 0,
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_COUNT
+};
+
+enum DrainPolicy {
+    DRAIN_SYNC = 0,  // written inline, the caller waits for the device
+    DRAIN_ASYNC,     // queued and drained from the device irq, caller waits only on overflow,
+                     // with interrupts on, or drops if it has them off
+    DRAIN_DROP       // queued and drained from the device irq, overflow is dropped
+};
+
+// Pushes up to len bytes to the device without blocking, returns how many it took
+typedef size_t (*ConsoleWriteFunc)(const char* data, size_t len);
+
+struct ConsoleSink {
+    const char* name;
+    ConsoleWriteFunc write;
+    enum DrainPolicy policy;
+    enum LogLevel min_level;
+    char* buffer;
+    uint32_t head;  // next byte to drain
+    uint32_t tail;  // next free byte
+    uint32_t dropped;
+    bool draining;  // someone is pushing to the device, others leave it to them
+    bool retry;     // the device asked for more meanwhile
+};
+
+typedef struct ConsoleSink ConsoleSink;
+typedef enum LogLevel LogLevel;
+typedef enum DrainPolicy DrainPolicy;
+
+void console_init();
+ConsoleSink* console_register_sink(const char* name, ConsoleWriteFunc write, DrainPolicy policy,
+                                   LogLevel min_level);
+ConsoleSink* console_find_sink(const char* name);
+void console_set_sink_level(ConsoleSink* sink, LogLevel min_level);
+
+void console_write(LogLevel level, const char* data, size_t len);
+int console_vprintf(LogLevel level, const char* fmt, va_list args);
+void console_drain();
+void console_flush();
+
+size_t console_read_memory_ring(char* out, size_t size);
+const char* log_level_name(LogLevel level);
+
+#ifdef TEST
+void run_console_tests();
+#endif
+
+#endif
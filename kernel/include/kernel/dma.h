@@ -0,0 +1,44 @@
+#ifndef __DMA__
+#define __DMA__
+
+#include <kernel/paging.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Memory for bus-master devices: physically contiguous runs from a pool
+ * reserved at boot above the frame pool, so below 16 MiB and far from the
+ * 4 GiB line. x86 keeps device accesses coherent with the caches, the pool
+ * is mapped like any other kernel memory. The kernel's identity map makes
+ * virt and phys the same number today, drivers program phys regardless.
+ */
+#define DMA_POOL_BASE FRAME_POOL_END
+#define DMA_POOL_SIZE 0x40000
+#define DMA_POOL_END (DMA_POOL_BASE + DMA_POOL_SIZE)
+#define DMA_BLOCK 64  // the smallest alignment, a cache line
+
+typedef struct {
+    void* virt;
+    uint32_t phys;
+    uint32_t size;
+} DmaBuffer;
+
+/*
+ * Zeroed. align and boundary are powers of two, boundary 0 for none, else
+ * the buffer does not cross a multiple of it, like 64 KiB for ISA DMA and
+ * IDE PRDs. False if the arguments are invalid or nothing fits.
+ */
+bool dma_alloc(DmaBuffer* buffer, uint32_t size, uint32_t align, uint32_t boundary);
+void dma_free(DmaBuffer* buffer);
+uint32_t dma_free_bytes();
+
+// The bus address of a pointer into the buffer
+static inline uint32_t dma_phys(const DmaBuffer* buffer, const void* virt) {
+    return buffer->phys + ((const uint8_t*)virt - (const uint8_t*)buffer->virt);
+}
+
+#ifdef TEST
+void run_dma_tests();
+#endif
+
+#endif
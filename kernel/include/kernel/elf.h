@@ -0,0 +1,58 @@
+#ifndef __ELF_LOADER__
+#define __ELF_LOADER__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ELF_MAGIC 0x464C457F  // "\x7FELF"
+#define ELF_CLASS_32 1
+#define ELF_DATA_LSB 1
+#define ELF_TYPE_EXEC 2
+#define ELF_MACHINE_386 3
+#define ELF_PT_LOAD 1
+
+typedef struct {
+    uint32_t magic;
+    uint8_t class;
+    uint8_t data;
+    uint8_t version;
+    uint8_t pad[9];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t elf_version;
+    uint32_t entry;
+    uint32_t phoff;
+    uint32_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} __attribute__((packed)) ElfHeader;
+
+typedef struct {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t vaddr;
+    uint32_t paddr;
+    uint32_t filesz;
+    uint32_t memsz;
+    uint32_t flags;
+    uint32_t align;
+} __attribute__((packed)) ElfProgramHeader;
+
+/*
+ * Copies the PT_LOAD segments of a static 32-bit i386 executable to their
+ * addresses, which have to lie in [base, end), and zeroes what the file
+ * does not cover. False if the image is anything else, nothing is copied then.
+ */
+bool elf_load(const void* image, size_t size, uint32_t base, uint32_t end, uint32_t* entry);
+
+#ifdef TEST
+void run_elf_tests();
+#endif
+
+#endif
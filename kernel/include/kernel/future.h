@@ -8,6 +8,7 @@
 
 typedef bool (*IS_READY)(void*);
 typedef void (*RESUME_FUNC)(void*);
+typedef bool (*TASK_FUNC)(void*);  // returns true to run again on the next round
 
 enum FutureStatus { PENDING = 0, DONE };
 
@@ -17,7 +18,7 @@ typedef enum FutureStatus FutureStatus;
 typedef enum FutureType FutureType;
 
 struct SleepContext {
-    uint32_t target_tick;
+    uint64_t deadline_ns;  // monotonic_ns()
 };
 
 struct Future {
@@ -31,14 +32,28 @@ struct FutureList {
     int lastIdx;
 };
 
+// Deferred work (bottom halves) queued from irq handlers and run by the executor
+struct Task {
+    TASK_FUNC run;
+    void* context;
+    volatile bool queued;
+    struct Task* next;
+};
+
 typedef struct Future Future;
 typedef struct SleepContext SleepContext;
+typedef struct Task Task;
 
 void init_futures();
 void await(Future);
 void process_time_futures();
 Future create_future(uint32_t, IS_READY, RESUME_FUNC);
+Future create_io_future(IS_READY, void*);
 void delete_future(Future);
 void wakeup_executor();
+void init_task(Task* task, TASK_FUNC run, void* context);
+void schedule_task(Task* task);
+bool run_tasks();
+void executor_idle();
 
 #endif
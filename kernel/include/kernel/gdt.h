@@ -3,6 +3,14 @@
 
 #include <stdint.h>
 
+// Selectors, the user ones with RPL 3
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_USER_CODE (0x18 | 3)
+#define GDT_USER_DATA (0x20 | 3)
+#define GDT_TSS 0x28
+#define GDT_ENTRIES 6
+
 struct AccessByte {
     uint8_t p;
     uint8_t dpl;
@@ -34,11 +42,46 @@ typedef struct {
     uint64_t base;
 } __attribute__((packed)) GDTDescriptor;
 
+/*
+ * Only esp0 and ss0 are used: the stack the CPU switches to when an
+ * interrupt or int 0x80 comes in from ring 3. No hardware task switching.
+ */
+typedef struct {
+    uint32_t prev_tss;
+    uint32_t esp0;
+    uint32_t ss0;
+    uint32_t esp1;
+    uint32_t ss1;
+    uint32_t esp2;
+    uint32_t ss2;
+    uint32_t cr3;
+    uint32_t eip;
+    uint32_t eflags;
+    uint32_t eax;
+    uint32_t ecx;
+    uint32_t edx;
+    uint32_t ebx;
+    uint32_t esp;
+    uint32_t ebp;
+    uint32_t esi;
+    uint32_t edi;
+    uint32_t es;
+    uint32_t cs;
+    uint32_t ss;
+    uint32_t ds;
+    uint32_t fs;
+    uint32_t gs;
+    uint32_t ldt;
+    uint16_t trap;
+    uint16_t iomap_base;
+} __attribute__((packed)) Tss;
+
 // static const uint64_t create_descriptor(uint32_t base, uint32_t limit,
 // uint16_t flag);
 
 void init_gdt();
 void read_gdt();
+void tss_set_kernel_stack(uint32_t esp0);
 
 #ifdef TEST
 void run_gdt_tests();
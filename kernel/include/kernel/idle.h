@@ -0,0 +1,29 @@
+#ifndef __IDLE__
+#define __IDLE__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Where the CPU goes when there is nothing to run. With MONITOR/MWAIT the
+ * wait is on the wake flag itself, so one store to it ends the wait, also
+ * from another CPU, and the MWAIT hint picks the C-state. Otherwise it is
+ * hlt, which only an interrupt ends. idle=hlt on the command line forces
+ * hlt, idle_cstate=<n> allows C-states down to Cn (default C1).
+ */
+void idle_init();
+bool idle_uses_mwait();
+uint32_t idle_cstate();
+
+// With interrupts on. Returns once *wake is set or an interrupt came, at once if it is set
+// already. A NULL wake waits for an interrupt only.
+void idle_wait(const volatile bool* wake);
+// The same with interrupts off on entry, e.g. after arming a timeout. They come on as the CPU
+// goes idle, so no interrupt slips in before, and stay on.
+void idle_wait_sti(const volatile bool* wake);
+
+#ifdef TEST
+void run_idle_tests();
+#endif
+
+#endif
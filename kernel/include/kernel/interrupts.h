@@ -8,6 +8,8 @@
 
 #define PIC_1_OFFSET 0x20
 #define PIC_2_OFFSET 0x28
+#define INTERRUPT_STUB_SIZE 22    // bytes per generated entry stub
+#define INTERRUPT_STUB_RETURN 14  // offset of the return address of its call
 
 typedef void (*InterruptFunc)(void);
 
@@ -42,6 +44,9 @@ static inline GateDescriptor GateDescriptor_create(GateDescriptorNewArgs arg) {
 void init_idt();
 void read_idt();
 void register_interrupt(uint32_t interrupt_num, InterruptFunc interrupt_func);
+void unregister_interrupt(uint32_t interrupt_num);
+void set_trap_gate(uint32_t interrupt_num, void (*entry)(), uint8_t dpl);
+void set_interrupt_gate(uint32_t interrupt_num, void (*entry)());
 
 #ifdef TEST
 void run_idt_tests();
@@ -0,0 +1,43 @@
+#ifndef __HPET__
+#define __HPET__
+
+#include <kernel/interrupts.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HPET_VECTOR_BASE 0x40  // comparator n interrupts on HPET_VECTOR_BASE + n
+#define HPET_EVENT_TIMERS 4    // comparators handed out as event sources
+
+/*
+ * The HPET from the ACPI HPET table. Its main counter is the clocksource, at
+ * least 10 MHz and never stopped once hpet_init() started it. A 32 bit
+ * counter is widened in software, which needs a read at least once per wrap
+ * (43 s at 100 MHz); the RTC tick reads it every second.
+ */
+bool hpet_init();
+bool hpet_available();
+uint64_t hpet_counter();
+uint64_t hpet_frequency();  // counter ticks per second
+uint64_t hpet_counter_to_ns(uint64_t counter);
+uint64_t hpet_ns_to_counter(uint64_t ns);
+
+/*
+ * Comparators as one-shot event sources. They interrupt through FSB
+ * delivery, an MSI to the local APIC: the routes to I/O APIC inputs do not
+ * reach the 8259s and the legacy replacement route would take IRQ0 and IRQ8
+ * from the PIT and the RTC. NULL when no comparator can do that.
+ */
+typedef struct HpetTimer HpetTimer;
+
+HpetTimer* hpet_timer_claim(InterruptFunc handler);
+void hpet_timer_release(HpetTimer* timer);
+// Interrupts once when the counter reaches deadline, false if it already has. Deadlines more than
+// 2^31 ticks out fire early, the handler has to check the time.
+bool hpet_timer_arm(HpetTimer* timer, uint64_t deadline);
+void hpet_timer_cancel(HpetTimer* timer);
+
+#ifdef TEST
+void run_hpet_tests();
+#endif
+
+#endif
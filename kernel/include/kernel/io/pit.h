@@ -0,0 +1,14 @@
+#ifndef __PIT__
+#define __PIT__
+
+#include <kernel/interrupts.h>
+#include <stdint.h>
+
+#define PIT_FREQUENCY 1193182  // input clock, Hz
+#define PIT_IRQ_VECTOR PIC_1_OFFSET
+
+// Channel 0 as a rate generator on IRQ0, hz between 19 and PIT_FREQUENCY
+uint32_t pit_start_periodic(uint32_t hz, InterruptFunc handler);
+void pit_stop();
+
+#endif
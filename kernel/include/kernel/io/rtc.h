@@ -1,6 +1,7 @@
 #ifndef __RTC__
 #define __RTC__
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define CMOS_CONTROL_REG 0x70
@@ -16,6 +17,9 @@
 #define CENTURY_REG 0x32
 #define STATUS_REG_A 0x0a
 #define STATUS_REG_B 0x0b
+#define STATUS_REG_C 0x0c
+
+#define RTC_UPDATE_ENDED (1 << 4)  // UIE in register B, UF in register C
 
 #define RTC_FREQ 256
 
@@ -38,6 +42,7 @@ struct DateTime get_date_time();
 void set_date_time(struct DateTime);
 void configure_rtc();
 void register_rtc_driver();
+void rtc_update_interrupt(bool enable);
 
 int get_timestamp(char*);
 
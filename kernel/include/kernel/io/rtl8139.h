@@ -0,0 +1,51 @@
+#ifndef __RTL8139__
+#define __RTL8139__
+
+#include <kernel/net/napi.h>
+#include <kernel/net/pbuf.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RTL8139_VENDOR_ID 0x10EC
+#define RTL8139_DEVICE_ID 0x8139
+
+#define RTL8139_RX_RING_SIZE 8192  // RBLEN = 00
+#define RTL8139_TX_SLOTS 4
+#define RTL8139_MAX_FRAME 1536
+#define RTL8139_MIN_FRAME 60  // without CRC, the chip does not pad short frames
+
+#define RTL8139_TX_BUSY -1
+#define RTL8139_TX_TOO_LONG -2
+
+// Called from the napi poll task for every received frame (without CRC), must pbuf_free it
+typedef void (*Rtl8139RxFunc)(Pbuf* frame);
+
+struct Rtl8139Stats {
+    uint32_t rx_packets;
+    uint32_t rx_bytes;
+    uint32_t rx_errors;
+    uint32_t rx_overflows;
+    uint32_t rx_copied;   // handed up in a pool pbuf because too many ring frames were held
+    uint32_t rx_dropped;  // no pbuf available
+    uint32_t tx_packets;
+    uint32_t tx_bytes;
+    uint32_t tx_errors;
+    uint32_t tx_zero_copy;
+    uint32_t irqs;
+};
+
+typedef struct Rtl8139Stats Rtl8139Stats;
+
+bool rtl8139_init();
+void rtl8139_set_rx_handler(Rtl8139RxFunc handler);
+int rtl8139_transmit(const void* data, uint16_t len);
+int rtl8139_transmit_pbuf(Pbuf* p);
+const uint8_t* rtl8139_mac();
+const Rtl8139Stats* rtl8139_stats();
+const NapiStats* rtl8139_napi_stats();
+
+#ifdef TEST
+void run_rtl8139_tests();
+#endif
+
+#endif
@@ -2,12 +2,21 @@
 #define __UART__
 
 #include <kernel/future.h>
+#include <stddef.h>
 #include <stdint.h>
 
 int init_serial();
 
 void serial_write(const char* msg, int len);
+void serial_write_line(const char* line, size_t len);
 void serial_putchar(const char c);
+size_t serial_write_nonblocking(const char* msg, size_t len);
+
+// exit_ codes, QEMU's isa-debug-exit turns them into exit status (code << 1) | 1
+#define EXIT_CODE_PASSED 0
+#define EXIT_CODE_FAILED 1        // assert or panic
+#define EXIT_CODE_UNKNOWN_NAME 2  // test= or bench= named something that does not exist
+
 void exit_(const uint8_t);
 
 Future create_serial_future();
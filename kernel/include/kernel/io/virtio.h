@@ -0,0 +1,121 @@
+#ifndef __VIRTIO__
+#define __VIRTIO__
+
+#include <kernel/dma.h>
+#include <kernel/pci.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define VIRTIO_VENDOR_ID 0x1AF4
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER 0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FEATURES_OK 0x08
+#define VIRTIO_STATUS_FAILED 0x80
+
+#define VIRTIO_F_ANY_LAYOUT 27
+#define VIRTIO_RING_F_EVENT_IDX 29
+#define VIRTIO_F_VERSION_1 32
+
+#define VIRTQ_DESC_F_NEXT 0x1
+#define VIRTQ_DESC_F_WRITE 0x2
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 0x1
+#define VIRTQ_USED_F_NO_NOTIFY 0x1
+
+#define VIRTQ_MAX_SIZE 256
+#define VIRTQ_ALIGN 4096
+#define VIRTQ_ALIGN_UP(x) (((x) + VIRTQ_ALIGN - 1) & ~(VIRTQ_ALIGN - 1))
+
+// Legacy layout: descriptors and avail ring, then the used ring on the next page
+#define VIRTQ_RING_BYTES(size) \
+    (VIRTQ_ALIGN_UP(16 * (size) + 2 * (3 + (size))) + VIRTQ_ALIGN_UP(2 * 3 + 8 * (size)))
+
+struct VirtqDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed));
+
+struct VirtqAvail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];  // followed by used_event with EVENT_IDX
+};
+
+struct VirtqUsedElem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct VirtqUsed {
+    uint16_t flags;
+    uint16_t idx;
+    struct VirtqUsedElem ring[];  // followed by avail_event with EVENT_IDX
+};
+
+// One buffer of a descriptor chain
+struct VirtqBuffer {
+    uint32_t addr;
+    uint32_t len;
+    bool device_writes;
+};
+
+struct VirtioDevice;
+
+struct Virtqueue {
+    struct VirtioDevice* device;
+    uint16_t index;
+    uint16_t size;
+    volatile struct VirtqDesc* desc;
+    volatile struct VirtqAvail* avail;
+    volatile struct VirtqUsed* used;
+    uint16_t free_head;
+    uint16_t num_free;
+    uint16_t avail_idx;      // shadow of avail->idx, published by virtq_kick
+    uint16_t kicked_idx;     // avail idx the device was last told about
+    uint16_t last_used_idx;  // next used entry to consume
+    uint32_t notify_address;
+    void* tokens[VIRTQ_MAX_SIZE];
+    uint32_t kicks;
+    uint32_t kicks_suppressed;
+};
+
+struct VirtioDevice {
+    const PciDevice* pci;
+    bool modern;
+    uint16_t io_base;                 // legacy transport
+    volatile uint8_t* common;         // modern transport, struct virtio_pci_common_cfg
+    volatile uint8_t* isr;            // modern transport
+    volatile uint8_t* device_config;  // modern transport
+    uint32_t notify_base;
+    uint32_t notify_multiplier;
+    uint64_t features;  // negotiated
+    uint8_t irq;
+};
+
+typedef struct VirtqDesc VirtqDesc;
+typedef struct VirtqAvail VirtqAvail;
+typedef struct VirtqUsed VirtqUsed;
+typedef struct VirtqBuffer VirtqBuffer;
+typedef struct Virtqueue Virtqueue;
+typedef struct VirtioDevice VirtioDevice;
+
+bool virtio_open(VirtioDevice* dev, const PciDevice* pci);
+void virtio_set_status(VirtioDevice* dev, uint8_t status);
+uint8_t virtio_get_status(VirtioDevice* dev);
+bool virtio_negotiate(VirtioDevice* dev, uint64_t wanted);
+bool virtio_has_feature(const VirtioDevice* dev, int bit);
+uint8_t virtio_config_read8(VirtioDevice* dev, uint32_t offset);
+uint8_t virtio_read_isr(VirtioDevice* dev);
+
+bool virtq_init(Virtqueue* vq, VirtioDevice* dev, uint16_t index, const DmaBuffer* ring);
+int virtq_add(Virtqueue* vq, const VirtqBuffer* buffers, int count, void* token);
+bool virtq_kick(Virtqueue* vq);
+void* virtq_get_used(Virtqueue* vq, uint32_t* len);
+bool virtq_has_used(Virtqueue* vq);
+void virtq_disable_interrupts(Virtqueue* vq);
+bool virtq_enable_interrupts(Virtqueue* vq, uint16_t after);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef __VIRTIO_NET__
+#define __VIRTIO_NET__
+
+#include <kernel/net/napi.h>
+#include <kernel/net/pbuf.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define VIRTIO_NET_LEGACY_DEVICE_ID 0x1000  // transitional
+#define VIRTIO_NET_MODERN_DEVICE_ID 0x1041
+
+#define VIRTIO_NET_F_MAC 5
+#define VIRTIO_NET_F_MRG_RXBUF 15
+
+#define VIRTIO_NET_RX_BUFFERS 16  // pre-posted, refilled as frames arrive
+#define VIRTIO_NET_MAX_FRAME 1514
+
+#ifndef VIRTIO_NET_MERGEABLE_RX
+#define VIRTIO_NET_MERGEABLE_RX 1
+#endif
+
+#define VIRTIO_NET_TX_BUSY -1
+#define VIRTIO_NET_TX_TOO_LONG -2
+
+// Called from the napi poll task for every received frame, must pbuf_free it
+typedef void (*VirtioNetRxFunc)(Pbuf* frame);
+
+struct VirtioNetStats {
+    uint32_t rx_packets;
+    uint32_t rx_bytes;
+    uint32_t rx_dropped;
+    uint32_t rx_merged;  // frames that spanned more than one buffer
+    uint32_t tx_packets;
+    uint32_t tx_bytes;
+    uint32_t irqs;
+    uint32_t rx_kicks;
+    uint32_t rx_kicks_suppressed;
+    uint32_t tx_kicks;
+    uint32_t tx_kicks_suppressed;
+};
+
+typedef struct VirtioNetStats VirtioNetStats;
+
+bool virtio_net_init();
+void virtio_net_set_rx_handler(VirtioNetRxFunc handler);
+int virtio_net_queue_tx(Pbuf* p);
+void virtio_net_flush_tx();
+int virtio_net_transmit_pbuf(Pbuf* p);
+const uint8_t* virtio_net_mac();
+const VirtioNetStats* virtio_net_stats();
+const NapiStats* virtio_net_napi_stats();
+
+#ifdef TEST
+void run_virtio_net_tests();
+#endif
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __IRQSOFF__
+#define __IRQSOFF__
+
+#include <stdint.h>
+
+#define IRQSOFF_MAX_SITES 64
+#define IRQSOFF_BUCKETS 40  // log2 of the cycles a section took
+#define IRQSOFF_REPORT_TOP 8
+
+/*
+ * Interrupts-off latency tracer. With -DIRQSOFF_TRACE every INTERRUPT_GUARDED
+ * section that turns interrupts off times itself with the TSC and is recorded
+ * here under its file and line. Nested sections run with interrupts already
+ * off and count towards the outermost one. make test and make debug build it
+ * in, other builds take IRQSOFF=1.
+ */
+void irqsoff_record(uint64_t cycles, const char* file, int line);
+
+// Worst sites by their longest section, and the tail of all sections together
+void irqsoff_report();
+
+#ifdef TEST
+void run_irqsoff_tests();
+#endif
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef __KSYMS__
+#define __KSYMS__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct KernelSymbol {
+    uint32_t addr;
+    const char* name;
+};
+
+typedef struct KernelSymbol KernelSymbol;
+
+// Text symbols of myos.kernel sorted by address, generated by gen-ksyms.sh at link time
+extern const KernelSymbol kernel_symbols[];
+extern const int kernel_symbol_count;
+
+#define KSYM_NONE -1
+
+bool ksym_in_text(uint32_t addr);
+int ksym_lookup(uint32_t addr);
+const char* ksym_name(int idx);
+
+#ifdef TEST
+void run_ksyms_tests();
+#endif
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef __LAPIC__
+#define __LAPIC__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Just enough of the local APIC for message signalled interrupts. The 8259s
+ * keep delivering through LINT0 as ExtINT, MSIs arrive on vectors from
+ * LAPIC_VECTOR_BASE up and are acknowledged at the local APIC instead.
+ */
+#define LAPIC_VECTOR_BASE 0x30  // first vector after the two PICs
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+bool lapic_init();
+bool lapic_available();
+uint8_t lapic_id();
+void lapic_eoi();
+
+// Address and data for a fixed, edge triggered MSI to this CPU
+uint32_t lapic_msi_address();
+uint32_t lapic_msi_data(uint8_t vector);
+
+#endif
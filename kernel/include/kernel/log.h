@@ -0,0 +1,102 @@
+#ifndef __LOG__
+#define __LOG__
+
+#include <kernel/circular_buffer.h>
+#include <kernel/console.h>
+#include <kernel/static_key.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Leveled logging. LOG_TRACE() .. LOG_ERROR() below LOG_MIN_LEVEL are not
+ * compiled at all (make LOG_MIN_LEVEL=WARN). The rest check their
+ * subsystem's runtime level through a static key, so a disabled site is a
+ * nop. A file picks its subsystem by defining LOG_SUBSYSTEM before its first
+ * include, loglevel=debug or loglevel=pci:trace,net:warn on the command line
+ * changes the levels at boot.
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_TRACE
+#endif
+#ifdef DEBUG
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_DEBUG
+#else
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_INFO
+#endif
+
+#ifndef LOG_SUBSYSTEM
+#define LOG_SUBSYSTEM core
+#endif
+
+#define LOG_SUBSYSTEMS(X) X(core) X(mem) X(irq) X(time) X(acpi) X(pci) X(nic) X(net) X(proc)
+
+typedef struct {
+    const char* name;
+    LogLevel level;
+    StaticKey enabled[LOG_LEVEL_COUNT];  // enabled[l] is on while level <= l
+} LogSubsystem;
+
+#define LOG_KEY_INIT(level) STATIC_KEY_INIT((level) >= LOG_DEFAULT_LEVEL)
+#define LOG_SUBSYSTEM_DEFINE(subsystem)                                           \
+    LogSubsystem log_subsystem_##subsystem = {                                    \
+        .name = #subsystem,                                                       \
+        .level = LOG_DEFAULT_LEVEL,                                               \
+        .enabled = {LOG_KEY_INIT(LOG_LEVEL_TRACE), LOG_KEY_INIT(LOG_LEVEL_DEBUG), \
+                    LOG_KEY_INIT(LOG_LEVEL_INFO), LOG_KEY_INIT(LOG_LEVEL_WARN),   \
+                    LOG_KEY_INIT(LOG_LEVEL_ERROR)},                               \
+    };
+#define LOG_SUBSYSTEM_DECLARE(subsystem) extern LogSubsystem log_subsystem_##subsystem;
+LOG_SUBSYSTEMS(LOG_SUBSYSTEM_DECLARE)
+
+#define LOG_SUBSYSTEM_OF(subsystem) LOG_SUBSYSTEM_OF_(subsystem)
+#define LOG_SUBSYSTEM_OF_(subsystem) (&log_subsystem_##subsystem)
+
+// Constant level only, the static key is picked at compile time
+#define LOG_ENABLED(level)       \
+    ((level) >= LOG_MIN_LEVEL && \
+     static_branch(&LOG_SUBSYSTEM_OF(LOG_SUBSYSTEM)->enabled[level], (level) >= LOG_DEFAULT_LEVEL))
+
+#define LOG_AT(level, x, ...)                                             \
+    do {                                                                  \
+        if (LOG_ENABLED(level))                                           \
+            write_to_buffer(x, level, __FILE__, __LINE__, ##__VA_ARGS__); \
+    } while (0)
+
+#define LOG_TRACE(x, ...) LOG_AT(LOG_LEVEL_TRACE, x, ##__VA_ARGS__)
+#define LOG_DEBUG(x, ...) LOG_AT(LOG_LEVEL_DEBUG, x, ##__VA_ARGS__)
+#define LOG_INFO(x, ...) LOG_AT(LOG_LEVEL_INFO, x, ##__VA_ARGS__)
+#define LOG_WARN(x, ...) LOG_AT(LOG_LEVEL_WARN, x, ##__VA_ARGS__)
+#define LOG_ERROR(x, ...) LOG_AT(LOG_LEVEL_ERROR, x, ##__VA_ARGS__)
+
+/*
+ * For interrupt handlers: each site prints at most LOG_RATELIMIT_BURST lines
+ * a second, and says how many it dropped when the next second starts.
+ */
+#define LOG_RATELIMIT_BURST 10
+
+typedef struct {
+    uint32_t window_start;  // in ticks
+    uint32_t printed;
+    uint32_t missed;
+} LogRateLimit;
+
+bool log_ratelimit(LogRateLimit* state, const char* file, int line);
+
+#define LOG_RATELIMITED(level, x, ...)                                            \
+    do {                                                                          \
+        static LogRateLimit ratelimit_;                                           \
+        if (LOG_ENABLED(level) && log_ratelimit(&ratelimit_, __FILE__, __LINE__)) \
+            write_to_buffer(x, level, __FILE__, __LINE__, ##__VA_ARGS__);         \
+    } while (0)
+
+void log_set_level(LogSubsystem* subsystem, LogLevel level);
+// "debug" or "pci:trace,net:warn", false if a name or level is unknown
+bool log_apply(const char* spec, size_t len);
+void log_init();
+
+#ifdef TEST
+void run_log_tests();
+#endif
+
+#endif
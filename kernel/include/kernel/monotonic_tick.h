@@ -1,13 +1,33 @@
 #ifndef __MONOTONIC_TICK__
 #define __MONOTONIC_TICK__
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#define NS_PER_SECOND 1000000000ULL
+
 typedef struct {
     uint32_t tick;
 } MonotonicTick;
 
 void process_tick();
 uint32_t get_tick();
+uint64_t tsc_frequency();
+uint32_t tsc_to_us(uint64_t cycles);  // calibrates tsc_frequency() on first use
+
+/*
+ * Nanoseconds since boot from the HPET counter, or from the RTC tick in
+ * 1/RTC_FREQ steps without one. monotonic_init() claims an HPET comparator
+ * for timeouts, so waits end when they are due instead of on the next tick.
+ */
+void monotonic_init();
+uint64_t monotonic_ns();
+bool monotonic_precise_timeouts();
+void monotonic_set_timeout(uint64_t deadline_ns);  // the earliest deadline set wins
+void monotonic_wait_until(uint64_t deadline_ns);
+
+#ifdef TEST
+void run_monotonic_tests();
+#endif
 
 #endif
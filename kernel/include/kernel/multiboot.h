@@ -261,4 +261,11 @@ struct multiboot_apm_info {
 
 void parse_multiboot_info(multiboot_info_t* mbd, unsigned int magic);
 
+#define MULTIBOOT_MAX_MODULES 4
+
+// Copies the module list, which the loader may have put where the heap goes
+void multiboot_modules_init(multiboot_info_t* mbd);
+multiboot_uint32_t multiboot_module_count();
+const multiboot_module_t* multiboot_module(multiboot_uint32_t index);  // NULL past the last one
+
 #endif /* ! MULTIBOOT_HEADER */
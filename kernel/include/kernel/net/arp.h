@@ -0,0 +1,36 @@
+#ifndef __ARP__
+#define __ARP__
+
+#include <kernel/net/net.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ARP_CACHE_SIZE 16
+
+#define ARP_OP_REQUEST 1
+#define ARP_OP_REPLY 2
+
+struct ArpPacket {
+    uint16_t hardware_type;
+    uint16_t protocol_type;
+    uint8_t hardware_len;
+    uint8_t protocol_len;
+    uint16_t operation;
+    uint8_t sender_mac[ETH_ADDR_LEN];
+    uint32_t sender_ip;
+    uint8_t target_mac[ETH_ADDR_LEN];
+    uint32_t target_ip;
+} __attribute__((packed));
+
+typedef struct ArpPacket ArpPacket;
+
+void arp_input(Pbuf* p);
+int arp_output(Pbuf* p, uint32_t next_hop);
+bool arp_lookup(uint32_t ip, uint8_t mac[ETH_ADDR_LEN]);
+int arp_request(uint32_t ip);
+
+#ifdef TEST
+void run_arp_tests();
+#endif
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef __CHECKSUM__
+#define __CHECKSUM__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Below this the xmm save/restore costs more than the wider adds win
+#define CHECKSUM_SSE2_THRESHOLD 1024
+
+/*
+ * Sums are one's complement sums of 16-bit words in memory order: the folded
+ * result can be stored into a header as is, and fields read straight out of a
+ * packet can be passed to the incremental updates without byte swapping.
+ */
+void checksum_init();
+bool checksum_has_sse2();
+uint32_t checksum_partial(const void* data, size_t len, uint32_t sum);
+uint32_t checksum_copy(void* dst, const void* src, size_t len, uint32_t sum);
+uint16_t checksum_fold(uint32_t sum);
+uint16_t inet_checksum(const void* data, size_t len);
+
+// RFC 1624 incremental update of a stored checksum after a field changed
+uint16_t checksum_update16(uint16_t check, uint16_t old_value, uint16_t new_value);
+uint16_t checksum_update32(uint16_t check, uint32_t old_value, uint32_t new_value);
+
+#ifdef TEST
+void run_checksum_tests();
+#endif
+
+#endif
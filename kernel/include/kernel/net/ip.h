@@ -0,0 +1,49 @@
+#ifndef __IP__
+#define __IP__
+
+#include <kernel/net/net.h>
+#include <stdint.h>
+
+#define IP_HEADER_LEN 20  // without options, all we send
+#define IP_DEFAULT_TTL 64
+#define IP_PROTO_ICMP 1
+#define IP_PROTO_UDP 17
+
+#define IP_FLAG_MORE_FRAGMENTS 0x2000
+#define IP_FRAGMENT_OFFSET_MASK 0x1FFF
+
+#define ICMP_ECHO_REPLY 0
+#define ICMP_ECHO_REQUEST 8
+
+struct Ipv4Header {
+    uint8_t version_ihl;
+    uint8_t tos;
+    uint16_t total_len;
+    uint16_t id;
+    uint16_t flags_fragment;
+    uint8_t ttl;
+    uint8_t protocol;
+    uint16_t checksum;
+    uint32_t src;
+    uint32_t dst;
+} __attribute__((packed));
+
+struct IcmpHeader {
+    uint8_t type;
+    uint8_t code;
+    uint16_t checksum;
+    uint16_t id;
+    uint16_t sequence;
+} __attribute__((packed));
+
+typedef struct Ipv4Header Ipv4Header;
+typedef struct IcmpHeader IcmpHeader;
+
+void ip_input(Pbuf* p);
+int ip_output(Pbuf* p, uint32_t src, uint32_t dst, uint8_t protocol);
+
+#ifdef TEST
+void run_ip_tests();
+#endif
+
+#endif
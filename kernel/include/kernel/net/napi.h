@@ -0,0 +1,53 @@
+#ifndef __NAPI__
+#define __NAPI__
+
+#include <kernel/future.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define NAPI_DEFAULT_BUDGET 16  // frames per poll before other work gets a turn
+
+// Handles up to budget received frames, returns how many it handled
+typedef int (*NapiPollFunc)(int budget);
+
+/*
+ * Unmasks the device rx interrupt once the ring is drained. Returns true if
+ * frames arrived before the unmask took effect, the rx interrupt is then
+ * masked again and polling continues.
+ */
+typedef bool (*NapiEnableIrqFunc)();
+
+struct NapiStats {
+    uint32_t irqs;              // rx interrupts that switched the device to polling
+    uint32_t polls;
+    uint32_t packets;           // handled by polls, packets / polls is the batch size
+    uint32_t budget_exhausted;  // polls that stopped with frames left in the ring
+    uint32_t max_per_poll;
+};
+
+/*
+ * On an rx interrupt the driver masks its rx interrupt and calls napi_irq.
+ * The ring is then drained by a task on the executor, budget frames at a
+ * time, and the interrupt is unmasked once a poll comes up short.
+ */
+struct Napi {
+    const char* name;
+    NapiPollFunc poll;
+    NapiEnableIrqFunc enable_irq;
+    int budget;
+    Task task;
+    struct NapiStats stats;
+};
+
+typedef struct NapiStats NapiStats;
+typedef struct Napi Napi;
+
+void napi_init(Napi* napi, const char* name, NapiPollFunc poll, NapiEnableIrqFunc enable_irq);
+void napi_irq(Napi* napi);
+void napi_schedule(Napi* napi);
+
+#ifdef TEST
+void run_napi_tests();
+#endif
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef __NET__
+#define __NET__
+
+#include <kernel/net/napi.h>
+#include <kernel/net/pbuf.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Addresses are kept in host byte order and converted at the wire
+#define NET_IP(a, b, c, d) \
+    (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+// QEMU user networking defaults
+#define NET_DEFAULT_IP NET_IP(10, 0, 2, 15)
+#define NET_DEFAULT_NETMASK NET_IP(255, 255, 255, 0)
+#define NET_DEFAULT_GATEWAY NET_IP(10, 0, 2, 2)
+
+#define ETH_ADDR_LEN 6
+#define ETH_HEADER_LEN 14
+#define ETH_TYPE_IPV4 0x0800
+#define ETH_TYPE_ARP 0x0806
+
+#define NET_TX_DROPPED -1
+
+struct EthHeader {
+    uint8_t dst[ETH_ADDR_LEN];
+    uint8_t src[ETH_ADDR_LEN];
+    uint16_t type;  // network order
+} __attribute__((packed));
+
+struct NetStats {
+    uint32_t rx_frames;
+    uint32_t rx_dropped;  // unknown ethertype or malformed
+    uint32_t tx_frames;
+    uint32_t tx_dropped;  // driver busy or no route
+    uint32_t arp_requests;
+    uint32_t arp_replies;
+    uint32_t ip_rx;
+    uint32_t ip_dropped;  // bad header, checksum, not for us or fragmented
+    uint32_t icmp_echo_replies;
+    uint32_t udp_rx;
+    uint32_t udp_tx;
+    uint32_t udp_dropped;  // no socket or socket queue full
+};
+
+// Takes ownership of p on success
+typedef int (*NetTransmitFunc)(Pbuf* p);
+
+struct NetInterface {
+    const char* name;
+    uint8_t mac[ETH_ADDR_LEN];
+    uint32_t ip;
+    uint32_t netmask;
+    uint32_t gateway;
+    NetTransmitFunc transmit;
+    const NapiStats* napi_stats;  // of the driver's rx polling
+    struct NetStats stats;
+};
+
+typedef struct EthHeader EthHeader;
+typedef struct NetStats NetStats;
+typedef struct NetInterface NetInterface;
+
+static inline uint16_t htons(uint16_t value) {
+    return (value << 8) | (value >> 8);
+}
+
+static inline uint16_t ntohs(uint16_t value) {
+    return htons(value);
+}
+
+static inline uint32_t htonl(uint32_t value) {
+    return __builtin_bswap32(value);
+}
+
+static inline uint32_t ntohl(uint32_t value) {
+    return htonl(value);
+}
+
+extern const uint8_t ETH_BROADCAST[ETH_ADDR_LEN];
+
+bool net_init();
+NetInterface* net_interface();
+void net_receive(Pbuf* frame);
+int net_output(Pbuf* p, const uint8_t dst[ETH_ADDR_LEN], uint16_t type);
+
+#ifdef TEST
+void run_net_tests();
+#endif
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef __PBUF__
+#define __PBUF__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PBUF_POOL_SIZE 64
+#define PBUF_REF_POOL_SIZE 32
+#define PBUF_BUFFER_SIZE 2048  // multiple of the cache line
+#define PBUF_CACHE_LINE 64
+
+/*
+ * Room reserved in front of the payload for headers pushed by lower layers.
+ * It is 2 mod 4 so that after Ethernet + IPv4 + UDP/ICMP (42 bytes) or TCP
+ * (54 bytes) the frame starts on a dword, which the NIC wants for DMA.
+ */
+#define PBUF_HEADROOM 66
+
+enum PbufType {
+    PBUF_POOL = 0,  // owns a buffer from the pool
+    PBUF_REF        // points at memory owned by someone else, e.g. a NIC rx ring
+};
+
+// Called when the last reference to a PBUF_REF goes away
+typedef void (*PbufReleaseFunc)(void* ctx);
+
+struct Pbuf {
+    struct Pbuf* next;  // next segment of the same packet, or the free list link
+    uint8_t* buffer;    // start of the underlying storage
+    uint8_t* data;      // start of the valid bytes in this segment
+    uint16_t len;       // valid bytes in this segment
+    uint16_t capacity;  // bytes from buffer to the end of the storage
+    uint16_t refcount;
+    enum PbufType type;
+    PbufReleaseFunc release;
+    void* release_ctx;
+};
+
+typedef struct Pbuf Pbuf;
+typedef enum PbufType PbufType;
+
+void pbuf_init();
+
+Pbuf* pbuf_alloc(uint16_t len);
+Pbuf* pbuf_alloc_ref(uint8_t* data, uint16_t len, PbufReleaseFunc release, void* ctx);
+void pbuf_ref(Pbuf* p);
+void pbuf_free(Pbuf* p);
+
+uint8_t* pbuf_push(Pbuf* p, uint16_t len);
+uint8_t* pbuf_pull(Pbuf* p, uint16_t len);
+void pbuf_chain(Pbuf* head, Pbuf* tail);
+
+uint16_t pbuf_headroom(const Pbuf* p);
+uint16_t pbuf_tailroom(const Pbuf* p);
+uint32_t pbuf_total_len(const Pbuf* p);
+size_t pbuf_copy_out(const Pbuf* p, void* dst, size_t offset, size_t len);
+
+int pbuf_pool_available();
+
+#ifdef TEST
+void run_pbuf_tests();
+#endif
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef __UDP__
+#define __UDP__
+
+#include <kernel/future.h>
+#include <kernel/net/net.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define UDP_HEADER_LEN 8
+#define UDP_MAX_SOCKETS 8
+#define UDP_QUEUE_LEN 32  // power of two
+
+#define UDP_ECHO_PORT 7
+#define UDP_DISCARD_PORT 9
+
+struct UdpHeader {
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t len;
+    uint16_t checksum;
+} __attribute__((packed));
+
+struct UdpDatagram {
+    Pbuf* p;  // payload only
+    uint32_t src_ip;
+    uint16_t src_port;
+};
+
+struct UdpSocket {
+    bool used;
+    uint16_t port;
+    struct UdpDatagram queue[UDP_QUEUE_LEN];
+    volatile uint32_t head;  // next datagram to hand out
+    volatile uint32_t tail;  // next free slot, written from the rx path
+    uint32_t dropped;
+};
+
+typedef struct UdpHeader UdpHeader;
+typedef struct UdpDatagram UdpDatagram;
+typedef struct UdpSocket UdpSocket;
+
+void udp_input(Pbuf* p, uint32_t src, uint32_t dst);
+
+UdpSocket* udp_bind(uint16_t port);
+void udp_close(UdpSocket* sock);
+int udp_send_pbuf(UdpSocket* sock, uint32_t dst_ip, uint16_t dst_port, Pbuf* p);
+int udp_sendto(UdpSocket* sock, uint32_t dst_ip, uint16_t dst_port, const void* data,
+               size_t len);
+bool udp_recv(UdpSocket* sock, UdpDatagram* out);
+Future udp_recv_future(UdpSocket* sock);
+UdpDatagram udp_recv_blocking(UdpSocket* sock);
+
+void udp_services_run();
+
+#ifdef TEST
+void run_udp_tests();
+#endif
+
+#endif
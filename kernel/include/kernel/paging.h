@@ -0,0 +1,48 @@
+#ifndef __PAGING__
+#define __PAGING__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The kernel runs on an identity map of the whole 4 GiB in 4 MiB pages,
+ * which ring 3 cannot use. Every process gets a page directory of its own,
+ * which shares those and maps the user window in 4 KiB pages from the frame
+ * pool. A page is zero-filled when it is first touched, a cloned space
+ * shares every page copy-on-write until one side writes to it.
+ */
+#define PAGE_SIZE 0x1000
+#define FRAME_POOL_BASE 0x00800000  // physical, the DMA pool and the heap follow
+#define FRAME_POOL_END 0x01000000
+#define CR0_WP (1 << 16)  // faults on kernel writes to read-only pages too, for copy-on-write
+
+/*
+ * Ring 3 programs in the kernel image, for the tests, go on pages of their
+ * own. Their code may only call always_inline helpers and libgcc, and use
+ * their own data.
+ */
+#define RING3_TEXT __attribute__((section(".user_text")))
+#define RING3_DATA __attribute__((section(".user_data")))
+
+typedef struct {
+    uint32_t* directory;  // NULL for the kernel's identity map
+    uint32_t pages;       // from the frame pool, a shared one counts in each space
+} AddressSpace;
+
+void paging_init();
+// False when the frame pool runs out
+bool address_space_create(AddressSpace* space);
+bool address_space_clone(AddressSpace* parent, AddressSpace* child);
+void address_space_destroy(AddressSpace* space);
+void address_space_switch(AddressSpace* space);  // NULL for the kernel's
+// Lets ring 3 run the RING3_TEXT code in the kernel image, on its RING3_DATA
+void address_space_share_image(AddressSpace* space);
+uint32_t paging_free_frames();
+// From the entry stub in arch/i386/paging.S, with interrupts off
+void page_fault_handler(uint32_t address, uint32_t error, uint32_t eip);
+
+#ifdef TEST
+void run_paging_tests();
+#endif
+
+#endif
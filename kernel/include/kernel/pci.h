@@ -1,26 +1,64 @@
 #ifndef __KERNEL_PCI__
 #define __KERNEL_PCI__
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#define PCI_MAX_DEVICES 64
+#define PCI_NUM_BARS 6
+#define PCI_CONFIG_SPACE_SIZE 4096  // per function with ECAM, legacy access reaches 256
+#define PCI_ID_TABLE_SIZE 128  // power of two, at least 2 * PCI_MAX_DEVICES
+
+#define PCI_CLASS_BRIDGE 0x06
+#define PCI_SUBCLASS_PCI_TO_PCI 0x04
+
 struct PciAddress {
     int bus;
     int slot;
+    int func;
 };
 
 enum PciHeader { General = 0, PciToPci, PciToCardBridge };
 
+struct PciDevice {
+    struct PciAddress address;
+    enum PciHeader header_type;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t irq_line;
+    uint32_t bars[PCI_NUM_BARS];  // raw values, 0 when not implemented
+    int next_same_id;             // index of next device with the same vendor/device, or -1
+    int next_same_class;          // index of next device with the same class/subclass, or -1
+};
+
 struct Pci {
     struct PciAddress address;
     enum PciHeader header_type;
+    const struct PciDevice* device;
 };
 
 typedef struct PciAddress PciAddress;
+typedef struct PciDevice PciDevice;
 typedef struct Pci Pci;
 typedef enum PciHeader PciHeader;
 
-uint32_t pci_config_read(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
-uint32_t pci_read_regiser(PciAddress address, uint8_t reg);
+bool pci_has_ecam();
+uint32_t pci_config_read(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset);
+void pci_config_write(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset, uint32_t value);
+uint32_t pci_read_register(PciAddress address, uint16_t reg);
+void pci_write_register(PciAddress address, uint16_t reg, uint32_t value);
+
+void pci_enumerate();
+void pci_enumerate_in_background();
+int pci_device_count();
+const PciDevice* pci_get_device(int idx);
+const PciDevice* pci_find_device(uint16_t vendor_id, uint16_t device_id);
+const PciDevice* pci_find_class(uint8_t class_code, uint8_t subclass);
+const PciDevice* pci_next_in_class(const PciDevice* device);
+uint8_t pci_find_capability(const PciDevice* device, uint8_t cap_id, uint8_t prev);
 
 Pci find_pci_address(uint16_t vendor_id, uint16_t device_id);
 
@@ -0,0 +1,44 @@
+#ifndef __PROCESS__
+#define __PROCESS__
+
+#include <kernel/paging.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * User programs are loaded into a fixed window of their own address space.
+ * A single program runs at a time, process_run() returns when it exits or
+ * faults. It needs a space of its own, process_init() alone does not make
+ * one. Code in the kernel image runs with process_init_image().
+ */
+#define USER_BASE 0x40000000
+#define USER_END 0x40800000
+#define USER_TIME_PAGE (USER_END - PAGE_SIZE)  // read-only
+#define USER_STACK_SIZE 0x10000                // below the time page
+#define PROCESS_EXIT_FAULT 139                 // as a shell reports SIGSEGV
+
+typedef struct {
+    uint32_t pid;
+    uint32_t entry;
+    uint32_t user_stack;  // esp in ring 3 at entry
+    uint32_t kernel_esp;  // process_run()'s, ring 3 enters the kernel below it
+    uint32_t exit_code;
+    AddressSpace space;
+} Process;
+
+void process_init(Process* process, uint32_t entry, uint32_t user_stack);
+// The ELF program in a boot module, false if there is none or it does not load
+bool process_load_module(Process* process, uint32_t module);
+// RING3_TEXT at entry on a RING3_DATA stack, false when the frame pool runs out
+bool process_init_image(Process* process, void (*entry)(), uint32_t user_stack);
+uint32_t process_run(Process* process);  // the exit code, _start() gets the time page
+void process_destroy(Process* process);
+Process* process_current();
+void process_exit(uint32_t code) __attribute__((noreturn));
+
+#ifdef TEST
+void run_process_tests();
+#endif
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __PROFILER__
+#define __PROFILER__
+
+#include <stdint.h>
+
+#define PROFILE_MAX_DEPTH 16
+#define PROFILE_RING_SIZE 8192  // samples, power of two
+#define PROFILE_MAX_STACKS 1024
+#define PROFILE_DEFAULT_HZ 997  // prime, so sampling does not lock step with the 256 Hz RTC tick
+
+/*
+ * Statistical profiler. The PIT interrupts hz times a second, the handler
+ * walks the frame pointers of whatever it interrupted into a sample ring,
+ * and profiler_report() folds the samples by stack and prints them on COM1
+ * in the folded-stack format flamegraph.pl and speedscope read.
+ */
+void profiler_init();  // starts if the command line has profile=<hz>
+void profiler_start(uint32_t hz);
+void profiler_stop();
+void profiler_report();
+
+#ifdef TEST
+void run_profiler_tests();
+#endif
+
+#endif
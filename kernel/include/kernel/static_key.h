@@ -0,0 +1,64 @@
+#ifndef __STATIC_KEY__
+#define __STATIC_KEY__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Branches that cost one 5-byte instruction. Every static_branch() site is
+ * either a nop (falls through, the key is off) or a jmp to its taken block,
+ * and records itself in the __jump_table section. static_key_set() rewrites
+ * every site of a key. A site starts out as its key's initial value, which
+ * has to be the constant the key was initialized with.
+ *
+ * Off i386 (the host build) a site just reads the key.
+ */
+typedef struct {
+    volatile bool enabled;
+} StaticKey;
+
+struct JumpEntry {
+    uint32_t code;
+    uint32_t target;
+    StaticKey* key;
+};
+
+#define STATIC_KEY_INIT(on) {.enabled = (on)}
+
+#ifdef __i386__
+#define static_branch(key, initially_on)             \
+    ({                                               \
+        __label__ l_taken, l_done;                   \
+        bool taken_ = false;                         \
+        asm goto(                                    \
+            "1:\n\t"                                 \
+            ".if %c1\n\t"                            \
+            ".byte 0xe9\n\t"                         \
+            ".long %l[l_taken] - (1b + 5)\n\t"       \
+            ".else\n\t"                              \
+            ".byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t" \
+            ".endif\n\t"                             \
+            ".pushsection __jump_table, \"a\"\n\t"   \
+            ".long 1b, %l[l_taken], %c0\n\t"         \
+            ".popsection"                            \
+            :                                        \
+            : "i"(key), "i"(initially_on)            \
+            :                                        \
+            : l_taken);                              \
+        goto l_done;                                 \
+    l_taken:                                         \
+        taken_ = true;                               \
+    l_done:                                          \
+        taken_;                                      \
+    })
+#else
+#define static_branch(key, initially_on) ((key)->enabled)
+#endif
+
+void static_key_set(StaticKey* key, bool on);
+
+#ifdef TEST
+void run_static_key_tests();
+#endif
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef __SYSCALL__
+#define __SYSCALL__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * System calls from ring 3. The number goes in eax, up to three arguments
+ * in ebx, esi and edi, the result comes back in eax, ecx and edx are
+ * clobbered. SYSENTER saves neither the user esp nor where to go back, so
+ * the caller passes them in ecx and edx. int 0x80 takes the same registers
+ * and is there for CPUs without SYSENTER. Everything above __is_kernel is
+ * shared with user programs.
+ */
+#define SYS_EXIT 1
+#define SYS_WRITE 4
+#define SYS_GETPID 20
+
+#define SYSCALL_VECTOR 0x80
+#define SYSCALL_ERROR ((uint32_t)-1)
+
+#define CPUID_EDX_SEP (1 << 11)
+
+// Inlined at any -O, the kernel's ring 3 tests can only reach their own code
+#define SYSCALL_INLINE static inline __attribute__((always_inline))
+
+// The Pentium Pro reports SEP without having it
+static inline bool sysenter_supported() {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    uint32_t family = eax >> 8 & 0xF, model = eax >> 4 & 0xF, stepping = eax & 0xF;
+    return (edx & CPUID_EDX_SEP) && !(family == 6 && model < 3 && stepping < 3);
+}
+
+SYSCALL_INLINE uint32_t syscall_int80(uint32_t num, uint32_t a, uint32_t b, uint32_t c) {
+    uint32_t ret;
+    asm volatile("int $0x80"
+                 : "=a"(ret)
+                 : "a"(num), "b"(a), "S"(b), "D"(c)
+                 : "ecx", "edx", "memory");
+    return ret;
+}
+
+SYSCALL_INLINE uint32_t syscall_sysenter(uint32_t num, uint32_t a, uint32_t b, uint32_t c) {
+    uint32_t ret;
+    asm volatile(
+        "movl %%esp, %%ecx\n\t"
+        "movl $1f, %%edx\n\t"
+        "sysenter\n\t"
+        "1:"
+        : "=a"(ret)
+        : "a"(num), "b"(a), "S"(b), "D"(c)
+        : "ecx", "edx", "memory");
+    return ret;
+}
+
+#ifdef __is_kernel
+typedef struct {
+    uint32_t eax;  // number
+    uint32_t ebx;
+    uint32_t esi;
+    uint32_t edi;
+    uint32_t ebp;
+} SyscallFrame;
+
+void syscall_init();
+bool syscall_has_sysenter();
+// Where ring 3 enters the kernel, from the entry stubs in arch/i386/syscall.S
+void syscall_set_kernel_stack(uint32_t esp0);
+uint32_t syscall_dispatch(SyscallFrame* frame);
+
+#ifdef TEST
+void run_syscall_tests();
+#endif
+#endif
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef __TIME_PAGE__
+#define __TIME_PAGE__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Time without entering the kernel. The RTC interrupt stores the TSC, the
+ * monotonic time and the tick in one page that every process maps read-only
+ * and gets as the argument of _start(), readers add the TSC cycles since. The sequence is
+ * odd while the kernel writes and changes with every update, a reader that
+ * saw either retries. Everything above __is_kernel is shared with user
+ * programs, which only read the page.
+ */
+#define TIME_PAGE_SHIFT 24
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+
+typedef struct {
+    uint32_t sequence;
+    uint32_t tick;            // RTC ticks since boot
+    uint32_t rtc_freq;        // ticks per second
+    uint32_t tsc_mult;        // ns = cycles * tsc_mult >> TIME_PAGE_SHIFT
+    uint64_t tsc;             // when the kernel took ns
+    uint64_t ns;              // monotonic, since boot
+    uint64_t wall_offset_ns;  // Unix time in ns at monotonic 0
+} TimePage;
+
+typedef struct {
+    uint64_t seconds;
+    uint32_t nanoseconds;
+} TimeSpec;
+
+// Inlined at any -O, the kernel's ring 3 tests can only reach their own code
+#define TIME_PAGE_INLINE static inline __attribute__((always_inline))
+
+TIME_PAGE_INLINE void time_page_barrier() {
+    asm volatile("" ::: "memory");  // x86 keeps loads in order, the compiler has to as well
+}
+
+TIME_PAGE_INLINE uint32_t time_page_read_begin(const volatile TimePage* page) {
+    uint32_t sequence;
+    while ((sequence = page->sequence) & 1) asm volatile("pause");
+    time_page_barrier();
+    return sequence;
+}
+
+TIME_PAGE_INLINE bool time_page_read_retry(const volatile TimePage* page, uint32_t sequence) {
+    time_page_barrier();
+    return page->sequence != sequence;
+}
+
+TIME_PAGE_INLINE uint64_t time_page_rdtsc() {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+TIME_PAGE_INLINE uint64_t time_page_ns(const volatile TimePage* page, uint64_t* wall_offset_ns) {
+    uint32_t sequence;
+    uint64_t tsc, ns, offset;
+    uint32_t mult;
+    do {
+        sequence = time_page_read_begin(page);
+        tsc = page->tsc;
+        ns = page->ns;
+        mult = page->tsc_mult;
+        offset = page->wall_offset_ns;
+    } while (time_page_read_retry(page, sequence));
+    if (wall_offset_ns) *wall_offset_ns = offset;
+    return ns + ((time_page_rdtsc() - tsc) * mult >> TIME_PAGE_SHIFT);
+}
+
+TIME_PAGE_INLINE uint32_t time_page_tick(const volatile TimePage* page) {
+    return page->tick;  // one aligned load, no sequence needed
+}
+
+TIME_PAGE_INLINE bool time_page_clock_gettime(const volatile TimePage* page, int clock,
+                                              TimeSpec* time) {
+    uint64_t offset;
+    uint64_t ns = time_page_ns(page, &offset);
+    if (clock == CLOCK_REALTIME)
+        ns += offset;
+    else if (clock != CLOCK_MONOTONIC)
+        return false;
+    time->seconds = ns / 1000000000ULL;
+    time->nanoseconds = ns % 1000000000ULL;
+    return true;
+}
+
+#ifdef __is_kernel
+const TimePage* time_page();  // published on first use, which calibrates the TSC
+void time_page_update();      // from the RTC interrupt
+void time_page_set_wallclock(uint64_t unix_ns);
+
+#ifdef TEST
+void run_time_page_tests();
+#endif
+#endif
+
+#endif
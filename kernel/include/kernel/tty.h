@@ -6,6 +6,6 @@
 void terminal_initialize(void);
 void terminal_putchar(char c);
 void terminal_write(const char* data, size_t size);
-// void terminal_writestring(const char* data);
+void terminal_writestring(const char* data);
 
 #endif
@@ -0,0 +1,31 @@
+#ifndef __WALLCLOCK__
+#define __WALLCLOCK__
+
+#include <kernel/io/rtc.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Date and time without touching the CMOS. wallclock_init() reads the RTC
+ * once and arms its update-ended interrupt; the first one re-reads it right
+ * after the second turned over and pins that second to the current tick.
+ * From then on the time is that second plus the ticks since, both from the
+ * same RTC crystal.
+ */
+void wallclock_init();
+void wallclock_sync();          // re-reads the RTC at the next update-ended interrupt
+void wallclock_update_ended();  // from the RTC interrupt
+bool wallclock_synced();
+
+uint64_t wallclock_seconds();  // Unix time
+void wallclock_now(uint64_t* seconds, uint32_t* nanoseconds);
+struct DateTime wallclock_date_time();
+
+uint64_t date_time_to_unix(struct DateTime date_time);
+struct DateTime unix_to_date_time(uint64_t seconds);
+
+#ifdef TEST
+void run_wallclock_tests();
+#endif
+
+#endif
@@ -2,6 +2,8 @@
 #define __UTILS__
 
 #include <kernel/circular_buffer.h>
+#include <kernel/irqsoff.h>
+#include <kernel/log.h>
 #include <stdint.h>
 
 #include "utils.h"
@@ -11,9 +13,13 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
-#define LOG(x, ...) write_to_buffer(x, "INFO", __FILE__, __LINE__, ##__VA_ARGS__)
-#define LOG_GREEN(x, ...) \
-    write_to_buffer_colored(x, GREEN, "INFO", __FILE__, __LINE__, ##__VA_ARGS__)
+// INFO level in the file's LOG_SUBSYSTEM, see kernel/log.h
+#define LOG(x, ...) LOG_INFO(x, ##__VA_ARGS__)
+#define LOG_GREEN(x, ...)                                                                         \
+    do {                                                                                          \
+        if (LOG_ENABLED(LOG_LEVEL_INFO))                                                          \
+            write_to_buffer_colored(x, GREEN, LOG_LEVEL_INFO, __FILE__, __LINE__, ##__VA_ARGS__); \
+    } while (0)
 
 const char* to_str(char msg[100], int);
 // const char* int_to_hex_char(char msg[100], unsigned long long inp);
@@ -21,19 +27,69 @@ void reverse(char msg[100], int len);
 
 void outb(uint16_t port, uint8_t value);
 uint8_t inb(uint16_t port);
+void outw(uint16_t port, uint16_t value);
+uint16_t inw(uint16_t port);
 void outl(uint16_t port, uint32_t value);
 uint32_t inl(uint16_t port);
 
 void run_utils_tests();
 
+static inline __attribute__((always_inline)) uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx,
+                         uint32_t* edx) {
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
 void disable_interrupts();
 void enable_interrupts();
 
-#define INTERRUPT_GUARDED(code) \
-    do {                        \
-        disable_interrupts();   \
-        code;                   \
-        enable_interrupts();    \
+#define EFLAGS_IF (1 << 9)
+
+typedef uint32_t IrqFlags;
+
+// cli that remembers whether interrupts were on, so sections can nest
+static inline IrqFlags irq_save() {
+    IrqFlags flags;
+    asm volatile("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Turns interrupts back on only if the matching irq_save() found them on
+static inline void irq_restore(IrqFlags flags) {
+    if (flags & EFLAGS_IF) asm volatile("sti" ::: "memory");
+}
+
+#ifdef IRQSOFF_TRACE
+#define IRQSOFF_BEGIN(flags) uint64_t irqsoff_start_ = (flags) & EFLAGS_IF ? rdtsc() : 0
+#define IRQSOFF_END(flags) \
+    if ((flags) & EFLAGS_IF) irqsoff_record(rdtsc() - irqsoff_start_, __FILE__, __LINE__)
+#else
+#define IRQSOFF_BEGIN(flags)
+#define IRQSOFF_END(flags)
+#endif
+
+#define INTERRUPT_GUARDED(code)           \
+    do {                                  \
+        IrqFlags irq_flags_ = irq_save(); \
+        IRQSOFF_BEGIN(irq_flags_);        \
+        code;                             \
+        IRQSOFF_END(irq_flags_);          \
+        irq_restore(irq_flags_);          \
     } while (0)
 
 #endif
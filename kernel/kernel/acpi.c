@@ -0,0 +1,111 @@
+#define LOG_SUBSYSTEM acpi
+
+#include <kernel/acpi.h>
+#include <kernel/panic.h>
+#include <stddef.h>
+#include <string.h>
+#include <utils.h>
+
+#define EBDA_SEGMENT_PTR 0x40E
+#define EBDA_SCAN_LENGTH 1024
+#define BIOS_AREA_START 0xE0000
+#define BIOS_AREA_END 0x100000
+
+static const AcpiRsdp* rsdp = NULL;
+static const AcpiSdtHeader* root_table = NULL;  // XSDT when present, otherwise RSDT
+static bool root_is_xsdt = false;
+
+static bool checksum_ok(const void* data, uint32_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) sum += bytes[i];
+    return sum == 0;
+}
+
+// The RSDP sits on a 16 byte boundary in either the EBDA or the BIOS read-only area
+static const AcpiRsdp* scan_for_rsdp(uint32_t start, uint32_t end) {
+    for (uint32_t addr = start; addr + sizeof(AcpiRsdp) <= end; addr += 16) {
+        const AcpiRsdp* candidate = (const AcpiRsdp*)addr;
+        if (memcmp(candidate->signature, "RSD PTR ", 8) != 0) continue;
+        if (!checksum_ok(candidate, 20)) continue;  // the ACPI 1.0 part
+        if (candidate->revision >= 2 && !checksum_ok(candidate, candidate->length)) continue;
+        return candidate;
+    }
+    return NULL;
+}
+
+bool acpi_init() {
+    if (rsdp) return true;
+
+    uint32_t ebda = (uint32_t)(*(const uint16_t*)EBDA_SEGMENT_PTR) << 4;
+    const AcpiRsdp* found = ebda ? scan_for_rsdp(ebda, ebda + EBDA_SCAN_LENGTH) : NULL;
+    if (!found) found = scan_for_rsdp(BIOS_AREA_START, BIOS_AREA_END);
+    if (!found) {
+        LOG("ACPI: RSDP not found");
+        return false;
+    }
+
+    // Without paging only tables below 4G are reachable
+    if (found->revision >= 2 && found->xsdt_address && (found->xsdt_address >> 32) == 0) {
+        root_table = (const AcpiSdtHeader*)(uint32_t)found->xsdt_address;
+        root_is_xsdt = true;
+    } else {
+        root_table = (const AcpiSdtHeader*)found->rsdt_address;
+        root_is_xsdt = false;
+    }
+
+    if (!checksum_ok(root_table, root_table->length)) {
+        LOG("ACPI: bad %s checksum", root_is_xsdt ? "XSDT" : "RSDT");
+        root_table = NULL;
+        return false;
+    }
+
+    rsdp = found;
+    LOG_DEBUG("ACPI: revision %d, root table %s at %x", rsdp->revision,
+              root_is_xsdt ? "XSDT" : "RSDT", (uint32_t)root_table);
+    return true;
+}
+
+const AcpiSdtHeader* acpi_find_table(const char signature[4]) {
+    if (!root_table) return NULL;
+
+    const uint8_t* entries = (const uint8_t*)root_table + sizeof(AcpiSdtHeader);
+    uint32_t entry_size = root_is_xsdt ? 8 : 4;
+    uint32_t count = (root_table->length - sizeof(AcpiSdtHeader)) / entry_size;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t address;
+        if (root_is_xsdt) {
+            memcpy(&address, entries + i * 8, 8);  // entries are only 4 byte aligned
+        } else {
+            address = *(const uint32_t*)(entries + i * 4);
+        }
+        if (address >> 32) continue;
+
+        const AcpiSdtHeader* table = (const AcpiSdtHeader*)(uint32_t)address;
+        if (memcmp(table->signature, signature, 4) != 0) continue;
+        if (!checksum_ok(table, table->length)) {
+            LOG("ACPI: ignoring %c%c%c%c with bad checksum", signature[0], signature[1],
+                signature[2], signature[3]);
+            continue;
+        }
+        return table;
+    }
+    return NULL;
+}
+
+#ifdef TEST
+void test_find_fadt() {
+    // Every ACPI machine has a FADT, signature "FACP"
+    const AcpiSdtHeader* fadt = acpi_find_table("FACP");
+    assert(fadt != NULL, "test_find_fadt 1 FAILED");
+    assert(fadt->length >= sizeof(AcpiSdtHeader), "test_find_fadt 2 FAILED");
+    assert(acpi_find_table("NONE") == NULL, "test_find_fadt 3 FAILED");
+}
+
+void run_acpi_tests() {
+    assert(acpi_init(), "ACPI not available");
+    test_find_fadt();
+    LOG_GREEN("ACPI: [OK]");
+}
+#endif
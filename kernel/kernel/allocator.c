@@ -1,10 +1,16 @@
+#define LOG_SUBSYSTEM mem
+
 #include <kernel/allocator.h>
+#include <kernel/dma.h>
 #include <kernel/multiboot.h>
 #include <kernel/panic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <utils.h>
+#ifdef BENCHMARKS
+#include <kernel/bench.h>
+#endif
 
 struct FreeSegment* freeSegment = NULL;
 extern unsigned long KERNEL_START;
@@ -15,10 +21,20 @@ extern unsigned long KERNEL_END;
 static void insert_segment_into_free_list(struct FreeSegment*);
 static void merge_segments(struct FreeSegment*, struct FreeSegment*);
 
+// Past the kernel image, the boot modules and, if the block holds them, the frame and DMA pools
+static uintptr_t heap_start(multiboot_info_t* mbd, uintptr_t block_end) {
+    uintptr_t start = (uintptr_t)&KERNEL_END;
+    if (mbd->flags & MULTIBOOT_INFO_MODS) {
+        multiboot_module_t* modules = (multiboot_module_t*)mbd->mods_addr;
+        for (uint32_t i = 0; i < mbd->mods_count; i++)
+            if (modules[i].mod_end > start) start = modules[i].mod_end;
+    }
+    if (start < DMA_POOL_END && block_end > FRAME_POOL_BASE) start = DMA_POOL_END;
+    return (start + ALIGN - 1) & ~(uintptr_t)(ALIGN - 1);
+}
+
 void initialize_free_segments(multiboot_info_t* mbd) {
-#ifdef DEBUG
-    LOG("initialize_free_segments START");
-#endif
+    LOG_DEBUG("initialize_free_segments START");
 
     assert(sizeof(struct FreeSegment) == sizeof(struct AllocatedSegment),
            "FreeSegment and AllocatedSegment struct sizes are different!");
@@ -32,10 +48,8 @@ void initialize_free_segments(multiboot_info_t* mbd) {
         multiboot_memory_map_t* mmmt = (multiboot_memory_map_t*)(mbd->mmap_addr + i);
 
         if ((uintptr_t)mmmt->addr == (uintptr_t)&KERNEL_START) {
-#ifdef DEBUG
-            LOG("FOUND MATCHING: Size: %u : Addr: 0x%x : Len %lluK : Type %u", mmmt->size,
-                mmmt->addr, mmmt->len / 1024, mmmt->type);
-#endif
+            LOG_DEBUG("FOUND MATCHING: Size: %u : Addr: 0x%x : Len %lluK : Type %u", mmmt->size,
+                      mmmt->addr, mmmt->len / 1024, mmmt->type);
             entry.size = mmmt->size;
             entry.addr = mmmt->addr;
             entry.len = mmmt->len;
@@ -47,15 +61,14 @@ void initialize_free_segments(multiboot_info_t* mbd) {
 
     assert(found_big_block, "Could not find a big block of memory!");
 
-    uintptr_t reserved_mem_length = (uintptr_t)&KERNEL_END - (uintptr_t)&KERNEL_START;
+    uintptr_t start = heap_start(mbd, (uintptr_t)entry.addr + (uintptr_t)entry.len);
+    uintptr_t reserved_mem_length = start - (uintptr_t)&KERNEL_START;
     uint32_t big_block_size = entry.len - reserved_mem_length - sizeof(struct FreeSegment);
 
-    freeSegment = (struct FreeSegment*)(&KERNEL_END);
+    freeSegment = (struct FreeSegment*)start;
     freeSegment->size = big_block_size;
     freeSegment->next_segment = NULL;
-#ifdef DEBUG
-    LOG("Free memory: %d", freeSegment->size);
-#endif
+    LOG_DEBUG("Free memory: %d", freeSegment->size);
 }
 
 void* malloc(size_t size) {
@@ -204,3 +217,13 @@ void run_allocator_tests() {
     LOG_GREEN("Allocator: [OK]");
 }
 #endif
+
+#ifdef BENCHMARKS
+BENCH(malloc_free_64) {
+    free(malloc(64));
+}
+
+BENCH(malloc_free_4096) {
+    free(malloc(4096));
+}
+#endif
@@ -0,0 +1,150 @@
+#include <kernel/bench.h>
+#include <kernel/cmdline.h>
+#include <kernel/io/uart.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <utils.h>
+
+#define CPUID_EDX_SSE2 (1 << 26)
+#define CPUID_EXT_EDX_RDTSCP (1 << 27)
+
+extern const Bench __bench_start[];
+extern const Bench __bench_end[];
+
+static bool has_lfence = false;
+static bool has_rdtscp = false;
+static uint32_t samples[BENCH_SAMPLES];
+static uint64_t excluded = 0;
+
+/*
+ * rdtsc is not ordered against the code around it. The start read waits for
+ * earlier instructions with lfence (cpuid where there is no SSE2), the stop
+ * read uses rdtscp, which waits for the measured code, and an lfence keeps
+ * later instructions from starting before it.
+ */
+uint64_t bench_start() {
+    uint32_t lo, hi;
+    if (has_lfence) {
+        asm volatile("lfence\n\trdtsc" : "=a"(lo), "=d"(hi) : : "memory");
+    } else {
+        uint32_t eax, ebx, ecx, edx;
+        cpuid(0, &eax, &ebx, &ecx, &edx);
+        asm volatile("rdtsc" : "=a"(lo), "=d"(hi) : : "memory");
+    }
+    return ((uint64_t)hi << 32) | lo;
+}
+
+uint64_t bench_stop() {
+    uint32_t lo, hi;
+    if (has_rdtscp) {
+        asm volatile("rdtscp\n\tlfence" : "=a"(lo), "=d"(hi) : : "ecx", "memory");
+    } else if (has_lfence) {
+        asm volatile("lfence\n\trdtsc" : "=a"(lo), "=d"(hi) : : "memory");
+    } else {
+        uint32_t eax, ebx, ecx, edx;
+        cpuid(0, &eax, &ebx, &ecx, &edx);
+        asm volatile("rdtsc" : "=a"(lo), "=d"(hi) : : "memory");
+    }
+    return ((uint64_t)hi << 32) | lo;
+}
+
+void bench_exclude(uint64_t cycles) {
+    excluded += cycles;
+}
+
+static void detect_timer() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    has_lfence = edx & CPUID_EDX_SSE2;
+
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+        has_rdtscp = edx & CPUID_EXT_EDX_RDTSCP;
+    }
+}
+
+static void sort_samples(uint32_t* values, int count) {
+    for (int i = 1; i < count; i++) {
+        uint32_t value = values[i];
+        int j = i - 1;
+        for (; j >= 0 && values[j] > value; j--) values[j + 1] = values[j];
+        values[j + 1] = value;
+    }
+}
+
+// One JSON object per line
+static void emit(const char* fmt, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (len > (int)sizeof(line) - 1) len = sizeof(line) - 1;
+    serial_write_line(line, len);
+}
+
+static uint32_t timer_overhead() {
+    for (int i = 0; i < BENCH_SAMPLES; i++) {
+        uint64_t start = bench_start();
+        samples[i] = bench_stop() - start;
+    }
+    sort_samples(samples, BENCH_SAMPLES);
+    return samples[BENCH_SAMPLES / 2];
+}
+
+static void run_benchmark(const Bench* bench, uint32_t overhead) {
+    for (int i = 0; i < BENCH_WARMUP; i++) bench->func();
+
+    for (int i = 0; i < BENCH_SAMPLES; i++) {
+        excluded = 0;
+        uint64_t start = bench_start();
+        for (uint32_t j = 0; j < bench->batch; j++) bench->func();
+        uint64_t cycles = bench_stop() - start;
+        cycles = cycles > overhead + excluded ? cycles - overhead - excluded : 0;
+        samples[i] = cycles / (bench->batch * bench->ops);
+    }
+    sort_samples(samples, BENCH_SAMPLES);
+
+    uint64_t total = 0;
+    for (int i = 0; i < BENCH_SAMPLES; i++) total += samples[i];
+
+    emit("{\"bench\":\"%s\",\"unit\":\"cycles\",\"samples\":%d,\"batch\":%u,\"ops\":%u,"
+         "\"min\":%u,\"median\":%u,\"p99\":%u,\"max\":%u,\"mean\":%u}",
+         bench->name, BENCH_SAMPLES, bench->batch, bench->ops, samples[0],
+         samples[BENCH_SAMPLES / 2], samples[BENCH_SAMPLES * 99 / 100], samples[BENCH_SAMPLES - 1],
+         (uint32_t)(total / BENCH_SAMPLES));
+}
+
+/*
+ * Runs the registered benchmarks, or the ones named by bench=a,b on the
+ * command line, and prints one JSON line per result on COM1, framed by a
+ * header and a footer line so bench.sh can pick them out of the log. Cycles
+ * are per call, or per operation for BENCH_OPS(), with the timer overhead
+ * taken off. bench=list prints the names.
+ */
+void run_benchmarks() {
+    if (cmdline_has("bench") && cmdline_selects("bench", "list")) {
+        for (const Bench* bench = __bench_start; bench < __bench_end; bench++)
+            emit("list-bench: %s", bench->name);
+        return;
+    }
+
+    int count = 0;
+    for (const Bench* bench = __bench_start; bench < __bench_end; bench++)
+        if (cmdline_selects("bench", bench->name)) count++;
+    if (count < cmdline_count("bench")) {
+        LOG("Unknown benchmark in: %s", cmdline_get());
+        exit_(EXIT_CODE_UNKNOWN_NAME);
+    }
+
+    detect_timer();
+    uint32_t overhead = timer_overhead();
+
+    emit("{\"bench_run\":\"start\",\"benchmarks\":%d,\"timer_overhead\":%u,\"rdtscp\":%d}", count,
+         overhead, has_rdtscp);
+    for (const Bench* bench = __bench_start; bench < __bench_end; bench++)
+        if (cmdline_selects("bench", bench->name)) run_benchmark(bench, overhead);
+    emit("{\"bench_run\":\"end\"}");
+}
@@ -0,0 +1,80 @@
+#include <kernel/boot_trace.h>
+#include <kernel/monotonic_tick.h>
+#include <kernel/panic.h>
+#include <utils.h>
+
+struct BootPhase {
+    const char* name;
+    uint64_t end;
+};
+
+uint64_t boot_tsc_start;  // written by _start, before kernel_main
+
+static struct BootPhase phases[BOOT_TRACE_MAX_PHASES];
+static int num_phases = 0;
+
+// Cheap enough to leave in every build, a phase is milliseconds and this is one rdtsc
+void boot_trace(const char* phase) {
+    if (num_phases == BOOT_TRACE_MAX_PHASES) return;
+    phases[num_phases].name = phase;
+    phases[num_phases].end = rdtsc();
+    num_phases++;
+}
+
+/*
+ * One line per phase: start and duration in microseconds since _start, and a
+ * bar placed on a BOOT_TRACE_BAR_WIDTH column timeline of the whole boot.
+ * The TSC is calibrated here, after the last stamp, so it costs boot nothing.
+ */
+void boot_trace_report() {
+    if (num_phases == 0) return;
+
+    uint64_t hz = tsc_frequency();
+    uint64_t total = phases[num_phases - 1].end - boot_tsc_start;
+    if (total == 0) total = 1;
+
+    LOG("boot: _start at %u ms of TSC time (firmware and loader), TSC %u MHz",
+        (uint32_t)(boot_tsc_start / (hz / 1000)), (uint32_t)(hz / 1000000));
+    LOG("boot: %-12s %9s %9s", "phase", "start us", "took us");
+
+    uint64_t start = boot_tsc_start;
+    for (int i = 0; i < num_phases; i++) {
+        char bar[BOOT_TRACE_BAR_WIDTH + 1];
+        int from = (start - boot_tsc_start) * BOOT_TRACE_BAR_WIDTH / total;
+        int to = (phases[i].end - boot_tsc_start) * BOOT_TRACE_BAR_WIDTH / total;
+        if (to == from && to < BOOT_TRACE_BAR_WIDTH) to++;  // every phase gets a mark
+        for (int col = 0; col < BOOT_TRACE_BAR_WIDTH; col++)
+            bar[col] = col < from ? ' ' : col < to ? '#' : '\0';
+        bar[BOOT_TRACE_BAR_WIDTH] = '\0';
+
+        LOG("boot: %-12s %9u %9u |%s", phases[i].name, tsc_to_us(start - boot_tsc_start),
+            tsc_to_us(phases[i].end - start), bar);
+        start = phases[i].end;
+    }
+    LOG("boot: %u us from _start to %s", tsc_to_us(total), phases[num_phases - 1].name);
+}
+
+#ifdef TEST
+static void test_boot_trace_order() {
+    assert(boot_tsc_start != 0, "test_boot_trace_order: _start did not stamp the TSC");
+    assert(num_phases > 0, "test_boot_trace_order: no phases recorded");
+
+    uint64_t prev = boot_tsc_start;
+    for (int i = 0; i < num_phases; i++) {
+        assert(phases[i].end >= prev, "test_boot_trace_order: phase ends before it starts");
+        prev = phases[i].end;
+    }
+}
+
+static void test_tsc_frequency() {
+    uint64_t hz = tsc_frequency();
+    assert(hz > 10000000ULL, "test_tsc_frequency: TSC below 10 MHz");
+    assert(tsc_frequency() == hz, "test_tsc_frequency: calibrated twice");
+}
+
+void run_boot_trace_tests() {
+    test_boot_trace_order();
+    test_tsc_frequency();
+    LOG_GREEN("Boot trace: [OK]");
+}
+#endif
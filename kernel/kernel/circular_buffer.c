@@ -1,4 +1,5 @@
 #include <kernel/circular_buffer.h>
+#include <kernel/console.h>
 #include <kernel/io/rtc.h>
 #include <kernel/panic.h>
 #include <stdio.h>
@@ -6,6 +7,8 @@
 #include <utils.h>
 
 char BUFFER[NUM_LOG_LINES][LINE_SIZE];
+LogLevel LINE_LEVELS[NUM_LOG_LINES];
+int LINE_LENGTHS[NUM_LOG_LINES];
 int head = 0;
 int tail = 0;
 
@@ -17,7 +20,7 @@ static int build_prefix(char* out, const char* fmt, ...) {
     return size;
 }
 
-int write_to_buffer_colored(const char* fmt, const char* color, const char* level,
+int write_to_buffer_colored(const char* fmt, const char* color, LogLevel level,
                             const char* file_name, int line_number, ...) {
     if (tail == FULL_IDX - 1) {
         // empty buffer first
@@ -29,10 +32,11 @@ int write_to_buffer_colored(const char* fmt, const char* color, const char* leve
     char buf[100] = {0};
     va_list args;
     va_start(args, line_number);
-    int size = vsnprintf(buf, 100, fmt, args);
+    int size = min(vsnprintf(buf, 100, fmt, args), (int)sizeof(buf) - 1);
 
     char prefix[100] = {0};
-    int prefix_size = build_prefix(prefix, "%s [%s] %s:%d ", color, level, file_name, line_number);
+    int prefix_size = build_prefix(prefix, "%s [%s] %s:%d ", color, log_level_name(level),
+                                   file_name, line_number);
 
     int totalSize = size + prefix_size;
 
@@ -43,7 +47,9 @@ int write_to_buffer_colored(const char* fmt, const char* color, const char* leve
 
     memcpy(BUFFER[tail], prefix, prefix_size);
     memcpy(BUFFER[tail] + prefix_size, buf, size);
-    memcpy(BUFFER[tail++] + prefix_size + size, RESET, strlen(RESET));
+    memcpy(BUFFER[tail] + prefix_size + size, RESET, strlen(RESET));
+    LINE_LEVELS[tail] = level;
+    LINE_LENGTHS[tail++] = totalSize + strlen(RESET);
 
     va_end(args);
     return 0;
@@ -53,8 +59,7 @@ int write_to_buffer_colored(const char* fmt, const char* color, const char* leve
 // so it's not being used as a circular buffer currently
 //
 // When implementing manual flush, background thread or flush-on-panic, need to handle this
-int write_to_buffer(const char* fmt, const char* level, const char* file_name, int line_number,
-                    ...) {
+int write_to_buffer(const char* fmt, LogLevel level, const char* file_name, int line_number, ...) {
     if (tail == FULL_IDX - 1) {
         // empty buffer first
         // then write
@@ -65,10 +70,11 @@ int write_to_buffer(const char* fmt, const char* level, const char* file_name, i
     char buf[100] = {0};
     va_list args;
     va_start(args, line_number);
-    int size = vsnprintf(buf, 100, fmt, args);
+    int size = min(vsnprintf(buf, 100, fmt, args), (int)sizeof(buf) - 1);
 
     char prefix[100] = {0};
-    int prefix_size = build_prefix(prefix, "[%s] %s:%d ", level, file_name, line_number);
+    int prefix_size = build_prefix(prefix, "[%s] %s:%d ", log_level_name(level), file_name,
+                                   line_number);
 
     int totalSize = size + prefix_size;
 
@@ -78,7 +84,9 @@ int write_to_buffer(const char* fmt, const char* level, const char* file_name, i
     }
 
     memcpy(BUFFER[tail], prefix, prefix_size);
-    memcpy(BUFFER[tail++] + prefix_size, buf, size);
+    memcpy(BUFFER[tail] + prefix_size, buf, size);
+    LINE_LEVELS[tail] = level;
+    LINE_LENGTHS[tail++] = totalSize;
 
     va_end(args);
     return 0;
@@ -86,8 +94,8 @@ int write_to_buffer(const char* fmt, const char* level, const char* file_name, i
 
 void dump_buffer() {
     for (int i = 0; i < tail; i++) {
-        printf("%s\n", BUFFER[i]);
-        memset(BUFFER[i], 0, strlen(BUFFER[i]));
+        console_write(LINE_LEVELS[i], BUFFER[i], LINE_LENGTHS[i]);
+        console_write(LINE_LEVELS[i], "\n", 1);
     }
     tail = 0;
 }
@@ -0,0 +1,136 @@
+#include <kernel/cmdline.h>
+#include <kernel/panic.h>
+#include <string.h>
+#include <utils.h>
+
+static char cmdline[CMDLINE_MAX];
+
+// Copied out, the loader's copy lives in memory the allocator may hand out
+void cmdline_init(multiboot_info_t* mbd) {
+    cmdline[0] = '\0';
+    if (!(mbd->flags & MULTIBOOT_INFO_CMDLINE) || mbd->cmdline == 0) return;
+
+    const char* src = (const char*)mbd->cmdline;
+    size_t len = strlen(src);
+    if (len >= CMDLINE_MAX) len = CMDLINE_MAX - 1;
+    memcpy(cmdline, src, len);
+    cmdline[len] = '\0';
+    LOG("Command line: %s", cmdline);
+}
+
+const char* cmdline_get() {
+    return cmdline;
+}
+
+// Returns the value of the first key=value word in line, with its length, or NULL
+static const char* find_value(const char* line, const char* key, size_t* len) {
+    size_t key_len = strlen(key);
+    const char* word = line;
+    while (*word) {
+        while (*word == ' ') word++;
+        const char* end = word;
+        while (*end && *end != ' ') end++;
+
+        if ((size_t)(end - word) > key_len && strncmp(word, key, key_len) == 0 &&
+            word[key_len] == '=') {
+            *len = end - word - key_len - 1;
+            return word + key_len + 1;
+        }
+        word = end;
+    }
+    return NULL;
+}
+
+bool cmdline_has(const char* key) {
+    size_t len;
+    return find_value(cmdline, key, &len) != NULL;
+}
+
+static bool list_contains(const char* list, size_t len, const char* name) {
+    size_t name_len = strlen(name);
+    const char* item = list;
+    const char* end = list + len;
+    while (item < end) {
+        const char* comma = item;
+        while (comma < end && *comma != ',') comma++;
+        if ((size_t)(comma - item) == name_len && strncmp(item, name, name_len) == 0) return true;
+        item = comma + 1;
+    }
+    return false;
+}
+
+// True if key is missing (everything is selected) or name is in its comma separated list
+bool cmdline_selects(const char* key, const char* name) {
+    size_t len;
+    const char* list = find_value(cmdline, key, &len);
+    return list == NULL || list_contains(list, len, name);
+}
+
+// Number of names in key's list, 0 if key is missing
+int cmdline_count(const char* key) {
+    size_t len;
+    const char* list = find_value(cmdline, key, &len);
+    if (list == NULL || len == 0) return 0;
+
+    int count = 1;
+    for (size_t i = 0; i < len; i++)
+        if (list[i] == ',') count++;
+    return count;
+}
+
+// Value of key, not terminated, with its length in len. NULL if key is missing.
+const char* cmdline_value(const char* key, size_t* len) {
+    return find_value(cmdline, key, len);
+}
+
+// Decimal value of key, fallback if key is missing or not a number
+int cmdline_int(const char* key, int fallback) {
+    size_t len;
+    const char* value = find_value(cmdline, key, &len);
+    if (value == NULL || len == 0) return fallback;
+
+    int result = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (value[i] < '0' || value[i] > '9') return fallback;
+        result = result * 10 + (value[i] - '0');
+    }
+    return result;
+}
+
+#ifdef TEST
+void test_cmdline_parsing() {
+    char saved[CMDLINE_MAX];
+    memcpy(saved, cmdline, CMDLINE_MAX);
+
+    const char* line = "/boot/myos.kernel  test=pci,rtl8139 bench=memcpy_64 quiet";
+    memcpy(cmdline, line, strlen(line) + 1);
+    assert(cmdline_has("test") && cmdline_has("bench"), "test_cmdline_parsing 1 FAILED");
+    assert(!cmdline_has("quiet") && !cmdline_has("tes"), "test_cmdline_parsing 2 FAILED");
+    assert(cmdline_selects("test", "pci") && cmdline_selects("test", "rtl8139"),
+           "test_cmdline_parsing 3 FAILED");
+    assert(!cmdline_selects("test", "rtl") && !cmdline_selects("bench", "memcpy"),
+           "test_cmdline_parsing 4 FAILED");
+    assert(cmdline_selects("timeout", "anything"), "test_cmdline_parsing 5 FAILED");
+    assert(cmdline_count("test") == 2 && cmdline_count("bench") == 1 &&
+               cmdline_count("timeout") == 0,
+           "test_cmdline_parsing 6 FAILED");
+
+    line = "profile=997 test=pci";
+    memcpy(cmdline, line, strlen(line) + 1);
+    assert(cmdline_int("profile", 0) == 997 && cmdline_int("test", -1) == -1 &&
+               cmdline_int("bench", 5) == 5,
+           "test_cmdline_parsing 7 FAILED");
+
+    size_t len;
+    const char* value = cmdline_value("test", &len);
+    assert(value && len == 3 && strncmp(value, "pci", len) == 0 && !cmdline_value("x", &len),
+           "test_cmdline_parsing 8 FAILED");
+
+    memcpy(cmdline, saved, CMDLINE_MAX);
+}
+
+void run_cmdline_tests() {
+    test_cmdline_parsing();
+    LOG_GREEN("Cmdline: [OK]");
+}
+#endif
@@ -0,0 +1,330 @@
+#include <kernel/console.h>
+#include <kernel/panic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <utils.h>
+
+#define SINK_BUFFER_MASK (CONSOLE_SINK_BUFFER_SIZE - 1)
+#define MEMORY_RING_MASK (CONSOLE_MEMORY_RING_SIZE - 1)
+
+static ConsoleSink sinks[CONSOLE_MAX_SINKS];
+static int sink_count = 0;
+static char sink_buffers[CONSOLE_MAX_SINKS][CONSOLE_SINK_BUFFER_SIZE];
+
+static char memory_ring[CONSOLE_MEMORY_RING_SIZE];
+static uint32_t memory_ring_tail = 0;
+
+static const char* LEVEL_NAMES[LOG_LEVEL_COUNT] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR"};
+
+const char* log_level_name(LogLevel level) {
+    if (level >= LOG_LEVEL_COUNT) return "?";
+    return LEVEL_NAMES[level];
+}
+
+// Keeps the most recent CONSOLE_MEMORY_RING_SIZE bytes, oldest are overwritten
+static size_t memory_ring_write(const char* data, size_t len) {
+    size_t total = len;
+    if (len > CONSOLE_MEMORY_RING_SIZE) {
+        data += len - CONSOLE_MEMORY_RING_SIZE;
+        memory_ring_tail += len - CONSOLE_MEMORY_RING_SIZE;
+        len = CONSOLE_MEMORY_RING_SIZE;
+    }
+    while (len) {
+        uint32_t start = memory_ring_tail & MEMORY_RING_MASK;
+        size_t n = min(len, CONSOLE_MEMORY_RING_SIZE - start);
+        memcpy(memory_ring + start, data, n);
+        memory_ring_tail += n;
+        data += n;
+        len -= n;
+    }
+    return total;
+}
+
+size_t console_read_memory_ring(char* out, size_t size) {
+    size_t available = min(memory_ring_tail, CONSOLE_MEMORY_RING_SIZE);
+    size_t n = min(size, available);
+    uint32_t pos = memory_ring_tail - n;
+    for (size_t i = 0; i < n; i++) out[i] = memory_ring[(pos + i) & MEMORY_RING_MASK];
+    return n;
+}
+
+static inline uint32_t queued(const ConsoleSink* sink) {
+    return sink->tail - sink->head;
+}
+
+static inline bool accepts(const ConsoleSink* sink, LogLevel level) {
+    return level >= sink->min_level;
+}
+
+/*
+ * Pushes queued bytes until the queue is empty or the device stops taking
+ * them, with interrupts as the caller had them. One caller drains a sink at
+ * a time. A device irq that finds it busy leaves a retry for it, so the
+ * transmit empty interrupt is not lost. False if someone else was draining.
+ */
+static bool drain_sink(ConsoleSink* sink) {
+    bool claimed = false;
+    INTERRUPT_GUARDED({
+        claimed = !sink->draining;
+        sink->draining = true;
+        if (!claimed) sink->retry = true;
+    });
+    if (!claimed) return false;
+
+    bool again = true;
+    while (again) {
+        while (queued(sink)) {
+            uint32_t start = sink->head & SINK_BUFFER_MASK;
+            size_t contiguous = min(queued(sink), CONSOLE_SINK_BUFFER_SIZE - start);
+            size_t n = sink->write(sink->buffer + start, contiguous);
+            if (n == 0) break;
+            sink->head += n;
+        }
+        INTERRUPT_GUARDED({
+            again = sink->retry;
+            sink->retry = false;
+            sink->draining = again;
+        });
+    }
+    return true;
+}
+
+// Expects interrupts to be disabled. Copies what fits, returns how much that was.
+static size_t enqueue(ConsoleSink* sink, const char* data, size_t len) {
+    size_t total = 0;
+    while (len) {
+        uint32_t room = CONSOLE_SINK_BUFFER_SIZE - queued(sink);
+        if (room == 0) break;
+
+        uint32_t start = sink->tail & SINK_BUFFER_MASK;
+        size_t n = min(min(len, room), CONSOLE_SINK_BUFFER_SIZE - start);
+        memcpy(sink->buffer + start, data, n);
+        sink->tail += n;
+        data += n;
+        len -= n;
+        total += n;
+    }
+    return total;
+}
+
+// Sleeps until an interrupt, the device's makes room. False if interrupts are off.
+static bool wait_for_room(ConsoleSink* sink) {
+    IrqFlags flags = irq_save();
+    if (!(flags & EFLAGS_IF)) return false;
+    if (queued(sink) == CONSOLE_SINK_BUFFER_SIZE)
+        asm volatile("sti; hlt" ::: "memory");  // no interrupt slips in before the hlt
+    else
+        irq_restore(flags);
+    return true;
+}
+
+/*
+ * Only the copy into the queue runs with interrupts off. When it is full, a
+ * DRAIN_ASYNC caller waits for the device with interrupts on. One that has
+ * them off itself, like an irq handler, drops the rest as DRAIN_DROP does.
+ */
+static void write_queued(ConsoleSink* sink, const char* data, size_t len) {
+    while (len) {
+        size_t n = 0;
+        INTERRUPT_GUARDED(n = enqueue(sink, data, len));
+        data += n;
+        len -= n;
+        drain_sink(sink);
+        if (len == 0) return;
+
+        if (sink->policy == DRAIN_DROP || !wait_for_room(sink)) {
+            INTERRUPT_GUARDED(sink->dropped += len);
+            return;
+        }
+    }
+}
+
+static void write_sync(ConsoleSink* sink, const char* data, size_t len) {
+    while (len) {
+        size_t n = sink->write(data, len);
+        data += n;
+        len -= n;
+    }
+}
+
+static void write_sync_sinks(LogLevel level, const char* data, size_t len) {
+    for (int i = 0; i < sink_count; i++) {
+        ConsoleSink* sink = &sinks[i];
+        if (sink->policy == DRAIN_SYNC && accepts(sink, level)) write_sync(sink, data, len);
+    }
+}
+
+// A flush nested in the current drainer, from an irq or a fault, cannot wait for it
+static void drain_all_sinks(bool wait) {
+    for (int i = 0; i < sink_count; i++) {
+        ConsoleSink* sink = &sinks[i];
+        if (sink->policy == DRAIN_SYNC) continue;
+        while (drain_sink(sink) && wait && queued(sink)) {
+        }
+    }
+}
+
+void console_init() {
+    console_register_sink("mem", memory_ring_write, DRAIN_SYNC, LOG_LEVEL_TRACE);
+}
+
+ConsoleSink* console_register_sink(const char* name, ConsoleWriteFunc write, DrainPolicy policy,
+                                   LogLevel min_level) {
+    assert(sink_count < CONSOLE_MAX_SINKS, "Too many console sinks");
+    assert(write != NULL, "Console sink needs a write function");
+
+    ConsoleSink* sink = &sinks[sink_count];
+    sink->name = name;
+    sink->write = write;
+    sink->policy = policy;
+    sink->min_level = min_level;
+    sink->buffer = policy == DRAIN_SYNC ? NULL : sink_buffers[sink_count];
+    sink->head = 0;
+    sink->tail = 0;
+    sink->dropped = 0;
+    sink->draining = false;
+    sink->retry = false;
+    sink_count++;
+    return sink;
+}
+
+ConsoleSink* console_find_sink(const char* name) {
+    size_t len = strlen(name);
+    for (int i = 0; i < sink_count; i++) {
+        if (strlen(sinks[i].name) == len && memcmp(sinks[i].name, name, len) == 0)
+            return &sinks[i];
+    }
+    return NULL;
+}
+
+void console_set_sink_level(ConsoleSink* sink, LogLevel min_level) {
+    sink->min_level = min_level;
+}
+
+void console_write(LogLevel level, const char* data, size_t len) {
+    INTERRUPT_GUARDED(write_sync_sinks(level, data, len));
+    for (int i = 0; i < sink_count; i++) {
+        ConsoleSink* sink = &sinks[i];
+        if (sink->policy != DRAIN_SYNC && accepts(sink, level)) write_queued(sink, data, len);
+    }
+}
+
+static void level_sink(void* ctx, const char* data, size_t len) {
+    console_write(*(LogLevel*)ctx, data, len);
+}
+
+int console_vprintf(LogLevel level, const char* fmt, va_list args) {
+    return vcbprintf(level_sink, &level, fmt, args);
+}
+
+// Called from device irqs (e.g. uart transmit empty) to keep queues moving
+void console_drain() {
+    drain_all_sinks(false);
+}
+
+// Spins until every queued byte reached its device. Used before exit/panic.
+void console_flush() {
+    drain_all_sinks(true);
+}
+
+#ifdef TEST
+static char test_buffer[CONSOLE_SINK_BUFFER_SIZE];
+static char test_capture[32];
+static size_t test_captured = 0;
+static size_t test_device_budget = 0;
+
+// Takes at most 3 bytes per call and at most test_device_budget in total
+static size_t test_sink_write(const char* data, size_t len) {
+    size_t n = min(min(len, 3), test_device_budget);
+    memcpy(test_capture + test_captured, data, n);
+    test_captured += n;
+    test_device_budget -= n;
+    return n;
+}
+
+static void test_drain_partial_writes() {
+    ConsoleSink sink = {.name = "test",
+                        .write = test_sink_write,
+                        .policy = DRAIN_ASYNC,
+                        .min_level = LOG_LEVEL_INFO,
+                        .buffer = test_buffer};
+    test_captured = 0;
+    test_device_budget = 5;
+
+    enqueue(&sink, "hello world", 11);
+    drain_sink(&sink);
+    assert(test_captured == 5 && queued(&sink) == 6, "test_drain_partial_writes 1 FAILED");
+
+    test_device_budget = 100;
+    drain_sink(&sink);
+    assert(queued(&sink) == 0, "test_drain_partial_writes 2 FAILED");
+    assert(memcmp(test_capture, "hello world", 11) == 0, "test_drain_partial_writes 3 FAILED");
+}
+
+static void test_drop_on_full() {
+    ConsoleSink sink = {.name = "test",
+                        .write = test_sink_write,
+                        .policy = DRAIN_DROP,
+                        .min_level = LOG_LEVEL_INFO,
+                        .buffer = test_buffer};
+    char chunk[256];
+    memset(chunk, 'x', sizeof(chunk));
+    test_device_budget = 0;
+
+    for (int i = 0; i < CONSOLE_SINK_BUFFER_SIZE / (int)sizeof(chunk); i++)
+        write_queued(&sink, chunk, sizeof(chunk));
+    write_queued(&sink, chunk, 10);
+
+    assert(queued(&sink) == CONSOLE_SINK_BUFFER_SIZE, "test_drop_on_full 1 FAILED");
+    assert(sink.dropped == 10, "test_drop_on_full 2 FAILED");
+
+    // An overflowing DRAIN_ASYNC caller with interrupts off drops instead of spinning
+    sink.policy = DRAIN_ASYNC;
+    INTERRUPT_GUARDED(write_queued(&sink, chunk, 10));
+    assert(sink.dropped == 20, "test_drop_on_full 3 FAILED");
+}
+
+// A drain that finds the sink busy leaves the bytes to the drainer, which goes around again
+static void test_drain_claimed() {
+    ConsoleSink sink = {.name = "test",
+                        .write = test_sink_write,
+                        .policy = DRAIN_ASYNC,
+                        .min_level = LOG_LEVEL_INFO,
+                        .buffer = test_buffer};
+    test_captured = 0;
+    test_device_budget = 100;
+    INTERRUPT_GUARDED(enqueue(&sink, "abc", 3));
+
+    sink.draining = true;
+    assert(!drain_sink(&sink) && test_captured == 0, "test_drain_claimed 1 FAILED");
+    assert(sink.retry, "test_drain_claimed 2 FAILED");
+
+    sink.draining = false;
+    assert(drain_sink(&sink) && test_captured == 3, "test_drain_claimed 3 FAILED");
+    assert(!sink.draining && !sink.retry, "test_drain_claimed 4 FAILED");
+}
+
+static void test_level_filter() {
+    ConsoleSink sink = {.min_level = LOG_LEVEL_WARN};
+    assert(!accepts(&sink, LOG_LEVEL_INFO), "test_level_filter 1 FAILED");
+    assert(accepts(&sink, LOG_LEVEL_WARN), "test_level_filter 2 FAILED");
+    assert(accepts(&sink, LOG_LEVEL_ERROR), "test_level_filter 3 FAILED");
+}
+
+static void test_memory_ring() {
+    char out[8];
+    memory_ring_write("ring-ok", 7);
+    size_t n = console_read_memory_ring(out, 7);
+    assert(n == 7 && memcmp(out, "ring-ok", 7) == 0, "test_memory_ring FAILED");
+}
+
+void run_console_tests() {
+    test_drain_partial_writes();
+    test_drop_on_full();
+    test_drain_claimed();
+    test_level_filter();
+    test_memory_ring();
+    LOG_GREEN("Console: [OK]");
+}
+#endif
@@ -0,0 +1,165 @@
+#define LOG_SUBSYSTEM mem
+
+#include <kernel/dma.h>
+#include <kernel/panic.h>
+#include <string.h>
+#include <utils.h>
+#ifdef BENCHMARKS
+#include <kernel/bench.h>
+#endif
+
+#define BLOCKS (DMA_POOL_SIZE / DMA_BLOCK)
+#define NO_BLOCK BLOCKS
+
+// A bit per block, set while it belongs to a buffer
+static uint32_t used[BLOCKS / 32];
+static uint32_t free_blocks = BLOCKS;
+
+static uint32_t align_up(uint32_t value, uint32_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static bool block_used(uint32_t block) {
+    return used[block / 32] & (1u << (block % 32));
+}
+
+static void mark(uint32_t first, uint32_t count, bool in_use) {
+    for (uint32_t block = first; block < first + count; block++) {
+        if (in_use)
+            used[block / 32] |= 1u << (block % 32);
+        else
+            used[block / 32] &= ~(1u << (block % 32));
+    }
+}
+
+// The last used block in the run, so the search can go on past it
+static uint32_t last_used(uint32_t first, uint32_t count) {
+    for (uint32_t block = first + count; block > first; block--)
+        if (block_used(block - 1)) return block - 1;
+    return NO_BLOCK;
+}
+
+/*
+ * First fit: the lowest aligned start whose run is free and, if it would
+ * cross a boundary, the boundary itself instead. Starts only move forward,
+ * so the search ends after one pass over the pool.
+ */
+static uint32_t find_run(uint32_t size, uint32_t align, uint32_t boundary) {
+    uint32_t start = align_up(DMA_POOL_BASE, align);
+    while (start + size <= DMA_POOL_END) {
+        if (boundary && ((start ^ (start + size - 1)) & ~(boundary - 1))) {
+            start = align_up(start, boundary);
+            continue;
+        }
+        uint32_t first = (start - DMA_POOL_BASE) / DMA_BLOCK;
+        uint32_t block = last_used(first, align_up(size, DMA_BLOCK) / DMA_BLOCK);
+        if (block == NO_BLOCK) return start;
+        start = align_up(DMA_POOL_BASE + (block + 1) * DMA_BLOCK, align);
+    }
+    return 0;
+}
+
+bool dma_alloc(DmaBuffer* buffer, uint32_t size, uint32_t align, uint32_t boundary) {
+    buffer->virt = NULL;
+    buffer->phys = 0;
+    buffer->size = 0;
+    if (size == 0 || size > DMA_POOL_SIZE || (align & (align - 1)) ||
+        (boundary & (boundary - 1)) || (boundary && size > boundary))
+        return false;
+    if (align < DMA_BLOCK) align = DMA_BLOCK;
+
+    uint32_t blocks = align_up(size, DMA_BLOCK) / DMA_BLOCK;
+    uint32_t start = 0;
+    INTERRUPT_GUARDED({
+        start = find_run(size, align, boundary);
+        if (start) {
+            mark((start - DMA_POOL_BASE) / DMA_BLOCK, blocks, true);
+            free_blocks -= blocks;
+        }
+    });
+    if (!start) {
+        LOG_WARN("dma_alloc: no %u bytes aligned to %u within %u", size, align, boundary);
+        return false;
+    }
+
+    buffer->virt = (void*)start;  // identity mapped
+    buffer->phys = start;
+    buffer->size = size;
+    memset(buffer->virt, 0, size);
+    return true;
+}
+
+void dma_free(DmaBuffer* buffer) {
+    if (!buffer->virt) return;
+    assert(buffer->phys >= DMA_POOL_BASE && buffer->phys + buffer->size <= DMA_POOL_END,
+           "dma_free: not from the pool");
+    uint32_t blocks = align_up(buffer->size, DMA_BLOCK) / DMA_BLOCK;
+    INTERRUPT_GUARDED({
+        mark((buffer->phys - DMA_POOL_BASE) / DMA_BLOCK, blocks, false);
+        free_blocks += blocks;
+    });
+    buffer->virt = NULL;
+    buffer->phys = 0;
+    buffer->size = 0;
+}
+
+uint32_t dma_free_bytes() {
+    return free_blocks * DMA_BLOCK;
+}
+
+#ifdef TEST
+static bool crosses(const DmaBuffer* buffer, uint32_t boundary) {
+    return (buffer->phys ^ (buffer->phys + buffer->size - 1)) & ~(boundary - 1);
+}
+
+void test_dma_alignment() {
+    uint32_t free = dma_free_bytes();
+    DmaBuffer small, page;
+    assert(dma_alloc(&small, 100, 4, 0), "test_dma_alignment 1 FAILED");
+    assert(dma_alloc(&page, 100, 4096, 0), "test_dma_alignment 2 FAILED");
+    assert(small.phys % DMA_BLOCK == 0 && page.phys % 4096 == 0, "test_dma_alignment 3 FAILED");
+    assert((uint32_t)page.virt == page.phys && dma_phys(&page, page.virt) == page.phys,
+           "test_dma_alignment 4 FAILED");
+    assert(((uint8_t*)page.virt)[99] == 0, "test_dma_alignment 5 FAILED");
+    assert(free - dma_free_bytes() == 4 * DMA_BLOCK, "test_dma_alignment 6 FAILED");
+    dma_free(&small);
+    dma_free(&page);
+    assert(dma_free_bytes() == free && page.virt == NULL, "test_dma_alignment 7 FAILED");
+}
+
+// A filler ends 256 bytes short of a 64 KiB line, the next buffer would cross it
+void test_dma_boundary() {
+    DmaBuffer filler, buffer;
+    assert(dma_alloc(&filler, 0x10000 - 0x100, 0x10000, 0), "test_dma_boundary 1 FAILED");
+    assert(dma_alloc(&buffer, 0x200, 0x100, 0x10000), "test_dma_boundary 2 FAILED");
+    assert(!crosses(&buffer, 0x10000), "test_dma_boundary 3 FAILED");
+    assert(buffer.phys != filler.phys + filler.size, "test_dma_boundary 4 FAILED");
+    dma_free(&buffer);
+    dma_free(&filler);
+}
+
+void test_dma_invalid() {
+    DmaBuffer buffer;
+    assert(!dma_alloc(&buffer, 0, 4, 0), "test_dma_invalid 1 FAILED");
+    assert(!dma_alloc(&buffer, 64, 3, 0), "test_dma_invalid 2 FAILED");
+    assert(!dma_alloc(&buffer, 0x20000, 4, 0x10000), "test_dma_invalid 3 FAILED");
+    assert(!dma_alloc(&buffer, DMA_POOL_SIZE + 1, 4, 0), "test_dma_invalid 4 FAILED");
+    assert(buffer.virt == NULL, "test_dma_invalid 5 FAILED");
+}
+
+void run_dma_tests() {
+    test_dma_alignment();
+    test_dma_boundary();
+    test_dma_invalid();
+    LOG_GREEN("DMA: [OK]");
+}
+#endif
+
+#ifdef BENCHMARKS
+// A virtio ring's worth, page aligned
+BENCH(dma_alloc_free) {
+    DmaBuffer buffer;
+    dma_alloc(&buffer, 3 * 4096, 4096, 0);
+    dma_free(&buffer);
+}
+#endif
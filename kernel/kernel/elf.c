@@ -0,0 +1,143 @@
+#define LOG_SUBSYSTEM proc
+
+#include <kernel/elf.h>
+#include <kernel/panic.h>
+#include <string.h>
+#include <utils.h>
+
+static bool header_valid(const ElfHeader* header, size_t size) {
+    if (size < sizeof(ElfHeader) || header->magic != ELF_MAGIC) return false;
+    if (header->class != ELF_CLASS_32 || header->data != ELF_DATA_LSB) return false;
+    if (header->type != ELF_TYPE_EXEC || header->machine != ELF_MACHINE_386) return false;
+    if (header->phentsize != sizeof(ElfProgramHeader)) return false;
+    return header->phoff <= size && header->phnum <= (size - header->phoff) / header->phentsize;
+}
+
+static bool segment_valid(const ElfProgramHeader* segment, size_t size, uint32_t base,
+                          uint32_t end) {
+    if (segment->filesz > segment->memsz) return false;
+    if (segment->offset > size || segment->filesz > size - segment->offset) return false;
+    return segment->vaddr >= base && segment->vaddr <= end &&
+           segment->memsz <= end - segment->vaddr;
+}
+
+// Checks every segment first, so a bad image leaves the window alone
+bool elf_load(const void* image, size_t size, uint32_t base, uint32_t end, uint32_t* entry) {
+    const ElfHeader* header = image;
+    if (!header_valid(header, size)) {
+        LOG_WARN("ELF: not a static i386 executable");
+        return false;
+    }
+    uint32_t image_start = (uint32_t)image;
+    if (image_start < end && image_start + size > base) {
+        LOG_WARN("ELF: image at 0x%x overlaps the load window", image_start);
+        return false;
+    }
+
+    const ElfProgramHeader* segments = (const ElfProgramHeader*)(image_start + header->phoff);
+    bool entry_loaded = false;
+    for (uint16_t i = 0; i < header->phnum; i++) {
+        if (segments[i].type != ELF_PT_LOAD) continue;
+        if (!segment_valid(&segments[i], size, base, end)) {
+            LOG_WARN("ELF: segment %u at 0x%x is outside 0x%x - 0x%x", i, segments[i].vaddr, base,
+                     end);
+            return false;
+        }
+        if (header->entry >= segments[i].vaddr &&
+            header->entry < segments[i].vaddr + segments[i].memsz)
+            entry_loaded = true;
+    }
+    if (!entry_loaded) {
+        LOG_WARN("ELF: entry 0x%x is in no segment", header->entry);
+        return false;
+    }
+
+    for (uint16_t i = 0; i < header->phnum; i++) {
+        const ElfProgramHeader* segment = &segments[i];
+        if (segment->type != ELF_PT_LOAD) continue;
+        uint8_t* dest = (uint8_t*)segment->vaddr;
+        memcpy(dest, (const uint8_t*)image + segment->offset, segment->filesz);
+        memset(dest + segment->filesz, 0, segment->memsz - segment->filesz);
+        LOG_DEBUG("ELF: loaded 0x%x - 0x%x", segment->vaddr, segment->vaddr + segment->memsz);
+    }
+    *entry = header->entry;
+    return true;
+}
+
+#ifdef TEST
+// A header, one PT_LOAD segment and its bytes, loaded into window[]
+static struct {
+    ElfHeader header;
+    ElfProgramHeader segment;
+    uint8_t code[8];
+} __attribute__((packed)) test_image;
+static uint8_t window[64];
+
+static void make_test_image() {
+    memset(&test_image, 0, sizeof(test_image));
+    test_image.header.magic = ELF_MAGIC;
+    test_image.header.class = ELF_CLASS_32;
+    test_image.header.data = ELF_DATA_LSB;
+    test_image.header.version = 1;
+    test_image.header.type = ELF_TYPE_EXEC;
+    test_image.header.machine = ELF_MACHINE_386;
+    test_image.header.elf_version = 1;
+    test_image.header.entry = (uint32_t)window + 16;
+    test_image.header.phoff = sizeof(ElfHeader);
+    test_image.header.ehsize = sizeof(ElfHeader);
+    test_image.header.phentsize = sizeof(ElfProgramHeader);
+    test_image.header.phnum = 1;
+
+    test_image.segment.type = ELF_PT_LOAD;
+    test_image.segment.offset = sizeof(ElfHeader) + sizeof(ElfProgramHeader);
+    test_image.segment.vaddr = (uint32_t)window + 16;
+    test_image.segment.filesz = sizeof(test_image.code);
+    test_image.segment.memsz = 32;
+    memset(test_image.code, 0xC3, sizeof(test_image.code));
+}
+
+static bool load_test_image(uint32_t* entry) {
+    memset(window, 0xAA, sizeof(window));
+    return elf_load(&test_image, sizeof(test_image), (uint32_t)window,
+                    (uint32_t)window + sizeof(window), entry);
+}
+
+void test_elf_load() {
+    make_test_image();
+    uint32_t entry = 0;
+    assert(load_test_image(&entry) && entry == (uint32_t)window + 16, "test_elf_load 1 FAILED");
+    assert(window[15] == 0xAA && window[16] == 0xC3 && window[23] == 0xC3,
+           "test_elf_load 2 FAILED");
+    assert(window[24] == 0 && window[47] == 0 && window[48] == 0xAA, "test_elf_load 3 FAILED");
+}
+
+void test_elf_rejects() {
+    uint32_t entry = 0;
+    make_test_image();
+    test_image.header.magic = 0x7F454C46;
+    assert(!load_test_image(&entry), "test_elf_rejects 1 FAILED");
+
+    make_test_image();
+    test_image.header.machine = 62;  // x86-64
+    assert(!load_test_image(&entry), "test_elf_rejects 2 FAILED");
+
+    make_test_image();
+    test_image.segment.memsz = 64;  // runs past the window
+    assert(!load_test_image(&entry), "test_elf_rejects 3 FAILED");
+
+    make_test_image();
+    test_image.segment.filesz = 64;  // more than the file holds
+    assert(!load_test_image(&entry), "test_elf_rejects 4 FAILED");
+
+    make_test_image();
+    test_image.header.entry = (uint32_t)window;
+    assert(!load_test_image(&entry), "test_elf_rejects 5 FAILED");
+    assert(window[16] == 0xAA && entry == 0, "test_elf_rejects 6 FAILED");
+}
+
+void run_elf_tests() {
+    test_elf_load();
+    test_elf_rejects();
+    LOG_GREEN("ELF: [OK]");
+}
+#endif
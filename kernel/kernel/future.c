@@ -1,6 +1,6 @@
 #include <kernel/allocator.h>
 #include <kernel/future.h>
-#include <kernel/io/rtc.h>
+#include <kernel/idle.h>
 #include <kernel/monotonic_tick.h>
 #include <kernel/panic.h>
 #include <stdio.h>
@@ -8,7 +8,10 @@
 #include "utils.h"
 
 struct FutureList futureList;
-bool SHOULD_POLL = false;
+volatile bool SHOULD_POLL = false;
+
+static Task* task_head = NULL;
+static Task* task_tail = NULL;
 
 SleepContext* alloc_sleep_context() {
     SleepContext* ctx = (SleepContext*)malloc(sizeof(SleepContext));
@@ -17,13 +20,19 @@ SleepContext* alloc_sleep_context() {
 
 Future create_future(uint32_t seconds, IS_READY is_ready, RESUME_FUNC resume_func) {
     SleepContext* ctx = alloc_sleep_context();
-    ctx->target_tick = get_tick() + seconds * RTC_FREQ;
+    ctx->deadline_ns = monotonic_ns() + seconds * NS_PER_SECOND;
 
     Future fut = {.type = SleepFuture, .context = ctx, .is_ready = is_ready};
 
     return fut;
 }
 
+// Completes when is_ready(ctx) holds; the device irq that makes it ready calls wakeup_executor()
+Future create_io_future(IS_READY is_ready, void* ctx) {
+    Future fut = {.type = IOFuture, .context = ctx, .is_ready = is_ready};
+    return fut;
+}
+
 void init_futures() {
     futureList.lastIdx = -1;
 }
@@ -41,12 +50,15 @@ void await(Future fut) {
         });
     }
 
-    while (poll(fut) == PENDING) {
+    // Clear before polling, so a wakeup that races with the poll is not lost
+    while (1) {
         SHOULD_POLL = false;
+        run_tasks();
+        if (poll(fut) == DONE) break;
+        if (fut.type == SleepFuture)
+            monotonic_set_timeout(((SleepContext*)fut.context)->deadline_ns);
 
-        while (!SHOULD_POLL) {
-            asm volatile("hlt");
-        }
+        while (!SHOULD_POLL) idle_wait(&SHOULD_POLL);
     }
 
     delete_future(fut);
@@ -65,17 +77,67 @@ void delete_future(Future fut) {
     }
 }
 
+// One store, which also ends an mwait on the flag
 void wakeup_executor() {
     SHOULD_POLL = true;
 }
 
-void process_time_futures() {
-    // if current tick exists in our set, set flag to true
+void init_task(Task* task, TASK_FUNC run, void* context) {
+    task->run = run;
+    task->context = context;
+    task->queued = false;
+    task->next = NULL;
+}
+
+// Safe from irq handlers, a task already queued is not queued twice
+void schedule_task(Task* task) {
+    INTERRUPT_GUARDED({
+        if (!task->queued) {
+            task->queued = true;
+            task->next = NULL;
+            if (task_tail)
+                task_tail->next = task;
+            else
+                task_head = task;
+            task_tail = task;
+        }
+        SHOULD_POLL = true;
+    });
+}
+
+/*
+ * Runs every task queued so far once, with interrupts on. Tasks that ask to
+ * run again go to the back of the queue, so one busy task cannot starve the
+ * futures or the other tasks. Returns true if tasks are still queued.
+ */
+bool run_tasks() {
+    Task* batch;
+    INTERRUPT_GUARDED({
+        batch = task_head;
+        task_head = task_tail = NULL;
+    });
+
+    while (batch) {
+        Task* task = batch;
+        batch = task->next;
+        task->queued = false;  // an irq during run may queue it again
+        if (task->run(task->context)) schedule_task(task);
+    }
+    return task_head != NULL;
+}
+
+// Runs the queued tasks, or idles until an irq or a wakeup if there were none
+void executor_idle() {
     SHOULD_POLL = false;
+    if (!run_tasks()) idle_wait(&SHOULD_POLL);
+}
+
+// From the RTC tick and the monotonic timeout. A wakeup from an io irq is kept.
+void process_time_futures() {
     INTERRUPT_GUARDED({
         if (futureList.lastIdx != -1) {
             SleepContext* ctx = (SleepContext*)futureList.timeFutures[0].context;
-            if (get_tick() >= ctx->target_tick) SHOULD_POLL = true;
+            if (monotonic_ns() >= ctx->deadline_ns) SHOULD_POLL = true;
         }
     });
 }
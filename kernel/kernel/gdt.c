@@ -3,9 +3,12 @@
 #include <stdio.h>
 #include <utils.h>
 
-#define FLAGS 1100
+#define SEG_SIZE(x) ((x) << 0x0E)  // Size (0 for 16-bit, 1 for 32)
+#define SEG_GRAN(x) ((x) << 0x0F)  // Granularity (0 for 1B - 1MB, 1 for 4KB - 4GB)
+#define TSS_AVAILABLE 0x89         // Present, DPL 0, 32-bit TSS, byte granular
 
-uint64_t gdt[3] = {0};  // has to be global memory. This needs to stay alive.
+uint64_t gdt[GDT_ENTRIES] = {0};  // has to be global memory. This needs to stay alive.
+Tss tss = {0};
 
 static const uint64_t gdt_parse_base(uint64_t segment) {
     uint64_t ret = 0;
@@ -121,7 +124,7 @@ static uint64_t create_descriptor(uint32_t base, uint32_t limit, uint16_t flags)
     descriptor |= ((limit >> 16) & 0x0FULL) << 48;
 
     // Flags (high 4 bits of flags)
-    descriptor |= ((flags >> 8) & 0x0FULL) << 52;
+    descriptor |= ((flags >> 12) & 0x0FULL) << 52;
 
     // Highest 8 bits of base (bits 31:24)
     descriptor |= ((base >> 24) & 0xFFULL) << 56;
@@ -129,46 +132,45 @@ static uint64_t create_descriptor(uint32_t base, uint32_t limit, uint16_t flags)
     return descriptor;
 }
 
+// Flat 4 GiB segment, 32-bit and 4 KiB granular. Code is readable, data writable.
+static uint64_t flat_segment(uint8_t executable, uint8_t dpl) {
+    struct AccessByte access_byte;
+    set_p(&access_byte, 1);
+    set_dpl(&access_byte, dpl);
+    set_s(&access_byte, 1);
+    set_e(&access_byte, executable);
+    set_dc(&access_byte, 0);
+    set_rw(&access_byte, 1);
+    set_a(&access_byte, 0);
+
+    uint16_t flags = SEG_SIZE(1) | SEG_GRAN(1) | get_binary_from_access_byte(access_byte);
+    return create_descriptor(0, 0xFFFFF, flags);
+}
+
+/*
+ * SYSENTER derives every selector from the kernel code one: kernel data
+ * follows it, then user code and user data, so the order is fixed. The user
+ * segments only differ in DPL, without paging ring 3 sees all memory.
+ */
 static void fill_gdt_vals() {
-    struct AccessByte code_access_byte;
-    set_p(&code_access_byte, 1);
-    set_dpl(&code_access_byte, 0);
-    set_s(&code_access_byte, 1);
-    set_e(&code_access_byte, 1);
-    set_dc(&code_access_byte, 0);
-    set_rw(&code_access_byte, 0);
-    set_a(&code_access_byte, 1);
-
-    uint16_t flags = (0x1101 << 8) | get_binary_from_access_byte(code_access_byte);
-
-    const uint64_t code_segment = create_descriptor(0, 0xffffffff, flags);
-
-    struct AccessByte data_access_byte;
-    set_p(&data_access_byte, 1);
-    set_dpl(&data_access_byte, 0);
-    set_s(&data_access_byte, 1);
-    set_e(&data_access_byte, 0);
-    set_dc(&data_access_byte, 0);
-    set_rw(&data_access_byte, 1);
-    set_a(&data_access_byte, 1);
-
-    // LOG("data_access_byte: %d\n", get_binary_from_access_byte(data_access_byte));
-
-    flags = (0x1101 << 8) | get_binary_from_access_byte(data_access_byte);
-    const uint64_t data_segment = create_descriptor(0, 0xffffffff, flags);
-
-    const uint64_t null_segment = 0;
-
-    // TODO buggy
-    // gdt[0] = null_segment;
-    // gdt[1] = code_segment;
-    // gdt[2] = data_segment;
-    gdt[0] = 0x0000000000000000;
-    gdt[1] = 0x00CF9A000000FFFF;
-    gdt[2] = 0x00CF92000000FFFF;
-    assert(code_segment != 0, "code_Segment is zero!");
-    LOG("Loading null: 0x%llx - code: 0x%llx - data: 0x%llx", null_segment, code_segment,
-        data_segment);
+    gdt[0] = 0;
+    gdt[GDT_KERNEL_CODE / 8] = flat_segment(1, 0);
+    gdt[GDT_KERNEL_DATA / 8] = flat_segment(0, 0);
+    gdt[GDT_USER_CODE / 8] = flat_segment(1, 3);
+    gdt[GDT_USER_DATA / 8] = flat_segment(0, 3);
+
+    // No I/O permission bitmap past the limit, so ring 3 gets no ports
+    tss.ss0 = GDT_KERNEL_DATA;
+    tss.iomap_base = sizeof(tss);
+    gdt[GDT_TSS / 8] = create_descriptor((uint32_t)&tss, sizeof(tss) - 1, TSS_AVAILABLE);
+
+    assert(gdt[GDT_KERNEL_CODE / 8] == 0x00CF9A000000FFFF, "Unexpected kernel code segment");
+    LOG_DEBUG("Loading code: 0x%llx - data: 0x%llx - tss: 0x%llx", gdt[GDT_KERNEL_CODE / 8],
+              gdt[GDT_KERNEL_DATA / 8], gdt[GDT_TSS / 8]);
+}
+
+void tss_set_kernel_stack(uint32_t esp0) {
+    tss.esp0 = esp0;
 }
 
 void init_gdt() {
@@ -190,9 +192,11 @@ void init_gdt() {
         "mov %%eax, %%fs\n\t"
         "mov %%eax, %%gs\n\t"
         "mov %%eax, %%ss\n\t"
+        "mov %1, %%ax\n\t"
+        "ltr %%ax\n\t"
         :  // No output operands
-        : "r"(&gdtr)
-        : "memory");
+        : "r"(&gdtr), "i"(GDT_TSS)
+        : "eax", "memory");
 }
 
 void read_gdt() {
@@ -219,8 +223,6 @@ static void test_basic_parsing() {
 #define SEG_PRES(x) ((x) << 0x07)           // Present
 #define SEG_SAVL(x) ((x) << 0x0C)           // Available for system use
 #define SEG_LONG(x) ((x) << 0x0D)           // Long mode
-#define SEG_SIZE(x) ((x) << 0x0E)           // Size (0 for 16-bit, 1 for 32)
-#define SEG_GRAN(x) ((x) << 0x0F)           // Granularity (0 for 1B - 1MB, 1 for 4KB - 4GB)
 #define SEG_PRIV(x) (((x) & 0x03) << 0x05)  // Set privilege level (0 - 3)
 
 #define SEG_DATA_RD 0x00         // Read-Only
@@ -301,12 +303,31 @@ static void test_get_binary_from_access_byte() {
     assert(ret == 0x9A, "test_get_binary_from_access_byte FAILED");
 }
 
+// The table init_gdt() loaded, with the TSS in the task register
+static void test_loaded_gdt() {
+    GDTDescriptor gdtr;
+    asm volatile("sgdt %0" : "=m"(gdtr));
+    assert(gdtr.limit == GDT_ENTRIES * 8 - 1, "test_loaded_gdt 1 FAILED");
+
+    uint64_t* loaded = (uint64_t*)(uint32_t)gdtr.base;
+    assert(loaded[GDT_USER_CODE / 8] == 0x00CFFA000000FFFF, "test_loaded_gdt 2 FAILED");
+    assert(loaded[GDT_USER_DATA / 8] == 0x00CFF2000000FFFF, "test_loaded_gdt 3 FAILED");
+    assert(gdt_parse_base(loaded[GDT_TSS / 8]) == (uint32_t)&tss &&
+               gdt_parse_limit(loaded[GDT_TSS / 8]) == sizeof(tss) - 1,
+           "test_loaded_gdt 4 FAILED");
+
+    uint16_t task_register;
+    asm volatile("str %0" : "=r"(task_register));
+    assert(task_register == GDT_TSS, "test_loaded_gdt 5 FAILED");
+}
+
 void run_gdt_tests() {
     test_basic_parsing();
     test_create_descriptor();
     test_insert_base();
     test_insert_limit();
     test_get_binary_from_access_byte();
+    test_loaded_gdt();
     LOG("Global Descriptor Table: [OK]");
 }
 #endif
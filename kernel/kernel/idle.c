@@ -0,0 +1,158 @@
+#include <kernel/cmdline.h>
+#include <kernel/idle.h>
+#include <kernel/monotonic_tick.h>
+#include <kernel/panic.h>
+#include <stddef.h>
+#include <utils.h>
+#ifdef BENCHMARKS
+#include <kernel/bench.h>
+#endif
+
+#define CPUID_FEATURES 1
+#define CPUID_ECX_MONITOR (1 << 3)
+#define CPUID_MWAIT 5
+#define MWAIT_ECX_EXTENSIONS (1 << 0)  // the substate counts in edx are valid
+
+#define MWAIT_SUBSTATES(edx, cstate) (((edx) >> ((cstate) * 4)) & 0xF)
+#define MWAIT_HINT(cstate) (((cstate) - 1) << 4)  // substate 0 of Cn
+#define IDLE_MAX_CSTATE 7
+
+static bool use_mwait = false;
+static uint32_t cstate = 1;
+static uint32_t hint = MWAIT_HINT(1);
+static const volatile bool never_set = false;  // monitored for waits on interrupts alone
+
+static inline void monitor(const volatile void* address) {
+    asm volatile("monitor" : : "a"(address), "c"(0), "d"(0));
+}
+
+// sti holds interrupts off for one more instruction, so they cannot come in before the wait
+static inline void sti_mwait() {
+    asm volatile("sti; mwait" : : "a"(hint), "c"(0) : "memory");
+}
+
+static inline void sti_hlt() {
+    asm volatile("sti; hlt" ::: "memory");
+}
+
+// The deepest C-state up to the limit the CPU lists substates for, C1 is always there
+static uint32_t pick_cstate(uint32_t limit) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_MWAIT, &eax, &ebx, &ecx, &edx);
+    if (!(ecx & MWAIT_ECX_EXTENSIONS)) return 1;
+    for (uint32_t n = limit; n > 1; n--)
+        if (MWAIT_SUBSTATES(edx, n)) return n;
+    return 1;
+}
+
+void idle_init() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_leaf = eax;
+    cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+
+    if (cmdline_selects("idle", "hlt") || max_leaf < CPUID_MWAIT || !(ecx & CPUID_ECX_MONITOR)) {
+        use_mwait = false;
+        cstate = 1;
+        LOG("Idle: hlt");
+        return;
+    }
+
+    int limit = cmdline_int("idle_cstate", 1);
+    if (limit < 1 || limit > IDLE_MAX_CSTATE) {
+        LOG_WARN("Idle: idle_cstate=%d out of range, using C1", limit);
+        limit = 1;
+    }
+    cstate = pick_cstate(limit);
+    hint = MWAIT_HINT(cstate);
+    use_mwait = true;
+    LOG("Idle: mwait, C%d", cstate);
+}
+
+bool idle_uses_mwait() {
+    return use_mwait;
+}
+
+uint32_t idle_cstate() {
+    return cstate;
+}
+
+/*
+ * Arming the monitor before the last look at the flag closes the window
+ * where a store lands between that look and mwait: the store then ends
+ * mwait at once. With hlt the flag is only written by interrupts, which are
+ * off from the look until hlt.
+ */
+void idle_wait_sti(const volatile bool* wake) {
+    if (!wake) wake = &never_set;
+    if (use_mwait) {
+        monitor(wake);
+        if (!*wake) {
+            sti_mwait();
+            return;
+        }
+    } else if (!*wake) {
+        sti_hlt();
+        return;
+    }
+    enable_interrupts();
+}
+
+void idle_wait(const volatile bool* wake) {
+    disable_interrupts();
+    idle_wait_sti(wake);
+}
+
+#ifdef TEST
+static volatile bool test_wake = false;
+
+// A set flag does not wait at all, an unset one waits for the next RTC tick at most
+void test_idle_wait() {
+    test_wake = true;
+    uint32_t tick = get_tick();
+    idle_wait(&test_wake);
+    assert(get_tick() - tick <= 1, "test_idle_wait 1 FAILED");
+
+    test_wake = false;
+    tick = get_tick();
+    while (get_tick() == tick) idle_wait(&test_wake);
+    assert(get_tick() - tick == 1, "test_idle_wait 2 FAILED");
+    idle_wait(NULL);
+}
+
+// Both ways of idling work on this CPU, whatever the command line picked
+void test_idle_modes() {
+    bool saved = use_mwait;
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+
+    use_mwait = false;
+    test_idle_wait();
+    if (ecx & CPUID_ECX_MONITOR) {
+        use_mwait = true;
+        test_idle_wait();
+    }
+    use_mwait = saved;
+    assert(cstate >= 1 && cstate <= IDLE_MAX_CSTATE, "test_idle_modes FAILED");
+}
+
+void run_idle_tests() {
+    test_idle_wait();
+    test_idle_modes();
+    LOG_GREEN("Idle: [OK]");
+}
+#endif
+
+#ifdef BENCHMARKS
+#define WAKE_BENCH_DELAY_NS 50000
+
+/*
+ * Cycles from a timeout's deadline to the waiter running again: the HPET
+ * interrupt, leaving the C-state and returning through the wait. The
+ * 50 us of waiting are left out. Boot with idle=hlt to compare with hlt.
+ */
+BENCH(idle_wake) {
+    monotonic_wait_until(monotonic_ns() + WAKE_BENCH_DELAY_NS);
+    bench_exclude(WAKE_BENCH_DELAY_NS * tsc_frequency() / NS_PER_SECOND);
+}
+#endif
@@ -1,9 +1,16 @@
+#define LOG_SUBSYSTEM irq
+
+#include <kernel/gdt.h>
 #include <kernel/interrupts.h>
 #include <kernel/io/rtc.h>
 #include <kernel/io/uart.h>
+#include <kernel/lapic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <utils.h>
+#ifdef BENCHMARKS
+#include <kernel/bench.h>
+#endif
 
 #define PIC1 0x20 /* IO base address for master PIC */
 #define PIC2 0xA0 /* IO base address for slave PIC */
@@ -95,30 +102,39 @@ void generic_interrupt_handler(int num) {
     if (interruptList[num] != NULL)
         interruptList[num]();
     else
-        printf("unhandled Inside interrupt handler %d\n", num);
-    PIC_sendEOI(PIC_remove_offset(num));
+        LOG_RATELIMITED(LOG_LEVEL_WARN, "Unhandled interrupt %d", num);
+    // Spurious local APIC interrupts are not acknowledged at all
+    if (num < LAPIC_VECTOR_BASE)
+        PIC_sendEOI(PIC_remove_offset(num));
+    else if (num != LAPIC_SPURIOUS_VECTOR)
+        lapic_eoi();
 }
 
-uint8_t INTERRUPT_MEM[256][21] = {0};
+uint8_t INTERRUPT_MEM[256][INTERRUPT_STUB_SIZE] = {0};
 
 void generate_interrupt_stub(int num) {
     // 10220c:       55                      push   %ebp
     // 10220d:       89 e5                   mov    %esp,%ebp
     // 10220f:       60                      pusha
-    // 102210:       6a 79                   push   $0x79
-    // 102212:       e8 07 f4 ff ff          call   10161e <generic_interrupt_handler>
-    // 102217:       83 c4 04                add    $0x4,%esp
-    // 10221a:       61                      popa
-    // 10221b:       89 ec                   mov    %ebp,%esp
-    // 10221d:       5d                      pop    %ebp
-    // 10221e:       cf                      iret
-    // 10221f:       90                      nop
-
-    const int NUM_IDX = 5;
-    const int FUNCTION_ADDR_BASE = 7;
-
-    uint8_t TEMPLATE[21] = {0x55, 0x89, 0xe5, 0x60, 0x6a, 0x7a, 0xb8, 0x1e, 0x16, 0x10, 0x00,
-                            0xff, 0xd0, 0x83, 0xc4, 0x04, 0x61, 0x89, 0xec, 0x5d, 0xcf};
+    // 102210:       fc                      cld
+    // 102211:       6a 79                   push   $0x79
+    // 102213:       b8 1e 16 10 00          mov    $0x10161e,%eax
+    // 102218:       ff d0                   call   *%eax
+    // 10221a:       83 c4 04                add    $0x4,%esp
+    // 10221d:       61                      popa
+    // 10221e:       89 ec                   mov    %ebp,%esp
+    // 102220:       5d                      pop    %ebp
+    // 102221:       cf                      iret
+    //
+    // The cld matters: the interrupted code may be in the middle of a backward
+    // copy, and the handlers' string instructions expect DF clear.
+
+    const int NUM_IDX = 6;
+    const int FUNCTION_ADDR_BASE = 8;
+
+    uint8_t TEMPLATE[INTERRUPT_STUB_SIZE] = {0x55, 0x89, 0xe5, 0x60, 0xfc, 0x6a, 0x7a, 0xb8,
+                                             0x1e, 0x16, 0x10, 0x00, 0xff, 0xd0, 0x83, 0xc4,
+                                             0x04, 0x61, 0x89, 0xec, 0x5d, 0xcf};
     TEMPLATE[NUM_IDX] = num;
 
     uint32_t func_addr = (uint32_t)generic_interrupt_handler;
@@ -127,7 +143,7 @@ void generate_interrupt_stub(int num) {
     TEMPLATE[FUNCTION_ADDR_BASE + 2] = (func_addr >> 16) & 0xFF;
     TEMPLATE[FUNCTION_ADDR_BASE + 3] = (func_addr >> 24) & 0xFF;
 
-    for (int i = 0; i < 21; i++) {
+    for (int i = 0; i < INTERRUPT_STUB_SIZE; i++) {
         INTERRUPT_MEM[num][i] = TEMPLATE[i];
     }
 }
@@ -144,6 +160,7 @@ void generate_interrupt_stub(int num) {
         "   push %ebp\n\t"                                                \
         "   mov %esp, %ebp\n\t"                                           \
         "   pushal \n\t"                                                  \
+        "   cld\n\t"                                                      \
         "   push $" #num "\n\t"                                           \
         "   mov $generic_interrupt_handler, %eax \n\t"                    \
         "   call %eax\n\t"                           \
@@ -195,8 +212,34 @@ void init_idt() {
     read_idt();
 }
 
+static void set_gate(uint32_t interrupt_num, void (*entry)(), uint8_t gate, uint8_t dpl) {
+    GateDescriptorNewArgs arg;
+    arg.offset = (uint32_t)entry;
+    arg.segment_selector = GDT_KERNEL_CODE;
+    arg.gate = gate;
+    arg.dpl = dpl;
+    arg.p = 1;
+    interruptTable[interrupt_num] = GateDescriptor_create(arg);
+}
+
+/*
+ * Points a vector at an entry stub of its own instead of the generic one,
+ * which sends an EOI. DPL 3 lets ring 3 reach it with int.
+ */
+void set_trap_gate(uint32_t interrupt_num, void (*entry)(), uint8_t dpl) {
+    set_gate(interrupt_num, entry, 0b1111, dpl);
+}
+
+// Like set_trap_gate(), but the CPU turns interrupts off on the way in
+void set_interrupt_gate(uint32_t interrupt_num, void (*entry)()) {
+    set_gate(interrupt_num, entry, 0b1110, 0);
+}
+
 // Expects the caller to disable interrupts first
 void register_interrupt(uint32_t interrupt_num, InterruptFunc interrupt_func) {
+    interruptList[interrupt_num] = interrupt_func;
+    if (interrupt_num >= LAPIC_VECTOR_BASE) return;  // not behind the PICs
+
     bool pic_2_needed = false;
     uint8_t pic_1_bit = 0, pic_2_bit = 0;
 
@@ -214,8 +257,19 @@ void register_interrupt(uint32_t interrupt_num, InterruptFunc interrupt_func) {
         uint8_t pic2_mask = inb(PIC2_DATA);
         outb(PIC2_DATA, pic2_mask & ~(1 << pic_2_bit));
     }
+}
 
-    interruptList[interrupt_num] = interrupt_func;
+// Masks the line again, expects the caller to disable interrupts first. MSI sources have to be
+// stopped at the device.
+void unregister_interrupt(uint32_t interrupt_num) {
+    if (interrupt_num < PIC_2_OFFSET) {
+        uint8_t pic1_mask = inb(PIC1_DATA);
+        outb(PIC1_DATA, pic1_mask | (1 << (interrupt_num - PIC_1_OFFSET)));
+    } else if (interrupt_num < LAPIC_VECTOR_BASE) {
+        uint8_t pic2_mask = inb(PIC2_DATA);
+        outb(PIC2_DATA, pic2_mask | (1 << (interrupt_num - PIC_2_OFFSET)));
+    }
+    interruptList[interrupt_num] = NULL;
 }
 
 void read_idt() {
@@ -245,3 +299,16 @@ void run_idt_tests() {
     LOG_GREEN("Interrupt Descriptor Table: [OK]");
 }
 #endif
+
+#ifdef BENCHMARKS
+// IRQ 7 stays masked at the PIC, a software int through its vector costs the stub, dispatch and EOI
+#define BENCH_IRQ_VECTOR (PIC_1_OFFSET + 7)
+
+static void bench_irq_handler() {
+}
+
+BENCH(irq_dispatch) {
+    interruptList[BENCH_IRQ_VECTOR] = bench_irq_handler;
+    asm volatile("int %0" : : "i"(BENCH_IRQ_VECTOR) : "memory");
+}
+#endif
@@ -0,0 +1,314 @@
+#define LOG_SUBSYSTEM time
+
+#include <kernel/acpi.h>
+#include <kernel/io/hpet.h>
+#include <kernel/io/rtc.h>
+#include <kernel/lapic.h>
+#include <kernel/monotonic_tick.h>
+#include <kernel/panic.h>
+#include <stddef.h>
+#include <utils.h>
+
+// 64 bit registers, accessed as two 32 bit halves
+#define HPET_CAPABILITIES 0x000
+#define HPET_PERIOD 0x004  // high half of the capabilities, femtoseconds per counter tick
+#define HPET_CONFIG 0x010
+#define HPET_MAIN_COUNTER 0x0F0
+#define HPET_TIMER_CONFIG(n) (0x100 + 0x20 * (n))
+#define HPET_TIMER_COMPARATOR(n) (0x108 + 0x20 * (n))
+#define HPET_TIMER_FSB_DATA(n) (0x110 + 0x20 * (n))
+#define HPET_TIMER_FSB_ADDRESS(n) (0x114 + 0x20 * (n))
+
+#define HPET_CAP_NUM_TIMERS(caps) ((((caps) >> 8) & 0x1F) + 1)
+#define HPET_CAP_COUNTER_64 (1 << 13)
+#define HPET_ENABLE (1 << 0)
+#define HPET_LEGACY_ROUTE (1 << 1)
+
+#define TIMER_LEVEL_TRIGGERED (1 << 1)
+#define TIMER_INT_ENABLE (1 << 2)
+#define TIMER_PERIODIC (1 << 3)
+#define TIMER_32BIT_MODE (1 << 8)
+#define TIMER_FSB_ENABLE (1 << 14)
+#define TIMER_FSB_CAPABLE (1 << 15)
+
+#define FS_PER_SECOND 1000000000000000ULL
+#define HPET_MAX_PERIOD_FS 100000000  // 10 MHz, the slowest the spec allows
+#define HPET_MAX_DELTA 0x7FFFFFFFULL  // comparators run in 32 bit mode
+
+struct HpetTimer {
+    uint32_t index;  // of the comparator
+    bool claimed;
+    InterruptFunc handler;
+};
+
+static volatile uint32_t* hpet = NULL;
+static uint64_t frequency = 0;
+static uint32_t num_timers = 0;
+static bool counter_64 = false;
+static HpetTimer timers[HPET_EVENT_TIMERS];
+
+// A 32 bit counter widened, written with interrupts off
+static uint32_t counter_high = 0;
+static uint32_t last_counter_low = 0;
+
+static uint32_t hpet_read(uint32_t reg) {
+    return hpet[reg / 4];
+}
+
+static void hpet_write(uint32_t reg, uint32_t value) {
+    hpet[reg / 4] = value;
+}
+
+bool hpet_init() {
+    if (hpet) return true;
+
+    const AcpiHpet* table = (const AcpiHpet*)acpi_find_table("HPET");
+    if (!table) {
+        LOG("HPET: no ACPI table");
+        return false;
+    }
+    // Without paging only registers below 4G are reachable
+    if (table->address.address_space_id != ACPI_ADDRESS_SPACE_MEMORY ||
+        (table->address.address >> 32)) {
+        LOG("HPET: registers out of reach");
+        return false;
+    }
+
+    volatile uint32_t* registers = (volatile uint32_t*)(uint32_t)table->address.address;
+    uint32_t period = registers[HPET_PERIOD / 4];
+    if (period == 0 || period > HPET_MAX_PERIOD_FS) {
+        LOG("HPET: bad period of %u fs", period);
+        return false;
+    }
+
+    hpet = registers;
+    uint32_t capabilities = hpet_read(HPET_CAPABILITIES);
+    frequency = FS_PER_SECOND / period;
+    num_timers = HPET_CAP_NUM_TIMERS(capabilities);
+    counter_64 = capabilities & HPET_CAP_COUNTER_64;
+
+    // Comparators the firmware left armed stay quiet until claimed
+    for (uint32_t n = 0; n < num_timers; n++) {
+        uint32_t config = hpet_read(HPET_TIMER_CONFIG(n));
+        hpet_write(HPET_TIMER_CONFIG(n), config & ~(TIMER_INT_ENABLE | TIMER_FSB_ENABLE));
+    }
+    uint32_t config = hpet_read(HPET_CONFIG);
+    hpet_write(HPET_CONFIG, (config & ~HPET_LEGACY_ROUTE) | HPET_ENABLE);
+
+    LOG("HPET: %d comparators, %u Hz, %d bit counter", num_timers, (uint32_t)frequency,
+        counter_64 ? 64 : 32);
+    return true;
+}
+
+bool hpet_available() {
+    return hpet != NULL;
+}
+
+uint64_t hpet_frequency() {
+    return frequency;
+}
+
+uint64_t hpet_counter() {
+    if (counter_64) {
+        // The low half may carry into the high one between the two reads
+        uint32_t high, low;
+        do {
+            high = hpet_read(HPET_MAIN_COUNTER + 4);
+            low = hpet_read(HPET_MAIN_COUNTER);
+        } while (high != hpet_read(HPET_MAIN_COUNTER + 4));
+        return (uint64_t)high << 32 | low;
+    }
+
+    uint64_t counter;
+    INTERRUPT_GUARDED({
+        uint32_t low = hpet_read(HPET_MAIN_COUNTER);
+        if (low < last_counter_low) counter_high++;
+        last_counter_low = low;
+        counter = (uint64_t)counter_high << 32 | low;
+    });
+    return counter;
+}
+
+uint64_t hpet_counter_to_ns(uint64_t counter) {
+    return counter / frequency * NS_PER_SECOND + counter % frequency * NS_PER_SECOND / frequency;
+}
+
+uint64_t hpet_ns_to_counter(uint64_t ns) {
+    return ns / NS_PER_SECOND * frequency + ns % NS_PER_SECOND * frequency / NS_PER_SECOND;
+}
+
+/*
+ * A 32 bit comparator matches again every time the counter wraps, so it is
+ * disarmed once reached. One armed again while this interrupt was on its
+ * way is left alone, its handler only runs early.
+ */
+static void timer_interrupt(HpetTimer* timer) {
+    uint32_t config = HPET_TIMER_CONFIG(timer->index);
+    uint32_t comparator = hpet_read(HPET_TIMER_COMPARATOR(timer->index));
+    if ((int32_t)(hpet_read(HPET_MAIN_COUNTER) - comparator) >= 0)
+        hpet_write(config, hpet_read(config) & ~TIMER_INT_ENABLE);
+    timer->handler();
+}
+
+#define TIMER_INTERRUPT(slot)                \
+    static void timer_##slot##_interrupt() { \
+        timer_interrupt(&timers[slot]);      \
+    }
+TIMER_INTERRUPT(0)
+TIMER_INTERRUPT(1)
+TIMER_INTERRUPT(2)
+TIMER_INTERRUPT(3)
+
+static const InterruptFunc timer_interrupts[HPET_EVENT_TIMERS] = {
+    timer_0_interrupt, timer_1_interrupt, timer_2_interrupt, timer_3_interrupt};
+
+static bool comparator_claimed(uint32_t index) {
+    for (int slot = 0; slot < HPET_EVENT_TIMERS; slot++)
+        if (timers[slot].claimed && timers[slot].index == index) return true;
+    return false;
+}
+
+static int free_slot() {
+    for (int slot = 0; slot < HPET_EVENT_TIMERS; slot++)
+        if (!timers[slot].claimed) return slot;
+    return -1;
+}
+
+HpetTimer* hpet_timer_claim(InterruptFunc handler) {
+    if (!hpet || !lapic_init()) return NULL;
+
+    HpetTimer* timer = NULL;
+    INTERRUPT_GUARDED({
+        int slot = free_slot();
+        for (uint32_t n = 0; slot >= 0 && n < num_timers && !timer; n++) {
+            uint32_t config = hpet_read(HPET_TIMER_CONFIG(n));
+            if (!(config & TIMER_FSB_CAPABLE) || comparator_claimed(n)) continue;
+
+            timer = &timers[slot];
+            timer->index = n;
+            timer->handler = handler;
+            timer->claimed = true;
+
+            uint8_t vector = HPET_VECTOR_BASE + n;
+            register_interrupt(vector, timer_interrupts[slot]);
+            hpet_write(HPET_TIMER_FSB_DATA(n), lapic_msi_data(vector));
+            hpet_write(HPET_TIMER_FSB_ADDRESS(n), lapic_msi_address());
+            config &= ~(TIMER_LEVEL_TRIGGERED | TIMER_INT_ENABLE | TIMER_PERIODIC);
+            hpet_write(HPET_TIMER_CONFIG(n), config | TIMER_FSB_ENABLE | TIMER_32BIT_MODE);
+        }
+    });
+    if (timer)
+        LOG_DEBUG("HPET: comparator %d on vector %x", timer->index,
+                  HPET_VECTOR_BASE + timer->index);
+    return timer;
+}
+
+void hpet_timer_release(HpetTimer* timer) {
+    INTERRUPT_GUARDED({
+        uint32_t config = HPET_TIMER_CONFIG(timer->index);
+        hpet_write(config, hpet_read(config) & ~(TIMER_INT_ENABLE | TIMER_FSB_ENABLE));
+        unregister_interrupt(HPET_VECTOR_BASE + timer->index);
+        timer->claimed = false;
+    });
+}
+
+bool hpet_timer_arm(HpetTimer* timer, uint64_t deadline) {
+    bool armed = false;
+    INTERRUPT_GUARDED({
+        uint64_t now = hpet_counter();
+        if (deadline > now) {
+            uint32_t comparator = now + min(deadline - now, HPET_MAX_DELTA);
+            uint32_t config = HPET_TIMER_CONFIG(timer->index);
+            hpet_write(HPET_TIMER_COMPARATOR(timer->index), comparator);
+            hpet_write(config, hpet_read(config) | TIMER_INT_ENABLE);
+            // A comparator the counter passed before the write landed never matches
+            armed = (int32_t)(hpet_read(HPET_MAIN_COUNTER) - comparator) < 0;
+        }
+    });
+    return armed;
+}
+
+void hpet_timer_cancel(HpetTimer* timer) {
+    INTERRUPT_GUARDED({
+        uint32_t config = HPET_TIMER_CONFIG(timer->index);
+        hpet_write(config, hpet_read(config) & ~TIMER_INT_ENABLE);
+    });
+}
+
+#ifdef TEST
+static volatile uint32_t fired = 0;
+static volatile uint64_t fired_at = 0;
+
+static void count_interrupt() {
+    fired_at = hpet_counter();
+    fired++;
+}
+
+static void wait_for_interrupt(uint32_t count, uint32_t timeout_ticks) {
+    uint32_t start = get_tick();
+    while (fired < count && get_tick() - start < timeout_ticks) asm volatile("hlt");
+}
+
+void test_hpet_counter() {
+    assert(hpet_frequency() >= FS_PER_SECOND / HPET_MAX_PERIOD_FS, "test_hpet_counter 1 FAILED");
+    uint64_t first = hpet_counter();
+    assert(hpet_counter() > first, "test_hpet_counter 2 FAILED");
+
+    // 32 RTC ticks are 1/8 s, the two clocks agree to a few percent
+    uint32_t tick = get_tick();
+    while (get_tick() == tick) asm volatile("pause");
+    tick = get_tick();
+    uint64_t start = hpet_counter();
+    while (get_tick() - tick < RTC_FREQ / 8) asm volatile("pause");
+    uint64_t elapsed = hpet_counter() - start;
+    uint64_t expected = hpet_frequency() / 8;
+    assert(elapsed > expected - expected / 20 && elapsed < expected + expected / 20,
+           "test_hpet_counter 3 FAILED");
+}
+
+void test_hpet_conversions() {
+    uint64_t hz = hpet_frequency();
+    assert(hpet_counter_to_ns(hz) == NS_PER_SECOND, "test_hpet_conversions 1 FAILED");
+    assert(hpet_ns_to_counter(NS_PER_SECOND) == hz, "test_hpet_conversions 2 FAILED");
+    uint64_t hour = 3600 * hz + 12345;
+    assert(hpet_ns_to_counter(hpet_counter_to_ns(hour)) + 1 >= hour &&
+               hpet_ns_to_counter(hpet_counter_to_ns(hour)) <= hour,
+           "test_hpet_conversions 3 FAILED");
+}
+
+void test_hpet_one_shot() {
+    HpetTimer* timer = hpet_timer_claim(count_interrupt);
+    assert(timer != NULL, "test_hpet_one_shot: no FSB capable comparator");
+
+    // Fires once, not before its deadline and well before the next RTC tick would
+    fired = 0;
+    uint64_t deadline = hpet_counter() + hpet_ns_to_counter(2000000);
+    assert(hpet_timer_arm(timer, deadline), "test_hpet_one_shot 1 FAILED");
+    wait_for_interrupt(1, RTC_FREQ);
+    assert(fired == 1 && fired_at >= deadline, "test_hpet_one_shot 2 FAILED");
+    assert(fired_at - deadline < hpet_ns_to_counter(NS_PER_SECOND / RTC_FREQ),
+           "test_hpet_one_shot 3 FAILED");
+
+    // A deadline in the past is refused, a cancelled one never fires
+    assert(!hpet_timer_arm(timer, hpet_counter() - 1), "test_hpet_one_shot 4 FAILED");
+    assert(hpet_timer_arm(timer, hpet_counter() + hpet_ns_to_counter(5000000)),
+           "test_hpet_one_shot 5 FAILED");
+    hpet_timer_cancel(timer);
+    wait_for_interrupt(2, RTC_FREQ / 16);
+    assert(fired == 1, "test_hpet_one_shot 6 FAILED");
+
+    // Each claim gets its own comparator
+    HpetTimer* other = hpet_timer_claim(count_interrupt);
+    assert(other == NULL || other != timer, "test_hpet_one_shot 7 FAILED");
+    if (other) hpet_timer_release(other);
+    hpet_timer_release(timer);
+}
+
+void run_hpet_tests() {
+    assert(hpet_init(), "HPET not available");
+    test_hpet_counter();
+    test_hpet_conversions();
+    test_hpet_one_shot();
+    LOG_GREEN("HPET: [OK]");
+}
+#endif
@@ -0,0 +1,32 @@
+#include <kernel/io/pit.h>
+#include <utils.h>
+
+#define PIT_CHANNEL_0 0x40
+#define PIT_COMMAND 0x43
+
+#define PIT_SELECT_CHANNEL_0 (0 << 6)
+#define PIT_ACCESS_LOHI (3 << 4)
+#define PIT_MODE_RATE_GENERATOR (2 << 1)
+
+/*
+ * Programs channel 0 to fire handler hz times a second. The divisor is 16
+ * bits, so the rate is rounded to what the 1.193182 MHz clock can divide to;
+ * returns that actual rate.
+ */
+uint32_t pit_start_periodic(uint32_t hz, InterruptFunc handler) {
+    uint32_t divisor = PIT_FREQUENCY / hz;
+    if (divisor < 1) divisor = 1;
+    if (divisor > 0xFFFF) divisor = 0xFFFF;
+
+    INTERRUPT_GUARDED({
+        outb(PIT_COMMAND, PIT_SELECT_CHANNEL_0 | PIT_ACCESS_LOHI | PIT_MODE_RATE_GENERATOR);
+        outb(PIT_CHANNEL_0, divisor & 0xFF);
+        outb(PIT_CHANNEL_0, divisor >> 8);
+        register_interrupt(PIT_IRQ_VECTOR, handler);
+    });
+    return PIT_FREQUENCY / divisor;
+}
+
+void pit_stop() {
+    INTERRUPT_GUARDED({ unregister_interrupt(PIT_IRQ_VECTOR); });
+}
@@ -1,6 +1,9 @@
+#define LOG_SUBSYSTEM time
+
 #include <kernel/interrupts.h>
 #include <kernel/io/rtc.h>
 #include <kernel/monotonic_tick.h>
+#include <kernel/wallclock.h>
 #include <stdio.h>
 #include <utils.h>
 #ifdef TEST
@@ -19,14 +22,21 @@ static void select_cmos_register(uint8_t register_num) {
     outb(CMOS_CONTROL_REG, register_num);
 }
 
+// The RTC interrupt selects registers too, so select and access go together
 static uint8_t read_cmos_register(uint8_t register_num) {
-    select_cmos_register(register_num);
-    return inb(CMOS_DATA_REG);
+    uint8_t value;
+    INTERRUPT_GUARDED({
+        select_cmos_register(register_num);
+        value = inb(CMOS_DATA_REG);
+    });
+    return value;
 }
 
 static void write_cmos_register(uint8_t register_num, uint8_t val) {
-    select_cmos_register(register_num);
-    outb(CMOS_DATA_REG, val);
+    INTERRUPT_GUARDED({
+        select_cmos_register(register_num);
+        outb(CMOS_DATA_REG, val);
+    });
 }
 
 static int is_update_in_progress() {
@@ -108,12 +118,11 @@ static int get_timestamp_wrapper(char* buffer, int size, const char* fmt, ...) {
     return size;
 }
 
-// [2025-05-30T07:30:28+0530]
+// [2025-05-30T07:30:28], from the wallclock, no CMOS access
 int get_timestamp(char* buffer) {
-    struct DateTime d = get_date_time();
-    va_list args;
-    return get_timestamp_wrapper(buffer, 100, "[%d%d-%d-%dT%d:%d:%d]  ", d.century, d.year, d.month,
-                                 d.hours, d.minutes, d.seconds);
+    struct DateTime d = wallclock_date_time();
+    return get_timestamp_wrapper(buffer, 100, "[%d%02d-%02d-%02dT%02d:%02d:%02d]  ", d.century,
+                                 d.year, d.month, d.day_of_month, d.hours, d.minutes, d.seconds);
 }
 
 static void configure_rtc_interrupts() {
@@ -127,8 +136,17 @@ static void configure_rtc_interrupts() {
 
 void process_rtc_interrupt() {
     process_tick();
-    outb(CMOS_CONTROL_REG, 0x0C);
-    inb(CMOS_DATA_REG);
+    // Reading C acknowledges the interrupt
+    if (read_cmos_register(STATUS_REG_C) & RTC_UPDATE_ENDED) wallclock_update_ended();
+}
+
+// One interrupt a second, right after the RTC updated its time registers
+void rtc_update_interrupt(bool enable) {
+    INTERRUPT_GUARDED({
+        uint8_t flags = read_cmos_register(STATUS_REG_B);
+        flags = enable ? flags | RTC_UPDATE_ENDED : flags & ~RTC_UPDATE_ENDED;
+        write_cmos_register(STATUS_REG_B, flags);
+    });
 }
 
 void register_rtc_driver() {
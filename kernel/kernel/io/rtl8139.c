@@ -0,0 +1,489 @@
+#define LOG_SUBSYSTEM nic
+
+#include <kernel/dma.h>
+#include <kernel/interrupts.h>
+#include <kernel/io/rtl8139.h>
+#include <kernel/net/napi.h>
+#include <kernel/net/pbuf.h>
+#include <kernel/panic.h>
+#include <kernel/pci.h>
+#include <stddef.h>
+#include <string.h>
+#include <utils.h>
+#ifdef TEST
+#include <kernel/io/rtc.h>
+#include <kernel/monotonic_tick.h>
+#endif
+
+// Registers, offsets from the io base
+#define REG_IDR0 0x00
+#define REG_TSD0 0x10   // transmit status of descriptor 0, 4 bytes apart
+#define REG_TSAD0 0x20  // transmit start address of descriptor 0, 4 bytes apart
+#define REG_RBSTART 0x30
+#define REG_CR 0x37
+#define REG_CAPR 0x38
+#define REG_IMR 0x3C
+#define REG_ISR 0x3E
+#define REG_TCR 0x40
+#define REG_RCR 0x44
+#define REG_CONFIG1 0x52
+
+#define CR_BUFE 0x01  // rx buffer empty
+#define CR_TE 0x04
+#define CR_RE 0x08
+#define CR_RST 0x10
+
+#define INT_ROK 0x0001
+#define INT_RER 0x0002
+#define INT_TOK 0x0004
+#define INT_TER 0x0008
+#define INT_RXOVW 0x0010
+#define INT_FOVW 0x0040
+#define INT_RX (INT_ROK | INT_RER | INT_RXOVW | INT_FOVW)
+#define INT_MASK (INT_RX | INT_TOK | INT_TER)
+
+#define RCR_APM 0x02  // physical match
+#define RCR_AM 0x04   // multicast
+#define RCR_AB 0x08   // broadcast
+#define RCR_WRAP 0x80
+#define RCR_MXDMA_UNLIMITED (0x7 << 8)
+#define RCR_RXFTH_NONE (0x7 << 13)
+
+#define TCR_IFG_NORMAL (0x3 << 24)
+#define TCR_MXDMA_2048 (0x7 << 8)
+
+#define TSD_OWN (1 << 13)  // set by the chip once the frame left the tx buffer
+#define TSD_TUN (1 << 14)
+#define TSD_TOK (1 << 15)
+#define TSD_TABT (1 << 30)
+
+#define RX_STATUS_ROK 0x0001
+
+#define PCI_COMMAND_REG 0x01
+#define PCI_COMMAND_IO 0x1
+#define PCI_COMMAND_BUS_MASTER 0x4
+
+#define RX_CRC_LEN 4
+#define RX_HEADER_LEN 4
+
+/*
+ * With WRAP set the chip does not split a frame at the end of the ring, it
+ * keeps writing past it, so the buffer carries one maximum frame of slack.
+ */
+#define RX_BUFFER_SIZE (RTL8139_RX_RING_SIZE + 16 + 1500)
+
+/*
+ * Frames are handed up by reference into the ring, so CAPR can only move past
+ * a frame once the stack released it. Past the copy threshold new frames are
+ * copied into pool pbufs instead, so a slow consumer cannot stall the ring.
+ */
+#define RX_MAX_OUTSTANDING 16  // power of two
+#define RX_COPY_THRESHOLD (RX_MAX_OUTSTANDING / 2)
+
+struct RxFrame {
+    uint32_t next_offset;  // ring offset right after this frame
+    bool released;
+};
+
+struct Rtl8139 {
+    uint16_t io_base;
+    uint8_t irq;
+    uint8_t mac[6];
+    uint32_t rx_offset;  // next header to read in the rx ring
+    uint32_t rx_head;    // oldest frame not yet given back to the chip
+    uint32_t rx_tail;    // next frame sequence number
+    bool rx_stalled;
+    uint32_t tx_next;    // next descriptor to hand out
+    uint32_t tx_dirty;   // oldest descriptor still owned by the chip
+    volatile uint32_t tx_in_flight;
+    Rtl8139RxFunc rx_handler;
+    Rtl8139Stats stats;
+    Napi napi;
+};
+
+static struct Rtl8139 nic;
+static bool initialized = false;
+
+static DmaBuffer rx_buffer;   // RX_BUFFER_SIZE
+static DmaBuffer tx_buffers;  // RTL8139_TX_SLOTS of RTL8139_MAX_FRAME
+static Pbuf* tx_pbufs[RTL8139_TX_SLOTS];  // in flight without a copy, freed on completion
+static struct RxFrame rx_frames[RX_MAX_OUTSTANDING];
+
+// Frames still referenced when the ring is reset point at stale data, their release is ignored
+static void reset_rx() {
+    outb(nic.io_base + REG_CR, CR_TE);
+    nic.rx_offset = 0;
+    nic.rx_head = nic.rx_tail;
+    outl(nic.io_base + REG_RBSTART, rx_buffer.phys);
+    outb(nic.io_base + REG_CR, CR_RE | CR_TE);
+}
+
+static uint8_t* tx_buffer(uint32_t slot) {
+    return (uint8_t*)tx_buffers.virt + slot * RTL8139_MAX_FRAME;
+}
+
+// Gives the chip back every leading frame the stack is done with
+static void advance_capr() {
+    uint32_t capr = 0;
+    bool moved = false;
+    while (nic.rx_head != nic.rx_tail && rx_frames[nic.rx_head % RX_MAX_OUTSTANDING].released) {
+        capr = rx_frames[nic.rx_head % RX_MAX_OUTSTANDING].next_offset;
+        nic.rx_head++;
+        moved = true;
+    }
+    // CAPR lags the real read pointer by 16, a documented quirk of the chip
+    if (moved) outw(nic.io_base + REG_CAPR, (uint16_t)(capr - 16));
+}
+
+// Runs from pbuf_free, with interrupts off
+static void release_rx_frame(void* ctx) {
+    uint32_t seq = (uint32_t)ctx;
+    if (seq - nic.rx_head >= nic.rx_tail - nic.rx_head) return;  // from before a ring reset
+
+    rx_frames[seq % RX_MAX_OUTSTANDING].released = true;
+    advance_capr();
+    if (nic.rx_stalled) napi_schedule(&nic.napi);
+}
+
+static Pbuf* wrap_rx_frame(uint8_t* frame, uint16_t len, uint32_t seq) {
+    Pbuf* p = NULL;
+    if (nic.rx_tail - nic.rx_head <= RX_COPY_THRESHOLD)
+        p = pbuf_alloc_ref(frame, len, release_rx_frame, (void*)seq);
+    if (p) return p;
+
+    rx_frames[seq % RX_MAX_OUTSTANDING].released = true;
+    p = pbuf_alloc(len);
+    if (!p) {
+        nic.stats.rx_dropped++;
+        return NULL;
+    }
+    memcpy(p->data, frame, len);
+    nic.stats.rx_copied++;
+    return p;
+}
+
+// The napi poll, runs on the executor with the rx interrupts masked
+static int receive_packets(int budget) {
+    int done = 0;
+    nic.rx_stalled = false;
+    while (done < budget && !(inb(nic.io_base + REG_CR) & CR_BUFE)) {
+        if (nic.rx_tail - nic.rx_head == RX_MAX_OUTSTANDING) {
+            nic.rx_stalled = true;  // resumed from release_rx_frame
+            break;
+        }
+
+        uint8_t* header = (uint8_t*)rx_buffer.virt + nic.rx_offset;
+        uint16_t status = header[0] | (header[1] << 8);
+        uint16_t length = header[2] | (header[3] << 8);  // includes the CRC
+
+        if (!(status & RX_STATUS_ROK) || length < RX_CRC_LEN || length > RTL8139_MAX_FRAME) {
+            nic.stats.rx_errors++;
+            reset_rx();
+            break;
+        }
+
+        uint16_t frame_len = length - RX_CRC_LEN;
+        nic.stats.rx_packets++;
+        nic.stats.rx_bytes += frame_len;
+
+        nic.rx_offset = (nic.rx_offset + length + RX_HEADER_LEN + 3) & ~3;
+        nic.rx_offset %= RTL8139_RX_RING_SIZE;
+
+        done++;
+        uint32_t seq = nic.rx_tail++;
+        rx_frames[seq % RX_MAX_OUTSTANDING].next_offset = nic.rx_offset;
+        rx_frames[seq % RX_MAX_OUTSTANDING].released = false;
+
+        Pbuf* p = wrap_rx_frame(header + RX_HEADER_LEN, frame_len, seq);
+        if (p && nic.rx_handler)
+            nic.rx_handler(p);
+        else if (p)
+            pbuf_free(p);
+        advance_capr();
+    }
+    return done;
+}
+
+// Frames that arrive while masked latch ROK in ISR, which raises the irq right after this
+static bool enable_rx_irq() {
+    outw(nic.io_base + REG_IMR, INT_MASK);
+    return false;
+}
+
+static void reclaim_tx_slots() {
+    while (nic.tx_in_flight) {
+        uint32_t tsd = inl(nic.io_base + REG_TSD0 + nic.tx_dirty * 4);
+        if (!(tsd & (TSD_TOK | TSD_TUN | TSD_TABT))) break;
+
+        if (tsd & TSD_TOK) {
+            nic.stats.tx_packets++;
+            nic.stats.tx_bytes += tsd & 0x1FFF;
+        } else {
+            nic.stats.tx_errors++;
+        }
+        if (tx_pbufs[nic.tx_dirty]) {
+            pbuf_free(tx_pbufs[nic.tx_dirty]);
+            tx_pbufs[nic.tx_dirty] = NULL;
+        }
+        nic.tx_dirty = (nic.tx_dirty + 1) % RTL8139_TX_SLOTS;
+        nic.tx_in_flight--;
+    }
+}
+
+static void rtl8139_irq() {
+    uint16_t isr = inw(nic.io_base + REG_ISR);
+    outw(nic.io_base + REG_ISR, isr);  // write one to clear, before draining so nothing is lost
+    nic.stats.irqs++;
+
+    if (isr & (INT_RXOVW | INT_FOVW)) nic.stats.rx_overflows++;
+    if (isr & INT_RX) {
+        outw(nic.io_base + REG_IMR, INT_MASK & ~INT_RX);
+        napi_irq(&nic.napi);
+    }
+    if (isr & (INT_TOK | INT_TER)) reclaim_tx_slots();
+}
+
+bool rtl8139_init() {
+    if (initialized) return true;
+
+    const PciDevice* dev = pci_find_device(RTL8139_VENDOR_ID, RTL8139_DEVICE_ID);
+    if (!dev) {
+        LOG("RTL8139: device not found");
+        return false;
+    }
+    // Kept across a failed init, the next attempt uses them again
+    uint32_t tx_size = RTL8139_TX_SLOTS * RTL8139_MAX_FRAME;
+    if ((!rx_buffer.virt && !dma_alloc(&rx_buffer, RX_BUFFER_SIZE, 16, 0)) ||
+        (!tx_buffers.virt && !dma_alloc(&tx_buffers, tx_size, 16, 0))) {
+        LOG("RTL8139: no DMA memory");
+        return false;
+    }
+    Pci pci = find_pci_address(RTL8139_VENDOR_ID, RTL8139_DEVICE_ID);
+
+    memset(&nic, 0, sizeof(nic));
+    nic.io_base = find_io_base(pci);
+    nic.irq = dev->irq_line;
+
+    uint32_t command = pci_read_register(dev->address, PCI_COMMAND_REG);
+    pci_write_register(dev->address, PCI_COMMAND_REG,
+                       command | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+
+    outb(nic.io_base + REG_CONFIG1, 0x00);  // power on
+    outb(nic.io_base + REG_CR, CR_RST);
+    while (inb(nic.io_base + REG_CR) & CR_RST) {
+    }
+
+    for (int i = 0; i < 6; i++) nic.mac[i] = inb(nic.io_base + REG_IDR0 + i);
+    napi_init(&nic.napi, "rtl8139", receive_packets, enable_rx_irq);
+
+    outl(nic.io_base + REG_RBSTART, rx_buffer.phys);
+    outw(nic.io_base + REG_IMR, INT_MASK);
+    outl(nic.io_base + REG_RCR,
+         RCR_APM | RCR_AM | RCR_AB | RCR_WRAP | RCR_MXDMA_UNLIMITED | RCR_RXFTH_NONE);
+    outl(nic.io_base + REG_TCR, TCR_IFG_NORMAL | TCR_MXDMA_2048);
+    outb(nic.io_base + REG_CR, CR_RE | CR_TE);
+
+    uint32_t vector = nic.irq < 8 ? PIC_1_OFFSET + nic.irq : PIC_2_OFFSET + nic.irq - 8;
+    INTERRUPT_GUARDED({ register_interrupt(vector, rtl8139_irq); });
+    initialized = true;
+
+    LOG("RTL8139: io %x irq %d mac %x:%x:%x:%x:%x:%x", nic.io_base, nic.irq, nic.mac[0],
+        nic.mac[1], nic.mac[2], nic.mac[3], nic.mac[4], nic.mac[5]);
+    return true;
+}
+
+void rtl8139_set_rx_handler(Rtl8139RxFunc handler) {
+    INTERRUPT_GUARDED({ nic.rx_handler = handler; });
+}
+
+// Expects interrupts to be disabled and a free slot, phys is the frame's bus address
+static void start_tx(uint32_t phys, uint16_t len, Pbuf* owner) {
+    uint32_t slot = nic.tx_next;
+    tx_pbufs[slot] = owner;
+    outl(nic.io_base + REG_TSAD0 + slot * 4, phys);
+    outl(nic.io_base + REG_TSD0 + slot * 4, len);  // OWN = 0 starts the transfer
+
+    nic.tx_next = (slot + 1) % RTL8139_TX_SLOTS;
+    nic.tx_in_flight++;
+}
+
+/*
+ * Copies the frame into the next of the four tx buffers and hands it to the
+ * chip. Up to four frames are in flight at once, the descriptors are
+ * reclaimed in order from the TOK interrupt.
+ */
+int rtl8139_transmit(const void* data, uint16_t len) {
+    assert(initialized, "rtl8139_transmit before rtl8139_init");
+    if (len > RTL8139_MAX_FRAME) return RTL8139_TX_TOO_LONG;
+
+    int ret = 0;
+    INTERRUPT_GUARDED({
+        if (nic.tx_in_flight == RTL8139_TX_SLOTS) {
+            ret = RTL8139_TX_BUSY;
+        } else {
+            uint8_t* buffer = tx_buffer(nic.tx_next);
+            memcpy(buffer, data, len);
+            if (len < RTL8139_MIN_FRAME) {
+                memset(buffer + len, 0, RTL8139_MIN_FRAME - len);
+                len = RTL8139_MIN_FRAME;
+            }
+            start_tx(dma_phys(&tx_buffers, buffer), len, NULL);
+        }
+    });
+    return ret;
+}
+
+/*
+ * Sends a frame whose headers were built in place. A single dword aligned
+ * segment is DMAed straight out of the pbuf, which stays referenced until the
+ * descriptor completes; chained or unaligned frames are gathered into the
+ * slot's own buffer. On success the driver owns p, on error the caller does.
+ */
+int rtl8139_transmit_pbuf(Pbuf* p) {
+    assert(initialized, "rtl8139_transmit_pbuf before rtl8139_init");
+    uint32_t len = pbuf_total_len(p);
+    if (len > RTL8139_MAX_FRAME) return RTL8139_TX_TOO_LONG;
+
+    uint16_t pad = len < RTL8139_MIN_FRAME ? RTL8139_MIN_FRAME - len : 0;
+    bool zero_copy = p->next == NULL && ((uint32_t)p->data & 0x3) == 0 && pbuf_tailroom(p) >= pad;
+
+    int ret = 0;
+    Pbuf* copied = NULL;
+    INTERRUPT_GUARDED({
+        if (nic.tx_in_flight == RTL8139_TX_SLOTS) {
+            ret = RTL8139_TX_BUSY;
+        } else if (zero_copy) {
+            memset(p->data + len, 0, pad);
+            nic.stats.tx_zero_copy++;
+            start_tx((uint32_t)p->data, len + pad, p);  // pbufs are identity mapped
+        } else {
+            uint8_t* buffer = tx_buffer(nic.tx_next);
+            pbuf_copy_out(p, buffer, 0, len);
+            memset(buffer + len, 0, pad);
+            start_tx(dma_phys(&tx_buffers, buffer), len + pad, NULL);
+            copied = p;
+        }
+    });
+    if (copied) pbuf_free(copied);
+    return ret;
+}
+
+const uint8_t* rtl8139_mac() {
+    return nic.mac;
+}
+
+const Rtl8139Stats* rtl8139_stats() {
+    return &nic.stats;
+}
+
+const NapiStats* rtl8139_napi_stats() {
+    return &nic.napi.stats;
+}
+
+#ifdef TEST
+static volatile bool arp_reply_seen = false;
+
+static volatile bool arp_reply_by_ref = false;
+
+static void test_rx_handler(Pbuf* p) {
+    const uint8_t* frame = p->data;
+    // ethertype ARP, opcode reply
+    if (p->len >= 42 && frame[12] == 0x08 && frame[13] == 0x06 && frame[21] == 0x02) {
+        arp_reply_seen = true;
+        arp_reply_by_ref = p->type == PBUF_REF;
+    }
+    pbuf_free(p);
+}
+
+static void build_arp_request(uint8_t* frame) {
+    const uint8_t our_ip[4] = {10, 0, 2, 15};
+    const uint8_t gateway_ip[4] = {10, 0, 2, 2};
+    const uint8_t arp_header[8] = {0x00, 0x01, 0x08, 0x00, 6, 4, 0x00, 0x01};
+
+    memset(frame, 0xFF, 6);
+    memcpy(frame + 6, nic.mac, 6);
+    frame[12] = 0x08;
+    frame[13] = 0x06;
+    memcpy(frame + 14, arp_header, 8);
+    memcpy(frame + 22, nic.mac, 6);
+    memcpy(frame + 28, our_ip, 4);
+    memset(frame + 32, 0, 6);
+    memcpy(frame + 38, gateway_ip, 4);
+}
+
+// Frames are handed up from the napi task, so the executor's tasks are run while waiting
+static void wait_ticks(volatile bool* flag, uint32_t ticks) {
+    uint32_t deadline = get_tick() + ticks;
+    while (!*flag && get_tick() < deadline) {
+        if (!run_tasks()) asm volatile("hlt");
+    }
+}
+
+static bool tx_idle() {
+    return nic.tx_in_flight == 0;
+}
+
+// More frames than descriptors, so the ring wraps and slots get reused
+void test_tx_rotation() {
+    uint8_t frame[42];
+    build_arp_request(frame);
+
+    uint32_t sent_before = nic.stats.tx_packets;
+    int queued = 0;
+    uint32_t deadline = get_tick() + RTC_FREQ;
+    while (queued < 3 * RTL8139_TX_SLOTS && get_tick() < deadline) {
+        if (rtl8139_transmit(frame, sizeof(frame)) == 0) queued++;
+    }
+    assert(queued == 3 * RTL8139_TX_SLOTS, "test_tx_rotation 1 FAILED");
+
+    deadline = get_tick() + RTC_FREQ;
+    while (!tx_idle() && get_tick() < deadline) asm volatile("hlt");
+    assert(tx_idle(), "test_tx_rotation 2 FAILED");
+    assert(nic.stats.tx_packets - sent_before == (uint32_t)queued, "test_tx_rotation 3 FAILED");
+}
+
+// QEMU's user mode network answers ARP for the gateway
+void test_arp_roundtrip() {
+    uint8_t frame[42];
+    build_arp_request(frame);
+
+    arp_reply_seen = false;
+    rtl8139_set_rx_handler(test_rx_handler);
+    assert(rtl8139_transmit(frame, sizeof(frame)) == 0, "test_arp_roundtrip 1 FAILED");
+    wait_ticks(&arp_reply_seen, RTC_FREQ);
+    rtl8139_set_rx_handler(NULL);
+    assert(arp_reply_seen, "test_arp_roundtrip 2 FAILED");
+    assert(arp_reply_by_ref, "test_arp_roundtrip 3 FAILED");
+    assert(nic.rx_head == nic.rx_tail, "test_arp_roundtrip 4 FAILED");
+    assert(nic.napi.stats.polls > 0, "test_arp_roundtrip 5 FAILED");
+}
+
+// Headers pushed in front of the payload land on a dword, so the frame goes out without a copy
+void test_tx_zero_copy() {
+    uint8_t frame[42];
+    build_arp_request(frame);
+
+    Pbuf* p = pbuf_alloc(0);
+    assert(p != NULL, "test_tx_zero_copy 1 FAILED");
+    memcpy(pbuf_push(p, sizeof(frame)), frame, sizeof(frame));
+
+    int available = pbuf_pool_available();
+    uint32_t zero_copy_before = nic.stats.tx_zero_copy;
+    uint32_t deadline = get_tick() + RTC_FREQ;
+    while (rtl8139_transmit_pbuf(p) == RTL8139_TX_BUSY && get_tick() < deadline) {
+    }
+    assert(nic.stats.tx_zero_copy == zero_copy_before + 1, "test_tx_zero_copy 2 FAILED");
+
+    deadline = get_tick() + RTC_FREQ;
+    while (!tx_idle() && get_tick() < deadline) asm volatile("hlt");
+    assert(pbuf_pool_available() == available + 1, "test_tx_zero_copy 3 FAILED");
+}
+
+void run_rtl8139_tests() {
+    assert(rtl8139_init(), "RTL8139 not available");
+    test_arp_roundtrip();
+    test_tx_rotation();
+    test_tx_zero_copy();
+    LOG_GREEN("RTL8139: [OK]");
+}
+#endif
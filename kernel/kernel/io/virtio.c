@@ -0,0 +1,376 @@
+#define LOG_SUBSYSTEM nic
+
+#include <kernel/io/virtio.h>
+#include <kernel/panic.h>
+#include <string.h>
+#include <utils.h>
+
+// Legacy transport registers, offsets from io BAR0
+#define LEGACY_DEVICE_FEATURES 0x00
+#define LEGACY_DRIVER_FEATURES 0x04
+#define LEGACY_QUEUE_ADDRESS 0x08
+#define LEGACY_QUEUE_SIZE 0x0C
+#define LEGACY_QUEUE_SELECT 0x0E
+#define LEGACY_QUEUE_NOTIFY 0x10
+#define LEGACY_DEVICE_STATUS 0x12
+#define LEGACY_ISR_STATUS 0x13
+#define LEGACY_DEVICE_CONFIG 0x14  // without MSI-X
+
+// struct virtio_pci_common_cfg
+#define COMMON_DEVICE_FEATURE_SELECT 0x00
+#define COMMON_DEVICE_FEATURE 0x04
+#define COMMON_DRIVER_FEATURE_SELECT 0x08
+#define COMMON_DRIVER_FEATURE 0x0C
+#define COMMON_DEVICE_STATUS 0x14
+#define COMMON_QUEUE_SELECT 0x16
+#define COMMON_QUEUE_SIZE 0x18
+#define COMMON_QUEUE_ENABLE 0x1C
+#define COMMON_QUEUE_NOTIFY_OFF 0x1E
+#define COMMON_QUEUE_DESC 0x20
+#define COMMON_QUEUE_DRIVER 0x28
+#define COMMON_QUEUE_DEVICE 0x30
+
+#define PCI_CAP_VENDOR 0x09
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG 3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+// x86 only reorders stores after later loads, everything else just must not be moved by gcc
+#define barrier() asm volatile("" ::: "memory")
+#define full_barrier() asm volatile("lock; addl $0, (%%esp)" ::: "memory")
+
+static inline uint16_t mmio_read16(volatile uint8_t* base, uint32_t offset) {
+    return *(volatile uint16_t*)(base + offset);
+}
+
+static inline uint32_t mmio_read32(volatile uint8_t* base, uint32_t offset) {
+    return *(volatile uint32_t*)(base + offset);
+}
+
+static inline void mmio_write8(volatile uint8_t* base, uint32_t offset, uint8_t value) {
+    *(volatile uint8_t*)(base + offset) = value;
+}
+
+static inline void mmio_write16(volatile uint8_t* base, uint32_t offset, uint16_t value) {
+    *(volatile uint16_t*)(base + offset) = value;
+}
+
+static inline void mmio_write32(volatile uint8_t* base, uint32_t offset, uint32_t value) {
+    *(volatile uint32_t*)(base + offset) = value;
+}
+
+static inline void mmio_write64(volatile uint8_t* base, uint32_t offset, uint32_t value) {
+    mmio_write32(base, offset, value);
+    mmio_write32(base, offset + 4, 0);
+}
+
+// Address of a BAR relative region, 0 if the BAR is io space or mapped above 4G
+static uint32_t bar_address(const PciDevice* pci, uint8_t bar, uint32_t offset) {
+    if (bar >= PCI_NUM_BARS) return 0;
+    uint32_t value = pci->bars[bar];
+    if (value & 0x1) return 0;
+    if ((value & 0x6) == 0x4 && (bar + 1 >= PCI_NUM_BARS || pci->bars[bar + 1] != 0)) return 0;
+    return (value & ~0xF) + offset;
+}
+
+// Modern devices describe their register blocks with vendor specific capabilities
+static bool open_modern(VirtioDevice* dev, const PciDevice* pci) {
+    PciAddress a = pci->address;
+    uint8_t cap = 0;
+    while ((cap = pci_find_capability(pci, PCI_CAP_VENDOR, cap)) != 0) {
+        uint8_t cfg_type = pci_config_read(a.bus, a.slot, a.func, cap) >> 24;
+        uint8_t bar = pci_config_read(a.bus, a.slot, a.func, cap + 4) & 0xFF;
+        uint32_t offset = pci_config_read(a.bus, a.slot, a.func, cap + 8);
+        uint32_t address = bar_address(pci, bar, offset);
+        if (!address) continue;
+
+        switch (cfg_type) {
+            case VIRTIO_PCI_CAP_COMMON_CFG:
+                if (!dev->common) dev->common = (volatile uint8_t*)address;
+                break;
+            case VIRTIO_PCI_CAP_NOTIFY_CFG:
+                if (!dev->notify_base) {
+                    dev->notify_base = address;
+                    dev->notify_multiplier = pci_config_read(a.bus, a.slot, a.func, cap + 16);
+                }
+                break;
+            case VIRTIO_PCI_CAP_ISR_CFG:
+                if (!dev->isr) dev->isr = (volatile uint8_t*)address;
+                break;
+            case VIRTIO_PCI_CAP_DEVICE_CFG:
+                if (!dev->device_config) dev->device_config = (volatile uint8_t*)address;
+                break;
+        }
+    }
+    return dev->common && dev->notify_base && dev->isr;
+}
+
+/*
+ * Prefers the modern (virtio 1.0) transport and falls back to the legacy io
+ * port interface of transitional devices. Leaves the device reset and
+ * acknowledged, ready for virtio_negotiate.
+ */
+bool virtio_open(VirtioDevice* dev, const PciDevice* pci) {
+    memset(dev, 0, sizeof(*dev));
+    dev->pci = pci;
+    dev->irq = pci->irq_line;
+
+    uint32_t command = pci_read_register(pci->address, 0x01);
+    pci_write_register(pci->address, 0x01, command | 0x7);  // io, memory, bus master
+
+    if (open_modern(dev, pci)) {
+        dev->modern = true;
+    } else if (pci->bars[0] & 0x1) {
+        dev->modern = false;
+        dev->common = dev->isr = dev->device_config = NULL;  // partial modern capabilities
+        dev->notify_base = 0;
+        dev->io_base = pci->bars[0] & ~0x3;
+    } else {
+        LOG("virtio: no usable transport on %d:%d.%d", pci->address.bus, pci->address.slot,
+            pci->address.func);
+        return false;
+    }
+
+    virtio_set_status(dev, 0);
+    virtio_set_status(dev, VIRTIO_STATUS_ACKNOWLEDGE);
+    virtio_set_status(dev, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    return true;
+}
+
+void virtio_set_status(VirtioDevice* dev, uint8_t status) {
+    if (dev->modern)
+        mmio_write8(dev->common, COMMON_DEVICE_STATUS, status);
+    else
+        outb(dev->io_base + LEGACY_DEVICE_STATUS, status);
+}
+
+uint8_t virtio_get_status(VirtioDevice* dev) {
+    if (dev->modern) return dev->common[COMMON_DEVICE_STATUS];
+    return inb(dev->io_base + LEGACY_DEVICE_STATUS);
+}
+
+static uint64_t read_device_features(VirtioDevice* dev) {
+    if (!dev->modern) return inl(dev->io_base + LEGACY_DEVICE_FEATURES);
+
+    mmio_write32(dev->common, COMMON_DEVICE_FEATURE_SELECT, 0);
+    uint64_t low = mmio_read32(dev->common, COMMON_DEVICE_FEATURE);
+    mmio_write32(dev->common, COMMON_DEVICE_FEATURE_SELECT, 1);
+    uint64_t high = mmio_read32(dev->common, COMMON_DEVICE_FEATURE);
+    return (high << 32) | low;
+}
+
+static void write_driver_features(VirtioDevice* dev, uint64_t features) {
+    if (!dev->modern) {
+        outl(dev->io_base + LEGACY_DRIVER_FEATURES, (uint32_t)features);
+        return;
+    }
+    mmio_write32(dev->common, COMMON_DRIVER_FEATURE_SELECT, 0);
+    mmio_write32(dev->common, COMMON_DRIVER_FEATURE, (uint32_t)features);
+    mmio_write32(dev->common, COMMON_DRIVER_FEATURE_SELECT, 1);
+    mmio_write32(dev->common, COMMON_DRIVER_FEATURE, (uint32_t)(features >> 32));
+}
+
+// Accepts the offered subset of wanted, modern devices also get VERSION_1
+bool virtio_negotiate(VirtioDevice* dev, uint64_t wanted) {
+    uint64_t offered = read_device_features(dev);
+    if (dev->modern) {
+        if (!(offered & (1ULL << VIRTIO_F_VERSION_1))) return false;
+        wanted |= 1ULL << VIRTIO_F_VERSION_1;
+    } else {
+        wanted &= 0xFFFFFFFF;
+    }
+
+    dev->features = offered & wanted;
+    write_driver_features(dev, dev->features);
+    if (!dev->modern) return true;
+
+    uint8_t status = virtio_get_status(dev);
+    virtio_set_status(dev, status | VIRTIO_STATUS_FEATURES_OK);
+    return virtio_get_status(dev) & VIRTIO_STATUS_FEATURES_OK;
+}
+
+bool virtio_has_feature(const VirtioDevice* dev, int bit) {
+    return (dev->features >> bit) & 1;
+}
+
+uint8_t virtio_config_read8(VirtioDevice* dev, uint32_t offset) {
+    if (dev->modern) return dev->device_config ? dev->device_config[offset] : 0;
+    return inb(dev->io_base + LEGACY_DEVICE_CONFIG + offset);
+}
+
+// Reading the ISR acknowledges the interrupt
+uint8_t virtio_read_isr(VirtioDevice* dev) {
+    if (dev->modern) return *dev->isr;
+    return inb(dev->io_base + LEGACY_ISR_STATUS);
+}
+
+static inline volatile uint16_t* used_event(Virtqueue* vq) {
+    return &vq->avail->ring[vq->size];
+}
+
+static inline volatile uint16_t* avail_event(Virtqueue* vq) {
+    return (volatile uint16_t*)&vq->used->ring[vq->size];
+}
+
+static bool uses_event_idx(Virtqueue* vq) {
+    return virtio_has_feature(vq->device, VIRTIO_RING_F_EVENT_IDX);
+}
+
+/*
+ * Sets up queue index in ring, which must hold VIRTQ_RING_BYTES(VIRTQ_MAX_SIZE)
+ * bytes aligned to VIRTQ_ALIGN. The legacy layout is used for both transports.
+ */
+bool virtq_init(Virtqueue* vq, VirtioDevice* dev, uint16_t index, const DmaBuffer* ring) {
+    uint8_t* memory = ring->virt;
+    uint16_t size;
+    if (dev->modern) {
+        mmio_write16(dev->common, COMMON_QUEUE_SELECT, index);
+        size = mmio_read16(dev->common, COMMON_QUEUE_SIZE);
+        if (size > VIRTQ_MAX_SIZE) {
+            size = VIRTQ_MAX_SIZE;  // modern devices accept a smaller ring
+            mmio_write16(dev->common, COMMON_QUEUE_SIZE, size);
+        }
+    } else {
+        outw(dev->io_base + LEGACY_QUEUE_SELECT, index);
+        size = inw(dev->io_base + LEGACY_QUEUE_SIZE);
+        if (size > VIRTQ_MAX_SIZE) return false;
+    }
+    if (size == 0) return false;
+
+    memset(vq, 0, sizeof(*vq));
+    memset(memory, 0, VIRTQ_RING_BYTES(size));
+    vq->device = dev;
+    vq->index = index;
+    vq->size = size;
+    vq->desc = (volatile VirtqDesc*)memory;
+    vq->avail = (volatile VirtqAvail*)(memory + 16 * size);
+    vq->used = (volatile VirtqUsed*)(memory + VIRTQ_ALIGN_UP(16 * size + 2 * (3 + size)));
+    vq->num_free = size;
+    for (uint16_t i = 0; i < size; i++) vq->desc[i].next = i + 1;
+
+    if (dev->modern) {
+        mmio_write64(dev->common, COMMON_QUEUE_DESC, dma_phys(ring, (const void*)vq->desc));
+        mmio_write64(dev->common, COMMON_QUEUE_DRIVER, dma_phys(ring, (const void*)vq->avail));
+        mmio_write64(dev->common, COMMON_QUEUE_DEVICE, dma_phys(ring, (const void*)vq->used));
+        uint16_t notify_off = mmio_read16(dev->common, COMMON_QUEUE_NOTIFY_OFF);
+        vq->notify_address = dev->notify_base + notify_off * dev->notify_multiplier;
+        mmio_write16(dev->common, COMMON_QUEUE_ENABLE, 1);
+    } else {
+        outl(dev->io_base + LEGACY_QUEUE_ADDRESS, ring->phys / VIRTQ_ALIGN);
+        vq->notify_address = dev->io_base + LEGACY_QUEUE_NOTIFY;
+    }
+    return true;
+}
+
+/*
+ * Queues one descriptor chain without telling the device, so several adds
+ * can be published with a single virtq_kick. Returns -1 when the ring is full.
+ */
+int virtq_add(Virtqueue* vq, const VirtqBuffer* buffers, int count, void* token) {
+    if (count == 0 || vq->num_free < count) return -1;
+
+    uint16_t head = vq->free_head;
+    uint16_t idx = head;
+    for (int i = 0; i < count; i++) {
+        volatile VirtqDesc* desc = &vq->desc[idx];
+        desc->addr = buffers[i].addr;
+        desc->len = buffers[i].len;
+        desc->flags = (buffers[i].device_writes ? VIRTQ_DESC_F_WRITE : 0) |
+                      (i + 1 < count ? VIRTQ_DESC_F_NEXT : 0);
+        if (i + 1 < count) idx = desc->next;
+    }
+    vq->free_head = vq->desc[idx].next;
+    vq->num_free -= count;
+    vq->tokens[head] = token;
+
+    vq->avail->ring[vq->avail_idx % vq->size] = head;
+    vq->avail_idx++;
+    return 0;
+}
+
+/*
+ * Publishes everything added since the last kick and notifies the device
+ * unless it asked not to be: with EVENT_IDX only when the published range
+ * crosses the avail_event the device set, otherwise unless NO_NOTIFY is set.
+ */
+bool virtq_kick(Virtqueue* vq) {
+    if (vq->avail_idx == vq->kicked_idx) return false;
+
+    barrier();
+    vq->avail->idx = vq->avail_idx;
+    full_barrier();  // the device's event index must be read after the new idx is visible
+
+    uint16_t old_idx = vq->kicked_idx;
+    uint16_t new_idx = vq->avail_idx;
+    vq->kicked_idx = new_idx;
+
+    bool notify;
+    if (uses_event_idx(vq))
+        notify = (uint16_t)(new_idx - *avail_event(vq) - 1) < (uint16_t)(new_idx - old_idx);
+    else
+        notify = !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+
+    if (!notify) {
+        vq->kicks_suppressed++;
+        return false;
+    }
+
+    vq->kicks++;
+    if (vq->device->modern)
+        *(volatile uint16_t*)vq->notify_address = vq->index;
+    else
+        outw(vq->notify_address, vq->index);
+    return true;
+}
+
+// Returns the token of the next completed chain, or NULL when there is none
+void* virtq_get_used(Virtqueue* vq, uint32_t* len) {
+    if (vq->last_used_idx == vq->used->idx) return NULL;
+    barrier();
+
+    volatile struct VirtqUsedElem* elem = &vq->used->ring[vq->last_used_idx % vq->size];
+    uint16_t head = elem->id;
+    if (len) *len = elem->len;
+    vq->last_used_idx++;
+
+    uint16_t idx = head;
+    uint16_t count = 1;
+    while (vq->desc[idx].flags & VIRTQ_DESC_F_NEXT) {
+        idx = vq->desc[idx].next;
+        count++;
+    }
+    vq->desc[idx].next = vq->free_head;
+    vq->free_head = head;
+    vq->num_free += count;
+
+    void* token = vq->tokens[head];
+    vq->tokens[head] = NULL;
+    return token;
+}
+
+bool virtq_has_used(Virtqueue* vq) {
+    return vq->last_used_idx != vq->used->idx;
+}
+
+// Stops completion interrupts until the next virtq_enable_interrupts
+void virtq_disable_interrupts(Virtqueue* vq) {
+    if (uses_event_idx(vq))
+        *used_event(vq) = vq->last_used_idx - 1;  // not crossed again for 64k completions
+    else
+        vq->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+}
+
+/*
+ * Asks for an interrupt once more than `after` further chains complete (only
+ * with EVENT_IDX, otherwise on every completion). Returns true if that many
+ * completed already, the caller should poll again instead of waiting.
+ */
+bool virtq_enable_interrupts(Virtqueue* vq, uint16_t after) {
+    if (uses_event_idx(vq))
+        *used_event(vq) = vq->last_used_idx + after;
+    else
+        vq->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    full_barrier();
+    return (uint16_t)(vq->used->idx - vq->last_used_idx) > after;
+}
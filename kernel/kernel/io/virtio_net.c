@@ -0,0 +1,373 @@
+#define LOG_SUBSYSTEM nic
+
+#include <kernel/dma.h>
+#include <kernel/interrupts.h>
+#include <kernel/io/virtio.h>
+#include <kernel/io/virtio_net.h>
+#include <kernel/panic.h>
+#include <kernel/pci.h>
+#include <string.h>
+#include <utils.h>
+#ifdef TEST
+#include <kernel/io/rtc.h>
+#include <kernel/monotonic_tick.h>
+#endif
+
+#define RX_QUEUE 0
+#define TX_QUEUE 1
+#define RX_BUFFER_LEN (PBUF_BUFFER_SIZE - PBUF_HEADROOM)
+#define TX_MAX_SEGMENTS 8
+
+struct VirtioNetHeader {
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t num_buffers;  // only with MRG_RXBUF or VERSION_1
+} __attribute__((packed));
+
+struct VirtioNet {
+    VirtioDevice device;
+    Virtqueue rx;
+    Virtqueue tx;
+    uint8_t mac[6];
+    uint16_t header_len;
+    bool mergeable;
+    bool any_layout;  // header may share a descriptor with the frame
+    uint16_t rx_posted;
+    volatile uint16_t tx_in_flight;
+    VirtioNetRxFunc rx_handler;
+    VirtioNetStats stats;
+    Napi napi;
+};
+
+static struct VirtioNet net;
+static bool initialized = false;
+
+static DmaBuffer rx_ring_memory;  // VIRTQ_RING_BYTES(VIRTQ_MAX_SIZE) each, kept across inits
+static DmaBuffer tx_ring_memory;
+static const struct VirtioNetHeader tx_header = {0};  // no offloads, shared by every frame
+
+// Keeps VIRTIO_NET_RX_BUFFERS posted, the caller kicks once for the whole batch
+static void refill_rx() {
+    while (net.rx_posted < min(VIRTIO_NET_RX_BUFFERS, net.rx.size)) {
+        Pbuf* p = pbuf_alloc(RX_BUFFER_LEN);
+        if (!p) break;
+
+        VirtqBuffer buffer = {
+            .addr = (uint32_t)p->data, .len = RX_BUFFER_LEN, .device_writes = true};
+        if (virtq_add(&net.rx, &buffer, 1, p) != 0) {
+            pbuf_free(p);
+            break;
+        }
+        net.rx_posted++;
+    }
+}
+
+static Pbuf* take_rx_buffer() {
+    uint32_t len;
+    Pbuf* p = virtq_get_used(&net.rx, &len);
+    if (!p) return NULL;
+    net.rx_posted--;
+    p->len = len;
+    return p;
+}
+
+static void deliver(Pbuf* frame) {
+    net.stats.rx_packets++;
+    net.stats.rx_bytes += pbuf_total_len(frame);
+    if (net.rx_handler)
+        net.rx_handler(frame);
+    else
+        pbuf_free(frame);
+}
+
+// The napi poll, runs on the executor with the rx interrupt masked
+static int receive_frames(int budget) {
+    int done = 0;
+    Pbuf* frame;
+    while (done < budget && (frame = take_rx_buffer()) != NULL) {
+        done++;
+        uint16_t buffers = 1;
+        if (net.mergeable) buffers = ((struct VirtioNetHeader*)frame->data)->num_buffers;
+
+        // With mergeable buffers a large frame continues in the next used buffers
+        for (uint16_t i = 1; i < buffers; i++) {
+            Pbuf* rest = take_rx_buffer();
+            if (!rest) break;
+            pbuf_chain(frame, rest);
+        }
+        if (buffers > 1) net.stats.rx_merged++;
+
+        if (!pbuf_pull(frame, net.header_len)) {
+            net.stats.rx_dropped++;
+            pbuf_free(frame);
+            continue;
+        }
+        deliver(frame);
+    }
+
+    refill_rx();
+    virtq_kick(&net.rx);
+    return done;
+}
+
+static bool enable_rx_irq() {
+    if (!virtq_enable_interrupts(&net.rx, 0)) return false;
+    virtq_disable_interrupts(&net.rx);  // frames slipped in, keep polling
+    return true;
+}
+
+static void reclaim_tx() {
+    Pbuf* p;
+    while ((p = virtq_get_used(&net.tx, NULL)) != NULL) {
+        pbuf_free(p);
+        net.tx_in_flight--;
+    }
+}
+
+static void virtio_net_irq() {
+    virtio_read_isr(&net.device);
+    net.stats.irqs++;
+    if (virtq_has_used(&net.rx)) {
+        virtq_disable_interrupts(&net.rx);
+        napi_irq(&net.napi);
+    }
+    reclaim_tx();
+}
+
+static const PciDevice* find_device() {
+    const PciDevice* pci = pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_NET_MODERN_DEVICE_ID);
+    if (!pci) pci = pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_NET_LEGACY_DEVICE_ID);
+    return pci;
+}
+
+bool virtio_net_init() {
+    if (initialized) return true;
+
+    const PciDevice* pci = find_device();
+    if (!pci) {
+        LOG("virtio-net: device not found");
+        return false;
+    }
+
+    memset(&net, 0, sizeof(net));
+    VirtioDevice* dev = &net.device;
+    if (!virtio_open(dev, pci)) return false;
+
+    uint64_t wanted = (1ULL << VIRTIO_NET_F_MAC) | (1ULL << VIRTIO_RING_F_EVENT_IDX) |
+                      (1ULL << VIRTIO_F_ANY_LAYOUT);
+    if (VIRTIO_NET_MERGEABLE_RX) wanted |= 1ULL << VIRTIO_NET_F_MRG_RXBUF;
+
+    if (!virtio_negotiate(dev, wanted)) {
+        LOG("virtio-net: feature negotiation failed");
+        virtio_set_status(dev, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+
+    net.mergeable = virtio_has_feature(dev, VIRTIO_NET_F_MRG_RXBUF);
+    net.any_layout = dev->modern || virtio_has_feature(dev, VIRTIO_F_ANY_LAYOUT);
+    net.header_len = (dev->modern || net.mergeable) ? sizeof(struct VirtioNetHeader)
+                                                    : sizeof(struct VirtioNetHeader) - 2;
+
+    // RX buffers are posted as one descriptor holding header and frame
+    if (!net.any_layout && !net.mergeable) {
+        LOG("virtio-net: device needs a separate rx header descriptor, not supported");
+        virtio_set_status(dev, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+
+    uint32_t ring_bytes = VIRTQ_RING_BYTES(VIRTQ_MAX_SIZE);
+    if ((!rx_ring_memory.virt && !dma_alloc(&rx_ring_memory, ring_bytes, VIRTQ_ALIGN, 0)) ||
+        (!tx_ring_memory.virt && !dma_alloc(&tx_ring_memory, ring_bytes, VIRTQ_ALIGN, 0))) {
+        LOG("virtio-net: no DMA memory for the virtqueues");
+        virtio_set_status(dev, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+    if (!virtq_init(&net.rx, dev, RX_QUEUE, &rx_ring_memory) ||
+        !virtq_init(&net.tx, dev, TX_QUEUE, &tx_ring_memory)) {
+        LOG("virtio-net: could not set up virtqueues");
+        virtio_set_status(dev, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+
+    for (int i = 0; i < 6; i++)
+        net.mac[i] = virtio_has_feature(dev, VIRTIO_NET_F_MAC) ? virtio_config_read8(dev, i) : 0;
+
+    napi_init(&net.napi, "virtio-net", receive_frames, enable_rx_irq);
+
+    uint32_t vector = dev->irq < 8 ? PIC_1_OFFSET + dev->irq : PIC_2_OFFSET + dev->irq - 8;
+    INTERRUPT_GUARDED({
+        register_interrupt(vector, virtio_net_irq);
+        refill_rx();
+        virtq_enable_interrupts(&net.rx, 0);
+        virtio_set_status(dev, virtio_get_status(dev) | VIRTIO_STATUS_DRIVER_OK);
+        virtq_kick(&net.rx);
+    });
+    initialized = true;
+
+    LOG("virtio-net: %s, irq %d, mac %x:%x:%x:%x:%x:%x, event idx %d, mergeable %d",
+        dev->modern ? "modern" : "legacy", dev->irq, net.mac[0], net.mac[1], net.mac[2],
+        net.mac[3], net.mac[4], net.mac[5], virtio_has_feature(dev, VIRTIO_RING_F_EVENT_IDX),
+        net.mergeable);
+    return true;
+}
+
+void virtio_net_set_rx_handler(VirtioNetRxFunc handler) {
+    INTERRUPT_GUARDED({ net.rx_handler = handler; });
+}
+
+/*
+ * Adds a frame to the tx ring without notifying the device; a burst of frames
+ * is published with one virtio_net_flush_tx. The net header is pushed into
+ * the pbuf headroom when the layout allows, otherwise it goes in its own
+ * read-only descriptor. On success the driver owns p until the device is
+ * done with it, on error the caller keeps it unchanged.
+ */
+int virtio_net_queue_tx(Pbuf* p) {
+    assert(initialized, "virtio_net_queue_tx before virtio_net_init");
+    uint32_t len = pbuf_total_len(p);
+    if (len > VIRTIO_NET_MAX_FRAME) return VIRTIO_NET_TX_TOO_LONG;
+
+    VirtqBuffer buffers[TX_MAX_SEGMENTS];
+    int count = 0;
+    bool pushed = net.any_layout && pbuf_headroom(p) >= net.header_len;
+    if (pushed) {
+        memset(pbuf_push(p, net.header_len), 0, net.header_len);
+    } else {
+        buffers[count++] = (VirtqBuffer){(uint32_t)&tx_header, net.header_len, false};
+    }
+    for (Pbuf* seg = p; seg; seg = seg->next) {
+        if (count == TX_MAX_SEGMENTS) {
+            if (pushed) pbuf_pull(p, net.header_len);
+            return VIRTIO_NET_TX_TOO_LONG;
+        }
+        buffers[count++] = (VirtqBuffer){(uint32_t)seg->data, seg->len, false};
+    }
+
+    int ret = 0;
+    INTERRUPT_GUARDED({
+        reclaim_tx();
+        if (virtq_add(&net.tx, buffers, count, p) != 0) {
+            ret = VIRTIO_NET_TX_BUSY;
+        } else {
+            net.tx_in_flight++;
+            net.stats.tx_packets++;
+            net.stats.tx_bytes += len;
+        }
+    });
+    if (ret != 0 && pushed) pbuf_pull(p, net.header_len);
+    return ret;
+}
+
+/*
+ * Publishes the queued frames with at most one notification, and asks for a
+ * single interrupt once the last of them completes instead of one per frame.
+ */
+void virtio_net_flush_tx() {
+    INTERRUPT_GUARDED({
+        virtq_kick(&net.tx);
+        if (net.tx_in_flight && virtq_enable_interrupts(&net.tx, net.tx_in_flight - 1))
+            reclaim_tx();
+    });
+}
+
+int virtio_net_transmit_pbuf(Pbuf* p) {
+    int ret = virtio_net_queue_tx(p);
+    if (ret == 0) virtio_net_flush_tx();
+    return ret;
+}
+
+const uint8_t* virtio_net_mac() {
+    return net.mac;
+}
+
+const VirtioNetStats* virtio_net_stats() {
+    net.stats.rx_kicks = net.rx.kicks;
+    net.stats.rx_kicks_suppressed = net.rx.kicks_suppressed;
+    net.stats.tx_kicks = net.tx.kicks;
+    net.stats.tx_kicks_suppressed = net.tx.kicks_suppressed;
+    return &net.stats;
+}
+
+const NapiStats* virtio_net_napi_stats() {
+    return &net.napi.stats;
+}
+
+#ifdef TEST
+static volatile bool arp_reply_seen = false;
+
+static void test_rx_handler(Pbuf* p) {
+    const uint8_t* frame = p->data;
+    // ethertype ARP, opcode reply
+    if (p->len >= 42 && frame[12] == 0x08 && frame[13] == 0x06 && frame[21] == 0x02)
+        arp_reply_seen = true;
+    pbuf_free(p);
+}
+
+static Pbuf* build_arp_request() {
+    const uint8_t our_ip[4] = {10, 0, 2, 15};
+    const uint8_t gateway_ip[4] = {10, 0, 2, 2};
+    const uint8_t arp_header[8] = {0x00, 0x01, 0x08, 0x00, 6, 4, 0x00, 0x01};
+
+    Pbuf* p = pbuf_alloc(42);
+    assert(p != NULL, "build_arp_request: pool empty");
+    uint8_t* frame = p->data;
+    memset(frame, 0xFF, 6);
+    memcpy(frame + 6, net.mac, 6);
+    frame[12] = 0x08;
+    frame[13] = 0x06;
+    memcpy(frame + 14, arp_header, 8);
+    memcpy(frame + 22, net.mac, 6);
+    memcpy(frame + 28, our_ip, 4);
+    memset(frame + 32, 0, 6);
+    memcpy(frame + 38, gateway_ip, 4);
+    return p;
+}
+
+// Frames are handed up from the napi task, so the executor's tasks are run while waiting
+static void wait_until(volatile bool* flag, uint32_t ticks) {
+    uint32_t deadline = get_tick() + ticks;
+    while (!*flag && get_tick() < deadline) {
+        if (!run_tasks()) asm volatile("hlt");
+    }
+}
+
+// QEMU's user mode network answers ARP for the gateway
+void test_virtio_arp_roundtrip() {
+    arp_reply_seen = false;
+    virtio_net_set_rx_handler(test_rx_handler);
+    assert(virtio_net_transmit_pbuf(build_arp_request()) == 0,
+           "test_virtio_arp_roundtrip 1 FAILED");
+    wait_until(&arp_reply_seen, RTC_FREQ);
+    virtio_net_set_rx_handler(NULL);
+    assert(arp_reply_seen, "test_virtio_arp_roundtrip 2 FAILED");
+    assert(net.napi.stats.polls > 0, "test_virtio_arp_roundtrip 3 FAILED");
+}
+
+// A burst is published with at most one notification
+void test_virtio_tx_batch() {
+    const int burst = 8;
+    const VirtioNetStats* stats = virtio_net_stats();
+    uint32_t kicks_before = stats->tx_kicks;
+
+    for (int i = 0; i < burst; i++)
+        assert(virtio_net_queue_tx(build_arp_request()) == 0, "test_virtio_tx_batch 1 FAILED");
+    virtio_net_flush_tx();
+    stats = virtio_net_stats();
+    assert(stats->tx_kicks - kicks_before <= 1, "test_virtio_tx_batch 2 FAILED");
+
+    uint32_t deadline = get_tick() + RTC_FREQ;
+    while (net.tx_in_flight && get_tick() < deadline) asm volatile("hlt");
+    assert(net.tx_in_flight == 0, "test_virtio_tx_batch 3 FAILED");
+}
+
+void run_virtio_net_tests() {
+    assert(virtio_net_init(), "virtio-net not available");
+    test_virtio_arp_roundtrip();
+    test_virtio_tx_batch();
+    LOG_GREEN("virtio-net: [OK]");
+}
+#endif
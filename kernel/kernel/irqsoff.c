@@ -0,0 +1,161 @@
+#include <kernel/irqsoff.h>
+#include <kernel/monotonic_tick.h>
+#include <kernel/panic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <utils.h>
+
+struct IrqsoffSite {
+    const char* file;
+    int line;
+    uint32_t count;
+    uint64_t total;
+    uint64_t max;
+};
+
+static struct IrqsoffSite sites[IRQSOFF_MAX_SITES];
+static int num_sites = 0;
+static uint32_t histogram[IRQSOFF_BUCKETS];  // every section, by log2 of its cycles
+static uint32_t num_sections = 0;
+static uint32_t untracked = 0;  // sections from sites past IRQSOFF_MAX_SITES
+
+static int bucket_of(uint64_t cycles) {
+    int bucket = cycles ? 64 - __builtin_clzll(cycles) : 0;
+    return min(bucket, IRQSOFF_BUCKETS - 1);
+}
+
+// A site is one __FILE__ literal, the compiler keeps a single copy per translation unit
+static struct IrqsoffSite* find_site(const char* file, int line) {
+    for (int i = 0; i < num_sites; i++)
+        if (sites[i].line == line && sites[i].file == file) return &sites[i];
+    return NULL;
+}
+
+// Called with interrupts still off, at the end of the section it measured
+void irqsoff_record(uint64_t cycles, const char* file, int line) {
+    num_sections++;
+    histogram[bucket_of(cycles)]++;
+
+    struct IrqsoffSite* site = find_site(file, line);
+    if (!site) {
+        if (num_sites == IRQSOFF_MAX_SITES) {
+            untracked++;
+            return;
+        }
+        site = &sites[num_sites++];
+        *site = (struct IrqsoffSite){.file = file, .line = line};
+    }
+    site->count++;
+    site->total += cycles;
+    if (cycles > site->max) site->max = cycles;
+}
+
+// Upper bound of the bucket holding the given fraction (per mille) of all sections
+static uint64_t percentile(const uint32_t* buckets, uint32_t total, uint32_t per_mille) {
+    uint32_t wanted = (uint64_t)total * per_mille / 1000;
+    uint32_t seen = 0;
+    for (int i = 0; i < IRQSOFF_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > wanted || seen == total) return i ? 1ULL << i : 0;
+    }
+    return 0;
+}
+
+/*
+ * The tables are copied with interrupts off and printed from the copy, the
+ * LOG() calls below are guarded sections themselves.
+ */
+void irqsoff_report() {
+    static struct IrqsoffSite worst[IRQSOFF_MAX_SITES];
+    static uint32_t buckets[IRQSOFF_BUCKETS];
+
+    IrqFlags flags = irq_save();
+    int count = num_sites;
+    uint32_t total = num_sections;
+    uint32_t lost = untracked;
+    memcpy(worst, sites, sizeof(sites));
+    memcpy(buckets, histogram, sizeof(histogram));
+    irq_restore(flags);
+    if (total == 0) return;
+
+    for (int i = 1; i < count; i++) {
+        struct IrqsoffSite site = worst[i];
+        int j = i - 1;
+        for (; j >= 0 && worst[j].max < site.max; j--) worst[j + 1] = worst[j];
+        worst[j + 1] = site;
+    }
+
+    uint64_t hz = tsc_frequency();
+    LOG("irqsoff: %u sections from %d sites (%u untracked), TSC %u MHz", total, count, lost,
+        (uint32_t)(hz / 1000000));
+    LOG("irqsoff: cycles p50 <= %u, p99 <= %u, p99.9 <= %u, max %u us",
+        (uint32_t)percentile(buckets, total, 500), (uint32_t)percentile(buckets, total, 990),
+        (uint32_t)percentile(buckets, total, 999), tsc_to_us(worst[0].max));
+    for (int i = 0; i < min(count, IRQSOFF_REPORT_TOP); i++)
+        LOG("irqsoff: %7u us max %9u cycles avg %7u times  %s:%d", tsc_to_us(worst[i].max),
+            (uint32_t)(worst[i].total / worst[i].count), worst[i].count, worst[i].file,
+            worst[i].line);
+}
+
+#ifdef TEST
+static bool interrupts_enabled() {
+    uint32_t flags;
+    asm volatile("pushfl; popl %0" : "=r"(flags));
+    return flags & EFLAGS_IF;
+}
+
+// Inner sections leave interrupts off, only the outermost restore turns them on
+void test_irq_save_nesting() {
+    assert(interrupts_enabled(), "test_irq_save_nesting: interrupts off before the test");
+    IrqFlags outer = irq_save();
+    IrqFlags inner = irq_save();
+    assert(!(inner & EFLAGS_IF), "test_irq_save_nesting: inner save saw interrupts on");
+    irq_restore(inner);
+    assert(!interrupts_enabled(), "test_irq_save_nesting: inner restore turned interrupts on");
+    INTERRUPT_GUARDED({});
+    assert(!interrupts_enabled(), "test_irq_save_nesting: nested guard turned interrupts on");
+    irq_restore(outer);
+    assert(interrupts_enabled(), "test_irq_save_nesting: outer restore left interrupts off");
+}
+
+#ifdef IRQSOFF_TRACE
+#define TEST_SECTION_CYCLES 200000
+
+static void spin(uint64_t cycles) {
+    uint64_t start = rdtsc();
+    while (rdtsc() - start < cycles) asm volatile("pause");
+}
+
+// Returns the line of its guarded section
+static int guarded_spin(uint64_t cycles) {
+    INTERRUPT_GUARDED(spin(cycles));
+    return __LINE__ - 1;
+}
+
+static int nested_guarded_spin(uint64_t cycles) {
+    INTERRUPT_GUARDED(guarded_spin(cycles));
+    return __LINE__ - 1;
+}
+
+void test_irqsoff_record() {
+    int line = guarded_spin(TEST_SECTION_CYCLES);
+    struct IrqsoffSite* site = find_site(__FILE__, line);
+    assert(site && site->count == 1, "test_irqsoff_record: section not recorded");
+    assert(site->max >= TEST_SECTION_CYCLES, "test_irqsoff_record: section too short");
+
+    // Only the outer section is timed, the inner one is part of it
+    int outer_line = nested_guarded_spin(TEST_SECTION_CYCLES);
+    struct IrqsoffSite* outer = find_site(__FILE__, outer_line);
+    assert(outer && outer->max >= TEST_SECTION_CYCLES, "test_irqsoff_record: outer not recorded");
+    assert(site->count == 1, "test_irqsoff_record: nested section recorded on its own");
+}
+#endif
+
+void run_irqsoff_tests() {
+    test_irq_save_nesting();
+#ifdef IRQSOFF_TRACE
+    test_irqsoff_record();
+#endif
+    LOG_GREEN("Irqsoff: [OK]");
+}
+#endif
@@ -1,18 +1,48 @@
+#include <kernel/acpi.h>
 #include <kernel/allocator.h>
+#include <kernel/boot_trace.h>
 #include <kernel/circular_buffer.h>
+#include <kernel/cmdline.h>
+#include <kernel/console.h>
+#include <kernel/dma.h>
+#include <kernel/elf.h>
 #include <kernel/future.h>
 #include <kernel/gdt.h>
+#include <kernel/idle.h>
 #include <kernel/interrupts.h>
+#include <kernel/io/hpet.h>
 #include <kernel/io/rtc.h>
+#include <kernel/io/rtl8139.h>
 #include <kernel/io/uart.h>
+#include <kernel/io/virtio_net.h>
+#include <kernel/irqsoff.h>
+#include <kernel/ksyms.h>
+#include <kernel/log.h>
 #include <kernel/monotonic_tick.h>
 #include <kernel/multiboot.h>
+#include <kernel/net/arp.h>
+#include <kernel/net/checksum.h>
+#include <kernel/net/ip.h>
+#include <kernel/net/napi.h>
+#include <kernel/net/net.h>
+#include <kernel/net/pbuf.h>
+#include <kernel/net/udp.h>
+#include <kernel/paging.h>
 #include <kernel/panic.h>
 #include <kernel/pci.h>
+#include <kernel/process.h>
+#include <kernel/profiler.h>
+#include <kernel/static_key.h>
+#include <kernel/syscall.h>
+#include <kernel/time_page.h>
 #include <kernel/tty.h>
+#include <kernel/wallclock.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <utils.h>
+#ifdef BENCHMARKS
+#include <kernel/bench.h>
+#endif
 #ifdef TEST
 #include <kernel/spinlock.h>
 #include <stdio.h>
@@ -20,9 +50,9 @@
 #endif
 
 bool fut_is_ready(void* ctx) {
-    uint32_t* needed_tick = (uint32_t*)ctx;
+    SleepContext* sleep_ctx = (SleepContext*)ctx;
 
-    if (get_tick() < *needed_tick) return false;
+    if (monotonic_ns() < sleep_ctx->deadline_ns) return false;
     return true;
 }
 
@@ -32,30 +62,123 @@ void fut_resume_func(void* ctx) {
 
 extern unsigned int get_esp();
 
+#ifdef TEST
+struct TestSuite {
+    const char* name;
+    void (*run)();
+};
+
+// In boot order, later suites may rely on devices the earlier ones brought up
+static const struct TestSuite test_suites[] = {
+    {"utils", run_utils_tests},
+    {"stdio", run_stdio_tests},
+    {"console", run_console_tests},
+    {"static_key", run_static_key_tests},
+    {"log", run_log_tests},
+    {"allocator", run_allocator_tests},
+    {"gdt", run_gdt_tests},
+    {"idt", run_idt_tests},
+    {"irqsoff", run_irqsoff_tests},
+    {"spinlock", run_spinlock_tests},
+    {"rtc", run_rtc_tests},
+    {"wallclock", run_wallclock_tests},
+    {"boot_trace", run_boot_trace_tests},
+    {"ksyms", run_ksyms_tests},
+    {"profiler", run_profiler_tests},
+    {"acpi", run_acpi_tests},
+    {"hpet", run_hpet_tests},
+    {"monotonic", run_monotonic_tests},
+    {"idle", run_idle_tests},
+    {"paging", run_paging_tests},
+    {"dma", run_dma_tests},
+    {"elf", run_elf_tests},
+    {"syscall", run_syscall_tests},
+    {"process", run_process_tests},
+    {"time_page", run_time_page_tests},
+    {"pci", run_pci_tests},
+    {"pbuf", run_pbuf_tests},
+    {"napi", run_napi_tests},
+    {"rtl8139", run_rtl8139_tests},
+    {"virtio_net", run_virtio_net_tests},
+    {"checksum", run_checksum_tests},
+    {"net", run_net_tests},
+    {"arp", run_arp_tests},
+    {"ip", run_ip_tests},
+    {"udp", run_udp_tests},
+    {"cmdline", run_cmdline_tests},
+};
+#define NUM_TEST_SUITES (sizeof(test_suites) / sizeof(test_suites[0]))
+
+/*
+ * Runs every suite, or the ones named by test=a,b on the command line, and
+ * leaves through exit_() so runner.sh gets the result. test=list prints the
+ * names instead.
+ */
+static void run_tests() {
+    if (cmdline_has("test") && cmdline_selects("test", "list")) {
+        for (size_t i = 0; i < NUM_TEST_SUITES; i++) printf("list-test: %s\n", test_suites[i].name);
+        exit_(EXIT_CODE_PASSED);
+    }
+
+    int selected = 0;
+    for (size_t i = 0; i < NUM_TEST_SUITES; i++)
+        if (cmdline_selects("test", test_suites[i].name)) selected++;
+    if (selected < cmdline_count("test")) {
+        LOG("Unknown test suite in: %s", cmdline_get());
+        exit_(EXIT_CODE_UNKNOWN_NAME);
+    }
+
+    LOG_GREEN("Starting tests");
+    for (size_t i = 0; i < NUM_TEST_SUITES; i++) {
+        if (!cmdline_selects("test", test_suites[i].name)) continue;
+        test_suites[i].run();
+        dump_buffer();
+    }
+    irqsoff_report();
+    profiler_report();
+    exit_(EXIT_CODE_PASSED);
+}
+#endif
+
 void kernel_main(multiboot_info_t* mbd, unsigned int magic) {
     // unsigned int esp = get_esp();
+    boot_trace("entry");
+    console_init();
     terminal_initialize();
+    boot_trace("console");
 
     init_gdt();
     read_gdt();
     init_idt();
+    syscall_init();
+    boot_trace("gdt, idt");
 
     assert(init_serial() == 0, "Could not initialize serial port");
+    cmdline_init(mbd);
+    log_init();
+    idle_init();
+    boot_trace("serial");
     // printf("Stack pointer: 0x%x\n", esp);
     LOG("Hello, kernel World, bootloader: %s", mbd->boot_loader_name);
 
 #ifdef DEBUG
     parse_multiboot_info(mbd, magic);
 #endif
+    multiboot_modules_init(mbd);
     initialize_free_segments(mbd);
+    paging_init();
+    boot_trace("memory");
     configure_rtc();
+    boot_trace("rtc");
 
 #ifdef DEBUG
     LOG("reading before lgdt done");
     read_gdt();
 #endif
-    struct DateTime date_time = get_date_time();
+    wallclock_init();
+    struct DateTime date_time = wallclock_date_time();
     print_date_time(date_time);
+    boot_trace("date");
 
     // #ifndef TEST
     //     LOG("Sleeping for 4 seconds");
@@ -64,6 +187,16 @@ void kernel_main(multiboot_info_t* mbd, unsigned int magic) {
     //     LOG("Waking up");
     // #endif
     init_futures();
+    profiler_init();
+    acpi_init();
+    boot_trace("acpi");
+    monotonic_init();
+    boot_trace("hpet");
+    // The first device lookup enumerates if this has not run by then
+    pci_enumerate_in_background();
+    pbuf_init();
+    checksum_init();
+    boot_trace("pbuf");
 
     // date_time.hours -= 1;
     // set_date_time(date_time);
@@ -71,20 +204,15 @@ void kernel_main(multiboot_info_t* mbd, unsigned int magic) {
     // LOG("After updating");
     // date_time = get_date_time();
     // print_date_time(date_time);
+#ifdef BENCHMARKS
+    run_benchmarks();
+    irqsoff_report();
+    profiler_report();
+    exit_(EXIT_CODE_PASSED);
+#endif
+
 #ifdef TEST
-    LOG_GREEN("Starting tests");
-    run_utils_tests();
-    run_stdio_tests();
-    run_allocator_tests();
-    // run_gdt_tests(); TODO
-    run_idt_tests();
-    dump_buffer();
-    run_spinlock_tests();
-    dump_buffer();
-    run_rtc_tests();
-    run_pci_tests();
-    dump_buffer();
-    exit_(0);
+    run_tests();
 #endif
 
     // LOG("Sleeping for 4 seconds");
@@ -93,25 +221,16 @@ void kernel_main(multiboot_info_t* mbd, unsigned int magic) {
     // await(fut);
     // LOG("Waking up");
 
-    Pci pci = find_pci_address(0x10EC, 0x8139);
-    LOG("Found device at bus: %d, slot: %d", pci.address.bus, pci.address.slot);
-    uint32_t base_addr = find_io_base(pci);
-    LOG("Found base address: %x", base_addr);
-    LOG("Mac: %x", inl(base_addr));
-    LOG("Mac 2: %x", inl(base_addr + 4));
-
-    uint32_t memory_addr = find_mmap_base(pci);
-    LOG("Found memory address: %x", memory_addr);
-
-    uint8_t* mmio = (uint8_t*)memory_addr;
-    uint8_t mac[6];
-    for (int i = 0; i < 6; i++) mac[i] = mmio[i];
-    LOG("MAC from MMIO: %x:%x:%x:%x:%x:%x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    bool net_up = net_init();
+    boot_trace("net");
+    boot_trace_report();
+    irqsoff_report();
     dump_buffer();
 
 #ifdef TEST
     exit_(0);
 #endif
-    while (1) {
-    };
+    if (net_up) udp_services_run();
+
+    while (1) executor_idle();
 }
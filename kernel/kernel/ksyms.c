@@ -0,0 +1,53 @@
+#include <kernel/ksyms.h>
+#include <kernel/panic.h>
+#include <utils.h>
+
+extern unsigned long KERNEL_START;
+extern char __text_end[];
+
+bool ksym_in_text(uint32_t addr) {
+    return addr >= (uintptr_t)&KERNEL_START && addr < (uintptr_t)__text_end;
+}
+
+// Index of the symbol containing addr, the last one starting at or below it, or KSYM_NONE
+int ksym_lookup(uint32_t addr) {
+    if (!ksym_in_text(addr) || kernel_symbol_count == 0 || addr < kernel_symbols[0].addr)
+        return KSYM_NONE;
+
+    int lo = 0, hi = kernel_symbol_count - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (kernel_symbols[mid].addr <= addr)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+const char* ksym_name(int idx) {
+    if (idx < 0 || idx >= kernel_symbol_count) return "[unknown]";
+    return kernel_symbols[idx].name;
+}
+
+#ifdef TEST
+static void test_ksym_lookup() {
+    assert(kernel_symbol_count > 0, "test_ksym_lookup: empty symbol table");
+    for (int i = 1; i < kernel_symbol_count; i++)
+        assert(kernel_symbols[i - 1].addr < kernel_symbols[i].addr, "test_ksym_lookup: unsorted");
+
+    int idx = ksym_lookup((uintptr_t)test_ksym_lookup);
+    assert(idx != KSYM_NONE && kernel_symbols[idx].addr == (uintptr_t)test_ksym_lookup,
+           "test_ksym_lookup 1 FAILED");
+    assert(ksym_lookup((uintptr_t)test_ksym_lookup + 1) == idx, "test_ksym_lookup 2 FAILED");
+    assert(ksym_lookup((uintptr_t)ksym_lookup + 3) == ksym_lookup((uintptr_t)ksym_lookup),
+           "test_ksym_lookup 3 FAILED");
+    assert(ksym_lookup(0) == KSYM_NONE && ksym_lookup((uintptr_t)__text_end) == KSYM_NONE,
+           "test_ksym_lookup 4 FAILED");
+}
+
+void run_ksyms_tests() {
+    test_ksym_lookup();
+    LOG_GREEN("Kernel symbols: [OK]");
+}
+#endif
@@ -0,0 +1,90 @@
+#define LOG_SUBSYSTEM irq
+
+#include <kernel/interrupts.h>
+#include <kernel/lapic.h>
+#include <stddef.h>
+#include <utils.h>
+
+#define CPUID_FEATURES 1
+#define CPUID_EDX_APIC (1 << 9)
+
+#define IA32_APIC_BASE 0x1B
+#define APIC_BASE_ENABLE (1 << 11)
+#define APIC_BASE_ADDRESS_MASK 0xFFFFF000
+
+#define LAPIC_ID 0x020
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SPURIOUS 0x0F0
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+
+#define LAPIC_SOFTWARE_ENABLE (1 << 8)
+#define LVT_DELIVERY_NMI (4 << 8)
+#define LVT_DELIVERY_EXTINT (7 << 8)
+
+#define MSI_ADDRESS_BASE 0xFEE00000
+#define MSI_DESTINATION_SHIFT 12
+
+static volatile uint32_t* lapic = NULL;
+
+static uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+static void spurious_interrupt() {
+}
+
+/*
+ * Software enables the local APIC in virtual wire mode: LINT0 passes the
+ * 8259 through as ExtINT and LINT1 is NMI, as the firmware leaves them, so
+ * the PIC interrupts keep coming. Needs the APIC to be on in the base MSR.
+ */
+bool lapic_init() {
+    if (lapic) return true;
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_EDX_APIC)) {
+        LOG("LAPIC: not present");
+        return false;
+    }
+    uint64_t base = rdmsr(IA32_APIC_BASE);
+    if (!(base & APIC_BASE_ENABLE)) {
+        LOG("LAPIC: disabled by the firmware");
+        return false;
+    }
+
+    INTERRUPT_GUARDED({
+        lapic = (volatile uint32_t*)(uint32_t)(base & APIC_BASE_ADDRESS_MASK);
+        lapic_write(LAPIC_LVT_LINT0, LVT_DELIVERY_EXTINT);
+        lapic_write(LAPIC_LVT_LINT1, LVT_DELIVERY_NMI);
+        register_interrupt(LAPIC_SPURIOUS_VECTOR, spurious_interrupt);
+        lapic_write(LAPIC_SPURIOUS, LAPIC_SOFTWARE_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    });
+    LOG_DEBUG("LAPIC: id %d at %x", lapic_id(), (uint32_t)lapic);
+    return true;
+}
+
+bool lapic_available() {
+    return lapic != NULL;
+}
+
+uint8_t lapic_id() {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi() {
+    if (lapic) lapic_write(LAPIC_EOI, 0);
+}
+
+uint32_t lapic_msi_address() {
+    return MSI_ADDRESS_BASE | (uint32_t)lapic_id() << MSI_DESTINATION_SHIFT;
+}
+
+uint32_t lapic_msi_data(uint8_t vector) {
+    return vector;  // fixed delivery, edge triggered
+}
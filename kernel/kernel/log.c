@@ -0,0 +1,160 @@
+#include <kernel/cmdline.h>
+#include <kernel/io/rtc.h>
+#include <kernel/log.h>
+#include <kernel/monotonic_tick.h>
+#include <kernel/panic.h>
+#include <string.h>
+#include <utils.h>
+
+#define LOG_RATELIMIT_TICKS RTC_FREQ  // one second
+
+LOG_SUBSYSTEMS(LOG_SUBSYSTEM_DEFINE)
+
+#define LOG_SUBSYSTEM_ADDRESS(subsystem) &log_subsystem_##subsystem,
+static LogSubsystem* const subsystems[] = {LOG_SUBSYSTEMS(LOG_SUBSYSTEM_ADDRESS)};
+#define NUM_SUBSYSTEMS (sizeof(subsystems) / sizeof(subsystems[0]))
+
+void log_set_level(LogSubsystem* subsystem, LogLevel level) {
+    subsystem->level = level;
+    for (LogLevel l = LOG_LEVEL_TRACE; l < LOG_LEVEL_COUNT; l++)
+        static_key_set(&subsystem->enabled[l], l >= level);
+}
+
+// Case-insensitive, name is not terminated
+static bool matches(const char* name, size_t len, const char* word) {
+    if (strlen(word) != len) return false;
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i] >= 'A' && name[i] <= 'Z' ? name[i] - 'A' + 'a' : name[i];
+        char w = word[i] >= 'A' && word[i] <= 'Z' ? word[i] - 'A' + 'a' : word[i];
+        if (c != w) return false;
+    }
+    return true;
+}
+
+static LogLevel parse_level(const char* name, size_t len) {
+    LogLevel level = LOG_LEVEL_TRACE;
+    for (; level < LOG_LEVEL_COUNT; level++)
+        if (matches(name, len, log_level_name(level))) break;
+    return level;
+}
+
+static LogSubsystem* find_subsystem(const char* name, size_t len) {
+    for (size_t i = 0; i < NUM_SUBSYSTEMS; i++)
+        if (matches(name, len, subsystems[i]->name)) return subsystems[i];
+    return NULL;
+}
+
+bool log_apply(const char* spec, size_t len) {
+    bool valid = true;
+    const char* item = spec;
+    const char* end = spec + len;
+    while (item < end) {
+        const char* comma = item;
+        while (comma < end && *comma != ',') comma++;
+        const char* colon = item;
+        while (colon < comma && *colon != ':') colon++;
+
+        const char* level_name = colon < comma ? colon + 1 : item;
+        LogLevel level = parse_level(level_name, comma - level_name);
+        LogSubsystem* subsystem = colon < comma ? find_subsystem(item, colon - item) : NULL;
+        if (level == LOG_LEVEL_COUNT || (colon < comma && subsystem == NULL)) {
+            valid = false;
+        } else if (subsystem) {
+            log_set_level(subsystem, level);
+        } else {
+            for (size_t i = 0; i < NUM_SUBSYSTEMS; i++) log_set_level(subsystems[i], level);
+        }
+        item = comma + 1;
+    }
+    return valid;
+}
+
+void log_init() {
+    size_t len;
+    const char* spec = cmdline_value("loglevel", &len);
+    if (spec && !log_apply(spec, len)) LOG_WARN("Unknown subsystem or level in loglevel=");
+}
+
+bool log_ratelimit(LogRateLimit* state, const char* file, int line) {
+    bool print = false;
+    uint32_t missed = 0;
+    uint32_t now = get_tick();
+    INTERRUPT_GUARDED({
+        if (now - state->window_start >= LOG_RATELIMIT_TICKS) {
+            missed = state->missed;
+            state->window_start = now;
+            state->printed = state->missed = 0;
+        }
+        if (state->printed < LOG_RATELIMIT_BURST) {
+            state->printed++;
+            print = true;
+        } else {
+            state->missed++;
+        }
+    });
+    if (missed) write_to_buffer("%u messages suppressed", LOG_LEVEL_WARN, file, line, missed);
+    return print;
+}
+
+#ifdef TEST
+extern int tail;
+
+static void reset_levels() {
+    for (size_t i = 0; i < NUM_SUBSYSTEMS; i++) log_set_level(subsystems[i], LOG_DEFAULT_LEVEL);
+}
+
+void test_log_levels() {
+    dump_buffer();
+    LOG_TRACE("test_log_levels: must not show up");
+    assert(tail == 0, "test_log_levels 1 FAILED");
+
+    log_set_level(&log_subsystem_core, LOG_LEVEL_TRACE);
+    LOG_TRACE("test_log_levels: trace enabled");
+    assert(tail == 1 || LOG_LEVEL_TRACE < LOG_MIN_LEVEL, "test_log_levels 2 FAILED");
+
+    dump_buffer();
+    log_set_level(&log_subsystem_core, LOG_LEVEL_ERROR);
+    LOG("test_log_levels: must not show up");
+    LOG_WARN("test_log_levels: must not show up");
+    assert(tail == 0, "test_log_levels 3 FAILED");
+    reset_levels();
+}
+
+void test_log_apply() {
+    assert(log_apply("pci:trace,NET:warn", strlen("pci:trace,NET:warn")),
+           "test_log_apply 1 FAILED");
+    assert(log_subsystem_pci.level == LOG_LEVEL_TRACE &&
+               log_subsystem_net.level == LOG_LEVEL_WARN &&
+               log_subsystem_core.level == LOG_DEFAULT_LEVEL,
+           "test_log_apply 2 FAILED");
+    assert(log_apply("debug", strlen("debug")) && log_subsystem_pci.level == LOG_LEVEL_DEBUG &&
+               log_subsystem_mem.level == LOG_LEVEL_DEBUG,
+           "test_log_apply 3 FAILED");
+    assert(!log_apply("disk:info,pci:loud", strlen("disk:info,pci:loud")),
+           "test_log_apply 4 FAILED");
+    reset_levels();
+}
+
+void test_log_ratelimit() {
+    LogRateLimit state = {0};
+    int printed = 0;
+    for (int i = 0; i < 3 * LOG_RATELIMIT_BURST; i++)
+        if (log_ratelimit(&state, __FILE__, __LINE__)) printed++;
+    assert(printed == LOG_RATELIMIT_BURST && state.missed == 2 * LOG_RATELIMIT_BURST,
+           "test_log_ratelimit 1 FAILED");
+
+    // The next window reports what the last one dropped
+    dump_buffer();
+    state.window_start -= LOG_RATELIMIT_TICKS;
+    assert(log_ratelimit(&state, __FILE__, __LINE__) && tail == 1 && state.missed == 0,
+           "test_log_ratelimit 2 FAILED");
+    dump_buffer();
+}
+
+void run_log_tests() {
+    test_log_levels();
+    test_log_apply();
+    test_log_ratelimit();
+    LOG_GREEN("Log: [OK]");
+}
+#endif
@@ -1,16 +1,160 @@
+#define LOG_SUBSYSTEM time
+
 #include <kernel/future.h>
+#include <kernel/idle.h>
+#include <kernel/io/hpet.h>
+#include <kernel/io/rtc.h>
 #include <kernel/monotonic_tick.h>
+#include <kernel/panic.h>
+#include <kernel/time_page.h>
 #include <utils.h>
+#ifdef BENCHMARKS
+#include <kernel/bench.h>
+#endif
+
+#define TSC_CALIBRATION_TICKS 16     // 62.5 ms at RTC_FREQ
+#define TSC_CALIBRATION_NS 10000000  // against the HPET
+#define NO_TIMEOUT UINT64_MAX
 
 MonotonicTick monotonicTick = {0};
+static uint64_t tsc_hz = 0;
+
+static HpetTimer* timeout_timer = NULL;
+static volatile uint64_t timeout_deadline = NO_TIMEOUT;  // of the armed comparator, in ns
 
 void process_tick() {
     monotonicTick.tick++;
+    // Keeps a 32 bit HPET counter from wrapping unseen
+    if (monotonicTick.tick % RTC_FREQ == 0 && hpet_available()) hpet_counter();
+    time_page_update();
     process_time_futures();
 }
 
+// One aligned load, the interrupt cannot split it
 uint32_t get_tick() {
-    uint32_t tick = 0;
-    INTERRUPT_GUARDED({ tick = monotonicTick.tick; });
-    return tick;
+    return *(volatile uint32_t*)&monotonicTick.tick;
+}
+
+/*
+ * TSC cycles per second, measured against the HPET or else the RTC tick the
+ * first time it is asked for. Spins for TSC_CALIBRATION_NS or
+ * TSC_CALIBRATION_TICKS, so callers on the boot path should ask after the
+ * part they are timing.
+ */
+uint64_t tsc_frequency() {
+    if (tsc_hz) return tsc_hz;
+
+    if (hpet_available()) {
+        uint64_t window = hpet_ns_to_counter(TSC_CALIBRATION_NS);
+        uint64_t start = hpet_counter();
+        uint64_t tsc = rdtsc();
+        uint64_t counted;
+        while ((counted = hpet_counter() - start) < window) asm volatile("pause");
+        tsc_hz = (rdtsc() - tsc) * hpet_frequency() / counted;
+        return tsc_hz;
+    }
+
+    uint32_t tick = get_tick();
+    while (get_tick() == tick) asm volatile("pause");  // start on a tick edge
+
+    tick = get_tick();
+    uint64_t start = rdtsc();
+    while (get_tick() - tick < TSC_CALIBRATION_TICKS) asm volatile("pause");
+    tsc_hz = (rdtsc() - start) * RTC_FREQ / TSC_CALIBRATION_TICKS;
+    return tsc_hz;
+}
+
+uint32_t tsc_to_us(uint64_t cycles) {
+    return cycles * 1000000 / tsc_frequency();
+}
+
+static void timeout_interrupt() {
+    timeout_deadline = NO_TIMEOUT;
+    process_time_futures();
+}
+
+void monotonic_init() {
+    if (!hpet_init()) return;
+    timeout_timer = hpet_timer_claim(timeout_interrupt);
+    if (!timeout_timer) LOG("Monotonic: no HPET comparator for timeouts, using the RTC tick");
+}
+
+uint64_t monotonic_ns() {
+    if (hpet_available()) return hpet_counter_to_ns(hpet_counter());
+    return (uint64_t)get_tick() * (NS_PER_SECOND / RTC_FREQ);
+}
+
+bool monotonic_precise_timeouts() {
+    return timeout_timer != NULL;
+}
+
+// False if no interrupt is coming for it: already due, or no comparator and only the tick is
+static bool arm_timeout(uint64_t deadline_ns) {
+    if (!timeout_timer) return false;
+
+    bool armed;
+    INTERRUPT_GUARDED({
+        uint64_t now = monotonic_ns();
+        if (timeout_deadline > now && timeout_deadline <= deadline_ns) {
+            armed = true;  // an earlier one is pending, its waiter sets this one again after
+        } else {
+            armed = hpet_timer_arm(timeout_timer, hpet_ns_to_counter(deadline_ns));
+            timeout_deadline = armed ? deadline_ns : NO_TIMEOUT;
+        }
+    });
+    return armed;
+}
+
+void monotonic_set_timeout(uint64_t deadline_ns) {
+    if (timeout_timer && !arm_timeout(deadline_ns)) wakeup_executor();
+}
+
+void monotonic_wait_until(uint64_t deadline_ns) {
+    while (monotonic_ns() < deadline_ns) {
+        // Armed with interrupts off, so the timeout cannot fire before the CPU is idle
+        IrqFlags flags = irq_save();
+        if (!timeout_timer || arm_timeout(deadline_ns)) idle_wait_sti(NULL);
+        irq_restore(flags);
+    }
+}
+
+#ifdef TEST
+void test_monotonic_ns() {
+    uint64_t start = monotonic_ns();
+    uint32_t tick = get_tick();
+    while (get_tick() - tick < RTC_FREQ / 8) asm volatile("hlt");
+    uint64_t elapsed = monotonic_ns() - start;
+    uint64_t expected = NS_PER_SECOND / 8;
+    assert(elapsed > expected - expected / 10 && elapsed < expected + expected / 10,
+           "test_monotonic_ns 1 FAILED");
+}
+
+// With a comparator the wait ends well inside one RTC tick of its deadline
+void test_wait_until() {
+    uint64_t deadline = monotonic_ns() + 1500000;
+    monotonic_wait_until(deadline);
+    uint64_t late = monotonic_ns() - deadline;
+    assert(monotonic_ns() >= deadline, "test_wait_until 1 FAILED");
+    assert(!monotonic_precise_timeouts() || late < NS_PER_SECOND / RTC_FREQ / 2,
+           "test_wait_until 2 FAILED");
+
+    // Two deadlines, the later waiter sets its own again once the earlier fired
+    monotonic_set_timeout(monotonic_ns() + 500000);
+    deadline = monotonic_ns() + 2000000;
+    monotonic_wait_until(deadline);
+    assert(monotonic_ns() >= deadline, "test_wait_until 3 FAILED");
+}
+
+void run_monotonic_tests() {
+    monotonic_init();
+    test_monotonic_ns();
+    test_wait_until();
+    LOG_GREEN("Monotonic: [OK]");
+}
+#endif
+
+#ifdef BENCHMARKS
+BENCH(monotonic_ns) {
+    monotonic_ns();
 }
+#endif
@@ -4,6 +4,9 @@
 extern unsigned long KERNEL_START;
 extern unsigned long KERNEL_END;
 
+static multiboot_module_t modules[MULTIBOOT_MAX_MODULES];
+static multiboot_uint32_t module_count = 0;
+
 void parse_multiboot_info(multiboot_info_t* mbd, unsigned int magic) {
     if (magic != MULTIBOOT_BOOTLOADER_MAGIC) {
         LOG("invalid magic number");
@@ -32,3 +35,23 @@ void parse_multiboot_info(multiboot_info_t* mbd, unsigned int magic) {
     LOG("Kernel start: 0x%x\n", &KERNEL_START);
     LOG("Kernel end: 0x%x\n", &KERNEL_END);
 }
+
+void multiboot_modules_init(multiboot_info_t* mbd) {
+    if (!(mbd->flags & MULTIBOOT_INFO_MODS)) return;
+
+    const multiboot_module_t* list = (const multiboot_module_t*)mbd->mods_addr;
+    module_count = min(mbd->mods_count, MULTIBOOT_MAX_MODULES);
+    if (mbd->mods_count > module_count) LOG_WARN("Ignoring boot modules past %u", module_count);
+    for (multiboot_uint32_t i = 0; i < module_count; i++) {
+        modules[i] = list[i];
+        LOG_DEBUG("Module %u: 0x%x - 0x%x", i, modules[i].mod_start, modules[i].mod_end);
+    }
+}
+
+multiboot_uint32_t multiboot_module_count() {
+    return module_count;
+}
+
+const multiboot_module_t* multiboot_module(multiboot_uint32_t index) {
+    return index < module_count ? &modules[index] : NULL;
+}
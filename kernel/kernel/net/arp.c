@@ -0,0 +1,261 @@
+#define LOG_SUBSYSTEM net
+
+#include <kernel/future.h>
+#include <kernel/io/rtc.h>
+#include <kernel/monotonic_tick.h>
+#include <kernel/net/arp.h>
+#include <kernel/panic.h>
+#include <string.h>
+#include <utils.h>
+
+#define ARP_TIMEOUT_TICKS (60 * RTC_FREQ)
+#define ARP_RETRY_TICKS (RTC_FREQ / 4)
+
+#define ARP_HARDWARE_ETHERNET 1
+
+enum ArpState { ARP_FREE = 0, ARP_PENDING, ARP_RESOLVED };
+
+struct ArpEntry {
+    uint32_t ip;
+    uint8_t mac[ETH_ADDR_LEN];
+    enum ArpState state;
+    uint32_t updated_tick;
+    Pbuf* waiting;  // last packet sent while resolving, newer ones replace it
+};
+
+static struct ArpEntry cache[ARP_CACHE_SIZE];
+static const uint8_t ZERO_MAC[ETH_ADDR_LEN] = {0};
+
+// Expects interrupts to be disabled
+static struct ArpEntry* find_entry(uint32_t ip) {
+    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
+        if (cache[i].state != ARP_FREE && cache[i].ip == ip) return &cache[i];
+    }
+    return NULL;
+}
+
+// Expects interrupts to be disabled. Reuses a free slot or evicts the least recently updated.
+static struct ArpEntry* new_entry(uint32_t ip) {
+    struct ArpEntry* victim = &cache[0];
+    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
+        if (cache[i].state == ARP_FREE) {
+            victim = &cache[i];
+            break;
+        }
+        if (cache[i].updated_tick < victim->updated_tick) victim = &cache[i];
+    }
+    if (victim->waiting) pbuf_free(victim->waiting);
+
+    memset(victim, 0, sizeof(*victim));
+    victim->ip = ip;
+    return victim;
+}
+
+static bool expired(const struct ArpEntry* entry) {
+    return get_tick() - entry->updated_tick > ARP_TIMEOUT_TICKS;
+}
+
+bool arp_lookup(uint32_t ip, uint8_t mac[ETH_ADDR_LEN]) {
+    bool found = false;
+    INTERRUPT_GUARDED({
+        struct ArpEntry* entry = find_entry(ip);
+        if (entry && entry->state == ARP_RESOLVED && !expired(entry)) {
+            memcpy(mac, entry->mac, ETH_ADDR_LEN);
+            found = true;
+        }
+    });
+    return found;
+}
+
+static int send_arp(uint16_t operation, const uint8_t dst_mac[ETH_ADDR_LEN], uint32_t target_ip) {
+    NetInterface* netif = net_interface();
+    Pbuf* p = pbuf_alloc(sizeof(ArpPacket));
+    if (!p) return NET_TX_DROPPED;
+
+    ArpPacket* arp = (ArpPacket*)p->data;
+    arp->hardware_type = htons(ARP_HARDWARE_ETHERNET);
+    arp->protocol_type = htons(ETH_TYPE_IPV4);
+    arp->hardware_len = ETH_ADDR_LEN;
+    arp->protocol_len = 4;
+    arp->operation = htons(operation);
+    memcpy(arp->sender_mac, netif->mac, ETH_ADDR_LEN);
+    arp->sender_ip = htonl(netif->ip);
+    memcpy(arp->target_mac, operation == ARP_OP_REPLY ? dst_mac : ZERO_MAC, ETH_ADDR_LEN);
+    arp->target_ip = htonl(target_ip);
+
+    if (operation == ARP_OP_REQUEST)
+        netif->stats.arp_requests++;
+    else
+        netif->stats.arp_replies++;
+    return net_output(p, dst_mac, ETH_TYPE_ARP);
+}
+
+int arp_request(uint32_t ip) {
+    return send_arp(ARP_OP_REQUEST, ETH_BROADCAST, ip);
+}
+
+/*
+ * Sends an IPv4 packet to next_hop, resolving it first if needed. On a miss
+ * the packet is parked on the cache entry and goes out with the reply, so the
+ * caller never waits. Always takes ownership of p.
+ */
+int arp_output(Pbuf* p, uint32_t next_hop) {
+    uint8_t mac[ETH_ADDR_LEN];
+    if (next_hop == 0xFFFFFFFF) return net_output(p, ETH_BROADCAST, ETH_TYPE_IPV4);
+    if (arp_lookup(next_hop, mac)) return net_output(p, mac, ETH_TYPE_IPV4);
+
+    bool send_request = false;
+    INTERRUPT_GUARDED({
+        struct ArpEntry* entry = find_entry(next_hop);
+        if (!entry) entry = new_entry(next_hop);
+        if (entry->state != ARP_PENDING) {  // new, or expired and resolved again in place
+            entry->state = ARP_PENDING;
+            entry->updated_tick = get_tick() - ARP_RETRY_TICKS;
+        }
+        if (entry->waiting) pbuf_free(entry->waiting);
+        entry->waiting = p;
+
+        if (get_tick() - entry->updated_tick >= ARP_RETRY_TICKS) {
+            entry->updated_tick = get_tick();
+            send_request = true;
+        }
+    });
+    if (send_request) arp_request(next_hop);
+    return 0;
+}
+
+void arp_input(Pbuf* p) {
+    NetInterface* netif = net_interface();
+    if (p->len < sizeof(ArpPacket)) {
+        netif->stats.rx_dropped++;
+        pbuf_free(p);
+        return;
+    }
+
+    ArpPacket* arp = (ArpPacket*)p->data;
+    if (ntohs(arp->hardware_type) != ARP_HARDWARE_ETHERNET ||
+        ntohs(arp->protocol_type) != ETH_TYPE_IPV4) {
+        netif->stats.rx_dropped++;
+        pbuf_free(p);
+        return;
+    }
+
+    uint32_t sender_ip = ntohl(arp->sender_ip);
+    uint32_t target_ip = ntohl(arp->target_ip);
+    uint16_t operation = ntohs(arp->operation);
+    uint8_t sender_mac[ETH_ADDR_LEN];
+    memcpy(sender_mac, arp->sender_mac, ETH_ADDR_LEN);
+    pbuf_free(p);
+
+    // Learn the sender if it is known already or if it is talking to us (RFC 826)
+    Pbuf* waiting = NULL;
+    INTERRUPT_GUARDED({
+        struct ArpEntry* entry = find_entry(sender_ip);
+        if (!entry && target_ip == netif->ip) entry = new_entry(sender_ip);
+        if (entry) {
+            memcpy(entry->mac, sender_mac, ETH_ADDR_LEN);
+            entry->state = ARP_RESOLVED;
+            entry->updated_tick = get_tick();
+            waiting = entry->waiting;
+            entry->waiting = NULL;
+        }
+    });
+    if (waiting) net_output(waiting, sender_mac, ETH_TYPE_IPV4);
+
+    if (operation == ARP_OP_REQUEST && target_ip == netif->ip)
+        send_arp(ARP_OP_REPLY, sender_mac, sender_ip);
+}
+
+#ifdef TEST
+void test_arp_eviction() {
+    INTERRUPT_GUARDED({
+        for (int i = 0; i < ARP_CACHE_SIZE; i++) {
+            struct ArpEntry* entry = new_entry(NET_IP(192, 168, 0, i));
+            entry->state = ARP_RESOLVED;
+            entry->updated_tick = get_tick() - ARP_CACHE_SIZE + i;
+        }
+        // The oldest entry (192.168.0.0) makes room
+        struct ArpEntry* entry = new_entry(NET_IP(192, 168, 1, 0));
+        entry->state = ARP_RESOLVED;
+        entry->updated_tick = get_tick();
+    });
+
+    uint8_t mac[ETH_ADDR_LEN];
+    assert(!arp_lookup(NET_IP(192, 168, 0, 0), mac), "test_arp_eviction 1 FAILED");
+    assert(arp_lookup(NET_IP(192, 168, 0, 1), mac), "test_arp_eviction 2 FAILED");
+    assert(arp_lookup(NET_IP(192, 168, 1, 0), mac), "test_arp_eviction 3 FAILED");
+
+    INTERRUPT_GUARDED(memset(cache, 0, sizeof(cache)));
+}
+
+static int entries_for(uint32_t ip) {
+    int count = 0;
+    INTERRUPT_GUARDED({
+        for (int i = 0; i < ARP_CACHE_SIZE; i++)
+            if (cache[i].state != ARP_FREE && cache[i].ip == ip) count++;
+    });
+    return count;
+}
+
+// An expired entry is resolved again in place, never duplicated
+void test_arp_expired() {
+    uint32_t ip = NET_IP(10, 0, 2, 99);
+    uint8_t old_mac[ETH_ADDR_LEN] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x01};
+    uint8_t new_mac[ETH_ADDR_LEN] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x02};
+    INTERRUPT_GUARDED({
+        struct ArpEntry* entry = new_entry(ip);
+        memcpy(entry->mac, old_mac, ETH_ADDR_LEN);
+        entry->state = ARP_RESOLVED;
+        entry->updated_tick = get_tick() - ARP_TIMEOUT_TICKS - 1;
+    });
+
+    uint8_t mac[ETH_ADDR_LEN];
+    assert(!arp_lookup(ip, mac), "test_arp_expired 1 FAILED");
+    Pbuf* p = pbuf_alloc(64);  // stands in for an IPv4 packet
+    assert(p != NULL, "test_arp_expired 2 FAILED");
+    arp_output(p, ip);
+    assert(entries_for(ip) == 1, "test_arp_expired 3 FAILED");
+
+    // The reply updates that entry and sends the packet parked on it
+    Pbuf* reply = pbuf_alloc(sizeof(ArpPacket));
+    assert(reply != NULL, "test_arp_expired 4 FAILED");
+    ArpPacket* arp = (ArpPacket*)reply->data;
+    memset(arp, 0, sizeof(*arp));
+    arp->hardware_type = htons(ARP_HARDWARE_ETHERNET);
+    arp->protocol_type = htons(ETH_TYPE_IPV4);
+    arp->hardware_len = ETH_ADDR_LEN;
+    arp->protocol_len = 4;
+    arp->operation = htons(ARP_OP_REPLY);
+    memcpy(arp->sender_mac, new_mac, ETH_ADDR_LEN);
+    arp->sender_ip = htonl(ip);
+    arp->target_ip = htonl(net_interface()->ip);
+    arp_input(reply);
+
+    assert(arp_lookup(ip, mac) && memcmp(mac, new_mac, ETH_ADDR_LEN) == 0,
+           "test_arp_expired 5 FAILED");
+    assert(entries_for(ip) == 1, "test_arp_expired 6 FAILED");
+
+    INTERRUPT_GUARDED(memset(cache, 0, sizeof(cache)));
+}
+
+// QEMU's user mode network answers for the gateway
+void test_arp_resolve_gateway() {
+    uint8_t mac[ETH_ADDR_LEN];
+    uint32_t gateway = net_interface()->gateway;
+    arp_request(gateway);
+
+    uint32_t deadline = get_tick() + RTC_FREQ;
+    while (!arp_lookup(gateway, mac) && get_tick() < deadline) {
+        if (!run_tasks()) asm volatile("hlt");  // replies come in through the napi task
+    }
+    assert(arp_lookup(gateway, mac), "test_arp_resolve_gateway FAILED");
+}
+
+void run_arp_tests() {
+    assert(net_init(), "no network device");
+    test_arp_eviction();
+    test_arp_expired();
+    test_arp_resolve_gateway();
+    LOG_GREEN("ARP: [OK]");
+}
+#endif
@@ -0,0 +1,350 @@
+#define LOG_SUBSYSTEM net
+
+#include <kernel/net/checksum.h>
+#include <kernel/panic.h>
+#include <string.h>
+#include <utils.h>
+#ifdef BENCHMARKS
+#include <kernel/bench.h>
+#endif
+
+#define CPUID_EDX_FXSR (1 << 24)
+#define CPUID_EDX_SSE2 (1 << 26)
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
+#define ADC_BLOCK 32
+#define COPY_BLOCK 16
+#define SSE2_BLOCK 32
+// Each 32-bit lane takes two words per block, so it cannot wrap below 32768 blocks
+#define SSE2_MAX_BLOCKS 16384
+
+static bool use_sse2 = false;
+
+/*
+ * The kernel is built with -mgeneral-regs-only and has no FPU context
+ * switching, so SSE is only turned on for the checksum code, which saves
+ * every xmm register it touches.
+ */
+void checksum_init() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if ((edx & (CPUID_EDX_FXSR | CPUID_EDX_SSE2)) != (CPUID_EDX_FXSR | CPUID_EDX_SSE2)) {
+        LOG("Checksum: no SSE2, using adc");
+        return;
+    }
+
+    uint32_t cr0, cr4;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" : : "r"((cr0 & ~CR0_EM) | CR0_MP));
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile("mov %0, %%cr4" : : "r"(cr4 | CR4_OSFXSR | CR4_OSXMMEXCPT));
+    use_sse2 = true;
+    LOG("Checksum: using SSE2");
+}
+
+bool checksum_has_sse2() {
+    return use_sse2;
+}
+
+static uint32_t fold64(uint64_t sum) {
+    while (sum >> 32) sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    return (uint32_t)sum;
+}
+
+// Carries stay in CF across the unrolled adds and are folded back once at the end
+static uint32_t sum_blocks_adc(const uint8_t* data, uint32_t blocks) {
+    uint32_t sum = 0;
+    asm volatile(
+        "clc\n\t"
+        "1:\n\t"
+        "adcl 0(%[data]), %[sum]\n\t"
+        "adcl 4(%[data]), %[sum]\n\t"
+        "adcl 8(%[data]), %[sum]\n\t"
+        "adcl 12(%[data]), %[sum]\n\t"
+        "adcl 16(%[data]), %[sum]\n\t"
+        "adcl 20(%[data]), %[sum]\n\t"
+        "adcl 24(%[data]), %[sum]\n\t"
+        "adcl 28(%[data]), %[sum]\n\t"
+        "leal 32(%[data]), %[data]\n\t"  // lea and dec leave CF alone
+        "decl %[blocks]\n\t"
+        "jnz 1b\n\t"
+        "adcl $0, %[sum]"
+        : [sum] "+r"(sum), [data] "+r"(data), [blocks] "+r"(blocks)
+        :
+        : "cc", "memory");
+    return sum;
+}
+
+// Same as sum_blocks_adc, storing every dword to dst after adding it
+static uint32_t copy_blocks_adc(uint8_t* dst, const uint8_t* src, uint32_t blocks) {
+    uint32_t sum = 0;
+    uint32_t tmp;
+    asm volatile(
+        "clc\n\t"
+        "1:\n\t"
+        "movl 0(%[src]), %[tmp]\n\t"
+        "adcl %[tmp], %[sum]\n\t"
+        "movl %[tmp], 0(%[dst])\n\t"
+        "movl 4(%[src]), %[tmp]\n\t"
+        "adcl %[tmp], %[sum]\n\t"
+        "movl %[tmp], 4(%[dst])\n\t"
+        "movl 8(%[src]), %[tmp]\n\t"
+        "adcl %[tmp], %[sum]\n\t"
+        "movl %[tmp], 8(%[dst])\n\t"
+        "movl 12(%[src]), %[tmp]\n\t"
+        "adcl %[tmp], %[sum]\n\t"
+        "movl %[tmp], 12(%[dst])\n\t"
+        "leal 16(%[src]), %[src]\n\t"
+        "leal 16(%[dst]), %[dst]\n\t"
+        "decl %[blocks]\n\t"
+        "jnz 1b\n\t"
+        "adcl $0, %[sum]"
+        : [sum] "+r"(sum), [src] "+r"(src), [dst] "+r"(dst), [blocks] "+r"(blocks),
+          [tmp] "=&r"(tmp)
+        :
+        : "cc", "memory");
+    return sum;
+}
+
+/*
+ * Zero extends the 16-bit words into 32-bit lanes so the adds never carry,
+ * which avoids the end-around carry SSE2 cannot do. xmm0-4 are saved and
+ * restored around the loop since an irq may interrupt another checksum.
+ */
+static uint64_t sum_blocks_sse2(const uint8_t* data, uint32_t blocks) {
+    uint8_t saved[80];
+    uint32_t lanes[8];
+    asm volatile(
+        "movdqu %%xmm0, 0(%[saved])\n\t"
+        "movdqu %%xmm1, 16(%[saved])\n\t"
+        "movdqu %%xmm2, 32(%[saved])\n\t"
+        "movdqu %%xmm3, 48(%[saved])\n\t"
+        "movdqu %%xmm4, 64(%[saved])\n\t"
+        "pxor %%xmm0, %%xmm0\n\t"
+        "pxor %%xmm2, %%xmm2\n\t"
+        "pxor %%xmm3, %%xmm3\n\t"
+        "1:\n\t"
+        "movdqu 0(%[data]), %%xmm1\n\t"
+        "movdqa %%xmm1, %%xmm4\n\t"
+        "punpcklwd %%xmm0, %%xmm1\n\t"
+        "punpckhwd %%xmm0, %%xmm4\n\t"
+        "paddd %%xmm1, %%xmm2\n\t"
+        "paddd %%xmm4, %%xmm3\n\t"
+        "movdqu 16(%[data]), %%xmm1\n\t"
+        "movdqa %%xmm1, %%xmm4\n\t"
+        "punpcklwd %%xmm0, %%xmm1\n\t"
+        "punpckhwd %%xmm0, %%xmm4\n\t"
+        "paddd %%xmm1, %%xmm2\n\t"
+        "paddd %%xmm4, %%xmm3\n\t"
+        "addl $32, %[data]\n\t"
+        "decl %[blocks]\n\t"
+        "jnz 1b\n\t"
+        "movdqu %%xmm2, 0(%[lanes])\n\t"
+        "movdqu %%xmm3, 16(%[lanes])\n\t"
+        "movdqu 0(%[saved]), %%xmm0\n\t"
+        "movdqu 16(%[saved]), %%xmm1\n\t"
+        "movdqu 32(%[saved]), %%xmm2\n\t"
+        "movdqu 48(%[saved]), %%xmm3\n\t"
+        "movdqu 64(%[saved]), %%xmm4"
+        : [data] "+r"(data), [blocks] "+r"(blocks)
+        : [saved] "r"(saved), [lanes] "r"(lanes)
+        : "cc", "memory");
+
+    uint64_t sum = 0;
+    for (int i = 0; i < 8; i++) sum += lanes[i];
+    return sum;
+}
+
+static uint64_t sum_tail(const uint8_t* bytes, size_t len) {
+    uint64_t sum = 0;
+    while (len > 1) {
+        sum += (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8);
+        bytes += 2;
+        len -= 2;
+    }
+    if (len) sum += bytes[0];
+    return sum;
+}
+
+static uint32_t partial(const uint8_t* bytes, size_t len, uint32_t sum, bool sse2) {
+    uint64_t total = sum;
+    if (sse2 && len >= CHECKSUM_SSE2_THRESHOLD) {
+        while (len >= SSE2_BLOCK) {
+            uint32_t blocks = min(len / SSE2_BLOCK, SSE2_MAX_BLOCKS);
+            total += sum_blocks_sse2(bytes, blocks);
+            bytes += blocks * SSE2_BLOCK;
+            len -= blocks * SSE2_BLOCK;
+        }
+    } else if (len >= ADC_BLOCK) {
+        uint32_t blocks = len / ADC_BLOCK;
+        total += sum_blocks_adc(bytes, blocks);
+        bytes += blocks * ADC_BLOCK;
+        len -= blocks * ADC_BLOCK;
+    }
+    return fold64(total + sum_tail(bytes, len));
+}
+
+/*
+ * Adds 16-bit words of data to a running one's complement sum. The words are
+ * summed in memory order, so the folded result can be stored back without a
+ * byte swap. Only the last chunk of a message may have an odd length.
+ */
+uint32_t checksum_partial(const void* data, size_t len, uint32_t sum) {
+    return partial((const uint8_t*)data, len, sum, use_sse2);
+}
+
+// memcpy that returns checksum_partial(src, len, sum), reading the source once
+uint32_t checksum_copy(void* dst, const void* src, size_t len, uint32_t sum) {
+    uint8_t* to = (uint8_t*)dst;
+    const uint8_t* from = (const uint8_t*)src;
+    uint64_t total = sum;
+    if (len >= COPY_BLOCK) {
+        uint32_t blocks = len / COPY_BLOCK;
+        total += copy_blocks_adc(to, from, blocks);
+        to += blocks * COPY_BLOCK;
+        from += blocks * COPY_BLOCK;
+        len -= blocks * COPY_BLOCK;
+    }
+    memcpy(to, from, len);
+    return fold64(total + sum_tail(to, len));
+}
+
+uint16_t checksum_fold(uint32_t sum) {
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum & 0xFFFF;
+}
+
+uint16_t inet_checksum(const void* data, size_t len) {
+    return checksum_fold(checksum_partial(data, len, 0));
+}
+
+// HC' = ~(~HC + ~m + m')
+uint16_t checksum_update16(uint16_t check, uint16_t old_value, uint16_t new_value) {
+    uint32_t sum = (uint16_t)~check + (uint16_t)~old_value + new_value;
+    return checksum_fold(sum);
+}
+
+uint16_t checksum_update32(uint16_t check, uint32_t old_value, uint32_t new_value) {
+    uint32_t sum = (uint16_t)~check;
+    sum += (uint16_t)~old_value + (uint16_t)~(old_value >> 16);
+    sum += (new_value & 0xFFFF) + (new_value >> 16);
+    return checksum_fold(sum);
+}
+
+#ifdef TEST
+static uint32_t test_seed = 12345;
+
+static uint8_t test_random_byte() {
+    test_seed = test_seed * 1103515245 + 12345;
+    return (test_seed >> 16) & 0xFF;
+}
+
+// Example from RFC 1071 section 3
+void test_rfc1071_example() {
+    const uint8_t data[8] = {0x00, 0x01, 0xf2, 0x03, 0xf4, 0xf5, 0xf6, 0xf7};
+    uint16_t sum = ~inet_checksum(data, sizeof(data)) & 0xFFFF;
+    assert(sum == 0xf2dd, "test_rfc1071_example FAILED");  // 0xddf2 in network order
+}
+
+// A header with its checksum filled in sums to zero
+void test_verify_ipv4_header() {
+    uint8_t header[20] = {0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11,
+                          0x00, 0x00, 0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7};
+    uint16_t sum = inet_checksum(header, sizeof(header));
+    header[10] = sum & 0xFF;
+    header[11] = sum >> 8;
+    assert(header[10] == 0xb8 && header[11] == 0x61, "test_verify_ipv4_header 1 FAILED");
+    assert(inet_checksum(header, sizeof(header)) == 0, "test_verify_ipv4_header 2 FAILED");
+}
+
+// Every variant folds to what the plain word loop gives, at any length and alignment
+void test_variants_agree() {
+    static uint8_t data[1600];
+    static uint8_t copy[1600];
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = test_random_byte();
+    data[0] = data[1] = data[2] = data[3] = 0xFF;  // long carry chains
+
+    for (size_t offset = 0; offset < 4; offset++) {
+        for (size_t len = 0; len + offset <= sizeof(data); len += (len < 80 ? 1 : 37)) {
+            uint16_t expected = checksum_fold(fold64(0xABCD + sum_tail(data + offset, len)));
+            assert(checksum_fold(partial(data + offset, len, 0xABCD, false)) == expected,
+                   "test_variants_agree adc FAILED");
+            if (use_sse2)
+                assert(checksum_fold(partial(data + offset, len, 0xABCD, true)) == expected,
+                       "test_variants_agree sse2 FAILED");
+
+            memset(copy, 0, sizeof(copy));
+            uint32_t sum = checksum_copy(copy + offset, data + offset, len, 0xABCD);
+            assert(checksum_fold(sum) == expected, "test_variants_agree copy sum FAILED");
+            assert(memcmp(copy + offset, data + offset, len) == 0,
+                   "test_variants_agree copy data FAILED");
+        }
+    }
+}
+
+// Patching the TTL and an address gives the same checksum as summing again
+void test_incremental_update() {
+    uint8_t header[20] = {0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11,
+                          0x00, 0x00, 0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7};
+    uint16_t* check = (uint16_t*)&header[10];
+    *check = inet_checksum(header, sizeof(header));
+
+    uint16_t old_word = *(uint16_t*)&header[8];
+    header[8]--;  // TTL
+    *check = checksum_update16(*check, old_word, *(uint16_t*)&header[8]);
+    assert(inet_checksum(header, sizeof(header)) == 0, "test_incremental_update 1 FAILED");
+
+    uint32_t old_addr = *(uint32_t*)&header[16];
+    uint32_t new_addr = 0xFFFF000A;
+    *(uint32_t*)&header[16] = new_addr;
+    *check = checksum_update32(*check, old_addr, new_addr);
+    assert(inet_checksum(header, sizeof(header)) == 0, "test_incremental_update 2 FAILED");
+}
+
+void run_checksum_tests() {
+    test_rfc1071_example();
+    test_verify_ipv4_header();
+    test_variants_agree();
+    test_incremental_update();
+    LOG_GREEN("Checksum: [OK]");
+}
+#endif
+
+#ifdef BENCHMARKS
+static uint8_t bench_packet[1500];
+static uint8_t bench_copy[1500];
+static volatile uint32_t bench_sum;  // keeps the static variants from being optimized out
+
+BENCH(inet_checksum_64) {
+    inet_checksum(bench_packet, 64);
+}
+
+BENCH(inet_checksum_576) {
+    inet_checksum(bench_packet, 576);
+}
+
+BENCH(inet_checksum_1500) {
+    inet_checksum(bench_packet, sizeof(bench_packet));
+}
+
+// The variants inet_checksum() picks from, and the old word at a time loop as the baseline
+BENCH(checksum_words_1500) {
+    bench_sum = fold64(sum_tail(bench_packet, sizeof(bench_packet)));
+}
+
+BENCH(checksum_adc_1500) {
+    bench_sum = partial(bench_packet, sizeof(bench_packet), 0, false);
+}
+
+BENCH(checksum_sse2_1500) {
+    if (!use_sse2) return;
+    bench_sum = partial(bench_packet, sizeof(bench_packet), 0, true);
+}
+
+BENCH(checksum_copy_1500) {
+    checksum_copy(bench_copy, bench_packet, sizeof(bench_packet), 0);
+}
+#endif
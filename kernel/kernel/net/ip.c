@@ -0,0 +1,176 @@
+#define LOG_SUBSYSTEM net
+
+#include <kernel/net/arp.h>
+#include <kernel/net/checksum.h>
+#include <kernel/net/ip.h>
+#include <kernel/net/udp.h>
+#include <kernel/panic.h>
+#include <string.h>
+#include <utils.h>
+
+static uint16_t next_id = 0;
+
+static bool on_link(const NetInterface* netif, uint32_t dst) {
+    return (dst & netif->netmask) == (netif->ip & netif->netmask);
+}
+
+/*
+ * Answers from a fresh pool pbuf: the request may still sit in a NIC rx ring.
+ * The request is verified while it is copied, and since only the type
+ * changes the checksum is patched instead of recomputed.
+ */
+static void icmp_input(Pbuf* p, uint32_t src) {
+    NetInterface* netif = net_interface();
+    IcmpHeader* request = (IcmpHeader*)p->data;
+    if (p->len < sizeof(IcmpHeader) || request->type != ICMP_ECHO_REQUEST) {
+        netif->stats.ip_dropped++;
+        pbuf_free(p);
+        return;
+    }
+
+    Pbuf* reply = pbuf_alloc(p->len);
+    if (!reply) {
+        netif->stats.tx_dropped++;
+        pbuf_free(p);
+        return;
+    }
+    uint16_t check = checksum_fold(checksum_copy(reply->data, p->data, p->len, 0));
+    pbuf_free(p);
+    if (check != 0) {
+        netif->stats.ip_dropped++;
+        pbuf_free(reply);
+        return;
+    }
+
+    IcmpHeader* icmp = (IcmpHeader*)reply->data;
+    icmp->type = ICMP_ECHO_REPLY;
+    // code is unchanged, so the type alone stands in for the type/code word
+    icmp->checksum = checksum_update16(icmp->checksum, ICMP_ECHO_REQUEST, ICMP_ECHO_REPLY);
+
+    netif->stats.icmp_echo_replies++;
+    ip_output(reply, netif->ip, src, IP_PROTO_ICMP);
+}
+
+// Fragments are dropped, the fast path never reassembles
+void ip_input(Pbuf* p) {
+    NetInterface* netif = net_interface();
+    netif->stats.ip_rx++;
+
+    Ipv4Header* ip = (Ipv4Header*)p->data;
+    uint16_t header_len = (ip->version_ihl & 0xF) * 4;
+    if (p->len < IP_HEADER_LEN || (ip->version_ihl >> 4) != 4 || header_len < IP_HEADER_LEN ||
+        p->len < header_len) {
+        goto drop;
+    }
+
+    uint16_t total_len = ntohs(ip->total_len);
+    uint32_t dst = ntohl(ip->dst);
+    if (total_len < header_len || total_len > pbuf_total_len(p)) goto drop;
+    if (inet_checksum(ip, header_len) != 0) goto drop;
+    if (ntohs(ip->flags_fragment) & (IP_FLAG_MORE_FRAGMENTS | IP_FRAGMENT_OFFSET_MASK)) goto drop;
+    if (dst != netif->ip && dst != 0xFFFFFFFF && dst != (netif->ip | ~netif->netmask)) goto drop;
+
+    uint32_t src = ntohl(ip->src);
+    uint8_t protocol = ip->protocol;
+
+    // Drop the Ethernet padding of short frames, then the header
+    if (p->next == NULL) p->len = total_len;
+    pbuf_pull(p, header_len);
+
+    switch (protocol) {
+        case IP_PROTO_ICMP:
+            icmp_input(p, src);
+            return;
+        case IP_PROTO_UDP:
+            udp_input(p, src, dst);
+            return;
+    }
+
+drop:
+    netif->stats.ip_dropped++;
+    pbuf_free(p);
+}
+
+/*
+ * Prepends the IPv4 header in the pbuf headroom and hands the packet to ARP.
+ * Packets to our own address are looped back. Always takes ownership of p.
+ */
+int ip_output(Pbuf* p, uint32_t src, uint32_t dst, uint8_t protocol) {
+    NetInterface* netif = net_interface();
+    uint32_t total_len = pbuf_total_len(p) + IP_HEADER_LEN;
+    Ipv4Header* ip = (Ipv4Header*)pbuf_push(p, IP_HEADER_LEN);
+    if (!ip || total_len > 0xFFFF) {
+        netif->stats.tx_dropped++;
+        pbuf_free(p);
+        return NET_TX_DROPPED;
+    }
+
+    ip->version_ihl = 0x45;
+    ip->tos = 0;
+    ip->total_len = htons(total_len);
+    ip->id = htons(next_id++);
+    ip->flags_fragment = htons(0x4000);  // don't fragment
+    ip->ttl = IP_DEFAULT_TTL;
+    ip->protocol = protocol;
+    ip->checksum = 0;
+    ip->src = htonl(src);
+    ip->dst = htonl(dst);
+    ip->checksum = inet_checksum(ip, IP_HEADER_LEN);
+
+    if (dst == netif->ip) {
+        ip_input(p);
+        return 0;
+    }
+    if (dst == 0xFFFFFFFF || dst == (netif->ip | ~netif->netmask)) return arp_output(p, 0xFFFFFFFF);
+    return arp_output(p, on_link(netif, dst) ? dst : netif->gateway);
+}
+
+#ifdef TEST
+void test_icmp_loopback() {
+    NetInterface* netif = net_interface();
+    uint32_t replies = netif->stats.icmp_echo_replies;
+    uint32_t dropped = netif->stats.ip_dropped;
+
+    Pbuf* p = pbuf_alloc(sizeof(IcmpHeader) + 4);
+    IcmpHeader* icmp = (IcmpHeader*)p->data;
+    icmp->type = ICMP_ECHO_REQUEST;
+    icmp->code = 0;
+    icmp->checksum = 0;
+    icmp->id = htons(1);
+    icmp->sequence = htons(1);
+    memcpy(p->data + sizeof(IcmpHeader), "ping", 4);
+    icmp->checksum = inet_checksum(p->data, p->len);
+
+    // The request is answered, the looped back reply is then dropped as not a request
+    ip_output(p, netif->ip, netif->ip, IP_PROTO_ICMP);
+    assert(netif->stats.icmp_echo_replies == replies + 1, "test_icmp_loopback 1 FAILED");
+    assert(netif->stats.ip_dropped == dropped + 1, "test_icmp_loopback 2 FAILED");
+}
+
+void test_drop_fragments() {
+    NetInterface* netif = net_interface();
+    uint32_t dropped = netif->stats.ip_dropped;
+
+    Pbuf* p = pbuf_alloc(IP_HEADER_LEN + 8);
+    Ipv4Header* ip = (Ipv4Header*)p->data;
+    memset(ip, 0, p->len);
+    ip->version_ihl = 0x45;
+    ip->total_len = htons(p->len);
+    ip->flags_fragment = htons(IP_FLAG_MORE_FRAGMENTS);
+    ip->ttl = IP_DEFAULT_TTL;
+    ip->protocol = IP_PROTO_UDP;
+    ip->src = htonl(netif->gateway);
+    ip->dst = htonl(netif->ip);
+    ip->checksum = inet_checksum(ip, IP_HEADER_LEN);
+
+    ip_input(p);
+    assert(netif->stats.ip_dropped == dropped + 1, "test_drop_fragments FAILED");
+}
+
+void run_ip_tests() {
+    assert(net_init(), "no network device");
+    test_icmp_loopback();
+    test_drop_fragments();
+    LOG_GREEN("IPv4: [OK]");
+}
+#endif
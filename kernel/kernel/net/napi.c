@@ -0,0 +1,119 @@
+#define LOG_SUBSYSTEM net
+
+#include <kernel/net/napi.h>
+#include <kernel/panic.h>
+#include <string.h>
+#include <utils.h>
+
+static bool napi_run(void* ctx) {
+    Napi* napi = (Napi*)ctx;
+    int done = napi->poll(napi->budget);
+
+    napi->stats.polls++;
+    napi->stats.packets += done;
+    if ((uint32_t)done > napi->stats.max_per_poll) napi->stats.max_per_poll = done;
+    if (done >= napi->budget) {
+        napi->stats.budget_exhausted++;
+        return true;  // stays in polling mode, behind whatever else is queued
+    }
+
+    bool more = false;
+    INTERRUPT_GUARDED({ more = napi->enable_irq(); });
+    return more;
+}
+
+void napi_init(Napi* napi, const char* name, NapiPollFunc poll, NapiEnableIrqFunc enable_irq) {
+    memset(napi, 0, sizeof(Napi));
+    napi->name = name;
+    napi->poll = poll;
+    napi->enable_irq = enable_irq;
+    napi->budget = NAPI_DEFAULT_BUDGET;
+    init_task(&napi->task, napi_run, napi);
+}
+
+// From the rx irq handler, after the driver masked its rx interrupt
+void napi_irq(Napi* napi) {
+    napi->stats.irqs++;
+    schedule_task(&napi->task);
+}
+
+// Polls once more without an interrupt, e.g. when ring space was given back
+void napi_schedule(Napi* napi) {
+    schedule_task(&napi->task);
+}
+
+#ifdef TEST
+static int fake_pending = 0;
+static int fake_unmasks = 0;
+static bool fake_irq_enabled = true;
+
+static int fake_poll(int budget) {
+    int done = min(fake_pending, budget);
+    fake_pending -= done;
+    return done;
+}
+
+static bool fake_enable_irq() {
+    fake_unmasks++;
+    fake_irq_enabled = true;
+    return false;
+}
+
+static void fake_rx_irq(Napi* napi) {
+    fake_irq_enabled = false;
+    napi_irq(napi);
+}
+
+// A burst larger than the budget takes several polls and a single interrupt
+void test_napi_budget() {
+    Napi napi;
+    napi_init(&napi, "fake", fake_poll, fake_enable_irq);
+    fake_pending = 2 * NAPI_DEFAULT_BUDGET + 3;
+    fake_unmasks = 0;
+
+    fake_rx_irq(&napi);
+    fake_rx_irq(&napi);  // already queued
+    for (int i = 0; i < 10 && run_tasks(); i++) {
+    }
+
+    assert(fake_pending == 0, "test_napi_budget 1 FAILED");
+    assert(fake_irq_enabled && fake_unmasks == 1, "test_napi_budget 2 FAILED");
+    assert(napi.stats.irqs == 2 && napi.stats.polls == 3, "test_napi_budget 3 FAILED");
+    assert(napi.stats.budget_exhausted == 2, "test_napi_budget 4 FAILED");
+    assert(napi.stats.packets == 2 * NAPI_DEFAULT_BUDGET + 3, "test_napi_budget 5 FAILED");
+    assert(napi.stats.max_per_poll == NAPI_DEFAULT_BUDGET, "test_napi_budget 6 FAILED");
+}
+
+static int busy_runs = 0;
+
+static bool busy_task(void* ctx) {
+    (void)ctx;
+    return ++busy_runs < 3;
+}
+
+// A task that keeps asking for more gives the others a turn every round
+void test_tasks_round_robin() {
+    Task busy;
+    Napi napi;
+    init_task(&busy, busy_task, NULL);
+    napi_init(&napi, "fake", fake_poll, fake_enable_irq);
+    fake_pending = 1;
+    busy_runs = 0;
+
+    schedule_task(&busy);
+    fake_rx_irq(&napi);
+    assert(run_tasks(), "test_tasks_round_robin 1 FAILED");  // busy asked to run again
+    assert(busy_runs == 1 && fake_pending == 0, "test_tasks_round_robin 2 FAILED");
+    assert(napi.stats.polls == 1 && !napi.task.queued, "test_tasks_round_robin 3 FAILED");
+
+    while (run_tasks()) {
+    }
+    assert(busy_runs == 3 && !busy.queued, "test_tasks_round_robin 4 FAILED");
+}
+
+void run_napi_tests() {
+    test_napi_budget();
+    test_tasks_round_robin();
+    LOG_GREEN("NAPI: [OK]");
+}
+#endif
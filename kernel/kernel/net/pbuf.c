@@ -0,0 +1,250 @@
+#define LOG_SUBSYSTEM net
+
+#include <kernel/net/pbuf.h>
+#include <kernel/panic.h>
+#include <string.h>
+#include <utils.h>
+
+static Pbuf pool_pbufs[PBUF_POOL_SIZE];
+static Pbuf ref_pbufs[PBUF_REF_POOL_SIZE];
+static uint8_t pool_storage[PBUF_POOL_SIZE][PBUF_BUFFER_SIZE]
+    __attribute__((aligned(PBUF_CACHE_LINE)));
+
+static Pbuf* free_pool = NULL;
+static Pbuf* free_refs = NULL;
+static int pool_available = 0;
+static bool pool_ready = false;
+
+void pbuf_init() {
+    if (pool_ready) return;
+
+    for (int i = PBUF_POOL_SIZE - 1; i >= 0; i--) {
+        pool_pbufs[i].type = PBUF_POOL;
+        pool_pbufs[i].buffer = pool_storage[i];
+        pool_pbufs[i].capacity = PBUF_BUFFER_SIZE;
+        pool_pbufs[i].next = free_pool;
+        free_pool = &pool_pbufs[i];
+    }
+    for (int i = PBUF_REF_POOL_SIZE - 1; i >= 0; i--) {
+        ref_pbufs[i].type = PBUF_REF;
+        ref_pbufs[i].next = free_refs;
+        free_refs = &ref_pbufs[i];
+    }
+    pool_available = PBUF_POOL_SIZE;
+    pool_ready = true;
+}
+
+static Pbuf* pop(Pbuf** list) {
+    Pbuf* p = NULL;
+    INTERRUPT_GUARDED({
+        p = *list;
+        if (p) *list = p->next;
+    });
+    return p;
+}
+
+// Returns NULL when the pool is exhausted, the caller drops the packet
+Pbuf* pbuf_alloc(uint16_t len) {
+    assert(pool_ready, "pbuf_alloc before pbuf_init");
+    if (len > PBUF_BUFFER_SIZE - PBUF_HEADROOM) return NULL;
+
+    Pbuf* p = pop(&free_pool);
+    if (!p) return NULL;
+    INTERRUPT_GUARDED(pool_available--);
+
+    p->next = NULL;
+    p->data = p->buffer + PBUF_HEADROOM;
+    p->len = len;
+    p->refcount = 1;
+    p->release = NULL;
+    p->release_ctx = NULL;
+    return p;
+}
+
+/*
+ * Wraps memory the caller keeps ownership of, e.g. a frame still sitting in
+ * a NIC rx ring. The memory must stay valid until release(ctx) is called.
+ */
+Pbuf* pbuf_alloc_ref(uint8_t* data, uint16_t len, PbufReleaseFunc release, void* ctx) {
+    assert(pool_ready, "pbuf_alloc_ref before pbuf_init");
+
+    Pbuf* p = pop(&free_refs);
+    if (!p) return NULL;
+
+    p->next = NULL;
+    p->buffer = data;
+    p->data = data;
+    p->len = len;
+    p->capacity = len;
+    p->refcount = 1;
+    p->release = release;
+    p->release_ctx = ctx;
+    return p;
+}
+
+void pbuf_ref(Pbuf* p) {
+    INTERRUPT_GUARDED(p->refcount++);
+}
+
+static void release_one(Pbuf* p) {
+    if (p->type == PBUF_REF) {
+        if (p->release) p->release(p->release_ctx);
+        p->next = free_refs;
+        free_refs = p;
+    } else {
+        p->next = free_pool;
+        free_pool = p;
+        pool_available++;
+    }
+}
+
+// Drops one reference from the head; segments whose count reaches zero go back to their pool
+void pbuf_free(Pbuf* p) {
+    INTERRUPT_GUARDED({
+        while (p) {
+            assert(p->refcount > 0, "pbuf_free on a free pbuf");
+            if (--p->refcount > 0) break;
+            Pbuf* next = p->next;
+            release_one(p);
+            p = next;
+        }
+    });
+}
+
+// Extends the segment to the front, returns the new start or NULL without enough headroom
+uint8_t* pbuf_push(Pbuf* p, uint16_t len) {
+    if (pbuf_headroom(p) < len) return NULL;
+    p->data -= len;
+    p->len += len;
+    return p->data;
+}
+
+// Strips len bytes from the front, returns the new start or NULL if the segment is shorter
+uint8_t* pbuf_pull(Pbuf* p, uint16_t len) {
+    if (p->len < len) return NULL;
+    p->data += len;
+    p->len -= len;
+    return p->data;
+}
+
+// Appends tail to head's chain, head takes over the caller's reference to tail
+void pbuf_chain(Pbuf* head, Pbuf* tail) {
+    while (head->next) head = head->next;
+    head->next = tail;
+}
+
+uint16_t pbuf_headroom(const Pbuf* p) {
+    return p->data - p->buffer;
+}
+
+uint16_t pbuf_tailroom(const Pbuf* p) {
+    return p->capacity - pbuf_headroom(p) - p->len;
+}
+
+uint32_t pbuf_total_len(const Pbuf* p) {
+    uint32_t total = 0;
+    for (; p; p = p->next) total += p->len;
+    return total;
+}
+
+// Gathers up to len bytes starting at offset of the whole chain into dst
+size_t pbuf_copy_out(const Pbuf* p, void* dst, size_t offset, size_t len) {
+    uint8_t* out = (uint8_t*)dst;
+    size_t copied = 0;
+    for (; p && copied < len; p = p->next) {
+        if (offset >= p->len) {
+            offset -= p->len;
+            continue;
+        }
+        size_t n = min(p->len - offset, len - copied);
+        memcpy(out + copied, p->data + offset, n);
+        copied += n;
+        offset = 0;
+    }
+    return copied;
+}
+
+int pbuf_pool_available() {
+    return pool_available;
+}
+
+#ifdef TEST
+static int released_count = 0;
+
+static void test_release(void* ctx) {
+    released_count += (int)ctx;
+}
+
+void test_alloc_free() {
+    int available = pbuf_pool_available();
+    Pbuf* p = pbuf_alloc(100);
+    assert(p != NULL && p->len == 100, "test_alloc_free 1 FAILED");
+    assert(((uint32_t)p->buffer & (PBUF_CACHE_LINE - 1)) == 0, "test_alloc_free 2 FAILED");
+    assert(pbuf_pool_available() == available - 1, "test_alloc_free 3 FAILED");
+
+    pbuf_ref(p);
+    pbuf_free(p);
+    assert(pbuf_pool_available() == available - 1, "test_alloc_free 4 FAILED");
+    pbuf_free(p);
+    assert(pbuf_pool_available() == available, "test_alloc_free 5 FAILED");
+
+    assert(pbuf_alloc(PBUF_BUFFER_SIZE) == NULL, "test_alloc_free 6 FAILED");
+}
+
+void test_exhaustion() {
+    Pbuf* all[PBUF_POOL_SIZE];
+    int n = 0;
+    while ((all[n] = pbuf_alloc(1)) != NULL) n++;
+    assert(pbuf_pool_available() == 0, "test_exhaustion 1 FAILED");
+    for (int i = 0; i < n; i++) pbuf_free(all[i]);
+    assert(pbuf_pool_available() == n, "test_exhaustion 2 FAILED");
+}
+
+void test_push_pull() {
+    Pbuf* p = pbuf_alloc(8);
+    memcpy(p->data, "payload!", 8);
+
+    uint8_t* header = pbuf_push(p, 14);
+    assert(header != NULL && p->len == 22, "test_push_pull 1 FAILED");
+    assert(pbuf_push(p, PBUF_HEADROOM) == NULL, "test_push_pull 2 FAILED");
+    assert(((uint32_t)pbuf_push(p, 28) & 0x3) == 0, "test_push_pull 3 FAILED");  // 42 total
+
+    pbuf_pull(p, 42);
+    assert(p->len == 8 && memcmp(p->data, "payload!", 8) == 0, "test_push_pull 4 FAILED");
+    assert(pbuf_pull(p, 9) == NULL, "test_push_pull 5 FAILED");
+    pbuf_free(p);
+}
+
+void test_chain_and_ref() {
+    uint8_t external[6] = {'w', 'o', 'r', 'l', 'd', '!'};
+    released_count = 0;
+
+    Pbuf* head = pbuf_alloc(6);
+    memcpy(head->data, "hello ", 6);
+    Pbuf* tail = pbuf_alloc_ref(external, 6, test_release, (void*)1);
+    pbuf_chain(head, tail);
+    assert(pbuf_total_len(head) == 12, "test_chain_and_ref 1 FAILED");
+
+    char out[12];
+    assert(pbuf_copy_out(head, out, 0, 12) == 12, "test_chain_and_ref 2 FAILED");
+    assert(memcmp(out, "hello world!", 12) == 0, "test_chain_and_ref 3 FAILED");
+    assert(pbuf_copy_out(head, out, 8, 12) == 4, "test_chain_and_ref 4 FAILED");
+    assert(memcmp(out, "rld!", 4) == 0, "test_chain_and_ref 5 FAILED");
+
+    // An extra reference on the tail keeps it alive after the packet is freed
+    pbuf_ref(tail);
+    pbuf_free(head);
+    assert(released_count == 0, "test_chain_and_ref 6 FAILED");
+    pbuf_free(tail);
+    assert(released_count == 1, "test_chain_and_ref 7 FAILED");
+}
+
+void run_pbuf_tests() {
+    pbuf_init();
+    test_alloc_free();
+    test_exhaustion();
+    test_push_pull();
+    test_chain_and_ref();
+    LOG_GREEN("Pbuf: [OK]");
+}
+#endif
@@ -0,0 +1,273 @@
+#define LOG_SUBSYSTEM net
+
+#include <kernel/io/rtc.h>
+#include <kernel/monotonic_tick.h>
+#include <kernel/net/checksum.h>
+#include <kernel/net/ip.h>
+#include <kernel/net/udp.h>
+#include <kernel/panic.h>
+#include <string.h>
+#include <utils.h>
+
+#define UDP_QUEUE_MASK (UDP_QUEUE_LEN - 1)
+#define UDP_TX_HEADROOM (ETH_HEADER_LEN + IP_HEADER_LEN + UDP_HEADER_LEN)
+
+static UdpSocket sockets[UDP_MAX_SOCKETS];
+
+static UdpSocket* find_socket(uint16_t port) {
+    for (int i = 0; i < UDP_MAX_SOCKETS; i++) {
+        if (sockets[i].used && sockets[i].port == port) return &sockets[i];
+    }
+    return NULL;
+}
+
+// Adds the pseudo header to sum, len covers the UDP header and payload
+static uint32_t pseudo_header_sum(uint32_t src, uint32_t dst, uint16_t len, uint32_t sum) {
+    uint32_t pseudo[3] = {htonl(src), htonl(dst), htonl((IP_PROTO_UDP << 16) | len)};
+    return checksum_partial(pseudo, sizeof(pseudo), sum);
+}
+
+// Sums the pseudo header and the UDP header + payload, chains are left unchecked
+static uint16_t udp_checksum(const Pbuf* p, uint32_t src, uint32_t dst) {
+    uint32_t sum = pseudo_header_sum(src, dst, p->len, 0);
+    return checksum_fold(checksum_partial(p->data, p->len, sum));
+}
+
+void udp_input(Pbuf* p, uint32_t src, uint32_t dst) {
+    NetInterface* netif = net_interface();
+    UdpHeader* udp = (UdpHeader*)p->data;
+    uint16_t len = p->len >= UDP_HEADER_LEN ? ntohs(udp->len) : 0;
+    if (len < UDP_HEADER_LEN || len > pbuf_total_len(p)) goto drop;
+
+    if (p->next == NULL) {
+        p->len = len;
+        if (udp->checksum != 0 && udp_checksum(p, src, dst) != 0) goto drop;
+    }
+
+    UdpSocket* sock = find_socket(ntohs(udp->dst_port));
+    if (!sock) goto drop;
+
+    UdpDatagram datagram = {.p = p, .src_ip = src, .src_port = ntohs(udp->src_port)};
+    pbuf_pull(p, UDP_HEADER_LEN);
+
+    bool queued = false;
+    INTERRUPT_GUARDED({
+        if (sock->tail - sock->head < UDP_QUEUE_LEN) {
+            sock->queue[sock->tail & UDP_QUEUE_MASK] = datagram;
+            sock->tail++;
+            queued = true;
+        } else {
+            sock->dropped++;
+        }
+    });
+    if (!queued) goto drop;
+
+    netif->stats.udp_rx++;
+    wakeup_executor();
+    return;
+
+drop:
+    netif->stats.udp_dropped++;
+    pbuf_free(p);
+}
+
+UdpSocket* udp_bind(uint16_t port) {
+    UdpSocket* sock = NULL;
+    INTERRUPT_GUARDED({
+        if (!find_socket(port)) {
+            for (int i = 0; i < UDP_MAX_SOCKETS && !sock; i++) {
+                if (!sockets[i].used) sock = &sockets[i];
+            }
+        }
+        if (sock) {
+            memset(sock, 0, sizeof(*sock));
+            sock->port = port;
+            sock->used = true;
+        }
+    });
+    return sock;
+}
+
+void udp_close(UdpSocket* sock) {
+    UdpDatagram datagram;
+    INTERRUPT_GUARDED(sock->used = false);
+    while (udp_recv(sock, &datagram)) pbuf_free(datagram.p);
+}
+
+/*
+ * Prepends the UDP header in place when the pbuf has room for every header
+ * below it, otherwise the payload is copied into a fresh pool pbuf first
+ * (e.g. for a frame still referencing a NIC rx ring) and summed on the way.
+ * Takes ownership of p.
+ */
+int udp_send_pbuf(UdpSocket* sock, uint32_t dst_ip, uint16_t dst_port, Pbuf* p) {
+    NetInterface* netif = net_interface();
+    uint32_t payload_sum = 0;
+    bool payload_summed = false;
+    if (p->type != PBUF_POOL || pbuf_headroom(p) < UDP_TX_HEADROOM) {
+        uint32_t len = pbuf_total_len(p);
+        Pbuf* copy = pbuf_alloc(len);
+        if (copy && p->next == NULL) {
+            payload_sum = checksum_copy(copy->data, p->data, len, 0);
+            payload_summed = true;
+        } else if (copy) {
+            pbuf_copy_out(p, copy->data, 0, len);
+        }
+        pbuf_free(p);
+        if (!copy) {
+            netif->stats.tx_dropped++;
+            return NET_TX_DROPPED;
+        }
+        p = copy;
+    }
+
+    uint32_t len = pbuf_total_len(p) + UDP_HEADER_LEN;
+    UdpHeader* udp = (UdpHeader*)pbuf_push(p, UDP_HEADER_LEN);
+    udp->src_port = htons(sock->port);
+    udp->dst_port = htons(dst_port);
+    udp->len = htons(len);
+    udp->checksum = 0;  // optional over IPv4, left out for chains
+    if (payload_summed) {
+        uint32_t sum = checksum_partial(udp, UDP_HEADER_LEN, payload_sum);
+        udp->checksum = checksum_fold(pseudo_header_sum(netif->ip, dst_ip, len, sum));
+        if (udp->checksum == 0) udp->checksum = 0xFFFF;
+    } else if (p->next == NULL) {
+        udp->checksum = udp_checksum(p, netif->ip, dst_ip);
+        if (udp->checksum == 0) udp->checksum = 0xFFFF;
+    }
+
+    netif->stats.udp_tx++;
+    return ip_output(p, netif->ip, dst_ip, IP_PROTO_UDP);
+}
+
+int udp_sendto(UdpSocket* sock, uint32_t dst_ip, uint16_t dst_port, const void* data,
+               size_t len) {
+    Pbuf* p = pbuf_alloc(len);
+    if (!p) {
+        net_interface()->stats.tx_dropped++;
+        return NET_TX_DROPPED;
+    }
+    memcpy(p->data, data, len);
+    return udp_send_pbuf(sock, dst_ip, dst_port, p);
+}
+
+// Non-blocking, the caller owns out->p
+bool udp_recv(UdpSocket* sock, UdpDatagram* out) {
+    bool found = false;
+    INTERRUPT_GUARDED({
+        if (sock->head != sock->tail) {
+            *out = sock->queue[sock->head & UDP_QUEUE_MASK];
+            sock->head++;
+            found = true;
+        }
+    });
+    return found;
+}
+
+static bool socket_readable(void* ctx) {
+    UdpSocket* sock = (UdpSocket*)ctx;
+    return sock->head != sock->tail;
+}
+
+Future udp_recv_future(UdpSocket* sock) {
+    return create_io_future(socket_readable, sock);
+}
+
+UdpDatagram udp_recv_blocking(UdpSocket* sock) {
+    UdpDatagram datagram;
+    while (!udp_recv(sock, &datagram)) await(udp_recv_future(sock));
+    return datagram;
+}
+
+static UdpSocket* echo_socket;
+static UdpSocket* discard_socket;
+
+static bool services_readable(void* ctx) {
+    (void)ctx;
+    return socket_readable(echo_socket) || socket_readable(discard_socket);
+}
+
+/*
+ * Echo (port 7) and discard (port 9) services for load generators on the
+ * host. Echoed payloads go back in the pbuf they arrived in whenever it has
+ * the headroom. The discard side reports its packet rate once per second,
+ * with the interrupts and napi polls it took.
+ * Never returns.
+ */
+void udp_services_run() {
+    echo_socket = udp_bind(UDP_ECHO_PORT);
+    discard_socket = udp_bind(UDP_DISCARD_PORT);
+    assert(echo_socket && discard_socket, "udp_services_run: ports in use");
+    LOG("UDP echo on port %d, discard on port %d", UDP_ECHO_PORT, UDP_DISCARD_PORT);
+
+    const NapiStats* napi = net_interface()->napi_stats;
+    NapiStats window = *napi;
+    uint32_t window_start = get_tick();
+    uint32_t packets = 0, bytes = 0;
+    while (1) {
+        await(create_io_future(services_readable, NULL));
+
+        UdpDatagram datagram;
+        while (udp_recv(echo_socket, &datagram))
+            udp_send_pbuf(echo_socket, datagram.src_ip, datagram.src_port, datagram.p);
+
+        while (udp_recv(discard_socket, &datagram)) {
+            packets++;
+            bytes += pbuf_total_len(datagram.p);
+            pbuf_free(datagram.p);
+        }
+
+        if (get_tick() - window_start >= RTC_FREQ && packets) {
+            uint32_t polls = napi->polls - window.polls;
+            uint32_t polled = napi->packets - window.packets;
+            LOG("UDP discard: %u pps, %u bytes/s, rx irqs %u, polls %u, %u frames/poll", packets,
+                bytes, napi->irqs - window.irqs, polls, polls ? polled / polls : 0);
+            packets = bytes = 0;
+            window = *napi;
+            window_start = get_tick();
+        }
+    }
+}
+
+#ifdef TEST
+void test_udp_loopback() {
+    NetInterface* netif = net_interface();
+    UdpSocket* server = udp_bind(4000);
+    UdpSocket* client = udp_bind(4001);
+    assert(server && client, "test_udp_loopback 1 FAILED");
+    assert(udp_bind(4000) == NULL, "test_udp_loopback 2 FAILED");
+
+    assert(udp_sendto(client, netif->ip, 4000, "hello", 5) == 0, "test_udp_loopback 3 FAILED");
+    UdpDatagram datagram;
+    assert(udp_recv(server, &datagram), "test_udp_loopback 4 FAILED");
+    assert(datagram.src_port == 4001 && datagram.src_ip == netif->ip,
+           "test_udp_loopback 5 FAILED");
+    assert(datagram.p->len == 5 && memcmp(datagram.p->data, "hello", 5) == 0,
+           "test_udp_loopback 6 FAILED");
+
+    // Reply in place, then through the blocking receive
+    udp_send_pbuf(server, datagram.src_ip, datagram.src_port, datagram.p);
+    datagram = udp_recv_blocking(client);
+    assert(memcmp(datagram.p->data, "hello", 5) == 0, "test_udp_loopback 7 FAILED");
+    pbuf_free(datagram.p);
+
+    udp_close(server);
+    udp_close(client);
+}
+
+void test_udp_no_socket() {
+    NetInterface* netif = net_interface();
+    UdpSocket* client = udp_bind(4002);
+    uint32_t dropped = netif->stats.udp_dropped;
+    udp_sendto(client, netif->ip, 4003, "x", 1);
+    assert(netif->stats.udp_dropped == dropped + 1, "test_udp_no_socket FAILED");
+    udp_close(client);
+}
+
+void run_udp_tests() {
+    assert(net_init(), "no network device");
+    test_udp_loopback();
+    test_udp_no_socket();
+    LOG_GREEN("UDP: [OK]");
+}
+#endif
@@ -0,0 +1,427 @@
+#define LOG_SUBSYSTEM mem
+
+#include <kernel/interrupts.h>
+#include <kernel/paging.h>
+#include <kernel/panic.h>
+#include <kernel/process.h>
+#include <kernel/time_page.h>
+#include <string.h>
+#include <utils.h>
+#ifdef TEST
+#include <kernel/syscall.h>
+#endif
+#ifdef BENCHMARKS
+#include <kernel/bench.h>
+#endif
+
+#define PAGE_PRESENT (1 << 0)
+#define PAGE_WRITE (1 << 1)
+#define PAGE_USER (1 << 2)
+#define PAGE_LARGE (1 << 7)  // 4 MiB, in a directory entry
+#define PAGE_COW (1 << 9)    // one of the bits left to software
+#define PAGE_FRAME(entry) ((entry) & ~(uint32_t)(PAGE_SIZE - 1))
+
+#define PF_WRITE (1 << 1)  // error code bits
+#define PF_USER (1 << 2)
+
+#define PAGE_FAULT_VECTOR 14
+#define ENTRIES 1024
+#define LARGE_PAGE_SHIFT 22
+#define USER_FIRST_TABLE (USER_BASE >> LARGE_PAGE_SHIFT)
+#define USER_LAST_TABLE ((USER_END - 1) >> LARGE_PAGE_SHIFT)
+#define POOL_FRAMES ((FRAME_POOL_END - FRAME_POOL_BASE) / PAGE_SIZE)
+
+#define CR0_PG (1u << 31)
+#define CR4_PSE (1 << 4)
+#define CPUID_EDX_PSE (1 << 3)
+
+// In arch/i386/paging.S
+extern void page_fault_entry();
+// From the linker script, page aligned
+extern char __user_text_start[], __user_text_end[], __user_data_start[], __user_data_end[];
+
+static uint32_t kernel_directory[ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+// The first 4 MiB again in 4 KiB pages, ring 3 may read RING3_TEXT and write RING3_DATA
+static uint32_t image_table[ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+static AddressSpace* current_space = NULL;
+
+/*
+ * The frame pool, a stack of free frames and a count of the mappings of
+ * each one. Frames change hands in process setup and in the fault handler,
+ * never in an interrupt handler, so there is one user at a time.
+ */
+static uint16_t free_frames[POOL_FRAMES];
+static uint32_t free_count = 0;
+static uint16_t frame_refs[POOL_FRAMES];
+
+static bool in_pool(uint32_t frame) {
+    return frame >= FRAME_POOL_BASE && frame < FRAME_POOL_END;
+}
+
+static uint32_t frame_index(uint32_t frame) {
+    return (frame - FRAME_POOL_BASE) / PAGE_SIZE;
+}
+
+// Not cleared, 0 when the pool is empty. The pool is identity mapped in every space.
+static uint32_t frame_alloc() {
+    if (free_count == 0) return 0;
+    uint16_t index = free_frames[--free_count];
+    frame_refs[index] = 1;
+    return FRAME_POOL_BASE + index * PAGE_SIZE;
+}
+
+static uint32_t frame_alloc_zeroed() {
+    uint32_t frame = frame_alloc();
+    if (frame) memset((void*)frame, 0, PAGE_SIZE);
+    return frame;
+}
+
+static void frame_get(uint32_t frame) {
+    if (in_pool(frame)) frame_refs[frame_index(frame)]++;
+}
+
+static void frame_put(uint32_t frame) {
+    if (!in_pool(frame)) return;
+    uint32_t index = frame_index(frame);
+    assert(frame_refs[index] > 0, "frame_put: frame is free already");
+    if (--frame_refs[index] == 0) free_frames[free_count++] = index;
+}
+
+static inline void load_directory(uint32_t* directory) {
+    asm volatile("movl %0, %%cr3" : : "r"(directory) : "memory");
+}
+
+static inline void invlpg(uint32_t address) {
+    asm volatile("invlpg (%0)" : : "r"(address) : "memory");
+}
+
+static void share_pages(const char* start, const char* end, uint32_t flags) {
+    for (uint32_t page = (uint32_t)start; page < (uint32_t)end; page += PAGE_SIZE)
+        image_table[page / PAGE_SIZE] = page | flags | PAGE_USER | PAGE_PRESENT;
+}
+
+/*
+ * The identity map takes one directory and no tables, for the kernel alone.
+ * The image table is there for the spaces that share the in-image programs.
+ */
+void paging_init() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    assert(edx & CPUID_EDX_PSE, "paging_init: no 4 MiB pages");
+    assert((uint32_t)__user_data_end <= 1 << LARGE_PAGE_SHIFT,
+           "paging_init: ring 3 image pages past the first 4 MiB");
+
+    for (uint32_t i = 0; i < ENTRIES; i++)
+        kernel_directory[i] = (i << LARGE_PAGE_SHIFT) | PAGE_LARGE | PAGE_WRITE | PAGE_PRESENT;
+    for (uint32_t i = 0; i < ENTRIES; i++)
+        image_table[i] = i * PAGE_SIZE | PAGE_WRITE | PAGE_PRESENT;
+    share_pages(__user_text_start, __user_text_end, 0);
+    share_pages(__user_data_start, __user_data_end, PAGE_WRITE);
+    for (uint32_t i = POOL_FRAMES; i > 0; i--) free_frames[free_count++] = i - 1;
+
+    set_interrupt_gate(PAGE_FAULT_VECTOR, page_fault_entry);
+    asm volatile(
+        "movl %%cr4, %%eax\n\t"
+        "orl %0, %%eax\n\t"
+        "movl %%eax, %%cr4\n\t"
+        "movl %1, %%cr3\n\t"
+        "movl %%cr0, %%eax\n\t"
+        "orl %2, %%eax\n\t"
+        "movl %%eax, %%cr0"
+        :
+        : "i"(CR4_PSE), "r"(kernel_directory), "i"(CR0_PG | CR0_WP)
+        : "eax", "memory");
+    LOG("Paging: identity map in 4 MiB pages, %u frames for user pages", free_count);
+}
+
+uint32_t paging_free_frames() {
+    return free_count;
+}
+
+// The entry for a user page, with a new table if create is set. NULL if there is none.
+static uint32_t* page_entry(AddressSpace* space, uint32_t address, bool create) {
+    uint32_t* table_entry = &space->directory[address >> LARGE_PAGE_SHIFT];
+    if (!(*table_entry & PAGE_PRESENT)) {
+        if (!create) return NULL;
+        uint32_t table = frame_alloc_zeroed();
+        if (!table) return NULL;
+        *table_entry = table | PAGE_USER | PAGE_WRITE | PAGE_PRESENT;
+    }
+    uint32_t* table = (uint32_t*)PAGE_FRAME(*table_entry);
+    return &table[address >> 12 & (ENTRIES - 1)];
+}
+
+/*
+ * The kernel's 4 MiB pages without ring 3 access and an empty user window,
+ * apart from the time page. Costs a directory, and a table for the time page.
+ */
+bool address_space_create(AddressSpace* space) {
+    uint32_t* directory = (uint32_t*)frame_alloc();
+    if (!directory) return false;
+    memcpy(directory, kernel_directory, sizeof(kernel_directory));
+    for (uint32_t i = USER_FIRST_TABLE; i <= USER_LAST_TABLE; i++) directory[i] = 0;
+    space->directory = directory;
+    space->pages = 0;
+
+    uint32_t* entry = page_entry(space, USER_TIME_PAGE, true);
+    if (!entry) {
+        address_space_destroy(space);
+        return false;
+    }
+    *entry = (uint32_t)time_page() | PAGE_USER | PAGE_PRESENT;
+    return true;
+}
+
+/*
+ * Copies the parent's tables, not its pages: both sides lose write access
+ * to every writable page, which the first write to it in either space
+ * copies. Costs a table per table the parent has.
+ */
+bool address_space_clone(AddressSpace* parent, AddressSpace* child) {
+    if (!address_space_create(child)) return false;
+    child->directory[0] = parent->directory[0];  // the image table, if the parent shares it
+    for (uint32_t i = USER_FIRST_TABLE; i <= USER_LAST_TABLE; i++) {
+        if (!(parent->directory[i] & PAGE_PRESENT)) continue;
+        uint32_t* from = (uint32_t*)PAGE_FRAME(parent->directory[i]);
+        uint32_t* to = page_entry(child, i << LARGE_PAGE_SHIFT, true);
+        if (!to) {
+            address_space_destroy(child);
+            return false;
+        }
+        for (uint32_t j = 0; j < ENTRIES; j++) {
+            uint32_t entry = from[j];
+            if (!(entry & PAGE_PRESENT)) continue;
+            if (entry & PAGE_WRITE) from[j] = entry = (entry & ~PAGE_WRITE) | PAGE_COW;
+            frame_get(PAGE_FRAME(entry));
+            to[j] = entry;
+        }
+    }
+    child->pages = parent->pages;
+    if (current_space == parent) load_directory(parent->directory);
+    return true;
+}
+
+void address_space_destroy(AddressSpace* space) {
+    assert(space != current_space, "address_space_destroy: space is in use");
+    for (uint32_t i = USER_FIRST_TABLE; i <= USER_LAST_TABLE; i++) {
+        if (!(space->directory[i] & PAGE_PRESENT)) continue;
+        uint32_t* table = (uint32_t*)PAGE_FRAME(space->directory[i]);
+        for (uint32_t j = 0; j < ENTRIES; j++)
+            if (table[j] & PAGE_PRESENT) frame_put(PAGE_FRAME(table[j]));
+        frame_put((uint32_t)table);
+    }
+    frame_put((uint32_t)space->directory);
+    space->directory = NULL;
+    space->pages = 0;
+}
+
+void address_space_share_image(AddressSpace* space) {
+    space->directory[0] = (uint32_t)image_table | PAGE_USER | PAGE_WRITE | PAGE_PRESENT;
+    if (current_space == space) load_directory(space->directory);
+}
+
+void address_space_switch(AddressSpace* space) {
+    current_space = space;
+    load_directory(space ? space->directory : kernel_directory);
+}
+
+// A zero-filled page where there was none, or a copy of a shared one written to
+static bool resolve_fault(AddressSpace* space, uint32_t address, uint32_t error) {
+    uint32_t page = address & ~(PAGE_SIZE - 1);
+    uint32_t* entry = page_entry(space, page, true);
+    if (!entry) return false;
+
+    if (!(*entry & PAGE_PRESENT)) {
+        uint32_t frame = frame_alloc_zeroed();
+        if (!frame) return false;
+        *entry = frame | PAGE_USER | PAGE_WRITE | PAGE_PRESENT;
+        space->pages++;
+        return true;  // nothing was cached for it
+    }
+    if (!(error & PF_WRITE) || !(*entry & PAGE_COW)) return false;
+
+    uint32_t frame = PAGE_FRAME(*entry);
+    if (frame_refs[frame_index(frame)] > 1) {
+        uint32_t copy = frame_alloc();
+        if (!copy) return false;
+        memcpy((void*)copy, (const void*)frame, PAGE_SIZE);
+        frame_put(frame);
+        frame = copy;
+    }
+    *entry = frame | PAGE_USER | PAGE_WRITE | PAGE_PRESENT;
+    invlpg(page);
+    return true;
+}
+
+/*
+ * Faults in the user window of the current space, from ring 3 or from the
+ * kernel copying to it, are resolved here. Anything else ends the process
+ * that caused it, or the kernel.
+ */
+void page_fault_handler(uint32_t address, uint32_t error, uint32_t eip) {
+    if (current_space && address >= USER_BASE && address < USER_END &&
+        resolve_fault(current_space, address, error))
+        return;
+
+    if (error & PF_USER) {
+        LOG_RATELIMITED(LOG_LEVEL_WARN, "Process %u: page fault at 0x%x, eip 0x%x, error %u",
+                        process_current()->pid, address, eip, error);
+        enable_interrupts();
+        process_exit(PROCESS_EXIT_FAULT);
+    }
+    LOG_ERROR("Page fault at 0x%x, eip 0x%x, error %u", address, eip, error);
+    panic("Page fault in the kernel");
+}
+
+#ifdef TEST
+#define TEST_ADDRESS (USER_BASE + 0x123450)
+
+static uint32_t read_in(AddressSpace* space, uint32_t address) {
+    address_space_switch(space);
+    uint32_t value = *(volatile uint32_t*)address;
+    address_space_switch(NULL);
+    return value;
+}
+
+static void write_in(AddressSpace* space, uint32_t address, uint32_t value) {
+    address_space_switch(space);
+    *(volatile uint32_t*)address = value;
+    address_space_switch(NULL);
+}
+
+void test_paging_identity() {
+    uint32_t cr0, cr3;
+    asm volatile("movl %%cr0, %0; movl %%cr3, %1" : "=r"(cr0), "=r"(cr3));
+    assert((cr0 & (CR0_PG | CR0_WP)) == (CR0_PG | CR0_WP), "test_paging_identity 1 FAILED");
+    assert(cr3 == (uint32_t)kernel_directory, "test_paging_identity 2 FAILED");
+}
+
+// A read and a write a megabyte apart cost their own pages and a table, nothing in between
+void test_paging_zero_fill() {
+    uint32_t free = paging_free_frames();
+    AddressSpace space;
+    assert(address_space_create(&space), "test_paging_zero_fill 1 FAILED");
+    assert(read_in(&space, TEST_ADDRESS) == 0, "test_paging_zero_fill 2 FAILED");
+    write_in(&space, TEST_ADDRESS + 0x100000, 42);
+    assert(read_in(&space, TEST_ADDRESS + 0x100000) == 42, "test_paging_zero_fill 3 FAILED");
+    assert(space.pages == 2, "test_paging_zero_fill 4 FAILED");
+    assert(free - paging_free_frames() == 5, "test_paging_zero_fill 5 FAILED");
+    address_space_destroy(&space);
+    assert(paging_free_frames() == free, "test_paging_zero_fill 6 FAILED");
+}
+
+void test_paging_copy_on_write() {
+    uint32_t free = paging_free_frames();
+    AddressSpace parent, child;
+    assert(address_space_create(&parent), "test_paging_copy_on_write 1 FAILED");
+    write_in(&parent, TEST_ADDRESS, 1);
+    uint32_t before_clone = paging_free_frames();
+    assert(address_space_clone(&parent, &child), "test_paging_copy_on_write 2 FAILED");
+    assert(read_in(&child, TEST_ADDRESS) == 1, "test_paging_copy_on_write 3 FAILED");
+    // The directory and two tables, the page itself is shared
+    assert(before_clone - paging_free_frames() == 3, "test_paging_copy_on_write 4 FAILED");
+
+    write_in(&child, TEST_ADDRESS, 2);
+    assert(read_in(&parent, TEST_ADDRESS) == 1, "test_paging_copy_on_write 5 FAILED");
+    assert(read_in(&child, TEST_ADDRESS) == 2, "test_paging_copy_on_write 6 FAILED");
+    assert(before_clone - paging_free_frames() == 4, "test_paging_copy_on_write 7 FAILED");
+
+    // The parent's page is not shared any more, writing to it takes no copy
+    write_in(&parent, TEST_ADDRESS, 3);
+    assert(before_clone - paging_free_frames() == 4, "test_paging_copy_on_write 8 FAILED");
+    assert(read_in(&child, TEST_ADDRESS) == 2, "test_paging_copy_on_write 9 FAILED");
+
+    address_space_destroy(&child);
+    address_space_destroy(&parent);
+    assert(paging_free_frames() == free, "test_paging_copy_on_write 10 FAILED");
+}
+
+/*
+ * movl $1, USER_TIME_PAGE; then an endless loop. The time page is read-only
+ * and not copy-on-write, so the process ends with the fault.
+ */
+static const uint8_t write_time_page[] = {0xC7, 0x05, USER_TIME_PAGE & 0xFF,
+                                          USER_TIME_PAGE >> 8 & 0xFF, USER_TIME_PAGE >> 16 & 0xFF,
+                                          USER_TIME_PAGE >> 24, 1, 0, 0, 0, 0xEB, 0xFE};
+
+void test_paging_user_fault() {
+    Process process;
+    process_init(&process, USER_BASE, USER_TIME_PAGE);
+    assert(address_space_create(&process.space), "test_paging_user_fault 1 FAILED");
+    address_space_switch(&process.space);
+    memcpy((void*)USER_BASE, write_time_page, sizeof(write_time_page));
+    address_space_switch(NULL);
+    assert(process_run(&process) == PROCESS_EXIT_FAULT, "test_paging_user_fault 2 FAILED");
+    assert(time_page()->sequence % 2 == 0, "test_paging_user_fault 3 FAILED");
+    process_destroy(&process);
+}
+
+static uint8_t ring3_stack[256] RING3_DATA __attribute__((aligned(16)));
+static uint32_t ring3_value RING3_DATA = 42;
+static const uint32_t* ring3_probe RING3_DATA;
+
+// Exits with what it reads at ring3_probe
+RING3_TEXT static void ring3_read_probe() {
+    syscall_int80(SYS_EXIT, *ring3_probe, 0, 0);
+    while (1) {
+    }
+}
+
+static uint32_t read_in_ring3(const uint32_t* address) {
+    Process process;
+    uint32_t stack_top = (uint32_t)ring3_stack + sizeof(ring3_stack);
+    ring3_probe = address;
+    assert(process_init_image(&process, ring3_read_probe, stack_top),
+           "test_paging_supervisor_only: out of frames");
+    uint32_t code = process_run(&process);
+    process_destroy(&process);
+    return code;
+}
+
+// A space that shares the image lets ring 3 at its own data and nothing else of the kernel
+void test_paging_supervisor_only() {
+    assert(read_in_ring3(&ring3_value) == 42, "test_paging_supervisor_only 1 FAILED");
+    assert(read_in_ring3(kernel_directory) == PROCESS_EXIT_FAULT,
+           "test_paging_supervisor_only 2 FAILED");
+    assert(read_in_ring3((const uint32_t*)time_page()) == PROCESS_EXIT_FAULT,
+           "test_paging_supervisor_only 3 FAILED");
+}
+
+void run_paging_tests() {
+    test_paging_identity();
+    test_paging_zero_fill();
+    test_paging_copy_on_write();
+    test_paging_user_fault();
+    test_paging_supervisor_only();
+    LOG_GREEN("Paging: [OK]");
+}
+#endif
+
+#ifdef BENCHMARKS
+#define BENCH_PAGES 64  // touched, the clone copies the two tables that hold them either way
+
+static AddressSpace bench_space;
+
+BENCH(address_space_clone) {
+    if (!bench_space.directory) {
+        assert(address_space_create(&bench_space), "address_space_clone: out of frames");
+        address_space_switch(&bench_space);
+        for (uint32_t i = 0; i < BENCH_PAGES; i++)
+            *(volatile uint8_t*)(USER_BASE + i * PAGE_SIZE) = 1;
+        address_space_switch(NULL);
+    }
+    AddressSpace child;
+    address_space_clone(&bench_space, &child);
+    address_space_destroy(&child);
+}
+
+// A fresh space each time, its first page costs a fault, a table and the page
+BENCH(page_fault_zero_fill) {
+    AddressSpace space;
+    address_space_create(&space);
+    address_space_switch(&space);
+    *(volatile uint8_t*)USER_BASE = 1;
+    address_space_switch(NULL);
+    address_space_destroy(&space);
+}
+#endif
@@ -2,15 +2,20 @@
 #include <stdio.h>
 
 #include "kernel/circular_buffer.h"
+#include "kernel/console.h"
 #include "kernel/io/uart.h"
 
 void panic(const char* msg) {
     asm volatile("cli");
     dump_buffer();
     printf("\npanic called with error: %s", msg);
+    console_flush();
+#if defined(TEST) || defined(BENCHMARKS)
+    exit_(EXIT_CODE_FAILED);  // unattended runs end here instead of hanging until the timeout
+#endif
 
     while (1) {
-        asm volatile("hlt");
+        asm volatile("cli; hlt");
     }
 }
 
@@ -0,0 +1,119 @@
+#define LOG_SUBSYSTEM proc
+
+#include <kernel/elf.h>
+#include <kernel/multiboot.h>
+#include <kernel/panic.h>
+#include <kernel/process.h>
+#include <utils.h>
+
+// In arch/i386/syscall.S
+extern uint32_t ring3_enter(uint32_t entry, uint32_t user_esp, uint32_t* kernel_esp);
+extern void ring3_leave(uint32_t kernel_esp, uint32_t code) __attribute__((noreturn));
+
+static Process* current = NULL;
+static uint32_t next_pid = 1;
+
+void process_init(Process* process, uint32_t entry, uint32_t user_stack) {
+    process->pid = next_pid++;
+    process->entry = entry;
+    process->user_stack = user_stack;
+    process->kernel_esp = 0;
+    process->exit_code = 0;
+    process->space.directory = NULL;
+    process->space.pages = 0;
+}
+
+bool process_load_module(Process* process, uint32_t module) {
+    const multiboot_module_t* image = multiboot_module(module);
+    if (image == NULL) {
+        LOG_WARN("No boot module %u", module);
+        return false;
+    }
+
+    process_init(process, 0, USER_TIME_PAGE);
+    if (!address_space_create(&process->space)) {
+        LOG_WARN("Out of frames for module %u", module);
+        return false;
+    }
+    // The copy faults the pages it writes in, the rest stay untouched
+    address_space_switch(&process->space);
+    bool loaded = elf_load((const void*)image->mod_start, image->mod_end - image->mod_start,
+                           USER_BASE, USER_TIME_PAGE - USER_STACK_SIZE, &process->entry);
+    address_space_switch(NULL);
+    if (!loaded) process_destroy(process);
+    return loaded;
+}
+
+bool process_init_image(Process* process, void (*entry)(), uint32_t user_stack) {
+    process_init(process, (uint32_t)entry, user_stack);
+    if (!address_space_create(&process->space)) return false;
+    address_space_share_image(&process->space);
+    return true;
+}
+
+/*
+ * Runs the process in ring 3 on the caller's stack: process_run()'s frame
+ * stays where it is and everything from ring 3 comes in below it, until
+ * the exit system call unwinds back here. The entry point is called as
+ * _start(const TimePage* time), with no return address.
+ */
+uint32_t process_run(Process* process) {
+    assert(current == NULL, "process_run: a process is running already");
+    assert(process->space.directory != NULL, "process_run: no address space");
+    address_space_switch(&process->space);
+    uint32_t* stack = (uint32_t*)process->user_stack;
+    *--stack = USER_TIME_PAGE;
+    *--stack = 0;
+
+    current = process;
+    LOG_DEBUG("Process %u: entering ring 3 at 0x%x", process->pid, process->entry);
+    process->exit_code = ring3_enter(process->entry, (uint32_t)stack, &process->kernel_esp);
+    current = NULL;
+    address_space_switch(NULL);
+    return process->exit_code;
+}
+
+void process_destroy(Process* process) {
+    if (process->space.directory) address_space_destroy(&process->space);
+}
+
+Process* process_current() {
+    return current;
+}
+
+void process_exit(uint32_t code) {
+    assert(current != NULL, "process_exit: no process is running");
+    LOG_DEBUG("Process %u: exit %u", current->pid, code);
+    ring3_leave(current->kernel_esp, code);
+}
+
+#ifdef TEST
+// The program boot module 0 holds, user/init.c, exits with 0 when its checks pass
+void test_process_init_module() {
+    Process process;
+    assert(multiboot_module_count() > 0, "test_process_init_module: no boot module");
+    assert(process_load_module(&process, 0), "test_process_init_module 1 FAILED");
+    assert(process.entry >= USER_BASE && process.entry < USER_END,
+           "test_process_init_module 2 FAILED");
+    uint32_t loaded = process.space.pages;
+    assert(process_run(&process) == 0, "test_process_init_module 3 FAILED");
+    assert(process_current() == NULL, "test_process_init_module 4 FAILED");
+    // The stack pages it touched, nowhere near all of USER_STACK_SIZE
+    uint32_t touched = process.space.pages - loaded;
+    assert(touched >= 1 && touched < USER_STACK_SIZE / PAGE_SIZE,
+           "test_process_init_module 5 FAILED");
+    process_destroy(&process);
+}
+
+void test_process_missing_module() {
+    Process process;
+    assert(!process_load_module(&process, MULTIBOOT_MAX_MODULES),
+           "test_process_missing_module FAILED");
+}
+
+void run_process_tests() {
+    test_process_init_module();
+    test_process_missing_module();
+    LOG_GREEN("Process: [OK]");
+}
+#endif
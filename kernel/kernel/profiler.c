@@ -0,0 +1,271 @@
+#include <kernel/cmdline.h>
+#include <kernel/future.h>
+#include <kernel/interrupts.h>
+#include <kernel/io/pit.h>
+#include <kernel/io/uart.h>
+#include <kernel/ksyms.h>
+#include <kernel/panic.h>
+#include <kernel/profiler.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <utils.h>
+#ifdef TEST
+#include <kernel/monotonic_tick.h>
+#endif
+
+#define MAX_FRAME_GAP 0x10000  // a caller frame further up the stack than this is garbage
+#define MAX_IRQ_FRAMES 8       // frames between this handler and the irq stub
+#define REPORT_LINE_MAX 1024
+
+struct ProfileSample {
+    uint32_t depth;
+    uint32_t pc[PROFILE_MAX_DEPTH];  // pc[0] is the interrupted instruction
+};
+
+// Filled by the timer irq, drained in task context. One per CPU once there is more than one.
+struct ProfileRing {
+    volatile uint32_t head;  // next sample to drain
+    volatile uint32_t tail;  // next free sample
+    volatile uint32_t dropped;
+    struct ProfileSample samples[PROFILE_RING_SIZE];
+};
+
+// Samples folded by stack. Frames are symbol indices, so a function is one frame.
+struct FoldedStack {
+    uint32_t count;
+    uint32_t hash;
+    int depth;
+    int16_t frames[PROFILE_MAX_DEPTH];
+};
+
+extern uint8_t INTERRUPT_MEM[256][INTERRUPT_STUB_SIZE];
+
+static struct ProfileRing ring;
+static struct FoldedStack stacks[PROFILE_MAX_STACKS];
+static uint32_t num_folded = 0;
+static uint32_t num_unfolded = 0;  // samples that found the table full
+static uint32_t rate_hz = 0;
+static bool running = false;
+static Task drain_task;
+
+static bool in_irq_stub(uint32_t addr) {
+    uintptr_t stubs = (uintptr_t)INTERRUPT_MEM;
+    return addr >= stubs && addr < stubs + sizeof(INTERRUPT_MEM);
+}
+
+static bool valid_caller(const uint32_t* fp, const uint32_t* caller) {
+    return caller > fp && (uintptr_t)caller - (uintptr_t)fp < MAX_FRAME_GAP &&
+           ((uintptr_t)caller & 3) == 0;
+}
+
+/*
+ * The irq stub pushes %ebp and points %ebp at it, so its frame looks like a
+ * call frame whose return address is the interrupted EIP. The walk climbs
+ * from fp to the first stub frame, then follows the saved %ebp chain through
+ * the interrupted code, crossing outer stubs the same way if irqs nested.
+ * Returns the number of pcs, 0 if no stub was found.
+ */
+static uint32_t walk_stack(uint32_t* pc, uint32_t* fp) {
+    int skipped = 0;
+    while (!in_irq_stub(fp[1])) {
+        uint32_t* caller = (uint32_t*)fp[0];
+        if (++skipped == MAX_IRQ_FRAMES || !valid_caller(fp, caller)) return 0;
+        fp = caller;
+    }
+    fp = (uint32_t*)fp[0];
+    uint32_t depth = 0;
+    pc[depth++] = fp[1];
+
+    while (depth < PROFILE_MAX_DEPTH) {
+        uint32_t* caller = (uint32_t*)fp[0];
+        if (!valid_caller(fp, caller)) break;
+        fp = caller;
+
+        if (in_irq_stub(fp[1])) {  // an irq handler that was itself interrupted
+            caller = (uint32_t*)fp[0];
+            if (!valid_caller(fp, caller)) break;
+            fp = caller;
+            pc[depth++] = fp[1];
+            continue;
+        }
+        if (!ksym_in_text(fp[1])) break;
+        pc[depth++] = fp[1] - 1;  // inside the call instruction, not after it
+    }
+    return depth;
+}
+
+static void profiler_tick() {
+    uint32_t tail = ring.tail;
+    if (tail - ring.head == PROFILE_RING_SIZE) {
+        ring.dropped++;
+        return;
+    }
+
+    struct ProfileSample* sample = &ring.samples[tail & (PROFILE_RING_SIZE - 1)];
+    sample->depth = walk_stack(sample->pc, __builtin_frame_address(0));
+    ring.tail = tail + 1;
+    if (tail + 1 - ring.head == PROFILE_RING_SIZE / 2) schedule_task(&drain_task);
+}
+
+static void fold_sample(const struct ProfileSample* sample) {
+    struct FoldedStack key = {.count = 0, .hash = 2166136261u, .depth = sample->depth};
+    for (uint32_t i = 0; i < sample->depth; i++) {
+        key.frames[i] = ksym_lookup(sample->pc[i]);
+        key.hash = (key.hash ^ (uint16_t)key.frames[i]) * 16777619u;
+    }
+
+    for (int probe = 0; probe < PROFILE_MAX_STACKS; probe++) {
+        struct FoldedStack* slot = &stacks[(key.hash + probe) & (PROFILE_MAX_STACKS - 1)];
+        if (slot->count == 0) {
+            *slot = key;
+            slot->count = 1;
+            num_folded++;
+            return;
+        }
+        if (slot->hash == key.hash && slot->depth == key.depth &&
+            memcmp(slot->frames, key.frames, key.depth * sizeof(key.frames[0])) == 0) {
+            slot->count++;
+            return;
+        }
+    }
+    num_unfolded++;
+}
+
+static bool drain(void* ctx) {
+    (void)ctx;
+    while (ring.head != ring.tail) {
+        fold_sample(&ring.samples[ring.head & (PROFILE_RING_SIZE - 1)]);
+        ring.head++;
+    }
+    return false;
+}
+
+void profiler_start(uint32_t hz) {
+    if (running) return;
+    init_task(&drain_task, drain, NULL);
+    rate_hz = pit_start_periodic(hz, profiler_tick);
+    running = true;
+    LOG("profiler: sampling at %u Hz", rate_hz);
+}
+
+void profiler_stop() {
+    if (!running) return;
+    pit_stop();
+    running = false;
+}
+
+void profiler_init() {
+    int hz = cmdline_int("profile", 0);
+    if (hz > 0) profiler_start(hz);
+}
+
+static size_t format(char* line, size_t len, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int written = vsnprintf(line + len, REPORT_LINE_MAX - len, fmt, args);
+    va_end(args);
+    return min(len + written, (size_t)REPORT_LINE_MAX - 1);
+}
+
+static size_t append(char* line, size_t len, const char* text) {
+    size_t n = strlen(text);
+    if (len + n >= REPORT_LINE_MAX) n = REPORT_LINE_MAX - 1 - len;
+    memcpy(line + len, text, n);
+    return len + n;
+}
+
+/*
+ * Stops sampling and prints one "root;...;leaf count" line per distinct
+ * stack between "profile: begin" and "profile: end" markers. runner.sh
+ * keeps those lines as results/<mode>.folded.
+ */
+void profiler_report() {
+    if (rate_hz == 0) return;
+    profiler_stop();
+    drain(NULL);
+
+    static char line[REPORT_LINE_MAX];
+    size_t len = format(line, 0, "profile: begin hz=%u stacks=%u dropped=%u unfolded=%u", rate_hz,
+                        num_folded, ring.dropped, num_unfolded);
+    serial_write_line(line, len);
+
+    for (int i = 0; i < PROFILE_MAX_STACKS; i++) {
+        const struct FoldedStack* stack = &stacks[i];
+        if (stack->count == 0) continue;
+
+        len = 0;
+        if (stack->depth == 0) len = append(line, len, "[unknown]");
+        for (int frame = stack->depth - 1; frame >= 0; frame--) {
+            len = append(line, len, ksym_name(stack->frames[frame]));
+            if (frame > 0) len = append(line, len, ";");
+        }
+        len = format(line, len, " %u", stack->count);
+        serial_write_line(line, len);
+    }
+    serial_write_line("profile: end", strlen("profile: end"));
+}
+
+#ifdef TEST
+static void reset_profile() {
+    ring.head = ring.tail = ring.dropped = 0;
+    memset(stacks, 0, sizeof(stacks));
+    num_folded = num_unfolded = 0;
+    rate_hz = 0;
+}
+
+static bool folded_contains(int symbol) {
+    for (int i = 0; i < PROFILE_MAX_STACKS; i++)
+        for (int frame = 0; frame < stacks[i].depth && stacks[i].count; frame++)
+            if (stacks[i].frames[frame] == symbol) return true;
+    return false;
+}
+
+// A fake irq: a handler frame returning into a stub, the stub frame, two callers
+static void test_walk_stack() {
+    uint32_t mem[16] = {0};
+    mem[0] = (uintptr_t)&mem[4];
+    mem[1] = (uintptr_t)INTERRUPT_MEM[PIT_IRQ_VECTOR] + INTERRUPT_STUB_RETURN;
+    mem[4] = (uintptr_t)&mem[8];
+    mem[5] = (uintptr_t)profiler_report + 5;
+    mem[8] = (uintptr_t)&mem[12];
+    mem[9] = (uintptr_t)ksym_lookup + 10;
+    mem[12] = 0;
+    mem[13] = (uintptr_t)profiler_start + 20;
+
+    uint32_t pc[PROFILE_MAX_DEPTH];
+    uint32_t depth = walk_stack(pc, mem);
+    assert(depth == 3, "test_walk_stack: wrong depth");
+    assert(ksym_lookup(pc[0]) == ksym_lookup((uintptr_t)profiler_report) &&
+               ksym_lookup(pc[1]) == ksym_lookup((uintptr_t)ksym_lookup) &&
+               ksym_lookup(pc[2]) == ksym_lookup((uintptr_t)profiler_start),
+           "test_walk_stack: wrong frames");
+}
+
+static void __attribute__((noinline)) profiler_test_spin() {
+    uint32_t start = get_tick();
+    while (get_tick() - start < 16) asm volatile("pause");
+}
+
+// Real samples from the PIT: ~60 ms in one function has to show up in its stacks
+static void test_sampling() {
+    profiler_stop();
+    reset_profile();
+    profiler_start(2000);
+    profiler_test_spin();
+    profiler_stop();
+    drain(NULL);
+
+    assert(num_folded > 0, "test_sampling: no samples");
+    assert(folded_contains(ksym_lookup((uintptr_t)profiler_test_spin)),
+           "test_sampling: spinning function not in any stack");
+    reset_profile();
+}
+
+void run_profiler_tests() {
+    test_walk_stack();
+    test_sampling();
+    LOG_GREEN("Profiler: [OK]");
+}
+#endif
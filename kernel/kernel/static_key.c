@@ -0,0 +1,99 @@
+#include <kernel/paging.h>
+#include <kernel/panic.h>
+#include <kernel/static_key.h>
+#include <string.h>
+#include <utils.h>
+
+#define JMP_REL32 0xe9
+
+extern struct JumpEntry __jump_table_start[];
+extern struct JumpEntry __jump_table_end[];
+
+static const uint8_t NOP5[5] = {0x0f, 0x1f, 0x44, 0x00, 0x00};
+
+/*
+ * Paging runs from boot with CR0.WP set, so ring 0 cannot count on .text
+ * being writable. Sites are written with WP cleared, interrupts are off
+ * while it is and while a site is half written, and x86 picks up stores to
+ * code on the same CPU by the next fetch.
+ */
+static uint32_t write_protect_off() {
+    uint32_t cr0;
+    asm volatile("movl %%cr0, %0" : "=r"(cr0));
+    asm volatile("movl %0, %%cr0" : : "r"(cr0 & ~CR0_WP) : "memory");
+    return cr0;
+}
+
+static void write_protect_restore(uint32_t cr0) {
+    asm volatile("movl %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+static void patch(const struct JumpEntry* entry, bool on) {
+    uint8_t* code = (uint8_t*)entry->code;
+    if (!on) {
+        memcpy(code, NOP5, sizeof(NOP5));
+        return;
+    }
+    int32_t rel = entry->target - (entry->code + sizeof(NOP5));
+    code[0] = JMP_REL32;
+    memcpy(code + 1, &rel, sizeof(rel));
+}
+
+void static_key_set(StaticKey* key, bool on) {
+    INTERRUPT_GUARDED({
+        if (key->enabled != on) {
+            key->enabled = on;
+            uint32_t cr0 = write_protect_off();
+            for (struct JumpEntry* entry = __jump_table_start; entry < __jump_table_end; entry++)
+                if (entry->key == key) patch(entry, on);
+            write_protect_restore(cr0);
+        }
+    });
+}
+
+#ifdef TEST
+static StaticKey test_key_off = STATIC_KEY_INIT(false);
+static StaticKey test_key_on = STATIC_KEY_INIT(true);
+
+static bool branch_off() {
+    return static_branch(&test_key_off, false);
+}
+
+static bool branch_on() {
+    return static_branch(&test_key_on, true);
+}
+
+static uint8_t site_opcode(StaticKey* key) {
+    for (struct JumpEntry* entry = __jump_table_start; entry < __jump_table_end; entry++)
+        if (entry->key == key) return *(uint8_t*)entry->code;
+    panic("site_opcode: no site for key");
+    return 0;
+}
+
+void test_static_key_patching() {
+    assert(!branch_off() && site_opcode(&test_key_off) == NOP5[0],
+           "test_static_key_patching 1 FAILED");
+    assert(branch_on() && site_opcode(&test_key_on) == JMP_REL32,
+           "test_static_key_patching 2 FAILED");
+
+    static_key_set(&test_key_off, true);
+    static_key_set(&test_key_on, false);
+    assert(branch_off() && site_opcode(&test_key_off) == JMP_REL32,
+           "test_static_key_patching 3 FAILED");
+    assert(!branch_on() && site_opcode(&test_key_on) == NOP5[0],
+           "test_static_key_patching 4 FAILED");
+
+    static_key_set(&test_key_off, false);
+    static_key_set(&test_key_on, true);
+    assert(!branch_off() && branch_on(), "test_static_key_patching 5 FAILED");
+
+    uint32_t cr0;
+    asm volatile("movl %%cr0, %0" : "=r"(cr0));
+    assert(cr0 & CR0_WP, "test_static_key_patching 6 FAILED");
+}
+
+void run_static_key_tests() {
+    test_static_key_patching();
+    LOG_GREEN("Static keys: [OK]");
+}
+#endif
@@ -0,0 +1,251 @@
+#define LOG_SUBSYSTEM proc
+
+#include <kernel/console.h>
+#include <kernel/gdt.h>
+#include <kernel/interrupts.h>
+#include <kernel/process.h>
+#include <kernel/syscall.h>
+#include <utils.h>
+#ifdef TEST
+#include <kernel/monotonic_tick.h>
+#include <string.h>
+#endif
+#ifdef BENCHMARKS
+#include <kernel/bench.h>
+#endif
+
+#define IA32_SYSENTER_CS 0x174
+#define IA32_SYSENTER_ESP 0x175
+#define IA32_SYSENTER_EIP 0x176
+
+// In arch/i386/syscall.S
+extern void syscall_int80_entry();
+extern void syscall_sysenter_entry();
+
+static bool has_sysenter = false;
+
+/*
+ * int 0x80 is always there. SYSENTER gets the kernel code selector, the
+ * rest follow from it, and its entry point here. Its stack comes with each
+ * process_run(), like the TSS one.
+ */
+void syscall_init() {
+    set_trap_gate(SYSCALL_VECTOR, syscall_int80_entry, 3);
+
+    has_sysenter = sysenter_supported();
+    if (has_sysenter) {
+        wrmsr(IA32_SYSENTER_CS, GDT_KERNEL_CODE);
+        wrmsr(IA32_SYSENTER_EIP, (uint32_t)syscall_sysenter_entry);
+    }
+    LOG("System calls: %s", has_sysenter ? "sysenter, int 0x80" : "int 0x80");
+}
+
+bool syscall_has_sysenter() {
+    return has_sysenter;
+}
+
+void syscall_set_kernel_stack(uint32_t esp0) {
+    tss_set_kernel_stack(esp0);
+    if (has_sysenter) wrmsr(IA32_SYSENTER_ESP, esp0);
+}
+
+// Only from the caller's user window, every space maps the kernel too
+static uint32_t sys_write(const char* data, uint32_t len) {
+    uint32_t start = (uint32_t)data;
+    if (start + len < start || start < USER_BASE || start + len > USER_END) return SYSCALL_ERROR;
+    console_write(LOG_LEVEL_INFO, data, len);
+    return len;
+}
+
+// From either entry stub, with interrupts on
+uint32_t syscall_dispatch(SyscallFrame* frame) {
+    switch (frame->eax) {
+        case SYS_EXIT:
+            process_exit(frame->ebx);
+        case SYS_WRITE:
+            return sys_write((const char*)frame->ebx, frame->esi);
+        case SYS_GETPID:
+            return process_current()->pid;
+        default:
+            LOG_RATELIMITED(LOG_LEVEL_WARN, "Unknown system call %u", frame->eax);
+            return SYSCALL_ERROR;
+    }
+}
+
+#if defined(TEST) || defined(BENCHMARKS)
+// Ring 3 code can live in the kernel image, on pages that a space shares with it
+static uint8_t ring3_stack[4096] RING3_DATA __attribute__((aligned(16)));
+
+RING3_TEXT static void ring3_exit(uint32_t code) {
+    syscall_int80(SYS_EXIT, code, 0, 0);
+    while (1) {
+    }
+}
+
+static void init_in_ring3(Process* process, void (*entry)()) {
+    assert(process_init_image(process, entry, (uint32_t)ring3_stack + sizeof(ring3_stack)),
+           "syscall: out of frames for a ring 3 process");
+}
+#endif
+
+#ifdef TEST
+static uint32_t run_in_ring3(Process* process, void (*entry)()) {
+    init_in_ring3(process, entry);
+    uint32_t code = process_run(process);
+    process_destroy(process);
+    return code;
+}
+
+static char test_message[] RING3_DATA = "syscall: hello from ring 3\n";
+static uint64_t spin_cycles RING3_DATA = 0;
+
+RING3_TEXT static void ring3_getpid_int80() {
+    ring3_exit(syscall_int80(SYS_GETPID, 0, 0, 0));
+}
+
+RING3_TEXT static void ring3_getpid_sysenter() {
+    ring3_exit(syscall_sysenter(SYS_GETPID, 0, 0, 0));
+}
+
+// Every register the stubs promise to keep, also ebp, still holds its value afterwards
+RING3_TEXT static void ring3_keeps_registers() {
+    uint32_t ebx, esi, edi, ebp;
+    asm volatile(
+        "pushl %%ebp\n\t"
+        "movl $0x11111111, %%ebx\n\t"
+        "movl $0x22222222, %%esi\n\t"
+        "movl $0x33333333, %%edi\n\t"
+        "movl $0x44444444, %%ebp\n\t"
+        "movl %4, %%eax\n\t"
+        "movl %%esp, %%ecx\n\t"
+        "movl $1f, %%edx\n\t"
+        "sysenter\n\t"
+        "1:\n\t"
+        "movl %%ebp, %%ecx\n\t"
+        "popl %%ebp"
+        : "=b"(ebx), "=S"(esi), "=D"(edi), "=c"(ebp)
+        : "i"(SYS_GETPID)
+        : "eax", "edx", "memory");
+    ring3_exit(ebx == 0x11111111 && esi == 0x22222222 && edi == 0x33333333 && ebp == 0x44444444);
+}
+
+// From the user window, which its first write there zero-fills
+RING3_TEXT static void ring3_write() {
+    volatile char* buffer = (volatile char*)USER_BASE;
+    uint32_t len = sizeof(test_message) - 1;
+    for (uint32_t i = 0; i < len; i++) buffer[i] = test_message[i];
+    uint32_t written = syscall_int80(SYS_WRITE, USER_BASE, len, 0);
+    uint32_t unknown = syscall_int80(99, 0, 0, 0);
+    ring3_exit(written == len && unknown == SYSCALL_ERROR);
+}
+
+// Busy in ring 3 for a few RTC ticks, each interrupt comes in on the TSS stack
+RING3_TEXT static void ring3_spin() {
+    uint64_t start = rdtsc();
+    while (rdtsc() - start < spin_cycles) asm volatile("pause");
+    ring3_exit(1);
+}
+
+void test_syscall_int80() {
+    Process process;
+    assert(run_in_ring3(&process, ring3_getpid_int80) == process.pid, "test_syscall_int80 FAILED");
+}
+
+void test_syscall_sysenter() {
+    if (!has_sysenter) {
+        LOG("test_syscall_sysenter: no SYSENTER, skipped");
+        return;
+    }
+    Process process;
+    assert(run_in_ring3(&process, ring3_getpid_sysenter) == process.pid,
+           "test_syscall_sysenter 1 FAILED");
+    assert(run_in_ring3(&process, ring3_keeps_registers) == 1, "test_syscall_sysenter 2 FAILED");
+}
+
+void test_syscall_write() {
+    Process process;
+    assert(run_in_ring3(&process, ring3_write) == 1, "test_syscall_write FAILED");
+}
+
+// Writes from a space of its own, the message is at USER_BASE + 0x100, and exits with the result
+static uint32_t write_in_user_space(uint32_t data, uint32_t len) {
+    uint8_t code[] = {
+        0xB8, 0, 0, 0, 0,  // mov eax, SYS_WRITE
+        0xBB, 0, 0, 0, 0,  // mov ebx, data
+        0xBE, 0, 0, 0, 0,  // mov esi, len
+        0xCD, 0x80,        // int 0x80
+        0x89, 0xC3,        // mov ebx, eax
+        0xB8, 0, 0, 0, 0,  // mov eax, SYS_EXIT
+        0xCD, 0x80,        // int 0x80
+    };
+    uint32_t imm[] = {SYS_WRITE, data, len, SYS_EXIT};
+    uint32_t offset[] = {1, 6, 11, 20};
+    for (int i = 0; i < 4; i++) memcpy(&code[offset[i]], &imm[i], sizeof(uint32_t));
+
+    Process process;
+    process_init(&process, USER_BASE, USER_TIME_PAGE);
+    assert(address_space_create(&process.space), "test_syscall_write_user_space: out of frames");
+    address_space_switch(&process.space);
+    memcpy((void*)USER_BASE, code, sizeof(code));
+    memcpy((void*)(USER_BASE + 0x100), test_message, sizeof(test_message));
+    address_space_switch(NULL);
+    uint32_t result = process_run(&process);
+    process_destroy(&process);
+    return result;
+}
+
+void test_syscall_write_user_space() {
+    uint32_t len = sizeof(test_message) - 1;
+    assert(write_in_user_space(USER_BASE + 0x100, len) == len,
+           "test_syscall_write_user_space 1 FAILED");
+    assert(write_in_user_space((uint32_t)test_message, len) == SYSCALL_ERROR,
+           "test_syscall_write_user_space 2 FAILED");
+    assert(write_in_user_space(USER_END - 4, 8) == SYSCALL_ERROR,
+           "test_syscall_write_user_space 3 FAILED");
+}
+
+void test_syscall_interrupted() {
+    Process process;
+    spin_cycles = tsc_frequency() / 50;  // 20 ms, five RTC ticks
+    uint32_t tick = get_tick();
+    assert(run_in_ring3(&process, ring3_spin) == 1, "test_syscall_interrupted 1 FAILED");
+    assert(get_tick() - tick >= 2, "test_syscall_interrupted 2 FAILED");
+}
+
+void run_syscall_tests() {
+    test_syscall_int80();
+    test_syscall_sysenter();
+    test_syscall_write();
+    test_syscall_write_user_space();
+    test_syscall_interrupted();
+    LOG_GREEN("Syscall: [OK]");
+}
+#endif
+
+#ifdef BENCHMARKS
+#define BENCH_SYSCALLS 256  // per entry to ring 3, which costs about as much as a few of them
+
+RING3_TEXT static void ring3_getpid_loop_int80() {
+    for (int i = 0; i < BENCH_SYSCALLS; i++) syscall_int80(SYS_GETPID, 0, 0, 0);
+    ring3_exit(0);
+}
+
+RING3_TEXT static void ring3_getpid_loop_sysenter() {
+    for (int i = 0; i < BENCH_SYSCALLS; i++) syscall_sysenter(SYS_GETPID, 0, 0, 0);
+    ring3_exit(0);
+}
+
+// Set up once, each run costs just the entry to ring 3 and the calls
+static Process bench_int80, bench_sysenter;
+
+BENCH_OPS(syscall_int80, BENCH_SYSCALLS) {
+    if (!bench_int80.space.directory) init_in_ring3(&bench_int80, ring3_getpid_loop_int80);
+    process_run(&bench_int80);
+}
+
+BENCH_OPS(syscall_sysenter, BENCH_SYSCALLS) {
+    if (!has_sysenter) return;
+    if (!bench_sysenter.space.directory) init_in_ring3(&bench_sysenter, ring3_getpid_loop_sysenter);
+    process_run(&bench_sysenter);
+}
+#endif
@@ -0,0 +1,170 @@
+#define LOG_SUBSYSTEM time
+
+#include <kernel/io/rtc.h>
+#include <kernel/monotonic_tick.h>
+#include <kernel/paging.h>
+#include <kernel/panic.h>
+#include <kernel/time_page.h>
+#include <kernel/wallclock.h>
+#include <utils.h>
+#ifdef TEST
+#include <kernel/process.h>
+#include <kernel/syscall.h>
+#endif
+#ifdef BENCHMARKS
+#include <kernel/bench.h>
+#endif
+
+#define MIN_RATE_NS (NS_PER_SECOND / RTC_FREQ / 2)  // shorter updates give a noisy rate
+
+// A page of its own, processes map all of it
+static union {
+    TimePage time;
+    uint8_t bytes[PAGE_SIZE];
+} shared __attribute__((aligned(PAGE_SIZE)));
+static TimePage* const page = &shared.time;
+static bool published = false;
+static uint64_t wall_offset_ns = 0;
+
+/*
+ * The page clock runs on the TSC between updates and is set back to
+ * monotonic_ns() at each one, unless the TSC ran ahead: then it keeps its
+ * own time and the rate for the next tick, taken against monotonic_ns(),
+ * comes out lower by as much. Readers never see it go back. Called with
+ * interrupts off, so there is one writer at a time.
+ */
+static void fill() {
+    uint64_t tsc = rdtsc();
+    uint64_t ns = monotonic_ns();
+
+    uint32_t mult = page->tsc_mult;
+    uint64_t cycles = tsc - page->tsc;
+    if (cycles) {
+        uint64_t extrapolated = page->ns + (cycles * mult >> TIME_PAGE_SHIFT);
+        if (ns >= page->ns + MIN_RATE_NS) mult = ((ns - page->ns) << TIME_PAGE_SHIFT) / cycles;
+        if (extrapolated > ns) ns = extrapolated;
+    }
+
+    page->sequence++;
+    time_page_barrier();
+    page->tick = get_tick();
+    page->tsc_mult = mult;
+    page->tsc = tsc;
+    page->ns = ns;
+    page->wall_offset_ns = wall_offset_ns;
+    time_page_barrier();
+    page->sequence++;
+}
+
+/*
+ * The wall clock offset starts out within a tick, the next update-ended
+ * interrupt pins it to the start of a second.
+ */
+const TimePage* time_page() {
+    if (published) return page;
+
+    uint64_t hz = tsc_frequency();
+    uint64_t seconds;
+    uint32_t nanoseconds;
+    wallclock_now(&seconds, &nanoseconds);
+    INTERRUPT_GUARDED({
+        wall_offset_ns = seconds * NS_PER_SECOND + nanoseconds - monotonic_ns();
+        page->rtc_freq = RTC_FREQ;
+        page->tsc_mult = (NS_PER_SECOND << TIME_PAGE_SHIFT) / hz;
+        page->tsc = rdtsc();
+        page->ns = monotonic_ns();
+        fill();
+        published = true;
+    });
+    wallclock_sync();
+    LOG_DEBUG("Time page at 0x%x, %u ns per 2^%u cycles", page, page->tsc_mult, TIME_PAGE_SHIFT);
+    return page;
+}
+
+void time_page_update() {
+    if (published) fill();
+}
+
+// Exact at the RTC's update-ended interrupt, where the second just began
+void time_page_set_wallclock(uint64_t unix_ns) {
+    INTERRUPT_GUARDED({
+        wall_offset_ns = unix_ns - monotonic_ns();
+        if (published) fill();
+    });
+}
+
+#ifdef TEST
+static uint8_t ring3_stack[1024] RING3_DATA __attribute__((aligned(16)));
+
+// Exits with the microseconds since boot, read in ring 3 from the page it got from process_run()
+RING3_TEXT static void ring3_read_clock(const TimePage* time) {
+    TimeSpec now;
+    uint32_t us = 0;
+    if (time_page_clock_gettime(time, CLOCK_MONOTONIC, &now))
+        us = now.seconds * 1000000 + now.nanoseconds / 1000;
+    syscall_int80(SYS_EXIT, us, 0, 0);
+    while (1) {
+    }
+}
+
+void test_time_page_matches() {
+    const TimePage* time = time_page();
+    for (int i = 0; i < 16; i++) {
+        uint64_t before = monotonic_ns();
+        uint64_t ns = time_page_ns(time, NULL);
+        uint64_t after = monotonic_ns();
+        assert(ns + 100000 >= before && ns <= after + 100000, "test_time_page_matches 1 FAILED");
+        uint32_t tick = get_tick();
+        while (get_tick() == tick) asm volatile("hlt");
+    }
+    assert(time_page_tick(time) + 1 >= get_tick(), "test_time_page_matches 2 FAILED");
+}
+
+// Across a few updates, which may have to make up for a TSC that ran ahead
+void test_time_page_monotonic() {
+    const TimePage* time = time_page();
+    uint32_t start = get_tick();
+    uint64_t prev = time_page_ns(time, NULL);
+    while (get_tick() - start < 4) {
+        uint64_t ns = time_page_ns(time, NULL);
+        assert(ns >= prev, "test_time_page_monotonic FAILED");
+        prev = ns;
+    }
+}
+
+void test_time_page_wallclock() {
+    TimeSpec now;
+    assert(time_page_clock_gettime(time_page(), CLOCK_REALTIME, &now),
+           "test_time_page_wallclock 1 FAILED");
+    uint64_t seconds = wallclock_seconds();
+    assert(now.seconds + 1 >= seconds && now.seconds <= seconds + 1,
+           "test_time_page_wallclock 2 FAILED");
+    assert(!time_page_clock_gettime(time_page(), 7, &now), "test_time_page_wallclock 3 FAILED");
+}
+
+void test_time_page_ring3() {
+    Process process;
+    uint32_t stack_top = (uint32_t)ring3_stack + sizeof(ring3_stack);
+    assert(process_init_image(&process, (void (*)())ring3_read_clock, stack_top),
+           "test_time_page_ring3: out of frames");
+    uint32_t before = monotonic_ns() / 1000;
+    uint32_t us = process_run(&process);
+    uint32_t after = monotonic_ns() / 1000;
+    process_destroy(&process);
+    assert(us + 100 >= before && us <= after + 100, "test_time_page_ring3 FAILED");
+}
+
+void run_time_page_tests() {
+    test_time_page_matches();
+    test_time_page_monotonic();
+    test_time_page_wallclock();
+    test_time_page_ring3();
+    LOG_GREEN("Time page: [OK]");
+}
+#endif
+
+#ifdef BENCHMARKS
+BENCH(time_page_ns) {
+    time_page_ns(time_page(), NULL);
+}
+#endif
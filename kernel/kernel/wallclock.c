@@ -0,0 +1,192 @@
+#define LOG_SUBSYSTEM time
+
+#include <kernel/monotonic_tick.h>
+#include <kernel/panic.h>
+#include <kernel/time_page.h>
+#include <kernel/wallclock.h>
+#include <utils.h>
+#ifdef TEST
+#include <unistd.h>
+#endif
+#ifdef BENCHMARKS
+#include <kernel/bench.h>
+#endif
+
+#define SECONDS_PER_DAY 86400
+#define NS_PER_TICK (1000000000 / RTC_FREQ)
+#define DEFAULT_CENTURY 20  // for RTCs without a century register
+
+// Unix time at base_tick. Written by the RTC interrupt, read with interrupts off.
+static uint64_t base_seconds = 0;
+static uint32_t base_tick = 0;
+static volatile bool synced = false;
+
+// Days since 1970-01-01 of a proleptic Gregorian date (Howard Hinnant's days_from_civil)
+static int32_t days_from_civil(int32_t year, uint32_t month, uint32_t day) {
+    year -= month <= 2;
+    int32_t era = (year >= 0 ? year : year - 399) / 400;
+    uint32_t year_of_era = year - era * 400;
+    uint32_t day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    uint32_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + (int32_t)day_of_era - 719468;
+}
+
+uint64_t date_time_to_unix(struct DateTime d) {
+    int32_t century = d.century ? d.century : DEFAULT_CENTURY;
+    int32_t days = days_from_civil(century * 100 + d.year, d.month, d.day_of_month);
+    return (uint64_t)days * SECONDS_PER_DAY + d.hours * 3600 + d.minutes * 60 + d.seconds;
+}
+
+struct DateTime unix_to_date_time(uint64_t seconds) {
+    int32_t days = seconds / SECONDS_PER_DAY;
+    uint32_t second_of_day = seconds % SECONDS_PER_DAY;
+
+    // civil_from_days, the inverse of the above
+    int32_t z = days + 719468;
+    int32_t era = (z >= 0 ? z : z - 146096) / 146097;
+    uint32_t day_of_era = z - era * 146097;
+    uint32_t year_of_era =
+        (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    uint32_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    uint32_t mp = (5 * day_of_year + 2) / 153;
+    uint32_t month = mp < 10 ? mp + 3 : mp - 9;
+    int32_t year = year_of_era + era * 400 + (month <= 2);
+
+    struct DateTime d;
+    d.seconds = second_of_day % 60;
+    d.minutes = second_of_day / 60 % 60;
+    d.hours = second_of_day / 3600;
+    d.week_day = (days + 4) % 7 + 1;  // 1970-01-01 was a Thursday, the RTC counts Sunday as 1
+    d.day_of_month = day_of_year - (153 * mp + 2) / 5 + 1;
+    d.month = month;
+    d.year = year % 100;
+    d.century = year / 100;
+    return d;
+}
+
+static void set_base(struct DateTime now) {
+    uint64_t seconds = date_time_to_unix(now);
+    uint32_t tick = get_tick();
+    INTERRUPT_GUARDED({
+        base_seconds = seconds;
+        base_tick = tick;
+    });
+    time_page_set_wallclock(seconds * NS_PER_SECOND);
+}
+
+// Within a second of the truth until the first update-ended interrupt
+void wallclock_init() {
+    set_base(get_date_time());
+    wallclock_sync();
+}
+
+void wallclock_sync() {
+    synced = false;
+    rtc_update_interrupt(true);
+}
+
+/*
+ * The RTC just finished an update, so the registers hold a fresh second and
+ * the next update is almost a second away: no waiting for UIP to clear.
+ */
+void wallclock_update_ended() {
+    set_base(get_date_time());
+    rtc_update_interrupt(false);
+    synced = true;
+}
+
+bool wallclock_synced() {
+    return synced;
+}
+
+void wallclock_now(uint64_t* seconds, uint32_t* nanoseconds) {
+    uint64_t base;
+    uint32_t since;
+    INTERRUPT_GUARDED({
+        base = base_seconds;
+        since = get_tick() - base_tick;
+    });
+    *seconds = base + since / RTC_FREQ;
+    if (nanoseconds) *nanoseconds = since % RTC_FREQ * NS_PER_TICK;
+}
+
+uint64_t wallclock_seconds() {
+    uint64_t seconds;
+    wallclock_now(&seconds, NULL);
+    return seconds;
+}
+
+struct DateTime wallclock_date_time() {
+    return unix_to_date_time(wallclock_seconds());
+}
+
+#ifdef TEST
+static struct DateTime date(int year, int month, int day, int hours, int minutes, int seconds) {
+    struct DateTime d = {.seconds = seconds,
+                         .minutes = minutes,
+                         .hours = hours,
+                         .day_of_month = day,
+                         .month = month,
+                         .year = year % 100,
+                         .century = year / 100};
+    return d;
+}
+
+static bool same_date_time(struct DateTime a, struct DateTime b) {
+    return a.seconds == b.seconds && a.minutes == b.minutes && a.hours == b.hours &&
+           a.day_of_month == b.day_of_month && a.month == b.month && a.year == b.year &&
+           a.century == b.century;
+}
+
+void test_unix_conversion() {
+    assert(date_time_to_unix(date(1970, 1, 1, 0, 0, 0)) == 0, "test_unix_conversion 1 FAILED");
+    assert(date_time_to_unix(date(2000, 2, 29, 12, 34, 56)) == 951827696,
+           "test_unix_conversion 2 FAILED");
+    assert(date_time_to_unix(date(2038, 1, 19, 3, 14, 8)) == 2147483648ULL,
+           "test_unix_conversion 3 FAILED");
+    assert(unix_to_date_time(0).week_day == 5 && unix_to_date_time(951827696).week_day == 3,
+           "test_unix_conversion 4 FAILED");
+
+    // Round trips across month, leap day and century ends
+    const struct DateTime dates[] = {
+        date(1999, 12, 31, 23, 59, 59), date(2000, 1, 1, 0, 0, 0),  date(2024, 2, 29, 8, 0, 0),
+        date(2024, 3, 1, 0, 0, 1),      date(2100, 2, 28, 23, 0, 0), date(2100, 3, 1, 1, 2, 3),
+    };
+    for (size_t i = 0; i < sizeof(dates) / sizeof(dates[0]); i++)
+        assert(same_date_time(unix_to_date_time(date_time_to_unix(dates[i])), dates[i]),
+               "test_unix_conversion 5 FAILED");
+}
+
+// After the update-ended interrupt the clock agrees with the CMOS to within its one-second steps
+void test_wallclock_matches_rtc() {
+    uint32_t start = get_tick();
+    while (!wallclock_synced() && get_tick() - start < 2 * RTC_FREQ) asm volatile("hlt");
+    assert(wallclock_synced(), "test_wallclock_matches_rtc: no update-ended interrupt");
+
+    uint64_t rtc = date_time_to_unix(get_date_time());
+    uint64_t wall = wallclock_seconds();
+    assert(wall + 1 >= rtc && wall <= rtc + 1, "test_wallclock_matches_rtc: clocks disagree");
+
+    uint64_t before = wallclock_seconds();
+    sleep(1);
+    assert(wallclock_seconds() - before >= 1, "test_wallclock_matches_rtc: clock did not advance");
+}
+
+void run_wallclock_tests() {
+    test_unix_conversion();
+    test_wallclock_matches_rtc();
+    LOG_GREEN("Wallclock: [OK]");
+}
+#endif
+
+#ifdef BENCHMARKS
+BENCH(wallclock_now) {
+    uint64_t seconds;
+    uint32_t nanoseconds;
+    wallclock_now(&seconds, &nanoseconds);
+}
+
+BENCH(rtc_get_date_time) {
+    get_date_time();
+}
+#endif
@@ -7,6 +7,8 @@
 
 #define EOF (-1)
 
+typedef void (*FormatSink)(void* ctx, const char* data, size_t len);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -15,6 +17,7 @@ int printf(const char* __restrict, ...);
 int putchar(int);
 int puts(const char*);
 int vsnprintf(char* buffer, size_t bufsz, const char* format, va_list vlist);
+int vcbprintf(FormatSink sink, void* ctx, const char* format, va_list vlist);
 void run_stdio_tests();
 
 #ifdef __cplusplus
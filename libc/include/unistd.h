@@ -4,5 +4,6 @@
 #include <stdint.h>
 
 void sleep(uint32_t);
+void usleep(uint32_t);
 
 #endif
@@ -2,163 +2,407 @@
 #include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <utils.h>
 
+#if defined(__is_libk)
+#include <kernel/console.h>
+#endif
+
+#define FLAG_LEFT 0x01
+#define FLAG_ZERO 0x02
+#define FLAG_PLUS 0x04
+#define FLAG_SPACE 0x08
+#define FLAG_ALT 0x10
+
+// Enough for a 64-bit value in decimal (20 digits) or hex (16 digits)
+#define DIGITS_MAX 24
+
+enum LengthModifier { LEN_DEFAULT = 0, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_Z };
+
+struct FormatSpec {
+    uint8_t flags;
+    int width;
+    int precision;  // -1 if not given
+    enum LengthModifier length;
+};
+
+struct Formatter {
+    FormatSink sink;
+    void* ctx;
+    size_t written;
+};
+
+struct BufferSink {
+    char* buffer;
+    size_t size;
+    size_t pos;
+};
+
+// "00" "01" ... "99": two decimal digits per lookup
+static const char DEC_PAIRS[200] = {
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899"};
+
+// "00" "01" ... "ff": one byte per lookup
+static const char HEX_PAIRS_LOWER[512] = {
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff"};
+
+static const char HEX_PAIRS_UPPER[512] = {
+    "000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECFD0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEFF0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF"};
+
+static const char SPACES[16] = {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ',
+                                ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '};
+static const char ZEROS[16] = {'0', '0', '0', '0', '0', '0', '0', '0',
+                               '0', '0', '0', '0', '0', '0', '0', '0'};
+
 char msg[100];
-static bool print(const char* data, size_t length) {
-    const unsigned char* bytes = (const unsigned char*)data;
-    for (size_t i = 0; i < length; i++)
-        if (putchar(bytes[i]) == EOF) return false;
-    return true;
-}
-
-static void int_to_hex(char* buf, uint64_t val, int num_digits) {
-    const char* digits = "0123456789abcdef";
-    for (int i = num_digits - 1; i >= 0; i--) {
-        buf[i] = digits[val & 0xF];
-        val >>= 4;
+
+static inline void emit(struct Formatter* f, const char* data, size_t len) {
+    if (len == 0) return;
+    f->sink(f->ctx, data, len);
+    f->written += len;
+}
+
+static void emit_fill(struct Formatter* f, const char fill[16], int count) {
+    while (count > 0) {
+        int n = min(count, 16);
+        emit(f, fill, n);
+        count -= n;
     }
-    buf[num_digits] = '\0';
 }
 
-int printf(const char* restrict format, ...) {
-    char buf[1024];
-    va_list args;
-    va_start(args, format);
-    int written = vsnprintf(buf, sizeof(buf), format, args);
-    va_end(args);
-    print(buf, written);
-    return written;
+static inline char* put_pair(char* p, const char* pair) {
+    p -= 2;
+    p[0] = pair[0];
+    p[1] = pair[1];
+    return p;
 }
 
-void to_str_unsigned(char* buf, uint64_t value) {
-    to_str(buf, value);
+// Writes the decimal digits of val so that they end right before end.
+// Returns the first digit. Only values above 32 bits pay for 64-bit division.
+static char* format_decimal(char* end, uint64_t val) {
+    char* p = end;
+
+    while (val > UINT32_MAX) {
+        uint64_t q = val / 100000000;
+        uint32_t r = (uint32_t)(val - q * 100000000);
+        for (int i = 0; i < 4; i++) {
+            p = put_pair(p, &DEC_PAIRS[(r % 100) * 2]);
+            r /= 100;
+        }
+        val = q;
+    }
+
+    uint32_t v = (uint32_t)val;
+    while (v >= 100) {
+        p = put_pair(p, &DEC_PAIRS[(v % 100) * 2]);
+        v /= 100;
+    }
+    if (v >= 10)
+        p = put_pair(p, &DEC_PAIRS[v * 2]);
+    else
+        *--p = '0' + v;
+
+    return p;
 }
 
-int vsnprintf(char* buffer, size_t bufsz, const char* format, va_list vlist) {
-    size_t written = 0;
-    char* out = buffer;
+static char* format_hex(char* end, uint64_t val, const char* pairs) {
+    char* p = end;
+    do {
+        p = put_pair(p, &pairs[(val & 0xFF) * 2]);
+        val >>= 8;
+    } while (val);
 
-    while (*format) {
-        if (*format != '%') {
-            if (written + 1 < bufsz) {
-                *out++ = *format;
-            }
-            written++;
-            format++;
-            continue;
-        }
+    if (*p == '0' && p + 1 < end) p++;  // odd number of nibbles
+    return p;
+}
 
-        const char* start_fmt = format++;  // skip '%'
+static void format_integer(struct Formatter* f, const struct FormatSpec* spec, uint64_t val,
+                           bool negative, char conv) {
+    char digits[DIGITS_MAX];
+    char* end = digits + DIGITS_MAX;
+    char* start = end;
+
+    // "%.0d" with a zero value prints no digits at all
+    if (val != 0 || spec->precision != 0) {
+        if (conv == 'X')
+            start = format_hex(end, val, HEX_PAIRS_UPPER);
+        else if (conv == 'x' || conv == 'p')
+            start = format_hex(end, val, HEX_PAIRS_LOWER);
+        else
+            start = format_decimal(end, val);
+    }
+    int num_digits = end - start;
+
+    char prefix[2];
+    int prefix_len = 0;
+    bool is_hex = conv == 'x' || conv == 'X' || conv == 'p';
+    if (negative)
+        prefix[prefix_len++] = '-';
+    else if (conv == 'd' && (spec->flags & FLAG_PLUS))
+        prefix[prefix_len++] = '+';
+    else if (conv == 'd' && (spec->flags & FLAG_SPACE))
+        prefix[prefix_len++] = ' ';
+    else if (is_hex && (spec->flags & FLAG_ALT) && (val != 0 || conv == 'p')) {
+        prefix[prefix_len++] = '0';
+        prefix[prefix_len++] = conv == 'X' ? 'X' : 'x';
+    }
 
-        // Handle %%
-        if (*format == '%') {
-            if (written + 1 < bufsz) {
-                *out++ = '%';
-            }
-            written++;
-            format++;
-            continue;
-        }
+    int zeros = spec->precision > num_digits ? spec->precision - num_digits : 0;
+    if ((spec->flags & FLAG_ZERO) && !(spec->flags & FLAG_LEFT) && spec->precision < 0) {
+        int used = prefix_len + num_digits;
+        if (spec->width > used) zeros = spec->width - used;
+    }
 
-        // Handle format specifier
-        char temp[32] = {0};
-        size_t len = 0;
+    int pad = spec->width - (prefix_len + zeros + num_digits);
+    if (!(spec->flags & FLAG_LEFT)) emit_fill(f, SPACES, pad);
+    emit(f, prefix, prefix_len);
+    emit_fill(f, ZEROS, zeros);
+    emit(f, start, num_digits);
+    if (spec->flags & FLAG_LEFT) emit_fill(f, SPACES, pad);
+}
 
-        if (*format == 'c') {
-            char c = (char)va_arg(vlist, int);
-            if (written + 1 < bufsz) {
-                *out++ = c;
-            }
-            written++;
-            format++;
-            continue;
-
-        } else if (*format == 's') {
-            const char* s = va_arg(vlist, const char*);
-            size_t slen = strlen(s);
-            for (size_t i = 0; i < slen; i++) {
-                if (written + 1 < bufsz) {
-                    *out++ = s[i];
-                }
-                written++;
-            }
+static void format_string(struct Formatter* f, const struct FormatSpec* spec, const char* s,
+                          size_t len) {
+    int pad = spec->width - (int)len;
+    if (!(spec->flags & FLAG_LEFT)) emit_fill(f, SPACES, pad);
+    emit(f, s, len);
+    if (spec->flags & FLAG_LEFT) emit_fill(f, SPACES, pad);
+}
+
+static const char* parse_number(const char* format, int* out) {
+    int val = 0;
+    while (*format >= '0' && *format <= '9') val = val * 10 + (*format++ - '0');
+    *out = val;
+    return format;
+}
+
+static const char* parse_spec(const char* format, struct FormatSpec* spec, va_list* vlist) {
+    spec->flags = 0;
+    spec->width = 0;
+    spec->precision = -1;
+    spec->length = LEN_DEFAULT;
+
+    for (;; format++) {
+        if (*format == '-')
+            spec->flags |= FLAG_LEFT;
+        else if (*format == '0')
+            spec->flags |= FLAG_ZERO;
+        else if (*format == '+')
+            spec->flags |= FLAG_PLUS;
+        else if (*format == ' ')
+            spec->flags |= FLAG_SPACE;
+        else if (*format == '#')
+            spec->flags |= FLAG_ALT;
+        else
+            break;
+    }
+
+    if (*format == '*') {
+        spec->width = va_arg(*vlist, int);
+        if (spec->width < 0) {
+            spec->flags |= FLAG_LEFT;
+            spec->width = -spec->width;
+        }
+        format++;
+    } else {
+        format = parse_number(format, &spec->width);
+    }
+
+    if (*format == '.') {
+        format++;
+        if (*format == '*') {
+            spec->precision = va_arg(*vlist, int);
+            if (spec->precision < 0) spec->precision = -1;
             format++;
-            continue;
-
-        } else if (*format == 'd') {
-            int x = va_arg(vlist, int);
-            to_str(temp, x);
-            len = strlen(temp);
-            goto copy_temp;
-
-        } else if (*format == 'u') {
-            unsigned int x = va_arg(vlist, unsigned int);
-            to_str_unsigned(temp, x);
-            len = strlen(temp);
-            goto copy_temp;
-
-        } else if (*format == 'x') {
-            unsigned int x = va_arg(vlist, unsigned int);
-            int_to_hex(temp, x, 8);
-            len = strlen(temp);
-            goto copy_temp;
-
-        } else if (strncmp(format, "llx", 3) == 0) {
-            format += 2;  // we'll increment once more below
-            unsigned long long x = va_arg(vlist, unsigned long long);
-            int_to_hex(temp, x, 16);
-            len = strlen(temp);
-            goto copy_temp;
-
-        } else if (strncmp(format, "llu", 3) == 0) {
-            format += 2;
-            unsigned long long x = va_arg(vlist, unsigned long long);
-            to_str_unsigned(temp, x);
-            len = strlen(temp);
-            goto copy_temp;
-
-        } else if (strncmp(format, "lu", 2) == 0) {
-            format += 1;
-            unsigned long x = va_arg(vlist, unsigned long);
-            to_str_unsigned(temp, x);
-            len = strlen(temp);
-            goto copy_temp;
+        } else {
+            format = parse_number(format, &spec->precision);
         }
+    }
 
-        // Unknown format specifier, just print as-is
-        while (*start_fmt && *start_fmt != '%') start_fmt++;
-        while (start_fmt <= format) {
-            if (written + 1 < bufsz) *out++ = *start_fmt;
-            written++;
-            start_fmt++;
+    if (*format == 'h') {
+        format++;
+        spec->length = LEN_H;
+        if (*format == 'h') {
+            format++;
+            spec->length = LEN_HH;
         }
+    } else if (*format == 'l') {
         format++;
-        continue;
+        spec->length = LEN_L;
+        if (*format == 'l') {
+            format++;
+            spec->length = LEN_LL;
+        }
+    } else if (*format == 'z') {
+        format++;
+        spec->length = LEN_Z;
+    }
 
-    copy_temp:
-        for (size_t i = 0; i < len; i++) {
-            if (written + 1 < bufsz) {
-                *out++ = temp[i];
+    return format;
+}
+
+static int64_t fetch_signed(enum LengthModifier length, va_list* vlist) {
+    switch (length) {
+        case LEN_HH:
+            return (signed char)va_arg(*vlist, int);
+        case LEN_H:
+            return (short)va_arg(*vlist, int);
+        case LEN_L:
+            return va_arg(*vlist, long);
+        case LEN_LL:
+            return va_arg(*vlist, long long);
+        case LEN_Z:
+            return va_arg(*vlist, ptrdiff_t);  // ssize_t, the same width as size_t
+        default:
+            return va_arg(*vlist, int);
+    }
+}
+
+static uint64_t fetch_unsigned(enum LengthModifier length, va_list* vlist) {
+    switch (length) {
+        case LEN_HH:
+            return (unsigned char)va_arg(*vlist, unsigned int);
+        case LEN_H:
+            return (unsigned short)va_arg(*vlist, unsigned int);
+        case LEN_L:
+            return va_arg(*vlist, unsigned long);
+        case LEN_LL:
+            return va_arg(*vlist, unsigned long long);
+        case LEN_Z:
+            return va_arg(*vlist, size_t);
+        default:
+            return va_arg(*vlist, unsigned int);
+    }
+}
+
+/*
+ * Single pass formatter. Literal runs and converted fields are handed to the
+ * sink as spans; nothing is staged in an intermediate line buffer.
+ */
+int vcbprintf(FormatSink sink, void* ctx, const char* format, va_list vlist) {
+    struct Formatter f = {.sink = sink, .ctx = ctx, .written = 0};
+    struct FormatSpec spec;
+    va_list args;
+    va_copy(args, vlist);
+
+    while (*format) {
+        const char* run = format;
+        while (*format && *format != '%') format++;
+        emit(&f, run, format - run);
+        if (!*format) break;
+
+        const char* start_fmt = format++;  // skip '%'
+        format = parse_spec(format, &spec, &args);
+
+        switch (*format) {
+            case '%':
+                emit(&f, "%", 1);
+                break;
+            case 'c': {
+                char c = (char)va_arg(args, int);
+                format_string(&f, &spec, &c, 1);
+                break;
+            }
+            case 's': {
+                const char* s = va_arg(args, const char*);
+                if (!s) s = "(null)";
+                size_t len = 0;
+                if (spec.precision >= 0)
+                    while (len < (size_t)spec.precision && s[len]) len++;
+                else
+                    while (s[len]) len++;
+                format_string(&f, &spec, s, len);
+                break;
             }
-            written++;
+            case 'd':
+            case 'i': {
+                int64_t x = fetch_signed(spec.length, &args);
+                uint64_t mag = x < 0 ? -(uint64_t)x : (uint64_t)x;
+                format_integer(&f, &spec, mag, x < 0, 'd');
+                break;
+            }
+            case 'u':
+            case 'x':
+            case 'X':
+                format_integer(&f, &spec, fetch_unsigned(spec.length, &args), false, *format);
+                break;
+            case 'p':
+                spec.flags |= FLAG_ALT;
+                format_integer(&f, &spec, (uintptr_t)va_arg(args, void*), false, 'p');
+                break;
+            case '\0':
+                // Dangling '%' at the end, print what we have
+                emit(&f, start_fmt, format - start_fmt);
+                va_end(args);
+                return f.written;
+            default:
+                // Unknown format specifier, just print as-is
+                emit(&f, start_fmt, format - start_fmt + 1);
+                break;
         }
         format++;
     }
 
-    // Null-terminate if space allows
-    if (bufsz > 0) {
-        if (written >= bufsz)
-            buffer[bufsz - 1] = '\0';
-        else
-            buffer[written] = '\0';
+    va_end(args);
+    return f.written;
+}
+
+static void buffer_sink(void* ctx, const char* data, size_t len) {
+    struct BufferSink* b = (struct BufferSink*)ctx;
+    if (b->pos + 1 < b->size) {
+        size_t room = b->size - 1 - b->pos;
+        memcpy(b->buffer + b->pos, data, min(len, room));
     }
+    b->pos += len;
+}
+
+int vsnprintf(char* buffer, size_t bufsz, const char* format, va_list vlist) {
+    struct BufferSink b = {.buffer = buffer, .size = bufsz, .pos = 0};
+    int written = vcbprintf(buffer_sink, &b, format, vlist);
+
+    // Null-terminate if space allows
+    if (bufsz > 0) buffer[min(b.pos, bufsz - 1)] = '\0';
 
     return written;
 }
 
+static void console_sink(void* ctx, const char* data, size_t len) {
+    (void)ctx;
+#if defined(__is_libk)
+    console_write(LOG_LEVEL_INFO, data, len);
+#else
+    for (size_t i = 0; i < len; i++) putchar(data[i]);
+#endif
+}
+
+int printf(const char* restrict format, ...) {
+    va_list args;
+    va_start(args, format);
+    int written = vcbprintf(console_sink, NULL, format, args);
+    va_end(args);
+    return written;
+}
+
 #ifdef TEST
 void test_printf() {
     memset(msg, 0, sizeof(msg));
@@ -167,14 +411,14 @@ void test_printf() {
 const char* test_vsnprintf_fn(int* outSize, const char* msg, int bufSize, const char* fmt, ...) {
     va_list args;
     va_start(args, fmt);
-    *outSize = vsnprintf(msg, bufSize, fmt, args);
+    *outSize = vsnprintf((char*)msg, bufSize, fmt, args);
     va_end(args);
     return msg;
 }
 
 void test_vsnprintf() {
     char out_buf[100] = {0};
-    char* out;
+    const char* out;
     int outSize = 0;
 
     out = test_vsnprintf_fn(&outSize, out_buf, 100, "test");
@@ -213,9 +457,94 @@ void test_vsnprintf() {
            "test_vsnprintf_6() FAILED");
 }
 
+void test_vsnprintf_width_precision() {
+    char out_buf[100] = {0};
+    const char* out;
+    int outSize = 0;
+
+    out = test_vsnprintf_fn(&outSize, out_buf, 100, "[%5d|%-5d|%05d]", 42, 42, -42);
+    assert(memcmp(out, "[   42|42   |-0042]", sizeof("[   42|42   |-0042]")) == 0,
+           "test_vsnprintf_width() FAILED");
+
+    out = test_vsnprintf_fn(&outSize, out_buf, 100, "[%.3d|%8.3d|%.0d]", 7, -7, 0);
+    assert(memcmp(out, "[007|    -007|]", sizeof("[007|    -007|]")) == 0,
+           "test_vsnprintf_precision() FAILED");
+
+    out = test_vsnprintf_fn(&outSize, out_buf, 100, "[%.3s|%6s|%-6s|%*d]", "abcdef", "ab", "ab", 4,
+                            9);
+    assert(memcmp(out, "[abc|    ab|ab    |   9]", sizeof("[abc|    ab|ab    |   9]")) == 0,
+           "test_vsnprintf_string() FAILED");
+
+    out = test_vsnprintf_fn(&outSize, out_buf, 100, "%x %X %#x %08x %x", 0xbeef, 0xbeef, 0x1f, 0xab,
+                            0);
+    assert(memcmp(out, "beef BEEF 0x1f 000000ab 0", sizeof("beef BEEF 0x1f 000000ab 0")) == 0,
+           "test_vsnprintf_hex() FAILED");
+
+    out = test_vsnprintf_fn(&outSize, out_buf, 100, "%llu %llx %lld", 18446744073709551615ULL,
+                            0x0123456789abcdefULL, -9000000000LL);
+    assert(memcmp(out, "18446744073709551615 123456789abcdef -9000000000",
+                  sizeof("18446744073709551615 123456789abcdef -9000000000")) == 0,
+           "test_vsnprintf_64bit() FAILED");
+
+    out = test_vsnprintf_fn(&outSize, out_buf, 100, "%d %u %hhu %c%%", -2147483647 - 1, 4294967295U,
+                            257, 'z');
+    assert(memcmp(out, "-2147483648 4294967295 1 z%", sizeof("-2147483648 4294967295 1 z%")) == 0,
+           "test_vsnprintf_limits() FAILED");
+
+    out = test_vsnprintf_fn(&outSize, out_buf, 100, "%zd %zu", (ptrdiff_t)-1, (size_t)-1);
+    assert(memcmp(out, "-1 4294967295", sizeof("-1 4294967295")) == 0,
+           "test_vsnprintf_size() FAILED");
+
+    // Truncation still reports the full length
+    out = test_vsnprintf_fn(&outSize, out_buf, 6, "%s-%d", "hello", 12345);
+    assert(outSize == 11, "test_vsnprintf_truncate() ret FAILED");
+    assert(memcmp(out, "hello", sizeof("hello")) == 0, "test_vsnprintf_truncate() FAILED");
+}
+
 void run_stdio_tests() {
     test_printf();
     test_vsnprintf();
+    test_vsnprintf_width_precision();
     LOG_GREEN("Stdio: [OK]");
 }
 #endif
+
+#if defined(__is_libk) && defined(BENCHMARKS)
+#include <kernel/bench.h>
+
+static int bench_line(char* out, size_t size, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int size_written = vsnprintf(out, size, fmt, args);
+    va_end(args);
+    return size_written;
+}
+
+static void bench_null_sink(void* ctx, const char* data, size_t len) {
+    (void)ctx;
+    (void)data;
+    (void)len;
+}
+
+static int bench_stream(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int size_written = vcbprintf(bench_null_sink, NULL, fmt, args);
+    va_end(args);
+    return size_written;
+}
+
+// The message and prefix of a typical LOG() line, without the log ring and devices
+BENCH(log_format) {
+    char buf[100];
+    char prefix[100];
+    bench_line(buf, sizeof(buf), "Found device at bus: %d, slot: %d, base: 0x%x", 0, 4, 0xc000);
+    bench_line(prefix, sizeof(prefix), "[%s] %s:%d ", "INFO", __FILE__, __LINE__);
+}
+
+// The same line streamed to a sink in one go, as console_vprintf() does
+BENCH(log_stream) {
+    bench_stream("[%s] %s:%d Found device at bus: %d, slot: %d, base: 0x%x", "INFO", __FILE__,
+                 __LINE__, 0, 4, 0xc000);
+}
+#endif
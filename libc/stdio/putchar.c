@@ -1,13 +1,13 @@
 #include <stdio.h>
 
 #if defined(__is_libk)
-#include <kernel/tty.h>
+#include <kernel/console.h>
 #endif
 
 int putchar(int ic) {
 #if defined(__is_libk)
     char c = (char)ic;
-    terminal_write(&c, sizeof(c));
+    console_write(LOG_LEVEL_INFO, &c, sizeof(c));
 #else
     // TODO: Implement stdio and the write system call.
 #endif
@@ -1,10 +1,10 @@
-#include <kernel/io/rtc.h>
 #include <kernel/monotonic_tick.h>
 #include <unistd.h>
 
 void sleep(uint32_t time_s) {
-    uint32_t start = get_tick();
-    uint32_t end = start + time_s * RTC_FREQ;
+    monotonic_wait_until(monotonic_ns() + time_s * NS_PER_SECOND);
+}
 
-    while (get_tick() < end) asm volatile("hlt");
+void usleep(uint32_t time_us) {
+    monotonic_wait_until(monotonic_ns() + time_us * 1000ULL);
 }
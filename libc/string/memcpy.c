@@ -1,8 +1,31 @@
 #include <string.h>
 
+// Dword moves for the bulk, then the 0-3 trailing bytes
 void* memcpy(void* restrict dstptr, const void* restrict srcptr, size_t size) {
-    unsigned char* dst = (unsigned char*)dstptr;
-    const unsigned char* src = (const unsigned char*)srcptr;
-    for (size_t i = 0; i < size; i++) dst[i] = src[i];
+    void* dst = dstptr;
+    const void* src = srcptr;
+    size_t dwords = size >> 2;
+    asm volatile(
+        "rep movsl\n\t"
+        "mov %3, %%ecx\n\t"
+        "rep movsb\n\t"
+        : "+D"(dst), "+S"(src), "+c"(dwords)
+        : "r"(size & 3)
+        : "memory");
     return dstptr;
 }
+
+#if defined(__is_libk) && defined(BENCHMARKS)
+#include <kernel/bench.h>
+
+static char bench_src[1500];
+static char bench_dst[1500];
+
+BENCH_BATCH(memcpy_64, 16) {
+    memcpy(bench_dst, bench_src, 64);
+}
+
+BENCH(memcpy_1500) {
+    memcpy(bench_dst, bench_src, sizeof(bench_dst));
+}
+#endif
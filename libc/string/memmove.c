@@ -3,10 +3,26 @@
 void* memmove(void* dstptr, const void* srcptr, size_t size) {
     unsigned char* dst = (unsigned char*)dstptr;
     const unsigned char* src = (const unsigned char*)srcptr;
-    if (dst < src) {
-        for (size_t i = 0; i < size; i++) dst[i] = src[i];
-    } else {
-        for (size_t i = size; i != 0; i--) dst[i - 1] = src[i - 1];
+    if (dst <= src || dst >= src + size) {
+        // A forward copy never overwrites source bytes it still has to read
+        return memcpy(dstptr, srcptr, size);
     }
+
+    // Overlapping with dst above src: copy backwards, trailing bytes first
+    size_t dwords = size >> 2;
+    size_t bytes = size & 3;
+    const unsigned char* s = src + size - 1;
+    unsigned char* d = dst + size - 1;
+    asm volatile(
+        "std\n\t"
+        "rep movsb\n\t"
+        "sub $3, %%esi\n\t"
+        "sub $3, %%edi\n\t"
+        "mov %3, %%ecx\n\t"
+        "rep movsl\n\t"
+        "cld\n\t"
+        : "+S"(s), "+D"(d), "+c"(bytes)
+        : "r"(dwords)
+        : "memory");
     return dstptr;
 }
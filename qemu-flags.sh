@@ -0,0 +1,20 @@
+# Machine and devices shared by qemu.sh, runner.sh and bench.sh. Source after config.sh,
+# optionally with net_forward set to extra hostfwd= options for the virtio-net backend.
+qemu="qemu-system-$(./target-triplet-to-arch.sh $HOST)"
+ram_flag="-m 512M"
+exit_flag="-device isa-debug-exit,iobase=0xf4,iosize=0x04"
+# MACHINE=q35 gives a PCIe root complex with an ACPI MCFG table (ECAM config access)
+machine=${MACHINE:-pc}
+# pci=ecam tells the tests to expect it there instead of skipping its checks
+if [ "$machine" = "q35" ]; then
+    root_bus="pcie.0"
+    kernel_flags="pci=ecam"
+else
+    root_bus="pci.0"
+    kernel_flags=""
+fi
+# MSI delivery lets the HPET comparators interrupt without an I/O APIC
+machine_flag="-machine $machine -global hpet.msi=on"
+pci_flag="-netdev user,id=n0 -device rtl8139,netdev=n0,bus=$root_bus,addr=4,mac=12:34:56:78:9A:BC" # addr is in hex
+# slot 6 keeps virtio-net off the rtl8139's interrupt line, irqs are not shared yet
+pci_flag="$pci_flag -netdev user,id=n1$net_forward -device virtio-net-pci,netdev=n1,bus=$root_bus,addr=6,mac=12:34:56:78:9A:BD"
@@ -0,0 +1,119 @@
+#!/bin/sh
+# Boots the kernel headless and turns the isa-debug-exit code into an exit status.
+# Run through `make test` / `make bench`, which build the matching kernel first.
+#
+#   ./runner.sh test                every suite in one boot
+#   ./runner.sh test pci,rtl8139    only the named suites (test=list on the kernel prints them)
+#   ./runner.sh test --each         one boot per suite, so TIMEOUT applies to each of them
+#   ./runner.sh bench [names]       the same for a BENCHMARKS build
+#
+# TIMEOUT is in seconds per boot (default 120). COM1 goes to RESULTS (default results/<mode>.log).
+# PROFILE=<hz> samples the run with the profiler and writes its folded stacks next to RESULTS,
+# as results/<mode>.folded, ready for flamegraph.pl.
+# Test runs that include the pci suite boot it once more on q35, the machine with ECAM, unless
+# MACHINE=q35 already; that log goes to results/test.q35.log.
+# Exit status: 0 passed, 1 failed or panicked, 2 unknown name, 3 reset or qemu error, 124 timeout.
+. ./config.sh
+. ./qemu-flags.sh
+
+mode=$1
+names=$2
+case "$mode" in
+test | bench) ;;
+*)
+    echo "usage: $0 test|bench [name,...|--each]"
+    exit 64
+    ;;
+esac
+
+kernel=sysroot/boot/myos.kernel
+initrd=sysroot/boot/init.elf # boot module 0, the first ring 3 program
+results=${RESULTS:-results/$mode.log}
+folded=${results%.log}.folded
+mkdir -p "$(dirname "$results")"
+[ -n "$PROFILE" ] && : >"$folded"
+
+# boot <kernel command line> <log file>, returns the exit status described above
+boot() {
+    append="$1${kernel_flags:+ $kernel_flags}${PROFILE:+ profile=$PROFILE}"
+    timeout "${TIMEOUT:-120}" $qemu $machine_flag $ram_flag $pci_flag $exit_flag \
+        -no-reboot -display none -serial "file:$2" -kernel "$kernel" -initrd "$initrd" \
+        -append "$append" </dev/null
+    case $? in
+    1) return 0 ;; # exit_(EXIT_CODE_PASSED)
+    3) return 1 ;; # exit_(EXIT_CODE_FAILED)
+    5) return 2 ;; # exit_(EXIT_CODE_UNKNOWN_NAME)
+    124) return 124 ;;
+    *) return 3 ;; # triple fault with -no-reboot, returned from kernel_main, or qemu failed
+    esac
+}
+
+# Appends the stacks between the profiler's begin and end markers in a log to $folded
+collect_profile() {
+    [ -n "$PROFILE" ] || return 0
+    tr -d '\r' <"$1" | sed -n '/^profile: begin/,/^profile: end/{/^profile: /!p}' >>"$folded"
+}
+
+describe() {
+    case $1 in
+    0) echo "passed" ;;
+    1) echo "FAILED" ;;
+    2) echo "unknown name" ;;
+    124) echo "TIMEOUT after ${TIMEOUT:-120}s" ;;
+    *) echo "no exit code (reset or qemu error)" ;;
+    esac
+}
+
+# The pci suite on q35 after the run on another machine, returns its boot status
+ecam_run() {
+    [ "$mode" = test ] && [ "$machine" != q35 ] || return 0
+    case ",$names," in ,, | ,--each, | *,pci,*) ;; *) return 0 ;; esac
+    MACHINE=q35
+    . ./qemu-flags.sh
+    ecam_log=${results%.log}.q35.log
+    boot "test=pci" "$ecam_log"
+    ecam_status=$?
+    tr -d '\r' <"$ecam_log"
+    echo "runner: test pci on q35 $(describe $ecam_status), log in $ecam_log"
+    return $ecam_status
+}
+
+if [ "$names" != "--each" ]; then
+    boot "${names:+$mode=$names}" "$results"
+    status=$?
+    tr -d '\r' <"$results"
+    collect_profile "$results"
+    echo "runner: $mode ${names:-all} $(describe $status), log in $results"
+    ecam_run
+    ecam_status=$?
+    [ $status -eq 0 ] && status=$ecam_status
+    exit $status
+fi
+
+boot "$mode=list" "$results"
+list=$(tr -d '\r' <"$results" | sed -n "s/^list-$mode: //p")
+if [ -z "$list" ]; then
+    echo "runner: could not list $mode names, log in $results"
+    exit 3
+fi
+
+: >"$results"
+worst=0
+for name in $list; do
+    boot "$mode=$name" "$results.part"
+    status=$?
+    echo "### $mode=$name: $(describe $status)" >>"$results"
+    tr -d '\r' <"$results.part" >>"$results"
+    collect_profile "$results.part"
+    printf '%-20s %s\n' "$name" "$(describe $status)"
+    if [ $status -ne 0 ]; then
+        tail -n 20 "$results.part"
+        [ $worst -eq 0 ] && worst=$status
+    fi
+done
+rm -f "$results.part"
+echo "runner: log in $results"
+ecam_run
+ecam_status=$?
+[ $worst -eq 0 ] && worst=$ecam_status
+exit $worst
@@ -0,0 +1,55 @@
+#include <kernel/syscall.h>
+#include <kernel/time_page.h>
+#include <stddef.h>
+
+/*
+ * The first ring 3 program, boot module 0. Asks for its pid through both
+ * system call paths, prints it with the uptime from the time page and exits
+ * with 0 if everything agreed, which the kernel's process test checks.
+ */
+static bool fast = false;
+
+static uint32_t syscall(uint32_t num, uint32_t a, uint32_t b, uint32_t c) {
+    return fast ? syscall_sysenter(num, a, b, c) : syscall_int80(num, a, b, c);
+}
+
+static size_t length(const char* s) {
+    size_t len = 0;
+    while (s[len]) len++;
+    return len;
+}
+
+static bool write(const char* s) {
+    size_t len = length(s);
+    return syscall(SYS_WRITE, (uint32_t)s, len, 0) == len;
+}
+
+// Decimal, into the end of a buffer of at least 11 bytes
+static const char* format(uint32_t value, char* end) {
+    *--end = '\0';
+    do {
+        *--end = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    return end;
+}
+
+__attribute__((noreturn, section(".text._start"))) void _start(const TimePage* time) {
+    fast = sysenter_supported();
+    uint32_t pid = syscall(SYS_GETPID, 0, 0, 0);
+    bool ok = pid == syscall_int80(SYS_GETPID, 0, 0, 0);
+    TimeSpec uptime;
+    ok &= time_page_clock_gettime(time, CLOCK_MONOTONIC, &uptime);
+    uint32_t ms = uptime.seconds * 1000 + uptime.nanoseconds / 1000000;
+
+    char digits[12];
+    ok &= write("init: pid ");
+    ok &= write(format(pid, digits + sizeof(digits)));
+    ok &= write(fast ? " in ring 3, sysenter, " : " in ring 3, int 0x80, ");
+    ok &= write(format(ms, digits + sizeof(digits)));
+    ok &= write(" ms since boot\n");
+
+    syscall(SYS_EXIT, ok ? 0 : 1, 0, 0);
+    while (1) {
+    }
+}